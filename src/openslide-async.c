@@ -0,0 +1,254 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Asynchronous region reads.
+ *
+ * Each read runs openslide_read_regions() as a detached task on the
+ * worker pool.  Reads that have been dispatched to the pool are
+ * "active".  A new read that overlaps an active read at the same level
+ * is deferred until no active read overlaps it, so that it finds the
+ * shared tiles in the cache rather than decoding them a second time.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <glib.h>
+
+struct _openslide_async_reads {
+  GMutex *lock;
+  GCond *finished;   // signaled when an active read finishes
+  GList *active;     // struct _openslide_async_read
+  GQueue *deferred;  // struct _openslide_async_read, oldest first
+};
+
+struct _openslide_async_read {
+  openslide_t *osr;
+  openslide_read_request_t *req;
+  openslide_read_callback_t callback;
+  void *userdata;
+
+  // protected by the osr's async_reads lock
+  bool started;
+  bool cancelled;
+
+  // copy of the request's error message, which may outlive the osr
+  char *error;
+
+  int refcount;  // caller plus task; atomic
+};
+
+struct _openslide_async_reads *_openslide_async_reads_create(void) {
+  struct _openslide_async_reads *ar =
+    g_slice_new0(struct _openslide_async_reads);
+  ar->lock = g_mutex_new();
+  ar->finished = g_cond_new();
+  ar->deferred = g_queue_new();
+  return ar;
+}
+
+static void async_read_unref(struct _openslide_async_read *ard) {
+  if (g_atomic_int_dec_and_test(&ard->refcount)) {
+    g_free(ard->error);
+    g_slice_free(struct _openslide_async_read, ard);
+  }
+}
+
+// level 0 bounds of the request, or false if it can't share tiles
+static bool get_bounds(struct _openslide_async_read *ard,
+                       double *x0, double *y0, double *x1, double *y1) {
+  openslide_read_request_t *req = ard->req;
+  double ds = openslide_get_level_downsample(ard->osr, req->level);
+  if (ds <= 0 || req->w <= 0 || req->h <= 0) {
+    return false;
+  }
+  *x0 = req->x;
+  *y0 = req->y;
+  *x1 = req->x + req->w * ds;
+  *y1 = req->y + req->h * ds;
+  return true;
+}
+
+static bool overlaps(struct _openslide_async_read *a,
+                     struct _openslide_async_read *b) {
+  double ax0, ay0, ax1, ay1;
+  double bx0, by0, bx1, by1;
+  return a->req->level == b->req->level &&
+         get_bounds(a, &ax0, &ay0, &ax1, &ay1) &&
+         get_bounds(b, &bx0, &by0, &bx1, &by1) &&
+         ax0 < bx1 && bx0 < ax1 && ay0 < by1 && by0 < ay1;
+}
+
+// async_reads lock must be held
+static bool overlaps_active(struct _openslide_async_reads *ar,
+                            struct _openslide_async_read *ard) {
+  for (GList *l = ar->active; l; l = l->next) {
+    if (overlaps(ard, l->data)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void run_async_read(void *data);
+
+// async_reads lock must be held.  moves deferred reads that can now run
+// onto the active list, and returns them for dispatch.
+static GList *take_runnable(struct _openslide_async_reads *ar) {
+  GList *runnable = NULL;
+  GList *link = ar->deferred->head;
+  while (link) {
+    GList *next = link->next;
+    struct _openslide_async_read *ard = link->data;
+    if (ard->cancelled || !overlaps_active(ar, ard)) {
+      g_queue_delete_link(ar->deferred, link);
+      ar->active = g_list_prepend(ar->active, ard);
+      runnable = g_list_prepend(runnable, ard);
+    }
+    link = next;
+  }
+  return g_list_reverse(runnable);
+}
+
+static void dispatch(GList *runnable) {
+  for (GList *l = runnable; l; l = l->next) {
+    _openslide_run_detached(run_async_read, l->data);
+  }
+  g_list_free(runnable);
+}
+
+static void run_async_read(void *data) {
+  struct _openslide_async_read *ard = data;
+  struct _openslide_async_reads *ar = ard->osr->async_reads;
+  openslide_read_request_t *req = ard->req;
+
+  g_mutex_lock(ar->lock);
+  bool cancelled = ard->cancelled;
+  ard->started = true;
+  g_mutex_unlock(ar->lock);
+
+  if (cancelled) {
+    if (req->dest && req->w > 0 && req->h > 0) {
+      memset(req->dest, 0, req->w * req->h * 4);
+    }
+    req->error = g_intern_static_string("Read cancelled");
+  } else if (openslide_read_regions(ard->osr, req, 1)) {
+    // the callback may run after the slide is closed
+    ard->error = g_strdup(req->error);
+    req->error = ard->error;
+  }
+
+  // let waiting reads proceed before telling the caller, who may close
+  // the slide as soon as the last callback runs
+  g_mutex_lock(ar->lock);
+  ar->active = g_list_remove(ar->active, ard);
+  GList *runnable = take_runnable(ar);
+  g_cond_broadcast(ar->finished);
+  g_mutex_unlock(ar->lock);
+  dispatch(runnable);
+
+  ard->callback(req, ard->userdata);
+  async_read_unref(ard);
+}
+
+void _openslide_async_reads_destroy(struct _openslide_async_reads *ar) {
+  // cancel reads that haven't started, and let the deferred ones finish
+  // as cancelled
+  g_mutex_lock(ar->lock);
+  for (GList *l = ar->active; l; l = l->next) {
+    struct _openslide_async_read *ard = l->data;
+    if (!ard->started) {
+      ard->cancelled = true;
+    }
+  }
+  for (GList *l = ar->deferred->head; l; l = l->next) {
+    struct _openslide_async_read *ard = l->data;
+    ard->cancelled = true;
+  }
+  GList *runnable = take_runnable(ar);
+  g_mutex_unlock(ar->lock);
+  dispatch(runnable);
+
+  // wait for reads still using the slide.  their callbacks may still be
+  // running, but no longer use it.
+  g_mutex_lock(ar->lock);
+  while (ar->active || !g_queue_is_empty(ar->deferred)) {
+    g_cond_wait(ar->finished, ar->lock);
+  }
+  g_mutex_unlock(ar->lock);
+
+  g_queue_free(ar->deferred);
+  g_cond_free(ar->finished);
+  g_mutex_free(ar->lock);
+  g_slice_free(struct _openslide_async_reads, ar);
+}
+
+openslide_async_read_t *openslide_read_region_async(openslide_t *osr,
+                                                    openslide_read_request_t *req,
+                                                    openslide_read_callback_t callback,
+                                                    void *userdata) {
+  struct _openslide_async_read *ard =
+    g_slice_new0(struct _openslide_async_read);
+  ard->osr = osr;
+  ard->req = req;
+  ard->callback = callback;
+  ard->userdata = userdata;
+  ard->refcount = 2;
+
+  struct _openslide_async_reads *ar = osr->async_reads;
+  bool deferred;
+  g_mutex_lock(ar->lock);
+  deferred = overlaps_active(ar, ard);
+  if (deferred) {
+    g_queue_push_tail(ar->deferred, ard);
+  } else {
+    ar->active = g_list_prepend(ar->active, ard);
+  }
+  g_mutex_unlock(ar->lock);
+
+  if (!deferred) {
+    _openslide_run_detached(run_async_read, ard);
+  }
+  return ard;
+}
+
+void openslide_cancel_read(openslide_async_read_t *ard) {
+  struct _openslide_async_reads *ar = ard->osr->async_reads;
+  GList *runnable = NULL;
+
+  g_mutex_lock(ar->lock);
+  if (!ard->started && !ard->cancelled) {
+    ard->cancelled = true;
+    // no need to wait anymore
+    runnable = take_runnable(ar);
+  }
+  g_mutex_unlock(ar->lock);
+  dispatch(runnable);
+}
+
+void openslide_release_read(openslide_async_read_t *ard) {
+  if (ard) {
+    async_read_unref(ard);
+  }
+}
@@ -0,0 +1,201 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A size-class pool for the buffers owned by the tile cache.
+ *
+ * Decoded tiles come in only a few sizes per slide, and the cache frees
+ * one for nearly every one it inserts.  Rather than go back to the
+ * system allocator each time, freed buffers wait on a free list for
+ * their exact size and are handed to the next allocation of that size.
+ *
+ * Buffers no larger than half a slab are carved from 2 MB slabs, which
+ * are never returned to the system; the pool therefore stays at its
+ * high-water mark, which the cache capacity bounds.  Larger buffers are
+ * allocated individually, and are released once the idle ones exceed
+ * OPENSLIDE_BUFFER_POOL_SIZE bytes.  If OPENSLIDE_HUGEPAGES is set,
+ * slabs and large buffers are aligned to 2 MB and marked for transparent
+ * huge pages, saving TLB misses when painting from many tiles.
+ *
+ * Only sizes allocated here get a size class, and there are at most
+ * MAX_CLASSES of them.  Variable-length data, such as compressed tiles,
+ * comes from GSlice instead; freeing a buffer whose size has no class
+ * hands it back to GSlice, so the pool never fills up with sizes that
+ * don't recur.  Buffers smaller than MIN_POOLED_SIZE also just use
+ * GSlice.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#if defined(HAVE_MADVISE) && defined(HAVE_POSIX_MEMALIGN)
+#include <sys/mman.h>
+#endif
+
+#define MIN_POOLED_SIZE (64 * 1024)
+#define SLAB_SIZE (2 * 1024 * 1024)
+#define DEFAULT_IDLE_LIMIT (64 * 1024 * 1024)
+// a slide decodes tiles in a handful of sizes
+#define MAX_CLASSES 32
+
+struct size_class {
+  GTrashStack *free;
+  // slab-carved buffers are never released
+  bool carved;
+};
+
+static struct {
+  GStaticMutex lock;
+  GHashTable *classes;  // size -> struct size_class
+  int64_t idle_bytes;   // individually allocated buffers only
+  int64_t idle_limit;
+  bool hugepages;
+} pool = {
+  .lock = G_STATIC_MUTEX_INIT,
+};
+
+static bool env_enabled(const char *name) {
+  const char *value = g_getenv(name);
+  return value != NULL && *value && strcmp(value, "0");
+}
+
+// pool lock must be held
+static void pool_init(void) {
+  if (pool.classes == NULL) {
+    pool.classes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    pool.idle_limit = DEFAULT_IDLE_LIMIT;
+    const char *value = g_getenv("OPENSLIDE_BUFFER_POOL_SIZE");
+    if (value) {
+      pool.idle_limit = MAX(0, g_ascii_strtoll(value, NULL, 10));
+    }
+    pool.hugepages = env_enabled("OPENSLIDE_HUGEPAGES");
+  }
+}
+
+// pool lock must be held.  returns NULL if there is no class for the
+// size and none can be created.
+static struct size_class *get_class(size_t size, bool create) {
+  int64_t key = size;
+  struct size_class *sc = g_hash_table_lookup(pool.classes, &key);
+  if (sc == NULL && create &&
+      g_hash_table_size(pool.classes) < MAX_CLASSES) {
+    int64_t *new_key = g_slice_new(int64_t);
+    *new_key = key;
+    sc = g_slice_new0(struct size_class);
+    sc->carved = size <= SLAB_SIZE / 2;
+    g_hash_table_insert(pool.classes, new_key, sc);
+  }
+  return sc;
+}
+
+// memory from the system, in huge pages if enabled
+static void *pages_alloc(size_t size) {
+#ifdef HAVE_POSIX_MEMALIGN
+  if (pool.hugepages) {
+    void *mem;
+    size_t rounded = (size + SLAB_SIZE - 1) & ~((size_t) SLAB_SIZE - 1);
+    if (posix_memalign(&mem, SLAB_SIZE, rounded)) {
+      g_error("Couldn't allocate %"G_GSIZE_FORMAT" bytes", rounded);
+    }
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+    // advisory; the kernel may not support it
+    madvise(mem, rounded, MADV_HUGEPAGE);
+#endif
+    return mem;
+  }
+#endif
+  return g_malloc(size);
+}
+
+static void pages_free(void *mem) {
+#ifdef HAVE_POSIX_MEMALIGN
+  if (pool.hugepages) {
+    free(mem);
+    return;
+  }
+#endif
+  g_free(mem);
+}
+
+void *_openslide_buffer_alloc(size_t size) {
+  if (size < MIN_POOLED_SIZE) {
+    return g_slice_alloc(size);
+  }
+
+  g_static_mutex_lock(&pool.lock);
+  pool_init();
+  struct size_class *sc = get_class(size, true);
+  if (sc == NULL) {
+    g_static_mutex_unlock(&pool.lock);
+    return g_slice_alloc(size);
+  }
+  void *buf = g_trash_stack_pop(&sc->free);
+  if (buf) {
+    if (!sc->carved) {
+      pool.idle_bytes -= size;
+    }
+  } else if (sc->carved) {
+    // carve a new slab; keep all but the first buffer
+    uint8_t *slab = pages_alloc(SLAB_SIZE);
+    for (size_t off = size; off + size <= SLAB_SIZE; off += size) {
+      g_trash_stack_push(&sc->free, slab + off);
+    }
+    buf = slab;
+  } else {
+    buf = pages_alloc(size);
+  }
+  g_static_mutex_unlock(&pool.lock);
+  return buf;
+}
+
+void _openslide_buffer_free(size_t size, void *buf) {
+  if (buf == NULL) {
+    return;
+  }
+  if (size < MIN_POOLED_SIZE) {
+    g_slice_free1(size, buf);
+    return;
+  }
+
+  g_static_mutex_lock(&pool.lock);
+  pool_init();
+  struct size_class *sc = get_class(size, false);
+  if (sc == NULL) {
+    // not from the pool
+    g_static_mutex_unlock(&pool.lock);
+    g_slice_free1(size, buf);
+    return;
+  }
+  if (sc->carved) {
+    g_trash_stack_push(&sc->free, buf);
+  } else if (pool.idle_bytes + (int64_t) size <= pool.idle_limit) {
+    g_trash_stack_push(&sc->free, buf);
+    pool.idle_bytes += size;
+  } else {
+    pages_free(buf);
+  }
+  g_static_mutex_unlock(&pool.lock);
+}
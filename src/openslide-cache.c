@@ -23,6 +23,7 @@
 
 #include "openslide-private.h"
 
+#include <string.h>
 #include <glib.h>
 
 #if defined(HAVE_UINTPTR_T) || defined(uintptr_t)
@@ -33,8 +34,27 @@
 #define ptr_int uint64_t
 #endif
 
+// the cache is split into independent shards, each with its own lock,
+// hash table, and CLOCK list, so that readers on different tiles rarely
+// contend.  the byte budget is divided evenly between the shards and is
+// therefore only enforced approximately.
+#define MAX_SHARDS 16
+#define MIN_SHARD_CAPACITY (4 * 1024 * 1024)
+
+// 2Q: share of a shard for tiles seen once, and the bytes' worth of
+// recently evicted keys to remember, as fractions of the shard capacity
+#define PROBATION_DIVISOR 4
+#define GHOST_DIVISOR 2
+
+// cost-weighted CLOCK: the most passes of the clock hand a tile can
+// survive without being used, and the decode time per megabyte of tile
+// data that earns one extra pass
+#define MAX_WEIGHT 8
+#define WEIGHT_USEC_PER_MB 4000
+
 // hash table key
 struct _openslide_cache_key {
+  uint64_t binding_id;  // distinguishes slides sharing the cache
   void *plane;  // cookie for coordinate plane (level, grid, etc.)
   int64_t x;
   int64_t y;
@@ -44,7 +64,10 @@ struct _openslide_cache_key {
 struct _openslide_cache_value {
   GList *link;            // direct pointer to the node in the list
   struct _openslide_cache_key *key; // for removing keys when aged out
-  struct _openslide_cache *cache; // sadly, for total_bytes and the list
+  struct cache_shard *shard; // sadly, for total_size and the list
+  gint referenced;        // CLOCK passes left; atomic ops only
+  gint weight;            // value of referenced after a use
+  bool probation;         // 2Q: in the probation queue, not the list
 
   struct _openslide_cache_entry *entry;  // may outlive the value
 };
@@ -53,42 +76,198 @@ struct _openslide_cache_value {
 struct _openslide_cache_entry {
   gint refcount;  // atomic ops only
   void *data;
-  int size;
+  int64_t size;
 };
 
-struct _openslide_cache {
+struct cache_shard {
   GMutex *mutex;
-  GQueue *list;
+  GQueue *list;           // head is newest; the clock hand is at the tail
   GHashTable *hashtable;
 
-  int capacity;
-  int total_size;
+  // 2Q only
+  GQueue *probation;      // FIFO of values seen once; head is newest
+  GQueue *ghosts;         // keys evicted from probation; head is newest
+  GHashTable *ghost_table;  // key -> link in ghosts
+  int64_t probation_size;
+  int64_t ghost_size;
+
+  int64_t capacity;
+  int64_t total_size;
+
+  // statistics
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t refused;
+};
+
+struct _openslide_cache {
+  gint refcount;          // atomic ops only
+  openslide_cache_policy_t policy;  // immutable
+
+  // second tier of compressed tile data, owned by this cache; NULL in
+  // the tier itself.  disabled while its capacity is zero.
+  struct _openslide_cache *compressed;
+
+  struct cache_shard *shards;
+  int shard_count;        // power of two
+
+  GMutex *mutex;          // protects capacity; taken before any shard lock
+  int64_t capacity;
+};
+
+// each openslide_t holds a binding, which points to the cache currently
+// in use.  switching caches only affects the binding.  lookups take no
+// lock: they load the pointer and reference the cache while counted in
+// readers, and a switch waits for readers to drain before dropping the
+// old cache.
+struct _openslide_cache_binding {
+  GMutex *mutex;                    // serializes switches
+  struct _openslide_cache *cache;   // atomic ops only
+  gint readers;                     // atomic ops only
+  uint64_t id;                      // immutable
+};
+
+struct ghost {
+  struct _openslide_cache_key *key;
+  int64_t size;
 };
 
+// per-thread state, so that a put following a miss can learn how long
+// the decode took, and so bulk readers can skip caching
+struct thread_state {
+  struct _openslide_cache_key miss_key;
+  bool miss_valid;
+  GTimer *timer;
+  bool bypass;
+};
+
+static GStaticPrivate thread_state_key = G_STATIC_PRIVATE_INIT;
+
+// source of binding IDs; never reused within the process, so entries of a
+// closed slide can't be confused with those of a newly opened one
+static GStaticMutex next_binding_id_lock = G_STATIC_MUTEX_INIT;
+static uint64_t next_binding_id;
+
+static void thread_state_free(gpointer data) {
+  struct thread_state *ts = data;
+  if (ts->timer) {
+    g_timer_destroy(ts->timer);
+  }
+  g_slice_free(struct thread_state, ts);
+}
+
+static struct thread_state *get_thread_state(void) {
+  struct thread_state *ts = g_static_private_get(&thread_state_key);
+  if (ts == NULL) {
+    ts = g_slice_new0(struct thread_state);
+    g_static_private_set(&thread_state_key, ts, thread_state_free);
+  }
+  return ts;
+}
+
+static gboolean key_equal_func(gconstpointer a, gconstpointer b);
+
+// ghosts
+// shard mutex must be held
+static void remove_ghost(struct cache_shard *shard, GList *link) {
+  struct ghost *ghost = link->data;
+  shard->ghost_size -= ghost->size;
+  g_queue_delete_link(shard->ghosts, link);
+  // frees the key
+  g_hash_table_remove(shard->ghost_table, ghost->key);
+  g_slice_free(struct ghost, ghost);
+}
+
+// shard mutex must be held
+static void add_ghost(struct cache_shard *shard,
+                      const struct _openslide_cache_key *key, int64_t size) {
+  struct ghost *ghost = g_slice_new(struct ghost);
+  ghost->key = g_slice_dup(struct _openslide_cache_key, key);
+  ghost->size = size;
+  g_queue_push_head(shard->ghosts, ghost);
+  g_hash_table_insert(shard->ghost_table, ghost->key,
+                      g_queue_peek_head_link(shard->ghosts));
+  shard->ghost_size += size;
+
+  while (shard->ghost_size > shard->capacity / GHOST_DIVISOR &&
+         !g_queue_is_empty(shard->ghosts)) {
+    remove_ghost(shard, g_queue_peek_tail_link(shard->ghosts));
+  }
+}
+
+// shard mutex must be held.  returns whether there was a ghost.
+static bool take_ghost(struct cache_shard *shard,
+                       const struct _openslide_cache_key *key) {
+  GList *link = g_hash_table_lookup(shard->ghost_table, key);
+  if (link == NULL) {
+    return false;
+  }
+  remove_ghost(shard, link);
+  return true;
+}
+
 // eviction
-// mutex must be held
-static void possibly_evict(struct _openslide_cache *cache, int incoming_size) {
+// shard mutex must be held
+static void evict_value(struct cache_shard *shard,
+                        struct _openslide_cache_value *value) {
+  //g_debug("EVICT: size: %d", value->entry->size);
+
+  if (value->probation) {
+    // remember it, in case it comes back soon
+    add_ghost(shard, value->key, value->entry->size);
+  }
+
+  // remove from hashtable, this will trigger removal from everything
+  bool result = g_hash_table_remove(shard->hashtable, value->key);
+  g_assert(result);
+  shard->evictions++;
+}
+
+// shard mutex must be held
+static void possibly_evict(struct cache_shard *shard, int64_t incoming_size) {
   g_assert(incoming_size >= 0);
 
-  int size = cache->total_size + incoming_size;
-  int target = cache->capacity;
+  int64_t target = shard->capacity;
+
+  while (shard->total_size + incoming_size > target) {
+    // 2Q: tiles seen once go first, once they exceed their share
+    struct _openslide_cache_value *value = g_queue_peek_tail(shard->probation);
+    if (value &&
+        (shard->probation_size > target / PROBATION_DIVISOR ||
+         g_queue_is_empty(shard->list))) {
+      evict_value(shard, value);
+      continue;
+    }
 
-  while(size > target) {
-    // get key of last element
-    struct _openslide_cache_value *value = g_queue_peek_tail(cache->list);
+    // look at the element under the clock hand
+    value = g_queue_peek_tail(shard->list);
     if (value == NULL) {
-      return; // cache is empty
+      return; // shard is empty
     }
-    struct _openslide_cache_key *key = value->key;
 
-    //g_debug("EVICT: size: %d", value->entry->size);
+    // recently used?  give it another chance
+    int referenced = g_atomic_int_get(&value->referenced);
+    if (referenced) {
+      g_atomic_int_set(&value->referenced, referenced - 1);
+      GList *link = value->link;
+      g_queue_unlink(shard->list, link);
+      g_queue_push_head_link(shard->list, link);
+      continue;
+    }
 
-    size -= value->entry->size;
+    evict_value(shard, value);
+  }
+}
 
-    // remove from hashtable, this will trigger removal from everything
-    bool result = g_hash_table_remove(cache->hashtable, key);
-    g_assert(result);
+// clock passes earned by a tile that took cost_usec to decode
+static int get_weight(int64_t cost_usec, int64_t size) {
+  if (cost_usec <= 0 || size <= 0) {
+    return 1;
   }
+  double usec_per_mb = cost_usec * (1024.0 * 1024.0) / size;
+  return 1 + MIN(MAX_WEIGHT - 1, (int) (usec_per_mb / WEIGHT_USEC_PER_MB));
 }
 
 
@@ -96,9 +275,17 @@ static void possibly_evict(struct _openslide_cache *cache, int incoming_size) {
 static guint hash_func(gconstpointer key) {
   const struct _openslide_cache_key *c_key = key;
 
+  // mix all the bits, so that the low bits are usable for shard selection
+  uint64_t h = (uint64_t) (ptr_int) c_key->plane;
+  h ^= c_key->binding_id * G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+  h ^= (uint64_t) c_key->x * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+  h ^= (uint64_t) c_key->y * G_GUINT64_CONSTANT(0xc2b2ae3d27d4eb4f);
+  h ^= h >> 33;
+  h *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+
   // assume 32-bit hash
-  return (guint) (((ptr_int) c_key->plane) ^
-                  ((34369 * (uint64_t) c_key->y) + ((uint64_t) c_key->x)));
+  return (guint) h;
 }
 
 static gboolean key_equal_func(gconstpointer a,
@@ -106,7 +293,8 @@ static gboolean key_equal_func(gconstpointer a,
   const struct _openslide_cache_key *c_a = a;
   const struct _openslide_cache_key *c_b = b;
 
-  return (c_a->plane == c_b->plane) && (c_a->x == c_b->x) && (c_a->y == c_b->y);
+  return (c_a->binding_id == c_b->binding_id) && (c_a->plane == c_b->plane) &&
+         (c_a->x == c_b->x) && (c_a->y == c_b->y);
 }
 
 static void hash_destroy_key(gpointer data) {
@@ -117,11 +305,16 @@ static void hash_destroy_value(gpointer data) {
   struct _openslide_cache_value *value = data;
 
   // remove the item from the list
-  g_queue_delete_link(value->cache->list, value->link);
+  if (value->probation) {
+    g_queue_delete_link(value->shard->probation, value->link);
+    value->shard->probation_size -= value->entry->size;
+  } else {
+    g_queue_delete_link(value->shard->list, value->link);
+  }
 
   // decrement the total size
-  value->cache->total_size -= value->entry->size;
-  g_assert(value->cache->total_size >= 0);
+  value->shard->total_size -= value->entry->size;
+  g_assert(value->shard->total_size >= 0);
 
   // unref the entry
   _openslide_cache_entry_unref(value->entry);
@@ -130,35 +323,136 @@ static void hash_destroy_value(gpointer data) {
   g_slice_free(struct _openslide_cache_value, value);
 }
 
-struct _openslide_cache *_openslide_cache_create(int capacity_in_bytes) {
+static struct cache_shard *get_shard(struct _openslide_cache *cache,
+                                     const struct _openslide_cache_key *key) {
+  // use the high bits; the hash table uses the low ones
+  guint hash = hash_func(key);
+  return &cache->shards[(hash >> 16) & (cache->shard_count - 1)];
+}
+
+// cache mutex must be held
+static void set_shard_capacities(struct _openslide_cache *cache) {
+  int64_t per_shard = cache->capacity / cache->shard_count;
+  for (int i = 0; i < cache->shard_count; i++) {
+    struct cache_shard *shard = &cache->shards[i];
+    g_mutex_lock(shard->mutex);
+    shard->capacity = per_shard;
+    possibly_evict(shard, 0);
+    g_mutex_unlock(shard->mutex);
+  }
+}
+
+static openslide_cache_policy_t get_default_policy(void) {
+  static gsize initialized;
+  static openslide_cache_policy_t policy;
+
+  if (g_once_init_enter(&initialized)) {
+    const char *value = g_getenv("OPENSLIDE_CACHE_POLICY");
+    policy = OPENSLIDE_CACHE_POLICY_CLOCK;
+    if (!g_strcmp0(value, "2q")) {
+      policy = OPENSLIDE_CACHE_POLICY_2Q;
+    } else if (!g_strcmp0(value, "cost")) {
+      policy = OPENSLIDE_CACHE_POLICY_COST;
+    } else if (value && *value && strcmp(value, "clock")) {
+      g_warning("Unknown cache policy %s", value);
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+  return policy;
+}
+
+static struct _openslide_cache *cache_new(int64_t capacity_in_bytes,
+                                          openslide_cache_policy_t policy,
+                                          int shard_count) {
+  g_assert(capacity_in_bytes >= 0);
+
   struct _openslide_cache *cache = g_slice_new0(struct _openslide_cache);
+  g_atomic_int_set(&cache->refcount, 1);
+  cache->policy = policy;
+  cache->shard_count = shard_count;
+
+  // init shards
+  cache->shards = g_new0(struct cache_shard, cache->shard_count);
+  for (int i = 0; i < cache->shard_count; i++) {
+    struct cache_shard *shard = &cache->shards[i];
+    shard->mutex = g_mutex_new();
+    shard->list = g_queue_new();
+    shard->hashtable = g_hash_table_new_full(hash_func,
+                                             key_equal_func,
+                                             hash_destroy_key,
+                                             hash_destroy_value);
+    shard->probation = g_queue_new();
+    shard->ghosts = g_queue_new();
+    shard->ghost_table = g_hash_table_new_full(hash_func,
+                                               key_equal_func,
+                                               hash_destroy_key,
+                                               NULL);
+  }
 
   // init mutex
   cache->mutex = g_mutex_new();
 
-  // init queue
-  cache->list = g_queue_new();
-
-  // init hashtable
-  cache->hashtable = g_hash_table_new_full(hash_func,
-					   key_equal_func,
-					   hash_destroy_key,
-					   hash_destroy_value);
-
   // init byte_capacity
   cache->capacity = capacity_in_bytes;
+  set_shard_capacities(cache);
 
   return cache;
 }
 
-void _openslide_cache_destroy(struct _openslide_cache *cache) {
-  // clear hashtable (auto-deletes all data)
-  g_mutex_lock(cache->mutex);
-  g_hash_table_unref(cache->hashtable);
-  g_mutex_unlock(cache->mutex);
+struct _openslide_cache *_openslide_cache_create(int64_t capacity_in_bytes,
+                                                 openslide_cache_policy_t policy) {
+  // pick a shard count, keeping each shard big enough to hold a
+  // reasonable number of tiles
+  int shard_count = 1;
+  while (shard_count < MAX_SHARDS &&
+         capacity_in_bytes / (shard_count * 2) >= MIN_SHARD_CAPACITY) {
+    shard_count *= 2;
+  }
+
+  struct _openslide_cache *cache = cache_new(capacity_in_bytes, policy,
+                                             shard_count);
+  // the compressed tier starts out disabled.  it holds smaller entries,
+  // but is consulted as often, so it gets as many shards.
+  cache->compressed = cache_new(0, OPENSLIDE_CACHE_POLICY_CLOCK,
+                                shard_count);
+  return cache;
+}
+
+static struct _openslide_cache *cache_ref(struct _openslide_cache *cache) {
+  g_atomic_int_inc(&cache->refcount);
+  return cache;
+}
+
+void _openslide_cache_unref(struct _openslide_cache *cache) {
+  if (!g_atomic_int_dec_and_test(&cache->refcount)) {
+    return;
+  }
 
-  // clear list
-  g_queue_free(cache->list);
+  if (cache->compressed) {
+    _openslide_cache_unref(cache->compressed);
+  }
+
+  for (int i = 0; i < cache->shard_count; i++) {
+    struct cache_shard *shard = &cache->shards[i];
+
+    // clear hashtable (auto-deletes all data)
+    g_mutex_lock(shard->mutex);
+    g_hash_table_unref(shard->hashtable);
+    g_mutex_unlock(shard->mutex);
+
+    // clear lists
+    g_queue_free(shard->list);
+    g_queue_free(shard->probation);
+    while (!g_queue_is_empty(shard->ghosts)) {
+      remove_ghost(shard, g_queue_peek_head_link(shard->ghosts));
+    }
+    g_queue_free(shard->ghosts);
+    g_hash_table_unref(shard->ghost_table);
+
+    // free mutex
+    g_mutex_free(shard->mutex);
+  }
+  g_free(cache->shards);
 
   // free mutex
   g_mutex_free(cache->mutex);
@@ -168,34 +462,46 @@ void _openslide_cache_destroy(struct _openslide_cache *cache) {
 }
 
 
-int _openslide_cache_get_capacity(struct _openslide_cache *cache) {
+int64_t _openslide_cache_get_capacity(struct _openslide_cache *cache) {
   g_mutex_lock(cache->mutex);
-  int capacity = cache->capacity;
+  int64_t capacity = cache->capacity;
   g_mutex_unlock(cache->mutex);
   return capacity;
 }
 
 void _openslide_cache_set_capacity(struct _openslide_cache *cache,
-				   int capacity_in_bytes) {
+				   int64_t capacity_in_bytes) {
   g_assert(capacity_in_bytes >= 0);
 
   g_mutex_lock(cache->mutex);
   cache->capacity = capacity_in_bytes;
-  possibly_evict(cache, 0);
+  set_shard_capacities(cache);
   g_mutex_unlock(cache->mutex);
 }
 
 // put and get
 
+// returns a reference to the binding's cache, which the caller must drop
+static struct _openslide_cache *get_bound_cache(struct _openslide_cache_binding *cb,
+                                                uint64_t *binding_id) {
+  g_atomic_int_inc(&cb->readers);
+  struct _openslide_cache *cache =
+    cache_ref(g_atomic_pointer_get((gpointer *) &cb->cache));
+  g_atomic_int_add(&cb->readers, -1);
+  *binding_id = cb->id;
+  return cache;
+}
+
 // the cache retains one reference, and the caller gets another one.  the
 // entry must be unreffed when the caller is done with it.
-void _openslide_cache_put(struct _openslide_cache *cache,
-			  void *plane,
-			  int64_t x,
-			  int64_t y,
-			  void *data,
-			  int size_in_bytes,
-			  struct _openslide_cache_entry **_entry) {
+static void tier_put(struct _openslide_cache_binding *cb,
+                     bool compressed,
+                     void *plane,
+                     int64_t x,
+                     int64_t y,
+                     void *data,
+                     int64_t size_in_bytes,
+                     struct _openslide_cache_entry **_entry) {
   // always create cache entry for caller's reference
   struct _openslide_cache_entry *entry =
       g_slice_new(struct _openslide_cache_entry);
@@ -205,75 +511,144 @@ void _openslide_cache_put(struct _openslide_cache *cache,
   entry->size = size_in_bytes;
   *_entry = entry;
 
-  // lock
-  g_mutex_lock(cache->mutex);
-
-  // don't try to put anything in the cache that cannot possibly fit
-  if (size_in_bytes > cache->capacity) {
-    //g_debug("refused %p", entry);
-    g_mutex_unlock(cache->mutex);
+  // a bulk reader asked us not to keep anything
+  struct thread_state *ts = get_thread_state();
+  if (ts->bypass) {
+    ts->miss_valid = false;
     return;
   }
 
-  possibly_evict(cache, size_in_bytes); // already checks for size >= 0
+  // get cache
+  uint64_t binding_id;
+  struct _openslide_cache *bound = get_bound_cache(cb, &binding_id);
+  struct _openslide_cache *cache = compressed ? bound->compressed : bound;
 
   // create key
   struct _openslide_cache_key *key = g_slice_new(struct _openslide_cache_key);
+  key->binding_id = binding_id;
   key->plane = plane;
   key->x = x;
   key->y = y;
 
+  // if we timed the decode, weigh the tile by its cost
+  int weight = 1;
+  if (cache->policy == OPENSLIDE_CACHE_POLICY_COST) {
+    if (ts->miss_valid && key_equal_func(&ts->miss_key, key)) {
+      int64_t cost_usec = g_timer_elapsed(ts->timer, NULL) * G_USEC_PER_SEC;
+      weight = get_weight(cost_usec, size_in_bytes);
+    }
+    ts->miss_valid = false;
+  }
+
+  // lock
+  struct cache_shard *shard = get_shard(cache, key);
+  g_mutex_lock(shard->mutex);
+
+  // don't try to put anything in the cache that cannot possibly fit.
+  // an entry bigger than its shard but smaller than the whole cache is
+  // still admitted; it just displaces the rest of the shard.
+  if (size_in_bytes > shard->capacity * cache->shard_count) {
+    //g_debug("refused %p", entry);
+    shard->refused++;
+    g_mutex_unlock(shard->mutex);
+    g_slice_free(struct _openslide_cache_key, key);
+    _openslide_cache_unref(bound);
+    return;
+  }
+
+  // 2Q: a tile is only trusted with the main list once it has been
+  // evicted and come back
+  bool probation = cache->policy == OPENSLIDE_CACHE_POLICY_2Q &&
+                   !take_ghost(shard, key);
+
+  // replace any existing value before evicting, so it can't be
+  // remembered as a ghost of itself
+  g_hash_table_remove(shard->hashtable, key);
+
+  possibly_evict(shard, size_in_bytes); // already checks for size >= 0
+
   // create value
   struct _openslide_cache_value *value =
     g_slice_new(struct _openslide_cache_value);
   value->key = key;
-  value->cache = cache;
+  value->shard = shard;
   value->entry = entry;
+  value->weight = weight;
+  value->probation = probation;
+  // costly tiles start out with some passes in hand
+  g_atomic_int_set(&value->referenced, weight - 1);
 
   // insert at head of queue
-  g_queue_push_head(cache->list, value);
-  value->link = g_queue_peek_head_link(cache->list);
+  GQueue *queue = probation ? shard->probation : shard->list;
+  g_queue_push_head(queue, value);
+  value->link = g_queue_peek_head_link(queue);
+  if (probation) {
+    shard->probation_size += size_in_bytes;
+  }
 
   // insert into hash table
-  g_hash_table_replace(cache->hashtable, key, value);
+  g_hash_table_insert(shard->hashtable, key, value);
 
   // increase size
-  cache->total_size += size_in_bytes;
+  shard->total_size += size_in_bytes;
+  shard->insertions++;
 
   // another ref for the cache
   g_atomic_int_inc(&entry->refcount);
 
   // unlock
-  g_mutex_unlock(cache->mutex);
+  g_mutex_unlock(shard->mutex);
+  _openslide_cache_unref(bound);
 
   //g_debug("insert %p", entry);
 }
 
 // entry must be unreffed when the caller is done with the data
-void *_openslide_cache_get(struct _openslide_cache *cache,
-			   void *plane,
-			   int64_t x,
-			   int64_t y,
-			   struct _openslide_cache_entry **_entry) {
-  // lock
-  g_mutex_lock(cache->mutex);
+static void *tier_get(struct _openslide_cache_binding *cb,
+                      bool compressed,
+                      void *plane,
+                      int64_t x,
+                      int64_t y,
+                      struct _openslide_cache_entry **_entry) {
+  // get cache
+  uint64_t binding_id;
+  struct _openslide_cache *bound = get_bound_cache(cb, &binding_id);
+  struct _openslide_cache *cache = compressed ? bound->compressed : bound;
 
   // create key
-  struct _openslide_cache_key key = { .plane = plane, .x = x, .y = y };
+  struct _openslide_cache_key key = { .binding_id = binding_id,
+                                      .plane = plane, .x = x, .y = y };
+
+  // lock
+  struct cache_shard *shard = get_shard(cache, &key);
+  g_mutex_lock(shard->mutex);
 
   // lookup key, maybe return NULL
-  struct _openslide_cache_value *value = g_hash_table_lookup(cache->hashtable,
+  struct _openslide_cache_value *value = g_hash_table_lookup(shard->hashtable,
 							     &key);
   if (value == NULL) {
-    g_mutex_unlock(cache->mutex);
+    shard->misses++;
+    g_mutex_unlock(shard->mutex);
+    if (cache->policy == OPENSLIDE_CACHE_POLICY_COST) {
+      // time the decode the caller is about to do
+      struct thread_state *ts = get_thread_state();
+      if (ts->timer == NULL) {
+        ts->timer = g_timer_new();
+      }
+      ts->miss_key = key;
+      ts->miss_valid = true;
+      g_timer_start(ts->timer);
+    }
+    _openslide_cache_unref(bound);
     *_entry = NULL;
     return NULL;
   }
 
-  // if found, move to front of list
-  GList *link = value->link;
-  g_queue_unlink(cache->list, link);
-  g_queue_push_head_link(cache->list, link);
+  shard->hits++;
+
+  // if found, mark as recently used; no list reordering on a hit.
+  // probation entries have no clock to survive, so this is moot for them.
+  g_atomic_int_set(&value->referenced, value->weight);
 
   // acquire entry reference for the caller
   struct _openslide_cache_entry *entry = value->entry;
@@ -282,20 +657,222 @@ void *_openslide_cache_get(struct _openslide_cache *cache,
   //g_debug("cache hit! %p %p %"G_GINT64_FORMAT" %"G_GINT64_FORMAT, (void *) entry, (void *) plane, x, y);
 
   // unlock
-  g_mutex_unlock(cache->mutex);
+  g_mutex_unlock(shard->mutex);
+  _openslide_cache_unref(bound);
 
   // return data
   *_entry = entry;
   return entry->data;
 }
 
+void _openslide_cache_put(struct _openslide_cache_binding *cb,
+			  void *plane,
+			  int64_t x,
+			  int64_t y,
+			  void *data,
+			  int64_t size_in_bytes,
+			  struct _openslide_cache_entry **entry) {
+  int64_t perf_start = _openslide_perf_start();
+  tier_put(cb, false, plane, x, y, data, size_in_bytes, entry);
+  _openslide_perf_end(OPENSLIDE_PERF_CACHE_PUT, perf_start, size_in_bytes);
+  _openslide_trace_cache_put(size_in_bytes);
+}
+
+void *_openslide_cache_get(struct _openslide_cache_binding *cb,
+			   void *plane,
+			   int64_t x,
+			   int64_t y,
+			   struct _openslide_cache_entry **entry) {
+  int64_t perf_start = _openslide_perf_start();
+  void *data = tier_get(cb, false, plane, x, y, entry);
+  _openslide_perf_end(OPENSLIDE_PERF_CACHE_GET, perf_start,
+                      data ? (*entry)->size : 0);
+  _openslide_trace_cache_get(data != NULL, data ? (*entry)->size : 0);
+  return data;
+}
+
+bool _openslide_cache_compressed_enabled(struct _openslide_cache_binding *cb) {
+  uint64_t binding_id;
+  struct _openslide_cache *bound = get_bound_cache(cb, &binding_id);
+  bool enabled = _openslide_cache_get_capacity(bound->compressed) > 0;
+  _openslide_cache_unref(bound);
+  return enabled;
+}
+
+void _openslide_cache_put_compressed(struct _openslide_cache_binding *cb,
+                                     void *plane,
+                                     int64_t x,
+                                     int64_t y,
+                                     void *data,
+                                     int64_t size_in_bytes,
+                                     struct _openslide_cache_entry **entry) {
+  int64_t perf_start = _openslide_perf_start();
+  tier_put(cb, true, plane, x, y, data, size_in_bytes, entry);
+  _openslide_perf_end(OPENSLIDE_PERF_CACHE_PUT, perf_start, size_in_bytes);
+}
+
+const void *_openslide_cache_get_compressed(struct _openslide_cache_binding *cb,
+                                            void *plane,
+                                            int64_t x,
+                                            int64_t y,
+                                            int64_t *size_in_bytes,
+                                            struct _openslide_cache_entry **entry) {
+  int64_t perf_start = _openslide_perf_start();
+  void *data = tier_get(cb, true, plane, x, y, entry);
+  *size_in_bytes = data ? (*entry)->size : 0;
+  _openslide_perf_end(OPENSLIDE_PERF_CACHE_GET, perf_start, *size_in_bytes);
+  return data;
+}
+
+// bindings
+struct _openslide_cache_binding *_openslide_cache_binding_create(int64_t capacity_in_bytes) {
+  struct _openslide_cache_binding *cb =
+    g_slice_new0(struct _openslide_cache_binding);
+  cb->mutex = g_mutex_new();
+  cb->cache = _openslide_cache_create(capacity_in_bytes,
+                                      get_default_policy());
+
+  g_static_mutex_lock(&next_binding_id_lock);
+  cb->id = next_binding_id++;
+  g_static_mutex_unlock(&next_binding_id_lock);
+
+  return cb;
+}
+
+void _openslide_cache_binding_set(struct _openslide_cache_binding *cb,
+                                  struct _openslide_cache *cache) {
+  g_mutex_lock(cb->mutex);
+  struct _openslide_cache *old_cache = cb->cache;
+  g_atomic_pointer_set((gpointer *) &cb->cache, cache_ref(cache));
+  // a lookup may have loaded the old pointer without referencing it yet.
+  // lookups starting now see the new one.
+  while (g_atomic_int_get(&cb->readers)) {
+    g_thread_yield();
+  }
+  g_mutex_unlock(cb->mutex);
+
+  // entries of this binding in the old cache are no longer reachable and
+  // will age out
+  _openslide_cache_unref(old_cache);
+}
+
+void _openslide_cache_binding_destroy(struct _openslide_cache_binding *cb) {
+  _openslide_cache_unref(cb->cache);
+  g_mutex_free(cb->mutex);
+  g_slice_free(struct _openslide_cache_binding, cb);
+}
+
+bool _openslide_cache_set_thread_bypass(bool bypass) {
+  struct thread_state *ts = get_thread_state();
+  bool old = ts->bypass;
+  ts->bypass = bypass;
+  return old;
+}
+
+static void cache_get_stats(struct _openslide_cache *cache,
+                            openslide_cache_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->capacity = _openslide_cache_get_capacity(cache);
+  for (int i = 0; i < cache->shard_count; i++) {
+    struct cache_shard *shard = &cache->shards[i];
+    g_mutex_lock(shard->mutex);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->insertions += shard->insertions;
+    stats->evictions += shard->evictions;
+    stats->refused += shard->refused;
+    stats->bytes += shard->total_size;
+    g_mutex_unlock(shard->mutex);
+  }
+}
+
+struct _openslide_cache *_openslide_cache_binding_get_cache(struct _openslide_cache_binding *cb) {
+  uint64_t binding_id;
+  return get_bound_cache(cb, &binding_id);
+}
+
+// the default capacity of private caches; -1 until initialized
+static int64_t default_capacity = -1;
+static GStaticMutex default_capacity_lock = G_STATIC_MUTEX_INIT;
+
+int64_t _openslide_cache_get_default_capacity(void) {
+  g_static_mutex_lock(&default_capacity_lock);
+  if (default_capacity == -1) {
+    default_capacity = _OPENSLIDE_USEFUL_CACHE_SIZE;
+    const char *value = g_getenv("OPENSLIDE_CACHE_SIZE");
+    if (value && *value) {
+      gint64 size = g_ascii_strtoll(value, NULL, 10);
+      if (size >= 0) {
+        default_capacity = size;
+      } else {
+        g_warning("Invalid cache size %s", value);
+      }
+    }
+  }
+  int64_t capacity = default_capacity;
+  g_static_mutex_unlock(&default_capacity_lock);
+  return capacity;
+}
+
+static int64_t clamp_capacity(size_t capacity) {
+  return (uint64_t) capacity > (uint64_t) G_MAXINT64 ?
+         G_MAXINT64 : (int64_t) capacity;
+}
+
+// public API
+void openslide_set_default_cache_capacity(size_t capacity) {
+  g_static_mutex_lock(&default_capacity_lock);
+  default_capacity = clamp_capacity(capacity);
+  g_static_mutex_unlock(&default_capacity_lock);
+}
+
+void openslide_cache_set_capacity(openslide_cache_t *cache,
+                                  size_t capacity) {
+  _openslide_cache_set_capacity(cache, clamp_capacity(capacity));
+}
+
+void openslide_cache_get_stats(openslide_cache_t *cache,
+                               openslide_cache_stats_t *stats,
+                               openslide_cache_stats_t *compressed) {
+  if (stats) {
+    cache_get_stats(cache, stats);
+  }
+  if (compressed) {
+    cache_get_stats(cache->compressed, compressed);
+  }
+}
+
+openslide_cache_t *openslide_cache_create(size_t capacity) {
+  return openslide_cache_create_with_policy(capacity,
+                                            get_default_policy());
+}
+
+openslide_cache_t *openslide_cache_create_with_policy(size_t capacity,
+                                                      openslide_cache_policy_t policy) {
+  if (policy != OPENSLIDE_CACHE_POLICY_2Q &&
+      policy != OPENSLIDE_CACHE_POLICY_COST) {
+    policy = OPENSLIDE_CACHE_POLICY_CLOCK;
+  }
+  return _openslide_cache_create(clamp_capacity(capacity), policy);
+}
+
+void openslide_cache_set_compressed_capacity(openslide_cache_t *cache,
+                                             size_t capacity) {
+  _openslide_cache_set_capacity(cache->compressed,
+                                clamp_capacity(capacity));
+}
+
+void openslide_cache_release(openslide_cache_t *cache) {
+  _openslide_cache_unref(cache);
+}
+
 // value unref
 void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry) {
   //g_debug("unref %p, refs %d", entry, g_atomic_int_get(&entry->refcount));
 
   if (g_atomic_int_dec_and_test(&entry->refcount)) {
     // free the data
-    g_slice_free1(entry->size, entry->data);
+    _openslide_buffer_free(entry->size, entry->data);
 
     // free the entry
     g_slice_free(struct _openslide_cache_entry, entry);
@@ -44,6 +44,7 @@ bool _openslide_gdkpixbuf_read(const char *filename,
   GInputStream *buffered = NULL;
   GdkPixbuf *pixbuf = NULL;
   bool success = false;
+  int64_t perf_start = _openslide_perf_start();
 
   // open
   GFile *file = g_file_new_for_path(filename);
@@ -113,5 +114,7 @@ DONE:
   if (input) {
     g_object_unref(input);
   }
+  _openslide_perf_end(OPENSLIDE_PERF_DECODE_GDKPIXBUF, perf_start,
+                      success ? (int64_t) w * h * 4 : 0);
   return success;
 }
@@ -28,66 +28,53 @@
 
 #include <openjpeg.h>
 
-static void write_pixel_ycbcr(uint32_t *dest,
-                              uint8_t c0, uint8_t c1, uint8_t c2) {
-  int16_t R = c0 + _openslide_R_Cr[c2];
-  int16_t G = c0 + _openslide_G_CbCr[c1][c2];
-  int16_t B = c0 + _openslide_B_Cb[c1];
-
-  R = CLAMP(R, 0, 255);
-  G = CLAMP(G, 0, 255);
-  B = CLAMP(B, 0, 255);
-
-  *dest = 0xff000000 | ((uint8_t) R << 16) | ((uint8_t) G << 8) | ((uint8_t) B);
-}
-
-static void write_pixel_rgb(uint32_t *dest,
-                            uint8_t c0, uint8_t c1, uint8_t c2) {
-  *dest = 0xff000000 | c0 << 16 | c1 << 8 | c2;
+// get one row of a component, expanding subsampled data to full width
+static const int32_t *get_row(const opj_image_comp_t *comp,
+                              int32_t sub_x, int32_t sub_y,
+                              int32_t y, int32_t w,
+                              int32_t *buf) {
+  const int32_t *src = comp->data + (int64_t) (y / sub_y) * comp->w;
+  if (sub_x == 1) {
+    return src;
+  }
+  for (int32_t x = 0; x < w; x++) {
+    buf[x] = src[x / sub_x];
+  }
+  return buf;
 }
 
 static void unpack_argb(enum _openslide_jp2k_colorspace space,
                         opj_image_comp_t *comps,
                         uint32_t *dest,
                         int32_t w, int32_t h) {
-  // TODO: too slow, and with duplicated code!
-
-  int c0_sub_x = w / comps[0].w;
-  int c1_sub_x = w / comps[1].w;
-  int c2_sub_x = w / comps[2].w;
-  int c0_sub_y = h / comps[0].h;
-  int c1_sub_y = h / comps[1].h;
-  int c2_sub_y = h / comps[2].h;
-
-  int64_t i = 0;
-
-  switch (space) {
-  case OPENSLIDE_JP2K_YCBCR:
-    for (int32_t y = 0; y < h; y++) {
-      for (int32_t x = 0; x < w; x++) {
-        uint8_t c0 = comps[0].data[(y / c0_sub_y) * comps[0].w + (x / c0_sub_x)];
-        uint8_t c1 = comps[1].data[(y / c1_sub_y) * comps[1].w + (x / c1_sub_x)];
-        uint8_t c2 = comps[2].data[(y / c2_sub_y) * comps[2].w + (x / c2_sub_x)];
-
-        write_pixel_ycbcr(dest + i, c0, c1, c2);
-        i++;
-      }
-    }
-
-    break;
+  int32_t sub_x[3];
+  int32_t sub_y[3];
+  int32_t *bufs[3];
+  for (int c = 0; c < 3; c++) {
+    sub_x[c] = w / comps[c].w;
+    sub_y[c] = h / comps[c].h;
+    bufs[c] = sub_x[c] > 1 ? g_new(int32_t, w) : NULL;
+  }
 
-  case OPENSLIDE_JP2K_RGB:
-    for (int32_t y = 0; y < h; y++) {
-      for (int32_t x = 0; x < w; x++) {
-        uint8_t c0 = comps[0].data[(y / c0_sub_y) * comps[0].w + (x / c0_sub_x)];
-        uint8_t c1 = comps[1].data[(y / c1_sub_y) * comps[1].w + (x / c1_sub_x)];
-        uint8_t c2 = comps[2].data[(y / c2_sub_y) * comps[2].w + (x / c2_sub_x)];
+  for (int32_t y = 0; y < h; y++) {
+    const int32_t *rows[3];
+    for (int c = 0; c < 3; c++) {
+      rows[c] = get_row(&comps[c], sub_x[c], sub_y[c], y, w, bufs[c]);
+    }
 
-        write_pixel_rgb(dest + i, c0, c1, c2);
-        i++;
-      }
+    switch (space) {
+    case OPENSLIDE_JP2K_YCBCR:
+      _openslide_ycbcr_to_argb(dest, rows[0], rows[1], rows[2], w);
+      break;
+    case OPENSLIDE_JP2K_RGB:
+      _openslide_rgb_to_argb(dest, rows[0], rows[1], rows[2], w);
+      break;
     }
-    break;
+    dest += w;
+  }
+
+  for (int c = 0; c < 3; c++) {
+    g_free(bufs[c]);
   }
 }
 
@@ -109,16 +96,218 @@ static void error_callback(const char *msg, void *data) {
   }
 }
 
-bool _openslide_jp2k_decode_buffer(uint32_t *dest,
-                                   int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
-                                   enum _openslide_jp2k_colorspace space,
-                                   GError **err) {
+static bool check_image(opj_image_t *image,
+                        int32_t w, int32_t h,
+                        GError **err) {
+  if (image->numcomps != 3) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Expected 3 image components, found %d", image->numcomps);
+    return false;
+  }
+  // the first component is never subsampled, so it gives the size of
+  // the (possibly reduced) image
+  if ((int32_t) image->comps[0].w != w || (int32_t) image->comps[0].h != h) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Dimensional mismatch reading JP2K, "
+                "expected %dx%d, got %ux%u",
+                w, h, image->comps[0].w, image->comps[0].h);
+    return false;
+  }
+  // TODO more checks?
+  return true;
+}
+
+#ifdef HAVE_OPENJPEG2
+
+struct read_callback_params {
+  const uint8_t *data;
+  OPJ_SIZE_T datalen;
+  OPJ_SIZE_T pos;
+};
+
+static OPJ_SIZE_T read_callback(void *buf, OPJ_SIZE_T count, void *data) {
+  struct read_callback_params *params = data;
+  count = MIN(count, params->datalen - params->pos);
+  if (count == 0) {
+    return (OPJ_SIZE_T) -1;
+  }
+  memcpy(buf, params->data + params->pos, count);
+  params->pos += count;
+  return count;
+}
+
+static OPJ_OFF_T skip_callback(OPJ_OFF_T count, void *data) {
+  struct read_callback_params *params = data;
+  OPJ_SIZE_T orig_pos = params->pos;
+  if (count < 0) {
+    params->pos -= MIN((OPJ_SIZE_T) -count, params->pos);
+  } else {
+    params->pos += MIN((OPJ_SIZE_T) count, params->datalen - params->pos);
+  }
+  return (OPJ_OFF_T) params->pos - (OPJ_OFF_T) orig_pos;
+}
+
+static OPJ_BOOL seek_callback(OPJ_OFF_T pos, void *data) {
+  struct read_callback_params *params = data;
+  if (pos < 0 || (OPJ_SIZE_T) pos > params->datalen) {
+    return OPJ_FALSE;
+  }
+  params->pos = pos;
+  return OPJ_TRUE;
+}
+
+// create a codec and read the main header
+static opj_codec_t *open_codestream(struct read_callback_params *params,
+                                    int32_t reduce,
+                                    opj_stream_t **_stream,
+                                    opj_image_t **_image,
+                                    GError **err) {
+  opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, true);
+  opj_stream_set_user_data(stream, params, NULL);
+  opj_stream_set_user_data_length(stream, params->datalen);
+  opj_stream_set_read_function(stream, read_callback);
+  opj_stream_set_skip_function(stream, skip_callback);
+  opj_stream_set_seek_function(stream, seek_callback);
+
+  opj_codec_t *codec = opj_create_decompress(OPJ_CODEC_J2K);
+  opj_dparameters_t parameters;
+  opj_set_default_decoder_parameters(&parameters);
+  parameters.cp_reduce = reduce;
+  opj_setup_decoder(codec, &parameters);
+  opj_set_error_handler(codec, error_callback, err);
+  opj_set_warning_handler(codec, warning_callback, NULL);
+
+  opj_image_t *image = NULL;
+  if (!opj_read_header(stream, codec, &image)) {
+    if (err && !*err) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Couldn't read JP2K header");
+    }
+    if (image) {
+      opj_image_destroy(image);
+    }
+    opj_destroy_codec(codec);
+    opj_stream_destroy(stream);
+    return NULL;
+  }
+
+  *_stream = stream;
+  *_image = image;
+  return codec;
+}
+
+int32_t _openslide_jp2k_get_max_reduce(const void *data, int32_t datalen) {
+  struct read_callback_params params = {
+    .data = data,
+    .datalen = datalen,
+  };
+  opj_stream_t *stream;
+  opj_image_t *image;
+  opj_codec_t *codec = open_codestream(&params, 0, &stream, &image, NULL);
+  if (!codec) {
+    return 0;
+  }
+
+  int32_t result = 0;
+  opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+  if (info) {
+    if (info->m_default_tile_info.tccp_info) {
+      result = info->m_default_tile_info.tccp_info[0].numresolutions - 1;
+    }
+    opj_destroy_cstr_info(&info);
+  }
+
+  opj_image_destroy(image);
+  opj_destroy_codec(codec);
+  opj_stream_destroy(stream);
+  return MAX(result, 0);
+}
+
+static bool jp2k_decode(uint32_t *dest,
+                        int32_t w, int32_t h,
+                        int32_t reduce,
+                        const void *data, int32_t datalen,
+                        enum _openslide_jp2k_colorspace space,
+                        GError **err) {
+  GError *tmp_err = NULL;
+  bool success = false;
+
+  g_assert(data != NULL);
+  g_assert(reduce >= 0);
+
+  struct read_callback_params params = {
+    .data = data,
+    .datalen = datalen,
+  };
+  opj_stream_t *stream;
+  opj_image_t *image;
+  opj_codec_t *codec = open_codestream(&params, reduce,
+                                       &stream, &image, &tmp_err);
+  if (!codec) {
+    g_propagate_error(err, tmp_err);
+    return false;
+  }
+
+#ifdef HAVE_OPJ_CODEC_SET_THREADS
+  // decode code-blocks in parallel, unless the worker pool is already
+  // decoding other tiles
+  if (!_openslide_in_task()) {
+    int threads = _openslide_get_worker_count();
+    if (threads > 1) {
+      opj_codec_set_threads(codec, threads);
+    }
+  }
+#endif
+
+  // decode
+  if (!opj_decode(codec, stream, image) ||
+      !opj_end_decompress(codec, stream)) {
+    if (!tmp_err) {
+      g_set_error(&tmp_err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Couldn't decode JP2K image");
+    }
+  }
+  if (tmp_err) {
+    g_propagate_error(err, tmp_err);
+    goto DONE;
+  }
+
+  // sanity checks
+  if (!check_image(image, w, h, err)) {
+    goto DONE;
+  }
+
+  unpack_argb(space, image->comps, dest, w, h);
+
+  success = true;
+
+DONE:
+  opj_image_destroy(image);
+  opj_destroy_codec(codec);
+  opj_stream_destroy(stream);
+  return success;
+}
+
+#else
+
+int32_t _openslide_jp2k_get_max_reduce(const void *data G_GNUC_UNUSED,
+                                       int32_t datalen G_GNUC_UNUSED) {
+  // OpenJPEG 1 doesn't expose the number of resolutions
+  return 0;
+}
+
+static bool jp2k_decode(uint32_t *dest,
+                        int32_t w, int32_t h,
+                        int32_t reduce,
+                        const void *data, int32_t datalen,
+                        enum _openslide_jp2k_colorspace space,
+                        GError **err) {
   GError *tmp_err = NULL;
   bool success = false;
 
   // opj_cio_open interprets a NULL buffer as opening for write
   g_assert(data != NULL);
+  g_assert(reduce >= 0);
 
   // init decompressor
   opj_cio_t *stream = NULL;
@@ -134,8 +323,10 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   opj_dparameters_t parameters;
   dinfo = opj_create_decompress(CODEC_J2K);
   opj_set_default_decoder_parameters(&parameters);
+  parameters.cp_reduce = reduce;
   opj_setup_decoder(dinfo, &parameters);
-  stream = opj_cio_open((opj_common_ptr) dinfo, data, datalen);
+  stream = opj_cio_open((opj_common_ptr) dinfo, (unsigned char *) data,
+                        datalen);
   opj_set_event_mgr((opj_common_ptr) dinfo, &event_callbacks, &tmp_err);
 
   // decode
@@ -169,20 +360,9 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   }
 
   // sanity checks
-  if (image->x1 != w || image->y1 != h) {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Dimensional mismatch reading JP2K, "
-                "expected %dx%d, got %dx%d",
-                w, h, image->x1, image->y1);
+  if (!check_image(image, w, h, err)) {
     goto DONE;
   }
-  if (image->numcomps != 3) {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Expected 3 image components, found %d", image->numcomps);
-    goto DONE;
-  }
-
-  // TODO more checks?
 
   unpack_argb(space, image->comps, dest, w, h);
 
@@ -200,3 +380,27 @@ DONE:
   }
   return success;
 }
+
+#endif
+
+bool _openslide_jp2k_decode_buffer_reduced(uint32_t *dest,
+                                           int32_t w, int32_t h,
+                                           int32_t reduce,
+                                           const void *data, int32_t datalen,
+                                           enum _openslide_jp2k_colorspace space,
+                                           GError **err) {
+  int64_t perf_start = _openslide_perf_start();
+  bool success = jp2k_decode(dest, w, h, reduce, data, datalen, space, err);
+  _openslide_perf_end(OPENSLIDE_PERF_DECODE_JP2K, perf_start,
+                      success ? (int64_t) w * h * 4 : 0);
+  return success;
+}
+
+bool _openslide_jp2k_decode_buffer(uint32_t *dest,
+                                   int32_t w, int32_t h,
+                                   const void *data, int32_t datalen,
+                                   enum _openslide_jp2k_colorspace space,
+                                   GError **err) {
+  return _openslide_jp2k_decode_buffer_reduced(dest, w, h, 0,
+                                               data, datalen, space, err);
+}
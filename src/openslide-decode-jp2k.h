@@ -34,8 +34,20 @@ enum _openslide_jp2k_colorspace {
 
 bool _openslide_jp2k_decode_buffer(uint32_t *dest,
                                    int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
+                                   const void *data, int32_t datalen,
                                    enum _openslide_jp2k_colorspace space,
                                    GError **err);
 
+// decode discarding the finest reduce resolution levels; w and h are
+// the dimensions of the reduced image
+bool _openslide_jp2k_decode_buffer_reduced(uint32_t *dest,
+                                           int32_t w, int32_t h,
+                                           int32_t reduce,
+                                           const void *data, int32_t datalen,
+                                           enum _openslide_jp2k_colorspace space,
+                                           GError **err);
+
+// the largest reduce value the codestream supports, or 0 if unknown
+int32_t _openslide_jp2k_get_max_reduce(const void *data, int32_t datalen);
+
 #endif
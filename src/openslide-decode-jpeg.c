@@ -24,6 +24,7 @@
 
 #include "openslide-private.h"
 #include "openslide-decode-jpeg.h"
+#include "openslide-snapshot.h"
 
 #include <glib.h>
 #include <setjmp.h>
@@ -128,19 +129,19 @@ bool _openslide_jpeg_read_dimensions(const char *filename,
                                      int64_t offset,
                                      int32_t *w, int32_t *h,
                                      GError **err) {
-  FILE *f = _openslide_fopen(filename, "rb", err);
+  FILE *f = _openslide_pool_fopen(filename, err);
   if (f == NULL) {
     return false;
   }
   if (offset && fseeko(f, offset, SEEK_SET) == -1) {
     _openslide_io_error(err, "Cannot seek to offset");
-    fclose(f);
+    _openslide_pool_fclose(filename, f);
     return false;
   }
 
   bool success = jpeg_get_dimensions(f, NULL, 0, w, h, err);
 
-  fclose(f);
+  _openslide_pool_fclose(filename, f);
   return success;
 }
 
@@ -150,23 +151,140 @@ bool _openslide_jpeg_decode_buffer_dimensions(const void *buf, uint32_t len,
   return jpeg_get_dimensions(NULL, buf, len, w, h, err);
 }
 
+#ifdef HAVE_JCS_EXT_BGRA
+// libjpeg-turbo can write CAIRO_FORMAT_ARGB32 pixels itself
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define ARGB_COLOR_SPACE JCS_EXT_BGRA
+#else
+#define ARGB_COLOR_SPACE JCS_EXT_ARGB
+#endif
+#endif
+
+// read the next nrows scanlines directly into rows of dest
+static void read_scanlines_direct(struct jpeg_decompress_struct *cinfo,
+                                  uint8_t *dest, gsize stride,
+                                  JDIMENSION nrows) {
+  JSAMPROW rows[MAX_SAMP_FACTOR];
+  JDIMENSION first = cinfo->output_scanline;
+  JDIMENSION end = first + nrows;
+  while (cinfo->output_scanline < end) {
+    JDIMENSION count = MIN(end - cinfo->output_scanline,
+                           (JDIMENSION) cinfo->rec_outbuf_height);
+    count = MIN(count, MAX_SAMP_FACTOR);
+    for (JDIMENSION i = 0; i < count; i++) {
+      rows[i] = dest + (cinfo->output_scanline - first + i) * stride;
+    }
+    jpeg_read_scanlines(cinfo, rows, count);
+  }
+}
+
+void _openslide_jpeg_set_argb_output(struct jpeg_decompress_struct *cinfo) {
+#ifdef ARGB_COLOR_SPACE
+  cinfo->out_color_space = ARGB_COLOR_SPACE;
+#else
+  cinfo->out_color_space = JCS_RGB;
+#endif
+}
+
+void _openslide_jpeg_read_argb(struct jpeg_decompress_struct *cinfo,
+                               uint32_t *dest) {
+  _openslide_jpeg_read_argb_rows(cinfo, dest,
+                                 cinfo->output_height -
+                                 cinfo->output_scanline);
+}
+
+void _openslide_jpeg_read_argb_rows(struct jpeg_decompress_struct *cinfo,
+                                    uint32_t *dest, int32_t nrows) {
+  g_assert(nrows >= 0 &&
+           cinfo->output_scanline + nrows <= cinfo->output_height);
+#ifdef ARGB_COLOR_SPACE
+  g_assert(cinfo->out_color_space == ARGB_COLOR_SPACE);
+  read_scanlines_direct(cinfo, (uint8_t *) dest, cinfo->output_width * 4,
+                        nrows);
+#else
+  g_assert(cinfo->out_color_space == JCS_RGB);
+
+  // freed by jpeg_destroy_decompress(), even after longjmp
+  JSAMPARRAY buffer =
+    (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE,
+                                cinfo->output_width * 3,
+                                cinfo->rec_outbuf_height);
+
+  JDIMENSION end = cinfo->output_scanline + nrows;
+  while (cinfo->output_scanline < end) {
+    JDIMENSION rows_read =
+      jpeg_read_scanlines(cinfo, buffer,
+                          MIN(end - cinfo->output_scanline,
+                              (JDIMENSION) cinfo->rec_outbuf_height));
+    for (JDIMENSION row = 0; row < rows_read; row++) {
+      // copy a row
+      for (JDIMENSION i = 0; i < cinfo->output_width; i++) {
+        dest[i] = 0xFF000000 |                // A
+          buffer[row][i * 3 + 0] << 16 |      // R
+          buffer[row][i * 3 + 1] << 8 |       // G
+          buffer[row][i * 3 + 2];             // B
+      }
+      dest += cinfo->output_width;
+    }
+  }
+#endif
+}
+
+void _openslide_jpeg_skip_rows(struct jpeg_decompress_struct *cinfo,
+                               int32_t nrows) {
+  g_assert(nrows >= 0 &&
+           cinfo->output_scanline + nrows <= cinfo->output_height);
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+  // entropy-decodes the skipped rows, but skips the IDCT, upsampling,
+  // and color conversion of whole iMCU rows
+  JDIMENSION end = cinfo->output_scanline + nrows;
+  while (cinfo->output_scanline < end) {
+    jpeg_skip_scanlines(cinfo, end - cinfo->output_scanline);
+  }
+#else
+  // freed by jpeg_destroy_decompress(), even after longjmp
+  JSAMPARRAY buffer =
+    (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE,
+                                cinfo->output_width *
+                                cinfo->out_color_components,
+                                cinfo->rec_outbuf_height);
+  JDIMENSION end = cinfo->output_scanline + nrows;
+  while (cinfo->output_scanline < end) {
+    jpeg_read_scanlines(cinfo, buffer,
+                        MIN(end - cinfo->output_scanline,
+                            (JDIMENSION) cinfo->rec_outbuf_height));
+  }
+#endif
+}
+
 static bool jpeg_decode(FILE *f,  // or:
                         const void *buf, uint32_t buflen,
+                        const void *tables, uint32_t tables_len,
+                        J_COLOR_SPACE space,
                         void * const _dest, bool grayscale,
+                        int32_t scale_denom,
                         int32_t w, int32_t h,
                         GError **err) {
   bool result = false;
   struct jpeg_decompress_struct cinfo;
   struct _openslide_jpeg_error_mgr jerr;
   jmp_buf env;
-  volatile gsize row_size = 0;  // preserve across longjmp
-
-  JSAMPARRAY buffer = g_slice_alloc0(sizeof(JSAMPROW) * MAX_SAMP_FACTOR);
+  int64_t perf_start = _openslide_perf_start();
 
   if (setjmp(env) == 0) {
     cinfo.err = _openslide_jpeg_set_error_handler(&jerr, &env);
     jpeg_create_decompress(&cinfo);
 
+    // read separately-stored tables, as from TIFFTAG_JPEGTABLES
+    if (tables) {
+      _openslide_jpeg_mem_src(&cinfo, (void *) tables, tables_len);
+      if (jpeg_read_header(&cinfo, FALSE) != JPEG_HEADER_TABLES_ONLY) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "Couldn't read JPEG tables");
+        goto DONE;
+      }
+    }
+
     // set up I/O
     if (f) {
       _openslide_jpeg_stdio_src(&cinfo, f);
@@ -183,7 +301,19 @@ static bool jpeg_decode(FILE *f,  // or:
       goto DONE;
     }
 
-    cinfo.out_color_space = grayscale ? JCS_GRAYSCALE : JCS_RGB;
+    if (space != JCS_UNKNOWN) {
+      // override libjpeg's guess
+      cinfo.jpeg_color_space = space;
+    }
+    if (grayscale) {
+      cinfo.out_color_space = JCS_GRAYSCALE;
+    } else {
+      _openslide_jpeg_set_argb_output(&cinfo);
+    }
+
+    // decode at reduced size in the DCT domain
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale_denom;
 
     jpeg_start_decompress(&cinfo);
 
@@ -198,44 +328,12 @@ static bool jpeg_decode(FILE *f,  // or:
       goto DONE;
     }
 
-    // allocate scanline buffers
-    row_size = sizeof(JSAMPLE) * cinfo.output_width * cinfo.output_components;
-    for (int i = 0; i < cinfo.rec_outbuf_height; i++) {
-      buffer[i] = g_slice_alloc(row_size);
-    }
-
     // decompress
-    uint32_t *dest32 = _dest;
-    uint8_t *dest8 = _dest;
-    while (cinfo.output_scanline < cinfo.output_height) {
-      JDIMENSION rows_read = jpeg_read_scanlines(&cinfo,
-						 buffer,
-						 cinfo.rec_outbuf_height);
-      int cur_buffer = 0;
-      while (rows_read > 0) {
-        // copy a row
-        int32_t i;
-        if (cinfo.output_components == 1) {
-          // grayscale
-          for (i = 0; i < (int32_t) cinfo.output_width; i++) {
-            dest8[i] = buffer[cur_buffer][i];
-          }
-          dest8 += cinfo.output_width;
-        } else {
-          // RGB
-          for (i = 0; i < (int32_t) cinfo.output_width; i++) {
-            dest32[i] = 0xFF000000 |                // A
-              buffer[cur_buffer][i * 3 + 0] << 16 | // R
-              buffer[cur_buffer][i * 3 + 1] << 8 |  // G
-              buffer[cur_buffer][i * 3 + 2];        // B
-          }
-          dest32 += cinfo.output_width;
-        }
-
-	// advance 1 row
-	rows_read--;
-	cur_buffer++;
-      }
+    if (grayscale) {
+      read_scanlines_direct(&cinfo, _dest, cinfo.output_width,
+                            cinfo.output_height);
+    } else {
+      _openslide_jpeg_read_argb(&cinfo, _dest);
     }
     result = true;
   } else {
@@ -244,14 +342,10 @@ static bool jpeg_decode(FILE *f,  // or:
   }
 
 DONE:
-  // free buffers
-  for (int i = 0; i < cinfo.rec_outbuf_height; i++) {
-    g_slice_free1(row_size, buffer[i]);
-  }
-  g_slice_free1(sizeof(JSAMPROW) * MAX_SAMP_FACTOR, buffer);
-
   jpeg_destroy_decompress(&cinfo);
 
+  _openslide_perf_end(OPENSLIDE_PERF_DECODE_JPEG, perf_start,
+                      result ? (int64_t) w * h * (grayscale ? 1 : 4) : 0);
   return result;
 }
 
@@ -260,21 +354,33 @@ bool _openslide_jpeg_read(const char *filename,
                           uint32_t *dest,
                           int32_t w, int32_t h,
                           GError **err) {
+  return _openslide_jpeg_read_scaled(filename, offset, dest, 1, w, h, err);
+}
+
+bool _openslide_jpeg_read_scaled(const char *filename,
+                                 int64_t offset,
+                                 uint32_t *dest,
+                                 int32_t scale_denom,
+                                 int32_t w, int32_t h,
+                                 GError **err) {
   //g_debug("read JPEG: %s %" G_GINT64_FORMAT, filename, offset);
+  g_assert(scale_denom == 1 || scale_denom == 2 ||
+           scale_denom == 4 || scale_denom == 8);
 
-  FILE *f = _openslide_fopen(filename, "rb", err);
+  FILE *f = _openslide_pool_fopen(filename, err);
   if (f == NULL) {
     return false;
   }
   if (offset && fseeko(f, offset, SEEK_SET) == -1) {
     _openslide_io_error(err, "Cannot seek to offset");
-    fclose(f);
+    _openslide_pool_fclose(filename, f);
     return false;
   }
 
-  bool success = jpeg_decode(f, NULL, 0, dest, false, w, h, err);
+  bool success = jpeg_decode(f, NULL, 0, NULL, 0, JCS_UNKNOWN,
+                             dest, false, scale_denom, w, h, err);
 
-  fclose(f);
+  _openslide_pool_fclose(filename, f);
   return success;
 }
 
@@ -284,7 +390,23 @@ bool _openslide_jpeg_decode_buffer(const void *buf, uint32_t len,
                                    GError **err) {
   //g_debug("decode JPEG buffer: %x %u", buf, len);
 
-  return jpeg_decode(NULL, buf, len, dest, false, w, h, err);
+  return jpeg_decode(NULL, buf, len, NULL, 0, JCS_UNKNOWN,
+                     dest, false, 1, w, h, err);
+}
+
+bool _openslide_jpeg_decode_buffer_scaled(const void *buf, uint32_t len,
+                                          const void *tables,
+                                          uint32_t tables_len,
+                                          J_COLOR_SPACE space,
+                                          uint32_t *dest,
+                                          int32_t scale_denom,
+                                          int32_t w, int32_t h,
+                                          GError **err) {
+  g_assert(scale_denom == 1 || scale_denom == 2 ||
+           scale_denom == 4 || scale_denom == 8);
+
+  return jpeg_decode(NULL, buf, len, tables, tables_len, space,
+                     dest, false, scale_denom, w, h, err);
 }
 
 bool _openslide_jpeg_decode_buffer_gray(const void *buf, uint32_t len,
@@ -293,7 +415,8 @@ bool _openslide_jpeg_decode_buffer_gray(const void *buf, uint32_t len,
                                         GError **err) {
   //g_debug("decode grayscale JPEG buffer: %x %u", buf, len);
 
-  return jpeg_decode(NULL, buf, len, dest, true, w, h, err);
+  return jpeg_decode(NULL, buf, len, NULL, 0, JCS_UNKNOWN,
+                     dest, true, 1, w, h, err);
 }
 
 static bool get_associated_image_data(struct _openslide_associated_image *_img,
@@ -307,6 +430,18 @@ static bool get_associated_image_data(struct _openslide_associated_image *_img,
                               img->base.w, img->base.h, err);
 }
 
+static bool get_associated_image_data_scaled(struct _openslide_associated_image *_img,
+                                             int32_t scale_denom,
+                                             uint32_t *dest,
+                                             GError **err) {
+  struct associated_image *img = (struct associated_image *) _img;
+  int64_t w, h;
+  _openslide_associated_image_get_scaled_dimensions(_img, scale_denom,
+                                                    &w, &h);
+  return _openslide_jpeg_read_scaled(img->filename, img->offset, dest,
+                                     scale_denom, w, h, err);
+}
+
 static void destroy_associated_image(struct _openslide_associated_image *_img) {
   struct associated_image *img = (struct associated_image *) _img;
 
@@ -316,6 +451,7 @@ static void destroy_associated_image(struct _openslide_associated_image *_img) {
 
 static const struct _openslide_associated_image_ops jpeg_associated_ops = {
   .get_argb_data = get_associated_image_data,
+  .get_argb_data_scaled = get_associated_image_data_scaled,
   .destroy = destroy_associated_image,
 };
 
@@ -341,3 +477,50 @@ bool _openslide_jpeg_add_associated_image(openslide_t *osr,
 
   return true;
 }
+
+bool _openslide_jpeg_snapshot_associated_images(openslide_t *osr,
+                                                struct _openslide_snapshot *snap) {
+  _openslide_snapshot_put_int(snap, g_hash_table_size(osr->associated_images));
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init(&iter, osr->associated_images);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    struct associated_image *img = value;
+    if (img->base.ops != &jpeg_associated_ops) {
+      return false;
+    }
+    _openslide_snapshot_put_string(snap, key);
+    _openslide_snapshot_put_string(snap, img->filename);
+    _openslide_snapshot_put_int(snap, img->offset);
+    _openslide_snapshot_put_int(snap, img->base.w);
+    _openslide_snapshot_put_int(snap, img->base.h);
+  }
+  return true;
+}
+
+bool _openslide_jpeg_restore_associated_images(openslide_t *osr,
+                                               struct _openslide_snapshot *snap) {
+  int64_t count = _openslide_snapshot_get_int(snap);
+  for (int64_t i = 0; i < count && _openslide_snapshot_ok(snap); i++) {
+    char *name = _openslide_snapshot_get_string(snap);
+    char *filename = _openslide_snapshot_get_string(snap);
+    int64_t offset = _openslide_snapshot_get_int(snap);
+    int64_t w = _openslide_snapshot_get_int(snap);
+    int64_t h = _openslide_snapshot_get_int(snap);
+    if (name == NULL || filename == NULL || !_openslide_snapshot_ok(snap)) {
+      g_free(name);
+      g_free(filename);
+      return false;
+    }
+
+    struct associated_image *img = g_slice_new0(struct associated_image);
+    img->base.ops = &jpeg_associated_ops;
+    img->base.w = w;
+    img->base.h = h;
+    img->filename = filename;
+    img->offset = offset;
+    g_hash_table_insert(osr->associated_images, name, img);
+  }
+  return _openslide_snapshot_ok(snap);
+}
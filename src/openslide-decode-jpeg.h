@@ -48,22 +48,71 @@ bool _openslide_jpeg_read(const char *filename,
                           int32_t w, int32_t h,
                           GError **err);
 
+// like _openslide_jpeg_read(), but decode at 1/scale_denom size as
+// _openslide_jpeg_decode_buffer_scaled() does
+bool _openslide_jpeg_read_scaled(const char *filename,
+                                 int64_t offset,
+                                 uint32_t *dest,
+                                 int32_t scale_denom,
+                                 int32_t w, int32_t h,
+                                 GError **err);
+
 bool _openslide_jpeg_decode_buffer(const void *buf, uint32_t len,
                                    uint32_t *dest,
                                    int32_t w, int32_t h,
                                    GError **err);
 
+// decode at 1/scale_denom size, where scale_denom is 1, 2, 4, or 8.
+// w and h are the scaled dimensions, rounded up.  tables, if not NULL,
+// is an abbreviated stream containing only tables, as in TIFF files.
+// space is the color space of the JPEG data, or JCS_UNKNOWN to guess.
+bool _openslide_jpeg_decode_buffer_scaled(const void *buf, uint32_t len,
+                                          const void *tables,
+                                          uint32_t tables_len,
+                                          J_COLOR_SPACE space,
+                                          uint32_t *dest,
+                                          int32_t scale_denom,
+                                          int32_t w, int32_t h,
+                                          GError **err);
+
 bool _openslide_jpeg_decode_buffer_gray(const void *buf, uint32_t len,
                                         uint8_t *dest,
                                         int32_t w, int32_t h,
                                         GError **err);
 
+// select an output color space suitable for _openslide_jpeg_read_argb();
+// call before jpeg_start_decompress()
+void _openslide_jpeg_set_argb_output(struct jpeg_decompress_struct *cinfo);
+
+// read the remaining scanlines into dest as CAIRO_FORMAT_ARGB32, with a
+// stride of output_width pixels.  may longjmp.
+void _openslide_jpeg_read_argb(struct jpeg_decompress_struct *cinfo,
+                               uint32_t *dest);
+
+// like _openslide_jpeg_read_argb(), but read only the next nrows
+// scanlines.  may longjmp.
+void _openslide_jpeg_read_argb_rows(struct jpeg_decompress_struct *cinfo,
+                                    uint32_t *dest, int32_t nrows);
+
+// discard the next nrows scanlines as cheaply as the library allows.
+// may longjmp.
+void _openslide_jpeg_skip_rows(struct jpeg_decompress_struct *cinfo,
+                               int32_t nrows);
+
 bool _openslide_jpeg_add_associated_image(openslide_t *osr,
                                           const char *name,
                                           const char *filename,
                                           int64_t offset,
                                           GError **err);
 
+// save or restore associated images added by
+// _openslide_jpeg_add_associated_image().  saving fails if the slide has
+// any other kind.
+bool _openslide_jpeg_snapshot_associated_images(openslide_t *osr,
+                                                struct _openslide_snapshot *snap);
+bool _openslide_jpeg_restore_associated_images(openslide_t *osr,
+                                               struct _openslide_snapshot *snap);
+
 /*
  * On Windows, we cannot fopen a file and pass it to another DLL that does fread.
  * So we need to compile all our freading into the OpenSlide DLL directly.
@@ -51,9 +51,11 @@ static void error_callback(png_struct *png, const char *message) {
 
 static void read_callback(png_struct *png, png_byte *buf, png_size_t len) {
   FILE *f = png_get_io_ptr(png);
+  int64_t perf_start = _openslide_perf_start();
   if (fread(buf, len, 1, f) != 1) {
     png_error(png, "Read failed");
   }
+  _openslide_perf_end(OPENSLIDE_PERF_FILE_IO, perf_start, len);
 }
 
 bool _openslide_png_read(const char *filename,
@@ -64,6 +66,7 @@ bool _openslide_png_read(const char *filename,
   png_struct *png = NULL;
   png_info *info = NULL;
   bool success = false;
+  int64_t perf_start = _openslide_perf_start();
 
   // allocate row pointers
   png_byte **rows = g_slice_alloc(h * sizeof(*rows));
@@ -72,7 +75,7 @@ bool _openslide_png_read(const char *filename,
   }
 
   // open and seek
-  FILE *f = _openslide_fopen(filename, "rb", err);
+  FILE *f = _openslide_pool_fopen(filename, err);
   if (!f) {
     goto DONE;
   }
@@ -179,8 +182,10 @@ bool _openslide_png_read(const char *filename,
 DONE:
   png_destroy_read_struct(&png, &info, NULL);
   if (f) {
-    fclose(f);
+    _openslide_pool_fclose(filename, f);
   }
   g_slice_free1(h * sizeof(*rows), rows);
+  _openslide_perf_end(OPENSLIDE_PERF_DECODE_PNG, perf_start,
+                      success ? w * h * 4 : 0);
   return success;
 }
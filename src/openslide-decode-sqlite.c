@@ -28,6 +28,18 @@
 #define BUSY_TIMEOUT 500  // ms
 #define PROFILE 0
 
+// idle connections kept by a pool
+#define POOL_MAX 16
+// memory-mapped I/O for pooled connections; older SQLite ignores this
+#define POOL_MMAP_SIZE (256 << 20)
+
+struct _openslide_sqlite_pool {
+  char *filename;
+  char *sql;
+  GQueue *idle;  // sqlite3_stmt, MRU first
+  GMutex *lock;
+};
+
 /* Can only use API supported in SQLite 3.6.20 for RHEL 6 compatibility */
 
 #if PROFILE
@@ -127,3 +139,84 @@ void _openslide_sqlite_close(sqlite3 *db) {
   }
 }
 #define sqlite3_close _OPENSLIDE_POISON(_openslide_sqlite_close)
+
+struct _openslide_sqlite_pool *_openslide_sqlite_pool_create(const char *filename,
+                                                             const char *sql) {
+  struct _openslide_sqlite_pool *pool =
+    g_slice_new0(struct _openslide_sqlite_pool);
+  pool->filename = g_strdup(filename);
+  pool->sql = g_strdup(sql);
+  pool->idle = g_queue_new();
+  pool->lock = g_mutex_new();
+  return pool;
+}
+
+static void finalize_and_close(sqlite3_stmt *stmt) {
+  sqlite3 *db = sqlite3_db_handle(stmt);
+  sqlite3_finalize(stmt);
+  _openslide_sqlite_close(db);
+}
+
+sqlite3_stmt *_openslide_sqlite_pool_get(struct _openslide_sqlite_pool *pool,
+                                         GError **err) {
+  g_mutex_lock(pool->lock);
+  sqlite3_stmt *stmt = g_queue_pop_head(pool->idle);
+  g_mutex_unlock(pool->lock);
+  if (stmt) {
+    return stmt;
+  }
+
+  // each connection has its own page cache; shared-cache mode would
+  // serialize readers on table locks
+  sqlite3 *db = _openslide_sqlite_open(pool->filename, err);
+  if (!db) {
+    return NULL;
+  }
+  // tuning only; unsupported pragmas are ignored
+  char *pragmas = g_strdup_printf("PRAGMA query_only = 1; "
+                                  "PRAGMA mmap_size = %d", POOL_MMAP_SIZE);
+  sqlite3_exec(db, pragmas, NULL, NULL, NULL);
+  g_free(pragmas);
+
+  stmt = _openslide_sqlite_prepare(db, pool->sql, err);
+  if (!stmt) {
+    _openslide_sqlite_close(db);
+    return NULL;
+  }
+  return stmt;
+}
+
+void _openslide_sqlite_pool_put(struct _openslide_sqlite_pool *pool,
+                                sqlite3_stmt *stmt) {
+  if (stmt == NULL) {
+    return;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  g_mutex_lock(pool->lock);
+  if (g_queue_get_length(pool->idle) < POOL_MAX) {
+    g_queue_push_head(pool->idle, stmt);
+    stmt = NULL;
+  }
+  g_mutex_unlock(pool->lock);
+
+  if (stmt) {
+    finalize_and_close(stmt);
+  }
+}
+
+void _openslide_sqlite_pool_destroy(struct _openslide_sqlite_pool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  sqlite3_stmt *stmt;
+  while ((stmt = g_queue_pop_head(pool->idle)) != NULL) {
+    finalize_and_close(stmt);
+  }
+  g_queue_free(pool->idle);
+  g_mutex_free(pool->lock);
+  g_free(pool->sql);
+  g_free(pool->filename);
+  g_slice_free(struct _openslide_sqlite_pool, pool);
+}
@@ -36,4 +36,17 @@ void _openslide_sqlite_propagate_error(sqlite3 *db, GError **err);
 void _openslide_sqlite_propagate_stmt_error(sqlite3_stmt *stmt, GError **err);
 void _openslide_sqlite_close(sqlite3 *db);
 
+/* Pool of read-only connections, each with one prepared statement */
+
+struct _openslide_sqlite_pool;
+
+struct _openslide_sqlite_pool *_openslide_sqlite_pool_create(const char *filename,
+                                                             const char *sql);
+// returns a reset statement with no bindings
+sqlite3_stmt *_openslide_sqlite_pool_get(struct _openslide_sqlite_pool *pool,
+                                         GError **err);
+void _openslide_sqlite_pool_put(struct _openslide_sqlite_pool *pool,
+                                sqlite3_stmt *stmt);
+void _openslide_sqlite_pool_destroy(struct _openslide_sqlite_pool *pool);
+
 #endif
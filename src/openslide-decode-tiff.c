@@ -24,6 +24,7 @@
 
 #include "openslide-private.h"
 #include "openslide-decode-tiff.h"
+#include "openslide-decode-jpeg.h"
 
 #include <glib.h>
 #include <tiffio.h>
@@ -35,13 +36,24 @@
 
 #include "openslide-hash.h"
 
-#define HANDLE_CACHE_MAX 32
+// idle handles kept per file; scaled up with the worker pool
+#define HANDLE_CACHE_MIN 32
+#define HANDLE_CACHE_PER_WORKER 4
+
+// don't synthesize levels smaller than this in either dimension
+#define MIN_SCALED_LEVEL_SIZE 64
 
 struct _openslide_tiffcache {
   char *filename;
-  GQueue *cache;
+  struct _openslide_file *file;  // opened with the first handle
+  GQueue *cache;  // MRU first
   GMutex *lock;
   int outstanding;
+  int limit;
+
+  // statistics for requests naming a directory
+  uint64_t dir_hits;      // handle was already on the directory
+  uint64_t dir_switches;  // handle had to change directory
 };
 
 // not thread-safe, like libtiff
@@ -83,7 +95,10 @@ bool _openslide_tiff_set_dir(TIFF *tiff,
     // avoid libtiff unnecessarily rereading directory contents
     return true;
   }
-  if (!TIFFSetDirectory(tiff, dir)) {
+  int64_t perf_start = _openslide_perf_start();
+  bool success = TIFFSetDirectory(tiff, dir);
+  _openslide_perf_end(OPENSLIDE_PERF_TIFF_DIRECTORY, perf_start, 0);
+  if (!success) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot set TIFF directory %d", dir);
     return false;
@@ -110,6 +125,20 @@ bool _openslide_tiff_level_init(TIFF *tiff,
   GET_FIELD_OR_FAIL(tiff, TIFFTAG_IMAGEWIDTH, uint32_t, iw);
   GET_FIELD_OR_FAIL(tiff, TIFFTAG_IMAGELENGTH, uint32_t, ih);
 
+  // can we hand tiles straight to libjpeg?
+  uint16_t compression, photometric, spp, bps, planar;
+  bool native_jpeg =
+    TIFFGetField(tiff, TIFFTAG_COMPRESSION, &compression) &&
+    compression == COMPRESSION_JPEG &&
+    TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric) &&
+    (photometric == PHOTOMETRIC_YCBCR || photometric == PHOTOMETRIC_RGB) &&
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLESPERPIXEL, &spp) &&
+    spp == 3 &&
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bps) &&
+    bps == 8 &&
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar) &&
+    planar == PLANARCONFIG_CONTIG;
+
   // safe now, start writing
   if (level) {
     level->w = iw;
@@ -129,11 +158,26 @@ bool _openslide_tiff_level_init(TIFF *tiff,
     // num tiles in each dimension
     tiffl->tiles_across = (iw / tw) + !!(iw % tw);   // integer ceiling
     tiffl->tiles_down = (ih / th) + !!(ih % th);
+
+    tiffl->native_jpeg = native_jpeg;
   }
 
   return true;
 }
 
+bool _openslide_tiff_level_can_scale(const struct _openslide_tiff_level *tiffl,
+                                     int32_t scale_denom) {
+  if (scale_denom != 2 && scale_denom != 4 && scale_denom != 8) {
+    return false;
+  }
+  // scaled tiles must still abut exactly
+  if (tiffl->tile_w % scale_denom || tiffl->tile_h % scale_denom) {
+    return false;
+  }
+  return tiffl->image_w / scale_denom >= MIN_SCALED_LEVEL_SIZE &&
+         tiffl->image_h / scale_denom >= MIN_SCALED_LEVEL_SIZE;
+}
+
 // clip right/bottom edges of tile in last row/column
 bool _openslide_tiff_clip_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *tiledata,
@@ -146,6 +190,21 @@ bool _openslide_tiff_clip_tile(struct _openslide_tiff_level *tiffl,
                               err);
 }
 
+bool _openslide_tiff_clip_tile_scaled(struct _openslide_tiff_level *tiffl,
+                                      uint32_t *tiledata,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int32_t scale_denom,
+                                      GError **err) {
+  int64_t s = scale_denom;
+  int64_t remaining_w = tiffl->image_w - tile_col * tiffl->tile_w;
+  int64_t remaining_h = tiffl->image_h - tile_row * tiffl->tile_h;
+  return _openslide_clip_tile(tiledata,
+                              tiffl->tile_w / s, tiffl->tile_h / s,
+                              (remaining_w + s - 1) / s,
+                              (remaining_h + s - 1) / s,
+                              err);
+}
+
 static bool tiff_read_region(TIFF *tiff,
                              uint32_t *dest,
                              int64_t x, int64_t y,
@@ -154,6 +213,7 @@ static bool tiff_read_region(TIFF *tiff,
   TIFFRGBAImage img;
   char emsg[1024] = "unknown error";
   bool success = false;
+  int64_t perf_start = _openslide_perf_start();
 
   // init
   if (!TIFFRGBAImageOK(tiff, emsg)) {
@@ -173,10 +233,7 @@ static bool tiff_read_region(TIFF *tiff,
   // draw it
   if (TIFFRGBAImageGet(&img, dest, w, h)) {
     // convert ABGR -> ARGB
-    for (uint32_t *p = dest; p < dest + w * h; p++) {
-      uint32_t val = GUINT32_SWAP_LE_BE(*p);
-      *p = (val << 24) | (val >> 8);
-    }
+    _openslide_abgr_to_argb(dest, (size_t) w * h);
     success = true;
   } else {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -186,6 +243,8 @@ static bool tiff_read_region(TIFF *tiff,
 
   // done
   TIFFRGBAImageEnd(&img);
+  _openslide_perf_end(OPENSLIDE_PERF_DECODE_TIFF, perf_start,
+                      success ? (int64_t) w * h * 4 : 0);
   return success;
 }
 
@@ -194,6 +253,13 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *dest,
                                int64_t tile_col, int64_t tile_row,
                                GError **err) {
+  // JPEG tiles go straight to libjpeg, skipping TIFFRGBAImage's
+  // per-tile setup and its own color conversion and packing
+  if (tiffl->native_jpeg) {
+    return _openslide_tiff_read_tile_scaled(tiffl, tiff, dest,
+                                            tile_col, tile_row, 1, err);
+  }
+
   // set directory
   SET_DIR_OR_FAIL(tiff, tiffl->dir);
 
@@ -203,6 +269,55 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
                           tiffl->tile_w, tiffl->tile_h, err);
 }
 
+bool _openslide_tiff_read_tile_scaled(struct _openslide_tiff_level *tiffl,
+                                      TIFF *tiff,
+                                      uint32_t *dest,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int32_t scale_denom,
+                                      GError **err) {
+  g_assert(tiffl->native_jpeg);
+  g_assert(tiffl->tile_w % scale_denom == 0);
+  g_assert(tiffl->tile_h % scale_denom == 0);
+
+  // set directory
+  SET_DIR_OR_FAIL(tiff, tiffl->dir);
+
+  // libtiff skips color conversion for RGB JPEG; so must we
+  uint16_t photometric;
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_PHOTOMETRIC, uint16_t, photometric);
+  J_COLOR_SPACE space =
+    photometric == PHOTOMETRIC_RGB ? JCS_RGB : JCS_UNKNOWN;
+
+  // get shared tables, if any
+  uint32_t tables_len;
+  void *tables;
+  if (!TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_len, &tables)) {
+    tables = NULL;
+    tables_len = 0;
+  }
+
+  // read raw tile
+  const void *buf;
+  int32_t buflen;
+  void *buf_to_free;
+  if (!_openslide_tiff_map_tile_data(tiffl, tiff, &buf, &buflen,
+                                     &buf_to_free,
+                                     tile_col, tile_row, err)) {
+    return false;
+  }
+
+  // decode
+  bool success =
+    _openslide_jpeg_decode_buffer_scaled(buf, buflen,
+                                         tables, tables_len, space,
+                                         dest, scale_denom,
+                                         tiffl->tile_w / scale_denom,
+                                         tiffl->tile_h / scale_denom,
+                                         err);
+  g_free(buf_to_free);
+  return success;
+}
+
 bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
                                     TIFF *tiff,
                                     void **_buf, int32_t *_len,
@@ -244,6 +359,144 @@ bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
   return true;
 }
 
+bool _openslide_tiff_map_tile_data(struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   const void **_buf, int32_t *_len,
+                                   void **_buf_to_free,
+                                   int64_t tile_col, int64_t tile_row,
+                                   GError **err) {
+  // set directory
+  SET_DIR_OR_FAIL(tiff, tiffl->dir);
+
+  // get tile number
+  ttile_t tile_no = TIFFComputeTile(tiff,
+                                    tile_col * tiffl->tile_w,
+                                    tile_row * tiffl->tile_h,
+                                    0, 0);
+
+  // look for the tile in the file mapping
+  toff_t *offsets;
+  toff_t *sizes;
+  if (TIFFGetField(tiff, TIFFTAG_TILEOFFSETS, &offsets) &&
+      TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &sizes) &&
+      sizes[tile_no] <= INT32_MAX) {
+    struct tiff_file_handle *hdl = TIFFClientdata(tiff);
+    const void *buf = _openslide_file_get_mapped(hdl->tc->file,
+                                                 sizes[tile_no],
+                                                 offsets[tile_no]);
+    if (buf) {
+      *_buf = buf;
+      *_len = sizes[tile_no];
+      *_buf_to_free = NULL;
+      return true;
+    }
+  }
+
+  // fall back to copying
+  void *buf;
+  if (!_openslide_tiff_read_tile_data(tiffl, tiff, &buf, _len,
+                                      tile_col, tile_row, err)) {
+    return false;
+  }
+  *_buf = buf;
+  *_buf_to_free = buf;
+  return true;
+}
+
+bool _openslide_tiff_read_raw_tile(struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   int64_t tile_col, int64_t tile_row,
+                                   void **_buf, int64_t *_len,
+                                   openslide_tile_format_t *format,
+                                   GError **err) {
+  // only whole JPEG tiles can be returned as they are
+  if (!tiffl->native_jpeg) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tiles are not JPEG");
+    return false;
+  }
+  if (tile_col < 0 || tile_col >= tiffl->tiles_across ||
+      tile_row < 0 || tile_row >= tiffl->tiles_down) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "No such tile: %"G_GINT64_FORMAT", %"G_GINT64_FORMAT,
+                tile_col, tile_row);
+    return false;
+  }
+  if ((tile_col + 1) * tiffl->tile_w > tiffl->image_w ||
+      (tile_row + 1) * tiffl->tile_h > tiffl->image_h) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tile would need clipping");
+    return false;
+  }
+
+  // set directory
+  SET_DIR_OR_FAIL(tiff, tiffl->dir);
+
+  // libjpeg assumes YCbCr unless told otherwise
+  uint16_t photometric;
+  GET_FIELD_OR_FAIL(tiff, TIFFTAG_PHOTOMETRIC, uint16_t, photometric);
+  static const uint8_t adobe_rgb[] = {
+    0xFF, 0xEE, 0x00, 0x0E, 'A', 'd', 'o', 'b', 'e',
+    0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00,  // transform 0: no YCbCr
+  };
+  size_t adobe_len = photometric == PHOTOMETRIC_RGB ? sizeof(adobe_rgb) : 0;
+
+  // get shared tables, if any, without their SOI and EOI
+  uint32_t tables_len;
+  const uint8_t *tables;
+  if (TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_len, &tables) &&
+      tables_len >= 4) {
+    tables += 2;
+    tables_len -= 4;
+  } else {
+    tables = NULL;
+    tables_len = 0;
+  }
+
+  // read raw tile
+  const void *buf;
+  int32_t buflen;
+  void *buf_to_free;
+  if (!_openslide_tiff_map_tile_data(tiffl, tiff, &buf, &buflen,
+                                     &buf_to_free,
+                                     tile_col, tile_row, err)) {
+    return false;
+  }
+  const uint8_t *data = buf;
+  if (buflen == 0) {
+    g_free(buf_to_free);
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tile is empty");
+    return false;
+  }
+  if (buflen < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    g_free(buf_to_free);
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Tile is not a JPEG stream");
+    return false;
+  }
+
+  // SOI, Adobe marker, tables, then the rest of the tile
+  int64_t len = 2 + adobe_len + tables_len + (buflen - 2);
+  uint8_t *out = g_malloc(len);
+  uint8_t *p = out;
+  *p++ = 0xFF;
+  *p++ = 0xD8;
+  memcpy(p, adobe_rgb, adobe_len);
+  p += adobe_len;
+  if (tables_len) {
+    memcpy(p, tables, tables_len);
+    p += tables_len;
+  }
+  memcpy(p, data + 2, buflen - 2);
+  g_free(buf_to_free);
+
+  *_buf = out;
+  *_len = len;
+  *format = OPENSLIDE_TILE_FORMAT_JPEG;
+  return true;
+}
+
 static bool _get_associated_image_data(TIFF *tiff,
                                        struct associated_image *img,
                                        uint32_t *dest,
@@ -274,7 +527,7 @@ static bool get_associated_image_data(struct _openslide_associated_image *_img,
                                       uint32_t *dest,
                                       GError **err) {
   struct associated_image *img = (struct associated_image *) _img;
-  TIFF *tiff = _openslide_tiffcache_get(img->tc, err);
+  TIFF *tiff = _openslide_tiffcache_get_dir(img->tc, img->directory, err);
   bool success = false;
   if (tiff) {
     success = _get_associated_image_data(tiff, img, dest, err);
@@ -336,7 +589,7 @@ bool _openslide_tiff_add_associated_image(openslide_t *osr,
                                           struct _openslide_tiffcache *tc,
                                           tdir_t dir,
                                           GError **err) {
-  TIFF *tiff = _openslide_tiffcache_get(tc, err);
+  TIFF *tiff = _openslide_tiffcache_get_dir(tc, dir, err);
   bool ret = false;
   if (tiff) {
     ret = _add_associated_image(osr, name, tc, dir, tiff, err);
@@ -351,19 +604,13 @@ bool _openslide_tiff_add_associated_image(openslide_t *osr,
 static tsize_t tiff_do_read(thandle_t th, tdata_t buf, tsize_t size) {
   struct tiff_file_handle *hdl = th;
 
-  // don't leave the file handle open between calls
-  // also ensures FD_CLOEXEC is set
-  FILE *f = _openslide_fopen(hdl->tc->filename, "rb", NULL);
-  if (f == NULL) {
-    return 0;
-  }
-  if (fseeko(f, hdl->offset, SEEK_SET)) {
-    fclose(f);
+  // positional read on the shared descriptor; no seek, no lock
+  int64_t rsize = _openslide_file_read_at(hdl->tc->file, buf, size,
+                                          hdl->offset);
+  if (rsize == -1) {
     return 0;
   }
-  int64_t rsize = fread(buf, 1, size, f);
   hdl->offset += rsize;
-  fclose(f);
   return rsize;
 }
 
@@ -407,36 +654,38 @@ static toff_t tiff_do_size(thandle_t th) {
 }
 
 #undef TIFFClientOpen
+static bool tiffcache_open_file(struct _openslide_tiffcache *tc,
+                                GError **err) {
+  bool success;
+  g_mutex_lock(tc->lock);
+  if (tc->file) {
+    // don't start a handle on a replaced file
+    success = _openslide_file_check_unchanged(tc->file, err);
+  } else {
+    tc->file = _openslide_file_open(tc->filename, err);
+    success = tc->file != NULL;
+  }
+  g_mutex_unlock(tc->lock);
+  return success;
+}
+
 static TIFF *tiff_open(struct _openslide_tiffcache *tc, GError **err) {
   // open
-  FILE *f = _openslide_fopen(tc->filename, "rb", err);
-  if (f == NULL) {
+  if (!tiffcache_open_file(tc, err)) {
     return NULL;
   }
 
   // read magic
   uint8_t buf[4];
-  if (fread(buf, 4, 1, f) != 1) {
+  if (_openslide_file_read_at(tc->file, buf, 4, 0) != 4) {
     // can't read
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Couldn't read TIFF magic number for %s", tc->filename);
-    fclose(f);
     return NULL;
   }
 
   // get size
-  if (fseeko(f, 0, SEEK_END) == -1) {
-    _openslide_io_error(err, "Couldn't seek to end of %s", tc->filename);
-    fclose(f);
-    return NULL;
-  }
-  int64_t size = ftello(f);
-  if (size == -1) {
-    _openslide_io_error(err, "Couldn't ftello() for %s", tc->filename);
-    fclose(f);
-    return NULL;
-  }
-  fclose(f);
+  int64_t size = _openslide_file_get_size(tc->file);
 
   // check magic
   // TODO: remove if libtiff gets private error/warning callbacks
@@ -494,22 +743,53 @@ struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename) {
   tc->filename = g_strdup(filename);
   tc->cache = g_queue_new();
   tc->lock = g_mutex_new();
+  tc->limit = MAX(HANDLE_CACHE_MIN,
+                  HANDLE_CACHE_PER_WORKER * _openslide_get_worker_count());
   return tc;
 }
 
-TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err) {
+// take an idle handle, preferring one positioned on dir, or NULL if
+// there are none.  lock must be held.
+static TIFF *tiffcache_take(struct _openslide_tiffcache *tc, int64_t dir) {
+  if (dir >= 0) {
+    for (GList *link = tc->cache->head; link; link = link->next) {
+      TIFF *tiff = link->data;
+      if (TIFFCurrentDirectory(tiff) == dir) {
+        g_queue_delete_link(tc->cache, link);
+        return tiff;
+      }
+    }
+  }
+  return g_queue_pop_head(tc->cache);
+}
+
+static TIFF *tiffcache_get(struct _openslide_tiffcache *tc, int64_t dir,
+                           GError **err) {
   //g_debug("get TIFF");
   g_mutex_lock(tc->lock);
   tc->outstanding++;
-  TIFF *tiff = g_queue_pop_head(tc->cache);
+  TIFF *tiff = tiffcache_take(tc, dir);
   g_mutex_unlock(tc->lock);
 
   if (tiff == NULL) {
     //g_debug("create TIFF");
-    // Does not check that we have the same file.  Then again, neither does
-    // tiff_do_read.
+    // tiff_open() checks that the file hasn't been replaced
     tiff = tiff_open(tc, err);
   }
+  if (tiff && dir >= 0) {
+    bool hit = TIFFCurrentDirectory(tiff) == dir;
+    if (!_openslide_tiff_set_dir(tiff, dir, err)) {
+      _openslide_tiffcache_put(tc, tiff);
+      return NULL;
+    }
+    g_mutex_lock(tc->lock);
+    if (hit) {
+      tc->dir_hits++;
+    } else {
+      tc->dir_switches++;
+    }
+    g_mutex_unlock(tc->lock);
+  }
   if (tiff == NULL) {
     g_mutex_lock(tc->lock);
     tc->outstanding--;
@@ -518,6 +798,15 @@ TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err) {
   return tiff;
 }
 
+TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err) {
+  return tiffcache_get(tc, -1, err);
+}
+
+TIFF *_openslide_tiffcache_get_dir(struct _openslide_tiffcache *tc,
+                                   tdir_t dir, GError **err) {
+  return tiffcache_get(tc, dir, err);
+}
+
 void _openslide_tiffcache_put(struct _openslide_tiffcache *tc, TIFF *tiff) {
   if (tiff == NULL) {
     return;
@@ -527,7 +816,7 @@ void _openslide_tiffcache_put(struct _openslide_tiffcache *tc, TIFF *tiff) {
   g_mutex_lock(tc->lock);
   g_assert(tc->outstanding);
   tc->outstanding--;
-  if (g_queue_get_length(tc->cache) < HANDLE_CACHE_MAX) {
+  if ((int) g_queue_get_length(tc->cache) < tc->limit) {
     g_queue_push_head(tc->cache, tiff);
     tiff = NULL;
   }
@@ -543,6 +832,11 @@ void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc) {
   if (tc == NULL) {
     return;
   }
+  if (_openslide_debug(OPENSLIDE_DEBUG_HANDLES)) {
+    g_message("%s: %" G_GUINT64_FORMAT " directory hits, %"
+              G_GUINT64_FORMAT " directory switches", tc->filename,
+              tc->dir_hits, tc->dir_switches);
+  }
   g_mutex_lock(tc->lock);
   TIFF *tiff;
   while ((tiff = g_queue_pop_head(tc->cache)) != NULL) {
@@ -552,6 +846,7 @@ void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc) {
   g_mutex_unlock(tc->lock);
   g_queue_free(tc->cache);
   g_mutex_free(tc->lock);
+  _openslide_file_close(tc->file);
   g_free(tc->filename);
   g_slice_free(struct _openslide_tiffcache, tc);
 }
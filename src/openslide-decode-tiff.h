@@ -37,6 +37,7 @@ struct _openslide_tiff_level {
   int64_t tile_h;
   int64_t tiles_across;
   int64_t tiles_down;
+  bool native_jpeg;  // tiles can be decoded directly with libjpeg
 };
 
 struct _openslide_tiffcache;
@@ -53,17 +54,57 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
                                int64_t tile_col, int64_t tile_row,
                                GError **err);
 
+// whether the geometry of tiffl allows synthesizing a smaller level by
+// decoding its tiles at 1/scale_denom size.  the caller must check that
+// the codec can do so.
+bool _openslide_tiff_level_can_scale(const struct _openslide_tiff_level *tiffl,
+                                     int32_t scale_denom);
+
+// decode a JPEG tile at 1/scale_denom size; requires native_jpeg
+bool _openslide_tiff_read_tile_scaled(struct _openslide_tiff_level *tiffl,
+                                      TIFF *tiff,
+                                      uint32_t *dest,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int32_t scale_denom,
+                                      GError **err);
+
 bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
                                     TIFF *tiff,
                                     void **buf, int32_t *len,
                                     int64_t tile_col, int64_t tile_row,
                                     GError **err);
 
+// like _openslide_tiff_read_tile_data(), but if the file is memory-mapped,
+// returns a pointer into the mapping instead of a copy.  the caller must
+// g_free() *buf_to_free, which is NULL if nothing was copied.
+bool _openslide_tiff_map_tile_data(struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   const void **buf, int32_t *len,
+                                   void **buf_to_free,
+                                   int64_t tile_col, int64_t tile_row,
+                                   GError **err);
+
+// a whole JPEG tile as a standalone JPEG stream, with the shared tables
+// merged in.  fails with OPENSLIDE_ERROR_NO_VALUE if the tile can't be
+// used without decoding.  the caller must g_free() *buf.
+bool _openslide_tiff_read_raw_tile(struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   int64_t tile_col, int64_t tile_row,
+                                   void **buf, int64_t *len,
+                                   openslide_tile_format_t *format,
+                                   GError **err);
+
 bool _openslide_tiff_clip_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *tiledata,
                                int64_t tile_col, int64_t tile_row,
                                GError **err);
 
+bool _openslide_tiff_clip_tile_scaled(struct _openslide_tiff_level *tiffl,
+                                      uint32_t *tiledata,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int32_t scale_denom,
+                                      GError **err);
+
 bool _openslide_tiff_add_associated_image(openslide_t *osr,
                                           const char *name,
                                           struct _openslide_tiffcache *tc,
@@ -81,6 +122,11 @@ struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename);
 
 TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err);
 
+// like _openslide_tiffcache_get(), but prefers an idle handle already
+// on dir, and returns the handle set to dir
+TIFF *_openslide_tiffcache_get_dir(struct _openslide_tiffcache *tc,
+                                   tdir_t dir, GError **err);
+
 void _openslide_tiffcache_put(struct _openslide_tiffcache *tc, TIFF *tiff);
 
 void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc);
@@ -98,15 +98,10 @@ static void fix_byte_order(void *data, int32_t size, int64_t count,
   }
 }
 
-// only sets *ok on failure
-static uint64_t read_uint(FILE *f, int32_t size, bool big_endian, bool *ok) {
-  g_assert(ok != NULL);
-
+static uint64_t decode_uint(const void *data, int32_t size,
+                            bool big_endian) {
   uint8_t buf[size];
-  if (fread(buf, size, 1, f) != 1) {
-    *ok = false;
-    return 0;
-  }
+  memcpy(buf, data, size);
   fix_byte_order(buf, sizeof(buf), 1, big_endian);
   switch (size) {
   case 1: {
@@ -134,6 +129,18 @@ static uint64_t read_uint(FILE *f, int32_t size, bool big_endian, bool *ok) {
   }
 }
 
+// only sets *ok on failure
+static uint64_t read_uint(FILE *f, int32_t size, bool big_endian, bool *ok) {
+  g_assert(ok != NULL);
+
+  uint8_t buf[size];
+  if (fread(buf, size, 1, f) != 1) {
+    *ok = false;
+    return 0;
+  }
+  return decode_uint(buf, size, big_endian);
+}
+
 static uint32_t get_value_size(uint16_t type, uint64_t *count) {
   switch (type) {
   case TIFF_BYTE:
@@ -321,7 +328,8 @@ static bool populate_item(struct _openslide_tifflike *tl,
     return true;
   }
 
-  FILE *f = _openslide_fopen(tl->filename, "rb", err);
+  // borrow a handle rather than opening the file for every value
+  FILE *f = _openslide_pool_fopen(tl->filename, err);
   if (!f) {
     goto FAIL;
   }
@@ -360,7 +368,7 @@ FAIL:
   g_mutex_unlock(tl->value_lock);
   g_free(buf);
   if (f) {
-    fclose(f);
+    _openslide_pool_fclose(tl->filename, f);
   }
   return success;
 }
@@ -383,6 +391,7 @@ static GHashTable *read_directory(FILE *f, int64_t *diroff,
   int64_t off = *diroff;
   *diroff = 0;
   GHashTable *result = NULL;
+  uint8_t *buf = NULL;
   bool ok = true;
 
   //  g_debug("diroff: %" PRId64, off);
@@ -420,22 +429,38 @@ static GHashTable *read_directory(FILE *f, int64_t *diroff,
 
   //  g_debug("dircount: %"G_GUINT64_FORMAT, dircount);
 
+  // read all directory entries and the next dir offset in one go
+  uint32_t value_len = bigtiff ? 8 : 4;
+  uint32_t entry_len = 4 + 2 * value_len;
+  if (dircount > (SSIZE_MAX - value_len) / entry_len) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Directory count too large");
+    goto FAIL;
+  }
+  size_t buf_len = dircount * entry_len + value_len;
+  buf = g_try_malloc(buf_len);
+  if (buf == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot allocate TIFF directory");
+    goto FAIL;
+  }
+  if (fread(buf, buf_len, 1, f) != 1) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot read directory entries");
+    goto FAIL;
+  }
 
   // initial checks passed, initialize the hashtable
   result = g_hash_table_new_full(g_direct_hash, g_direct_equal,
                                  NULL, tiff_item_destroy);
 
-  // read all directory entries
+  // decode all directory entries
+  const uint8_t *p = buf;
   for (uint64_t n = 0; n < dircount; n++) {
-    uint16_t tag = read_uint(f, 2, big_endian, &ok);
-    uint16_t type = read_uint(f, 2, big_endian, &ok);
-    uint64_t count = read_uint(f, bigtiff ? 8 : 4, big_endian, &ok);
-
-    if (!ok) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Cannot read tag, type, and count");
-      goto FAIL;
-    }
+    uint16_t tag = decode_uint(p, 2, big_endian);
+    uint16_t type = decode_uint(p + 2, 2, big_endian);
+    uint64_t count = decode_uint(p + 4, value_len, big_endian);
+    p += 4 + value_len;
 
     //    g_debug(" tag: %d, type: %d, count: %" PRId64, tag, type, count);
 
@@ -460,17 +485,11 @@ static GHashTable *read_directory(FILE *f, int64_t *diroff,
       goto FAIL;
     }
 
-    // read in the value/offset
-    uint8_t value[bigtiff ? 8 : 4];
-    if (fread(value, sizeof(value), 1, f) != 1) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Cannot read value/offset");
-      goto FAIL;
-    }
-
     // does value/offset contain the value?
-    if (value_size * count <= sizeof(value)) {
+    if (value_size * count <= value_len) {
       // yes
+      uint8_t value[value_len];
+      memcpy(value, p, value_len);
       fix_byte_order(value, value_size, count, big_endian);
       if (!set_item_values(item, value, err)) {
         goto FAIL;
@@ -478,32 +497,21 @@ static GHashTable *read_directory(FILE *f, int64_t *diroff,
 
     } else {
       // no; store offset
-      if (bigtiff) {
-        memcpy(&item->offset, value, 8);
-        fix_byte_order(&item->offset, sizeof(item->offset), 1, big_endian);
-      } else {
-        uint32_t off32;
-        memcpy(&off32, value, 4);
-        fix_byte_order(&off32, sizeof(off32), 1, big_endian);
-        item->offset = off32;
-      }
+      item->offset = decode_uint(p, value_len, big_endian);
     }
+    p += value_len;
   }
 
-  // read the next dir offset
-  int64_t nextdiroff = read_uint(f, bigtiff ? 8 : 4, big_endian, &ok);
-  if (!ok) {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Cannot read next directory offset");
-    goto FAIL;
-  }
-  *diroff = nextdiroff;
+  // decode the next dir offset
+  *diroff = decode_uint(p, value_len, big_endian);
+  g_free(buf);
 
   // success
   return result;
 
 
  FAIL:
+  g_free(buf);
   if (result != NULL) {
     g_hash_table_unref(result);
   }
@@ -630,6 +638,7 @@ void _openslide_tifflike_destroy(struct _openslide_tifflike *tl) {
   }
   g_mutex_unlock(tl->value_lock);
   g_ptr_array_free(tl->directories, true);
+  _openslide_pool_evict(tl->filename);
   g_free(tl->filename);
   g_mutex_free(tl->value_lock);
   g_slice_free(struct _openslide_tifflike, tl);
@@ -998,6 +1007,11 @@ static bool hash_tiff_level(struct _openslide_hash *hash,
                             struct _openslide_tifflike *tl,
                             int32_t dir,
                             GError **err) {
+  if (hash == NULL) {
+    // not hashing this time
+    return true;
+  }
+
   int32_t offset_tag;
   int32_t length_tag;
 
@@ -1052,14 +1066,16 @@ static bool hash_tiff_level(struct _openslide_hash *hash,
   }
 
   // hash raw data of each tile/strip
+  struct _openslide_hash_part *parts =
+    g_new(struct _openslide_hash_part, count);
   for (int64_t i = 0; i < count; i++) {
-    if (!_openslide_hash_file_part(hash, tl->filename, offsets[i], lengths[i],
-                                   err)) {
-      return false;
-    }
+    parts[i].filename = tl->filename;
+    parts[i].offset = offsets[i];
+    parts[i].size = lengths[i];
   }
-
-  return true;
+  bool success = _openslide_hash_file_parts(hash, parts, count, err);
+  g_free(parts);
+  return success;
 }
 
 bool _openslide_tifflike_init_properties_and_hash(openslide_t *osr,
@@ -0,0 +1,513 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * A file opened once and read at arbitrary offsets from any thread.
+ *
+ * On POSIX systems this is a close-on-exec descriptor read with pread(),
+ * which needs no locking and no seeking.  Elsewhere we fall back to a
+ * stdio handle serialized by a mutex.
+ *
+ * If memory-mapped I/O is enabled, the file is also mapped once at open
+ * time, and ranges lying within the size observed then can be read in
+ * place.  Anything past that size is always served by read_at, so a file
+ * that grows afterward never makes us touch pages outside the mapping.
+ * A file truncated while open can still raise SIGBUS, which is why
+ * mapping is opt-in.
+ *
+ * Separately, formats that read through stdio can borrow handles from a
+ * process-wide pool of idle FILEs keyed by path, saving an open() and
+ * close() per tile.  The pool is bounded and evicts the least recently
+ * returned handle.  A pooled handle keeps referring to the file it was
+ * opened on, so the pool records the device, inode, size, and mtime of
+ * each handle's file when it is opened.  A handle that hasn't been
+ * checked for POOL_CHECK_INTERVAL_MS is compared against the path before
+ * it is reused, and the handles for a path are dropped once the file
+ * there no longer matches.  Borrows in between don't touch the path.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+struct _openslide_file {
+  char *path;
+  int64_t size;
+#ifdef WIN32
+  FILE *f;
+  GMutex *lock;
+#else
+  int fd;
+  dev_t dev;
+  ino_t ino;
+#endif
+  const uint8_t *map;  // NULL if not mapped
+};
+
+// -1 until initialized from the environment
+static volatile gint mmap_enabled = -1;
+
+void _openslide_file_set_mmap_enabled(bool enabled) {
+  g_atomic_int_set(&mmap_enabled, enabled);
+}
+
+#ifdef HAVE_MMAP
+static bool get_mmap_enabled(void) {
+  int enabled = g_atomic_int_get(&mmap_enabled);
+  if (enabled == -1) {
+    const char *value = g_getenv("OPENSLIDE_MMAP");
+    enabled = value != NULL && *value && strcmp(value, "0");
+    // don't override a concurrent explicit setting
+    g_atomic_int_compare_and_exchange(&mmap_enabled, -1, enabled);
+    enabled = g_atomic_int_get(&mmap_enabled);
+  }
+  return enabled;
+}
+#endif
+
+#ifndef WIN32
+static int open_cloexec(const char *path) {
+  int flags = O_RDONLY;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+  int fd;
+  do {
+    fd = open(path, flags);
+  } while (fd == -1 && errno == EINTR);
+#ifndef O_CLOEXEC
+  if (fd != -1) {
+    long fdflags = fcntl(fd, F_GETFD);
+    if (fdflags == -1 || fcntl(fd, F_SETFD, fdflags | FD_CLOEXEC)) {
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -1;
+    }
+  }
+#endif
+  return fd;
+}
+#endif
+
+struct _openslide_file *_openslide_file_open(const char *path,
+                                             GError **err) {
+  struct _openslide_file *file = g_slice_new0(struct _openslide_file);
+  file->path = g_strdup(path);
+
+#ifdef WIN32
+  file->f = _openslide_fopen(path, "rb", err);
+  if (file->f == NULL) {
+    goto FAIL;
+  }
+  if (fseeko(file->f, 0, SEEK_END) ||
+      (file->size = ftello(file->f)) == -1) {
+    _openslide_io_error(err, "Couldn't get size of %s", path);
+    fclose(file->f);
+    goto FAIL;
+  }
+  file->lock = g_mutex_new();
+#else
+  file->fd = open_cloexec(path);
+  if (file->fd == -1) {
+    _openslide_io_error(err, "Couldn't open %s", path);
+    goto FAIL;
+  }
+  struct stat st;
+  if (fstat(file->fd, &st)) {
+    _openslide_io_error(err, "Couldn't stat %s", path);
+    close(file->fd);
+    goto FAIL;
+  }
+  file->size = st.st_size;
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+
+#ifdef HAVE_MMAP
+  if (get_mmap_enabled() && file->size > 0 &&
+      (uint64_t) file->size <= SIZE_MAX) {
+    void *map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (map != MAP_FAILED) {
+      file->map = map;
+    } else {
+      // not fatal; we can still read
+      g_debug("Couldn't map %s: %s", path, g_strerror(errno));
+    }
+  }
+#endif
+#endif
+
+  return file;
+
+FAIL:
+  g_free(file->path);
+  g_slice_free(struct _openslide_file, file);
+  return NULL;
+}
+
+static int64_t file_read_at(struct _openslide_file *file,
+                            void *buf, int64_t size,
+                            int64_t offset) {
+  if (offset < 0 || size < 0) {
+    return -1;
+  }
+
+#ifdef WIN32
+  g_mutex_lock(file->lock);
+  int64_t total = -1;
+  if (!fseeko(file->f, offset, SEEK_SET)) {
+    total = fread(buf, 1, size, file->f);
+    if (ferror(file->f)) {
+      clearerr(file->f);
+      total = -1;
+    }
+  }
+  g_mutex_unlock(file->lock);
+  return total;
+#else
+  int64_t total = 0;
+  while (total < size) {
+    ssize_t count = pread(file->fd, (char *) buf + total, size - total,
+                          offset + total);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (count == 0) {
+      // end of file
+      break;
+    }
+    total += count;
+  }
+  return total;
+#endif
+}
+
+int64_t _openslide_file_read_at(struct _openslide_file *file,
+                                void *buf, int64_t size,
+                                int64_t offset) {
+  int64_t perf_start = _openslide_perf_start();
+  int64_t total = file_read_at(file, buf, size, offset);
+  _openslide_perf_end(OPENSLIDE_PERF_FILE_IO, perf_start, total);
+  return total;
+}
+
+const void *_openslide_file_get_mapped(struct _openslide_file *file,
+                                       int64_t size, int64_t offset) {
+  if (file->map == NULL || offset < 0 || size < 0 ||
+      offset > file->size || size > file->size - offset) {
+    return NULL;
+  }
+  return file->map + offset;
+}
+
+int64_t _openslide_file_get_size(struct _openslide_file *file) {
+  return file->size;
+}
+
+bool _openslide_file_check_unchanged(struct _openslide_file *file,
+                                     GError **err) {
+#ifndef WIN32
+  struct stat st;
+  if (stat(file->path, &st)) {
+    _openslide_io_error(err, "Couldn't stat %s", file->path);
+    return false;
+  }
+  if (st.st_dev != file->dev || st.st_ino != file->ino) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "File %s was replaced after it was opened", file->path);
+    return false;
+  }
+#else
+  (void) file;
+  (void) err;
+#endif
+  return true;
+}
+
+void _openslide_file_close(struct _openslide_file *file) {
+  if (file == NULL) {
+    return;
+  }
+#ifdef WIN32
+  fclose(file->f);
+  g_mutex_free(file->lock);
+#else
+#ifdef HAVE_MMAP
+  if (file->map) {
+    munmap((void *) file->map, file->size);
+  }
+#endif
+  close(file->fd);
+#endif
+  g_free(file->path);
+  g_slice_free(struct _openslide_file, file);
+}
+
+#define DEFAULT_POOL_LIMIT 32
+
+// how long a pooled handle is trusted before its path is checked again
+#define POOL_CHECK_INTERVAL_MS 1000
+
+struct file_identity {
+  int64_t dev;
+  int64_t ino;
+  int64_t size;
+  int64_t mtime;
+};
+
+struct pooled_file {
+  char *path;
+  FILE *f;
+  GList *lru_link;
+  struct file_identity identity;  // of the open file
+  GTimeVal checked;  // when identity last matched the path
+};
+
+static struct {
+  GStaticMutex lock;
+  GHashTable *by_path;  // path -> GQueue of struct pooled_file, MRU first
+  GQueue lru;           // struct pooled_file, MRU first
+  GHashTable *borrowed;  // FILE * -> struct pooled_file, for lent handles
+  int limit;
+} pool = {
+  .lock = G_STATIC_MUTEX_INIT,
+};
+
+static void pooled_file_free(struct pooled_file *pf) {
+  fclose(pf->f);
+  g_free(pf->path);
+  g_slice_free(struct pooled_file, pf);
+}
+
+// pool lock must be held
+static void pool_init(void) {
+  if (pool.by_path == NULL) {
+    pool.by_path = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         g_free,
+                                         (GDestroyNotify) g_queue_free);
+    pool.borrowed = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pool.limit = DEFAULT_POOL_LIMIT;
+    const char *value = g_getenv("OPENSLIDE_FILE_POOL_SIZE");
+    if (value) {
+      pool.limit = MAX(0, atoi(value));
+    }
+  }
+}
+
+#ifndef WIN32
+static void set_identity(struct file_identity *id, const struct stat *st) {
+  id->dev = st->st_dev;
+  id->ino = st->st_ino;
+  id->size = st->st_size;
+  id->mtime = st->st_mtime;
+}
+
+static bool same_identity(const struct file_identity *a,
+                          const struct file_identity *b) {
+  return a->dev == b->dev && a->ino == b->ino &&
+         a->size == b->size && a->mtime == b->mtime;
+}
+
+// whether the path still refers to the file pf was opened on.  only
+// stats the path if pf hasn't been checked recently.
+static bool check_identity(struct pooled_file *pf) {
+  GTimeVal now;
+  g_get_current_time(&now);
+  int64_t elapsed_ms = (now.tv_sec - pf->checked.tv_sec) * 1000 +
+                       (now.tv_usec - pf->checked.tv_usec) / 1000;
+  if (elapsed_ms >= 0 && elapsed_ms < POOL_CHECK_INTERVAL_MS) {
+    return true;
+  }
+
+  struct stat st;
+  struct file_identity current;
+  if (stat(pf->path, &st)) {
+    return false;
+  }
+  set_identity(&current, &st);
+  if (!same_identity(&pf->identity, &current)) {
+    return false;
+  }
+  pf->checked = now;
+  return true;
+}
+#endif
+
+// pool lock must be held.  unlinks pf from the pool without freeing it.
+static void pool_remove(struct pooled_file *pf) {
+  GQueue *q = g_hash_table_lookup(pool.by_path, pf->path);
+  g_assert(q != NULL);
+  g_queue_remove(q, pf);
+  if (g_queue_is_empty(q)) {
+    g_hash_table_remove(pool.by_path, pf->path);
+  }
+  g_queue_delete_link(&pool.lru, pf->lru_link);
+  pf->lru_link = NULL;
+}
+
+// record a handle we're lending out, so it can be pooled on return
+static void lend(struct pooled_file *pf) {
+  g_static_mutex_lock(&pool.lock);
+  pool_init();
+  g_hash_table_insert(pool.borrowed, pf->f, pf);
+  g_static_mutex_unlock(&pool.lock);
+}
+
+FILE *_openslide_pool_fopen(const char *path, GError **err) {
+  struct pooled_file *pf = NULL;
+
+  g_static_mutex_lock(&pool.lock);
+  pool_init();
+  int limit = pool.limit;
+  GQueue *q = g_hash_table_lookup(pool.by_path, path);
+  if (q) {
+    pf = g_queue_peek_head(q);
+    pool_remove(pf);
+    g_hash_table_insert(pool.borrowed, pf->f, pf);
+  }
+  g_static_mutex_unlock(&pool.lock);
+
+#ifndef WIN32
+  if (pf && !check_identity(pf)) {
+    // the file was replaced or rewritten; the pooled handles refer to
+    // what was there before
+    g_static_mutex_lock(&pool.lock);
+    g_hash_table_remove(pool.borrowed, pf->f);
+    g_static_mutex_unlock(&pool.lock);
+    pooled_file_free(pf);
+    _openslide_pool_evict(path);
+    pf = NULL;
+  }
+#endif
+
+  if (pf) {
+    FILE *f = pf->f;
+    // callers expect a fresh handle
+    rewind(f);
+    return f;
+  }
+
+  FILE *f = _openslide_fopen(path, "rb", err);
+  if (f == NULL || limit == 0) {
+    return f;
+  }
+
+#ifndef WIN32
+  struct stat st;
+  if (fstat(fileno(f), &st)) {
+    // can't tell later whether it is still current, so don't pool it
+    return f;
+  }
+#endif
+  pf = g_slice_new0(struct pooled_file);
+  pf->path = g_strdup(path);
+  pf->f = f;
+#ifndef WIN32
+  set_identity(&pf->identity, &st);
+  g_get_current_time(&pf->checked);
+#endif
+  lend(pf);
+  return f;
+}
+
+void _openslide_pool_fclose(const char *path G_GNUC_UNUSED, FILE *f) {
+  struct pooled_file *pf = NULL;
+  struct pooled_file *evicted = NULL;
+
+  g_static_mutex_lock(&pool.lock);
+  pool_init();
+  pf = g_hash_table_lookup(pool.borrowed, f);
+  if (pf == NULL) {
+    // not one we can pool
+    g_static_mutex_unlock(&pool.lock);
+    fclose(f);
+    return;
+  }
+  g_hash_table_remove(pool.borrowed, f);
+  if (pool.limit == 0) {
+    evicted = pf;
+  } else {
+    GQueue *q = g_hash_table_lookup(pool.by_path, pf->path);
+    if (q == NULL) {
+      q = g_queue_new();
+      g_hash_table_insert(pool.by_path, g_strdup(pf->path), q);
+    }
+    g_queue_push_head(q, pf);
+    g_queue_push_head(&pool.lru, pf);
+    pf->lru_link = pool.lru.head;
+    if ((int) pool.lru.length > pool.limit) {
+      evicted = g_queue_peek_tail(&pool.lru);
+      pool_remove(evicted);
+    }
+  }
+  g_static_mutex_unlock(&pool.lock);
+
+  // close outside the lock
+  if (evicted) {
+    pooled_file_free(evicted);
+  }
+}
+
+void _openslide_pool_evict(const char *path) {
+  gpointer key = NULL;
+  gpointer value = NULL;
+
+  g_static_mutex_lock(&pool.lock);
+  if (pool.by_path &&
+      g_hash_table_lookup_extended(pool.by_path, path, &key, &value)) {
+    GQueue *q = value;
+    for (GList *l = q->head; l; l = l->next) {
+      struct pooled_file *pf = l->data;
+      g_queue_delete_link(&pool.lru, pf->lru_link);
+    }
+    g_hash_table_steal(pool.by_path, path);
+  }
+  g_static_mutex_unlock(&pool.lock);
+
+  // close outside the lock
+  GQueue *q = value;
+  if (q) {
+    while (!g_queue_is_empty(q)) {
+      pooled_file_free(g_queue_pop_head(q));
+    }
+    g_queue_free(q);
+    g_free(key);
+  }
+}
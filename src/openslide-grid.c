@@ -21,6 +21,7 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
 #include <math.h>
 #include <glib.h>
 #include <cairo.h>
@@ -59,6 +60,7 @@ struct grid_ops {
                        double x, double y,
                        struct _openslide_level *level,
                        int32_t w, int32_t h,
+                       bool pristine,
                        GError **err);
   bool (*read_tile)(struct _openslide_grid *grid,
                     struct region *region,
@@ -67,6 +69,11 @@ struct grid_ops {
                     int64_t tile_col, int64_t tile_row,
                     void *arg,
                     GError **err);
+  bool (*build_occupancy)(struct _openslide_grid *grid,
+                          void *arg,
+                          struct _openslide_level *level,
+                          struct _openslide_occupancy *occ,
+                          GError **err);
   void (*destroy)(struct _openslide_grid *grid);
 };
 
@@ -76,6 +83,10 @@ struct _openslide_grid {
 
   double tile_advance_x;
   double tile_advance_y;
+
+  // built on first use; read without the lock once set
+  struct _openslide_occupancy *occupancy;
+  GMutex *occupancy_lock;
 };
 
 struct simple_grid {
@@ -84,15 +95,35 @@ struct simple_grid {
   int64_t tiles_across;
   int64_t tiles_down;
   _openslide_tileread_fn read_tile;
+  _openslide_tilefetch_fn fetch_tile;
+  _openslide_tileempty_fn tile_empty;
 };
 
+// tiles are kept in parallel arrays rather than as individual heap
+// objects, so a map of a few hundred thousand tiles costs a few MB
 struct tilemap_grid {
   struct _openslide_grid base;
 
-  GHashTable *tiles;
+  // sorted by (row, col) once prepared
+  int64_t tile_count;
+  int64_t tile_capacity;
+  int32_t *cols;
+  int32_t *rows;
+  // delta from the "natural" position
+  float *offsets_x;
+  float *offsets_y;
+  float *widths;
+  float *heights;
+  void **data;
+  bool sorted;
+
   _openslide_tilemap_fn read_tile;
   GDestroyNotify destroy_tile;
 
+  // built on first paint; discarded if tiles are added afterward
+  struct tile_index *index;
+  GMutex *index_lock;
+
   // outer boundaries of grid
   double top;
   double bottom;
@@ -107,24 +138,17 @@ struct tilemap_grid {
   int32_t extra_tiles_right;
 };
 
-struct grid_tile {
-  struct tilemap_grid *grid;
-  void *data;
-
-  int64_t col;
-  int64_t row;
-
-  double w;
-  double h;
-  // delta from the "natural" position
-  double offset_x;
-  double offset_y;
-};
-
-struct tilemap_foreach_args {
-  struct _openslide_grid *grid;
-  _openslide_tilemap_foreach_fn func;
-  void *arg;
+// tiles bucketed into bands of tile_advance_y by the top of their
+// bounding box, sorted by left edge within each band
+struct tile_index {
+  int32_t *tiles;        // positions in the tilemap arrays
+  int64_t first_band;
+  int64_t band_count;
+  int64_t *band_starts;  // band_count + 1 entries into tiles
+
+  // largest tile dimensions, to bound searches
+  double max_w;
+  double max_h;
 };
 
 static void compute_region(struct _openslide_grid *grid,
@@ -235,6 +259,35 @@ static void label_tile(struct _openslide_grid *grid,
 
 
 
+static void occupancy_init(struct _openslide_occupancy *occ,
+                           struct _openslide_grid *grid,
+                           int64_t cols, int64_t rows) {
+  occ->cell_w = grid->tile_advance_x;
+  occ->cell_h = grid->tile_advance_y;
+  occ->cols = MAX(cols, 0);
+  occ->rows = MAX(rows, 0);
+  occ->bits = g_new0(uint8_t, (occ->cols * occ->rows + 7) / 8);
+}
+
+static void occupancy_set(struct _openslide_occupancy *occ,
+                          int64_t col, int64_t row) {
+  int64_t bit = row * occ->cols + col;
+  occ->bits[bit / 8] |= 1 << (bit % 8);
+}
+
+bool _openslide_occupancy_test(const struct _openslide_occupancy *occ,
+                               int64_t col, int64_t row) {
+  if (col < 0 || col >= occ->cols || row < 0 || row >= occ->rows) {
+    return false;
+  }
+  int64_t bit = row * occ->cols + col;
+  return occ->bits[bit / 8] & (1 << (bit % 8));
+}
+
+static struct _openslide_occupancy *get_built_occupancy(struct _openslide_grid *grid) {
+  return g_atomic_pointer_get((gpointer *) &grid->occupancy);
+}
+
 static void simple_get_bounds(struct _openslide_grid *_grid,
                               struct bounds *bounds) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
@@ -251,12 +304,135 @@ static void simple_get_tile_size(struct _openslide_grid *grid,
   bounds->h = grid->tile_advance_y;
 }
 
+// get the pixels of an ARGB32 image surface that cr paints onto with
+// a whole-pixel translation, and the position of the user-space origin
+static bool get_direct_target(cairo_t *cr,
+                              uint32_t **data, int64_t *stride,
+                              int64_t *w, int64_t *h,
+                              int64_t *origin_x, int64_t *origin_y) {
+  cairo_surface_t *target = cairo_get_group_target(cr);
+  if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE ||
+      cairo_image_surface_get_format(target) != CAIRO_FORMAT_ARGB32) {
+    return false;
+  }
+
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  double device_x, device_y;
+  cairo_surface_get_device_offset(target, &device_x, &device_y);
+  double ox = matrix.x0 + device_x;
+  double oy = matrix.y0 + device_y;
+  if (matrix.xx != 1 || matrix.yy != 1 || matrix.xy != 0 || matrix.yx != 0 ||
+      ox != floor(ox) || oy != floor(oy)) {
+    return false;
+  }
+
+  cairo_surface_flush(target);
+  *data = (uint32_t *) cairo_image_surface_get_data(target);
+  *stride = cairo_image_surface_get_stride(target) / 4;
+  *w = cairo_image_surface_get_width(target);
+  *h = cairo_image_surface_get_height(target);
+  *origin_x = ox;
+  *origin_y = oy;
+  return *data != NULL;
+}
+
+// false until the occupancy map is built
+static bool simple_tile_is_empty(struct simple_grid *grid,
+                                 int64_t tile_col, int64_t tile_row) {
+  struct _openslide_occupancy *occ = get_built_occupancy(&grid->base);
+  return occ && !_openslide_occupancy_test(occ, tile_col, tile_row);
+}
+
+// copy the tiles under a region into a pristine surface, skipping
+// cairo.  tiles of a simple grid never overlap, so on a pristine surface
+// this gives the same result as painting them with
+// CAIRO_OPERATOR_SATURATE.  sets *handled to false if the surface can't
+// be written directly or the tiles don't land on whole pixels.
+static bool simple_copy_tiles(struct simple_grid *grid,
+                              cairo_t *cr,
+                              struct _openslide_level *level,
+                              const struct region *region,
+                              void *arg,
+                              bool *handled,
+                              GError **err) {
+  uint32_t *dest;
+  int64_t stride, dest_w, dest_h, dx, dy;
+  *handled = get_direct_target(cr, &dest, &stride, &dest_w, &dest_h,
+                               &dx, &dy) &&
+             region->offset_x == floor(region->offset_x) &&
+             region->offset_y == floor(region->offset_y);
+  if (!*handled) {
+    return true;
+  }
+
+  // visible part of the region, in surface coordinates
+  int64_t clip_x0 = MAX(dx, 0);
+  int64_t clip_y0 = MAX(dy, 0);
+  int64_t clip_x1 = MIN(dx + region->w, dest_w);
+  int64_t clip_y1 = MIN(dy + region->h, dest_h);
+  if (clip_x1 <= clip_x0 || clip_y1 <= clip_y0) {
+    return true;
+  }
+
+  int64_t tw = grid->base.tile_advance_x;
+  int64_t th = grid->base.tile_advance_y;
+  // surface position of tile (start_tile_x, start_tile_y)
+  int64_t origin_x = dx - (int64_t) region->offset_x;
+  int64_t origin_y = dy - (int64_t) region->offset_y;
+
+  int64_t perf_start = _openslide_perf_start();
+  int64_t copied = 0;
+  for (int64_t row = MAX(region->start_tile_y, 0);
+       row < MIN(region->end_tile_y, grid->tiles_down); row++) {
+    int64_t ty = origin_y + (row - region->start_tile_y) * th;
+    int64_t y0 = MAX(ty, clip_y0);
+    int64_t y1 = MIN(ty + th, clip_y1);
+    if (y1 <= y0) {
+      continue;
+    }
+
+    for (int64_t col = MAX(region->start_tile_x, 0);
+         col < MIN(region->end_tile_x, grid->tiles_across); col++) {
+      int64_t tx = origin_x + (col - region->start_tile_x) * tw;
+      int64_t x0 = MAX(tx, clip_x0);
+      int64_t x1 = MIN(tx + tw, clip_x1);
+      if (x1 <= x0 || simple_tile_is_empty(grid, col, row)) {
+        // nothing visible, or already transparent
+        continue;
+      }
+
+      struct _openslide_cache_entry *cache_entry;
+      uint32_t *tiledata = grid->fetch_tile(grid->base.osr, level,
+                                            col, row, arg,
+                                            &cache_entry, err);
+      if (!tiledata) {
+        return false;
+      }
+      for (int64_t y = y0; y < y1; y++) {
+        memcpy(dest + y * stride + x0,
+               tiledata + (y - ty) * tw + (x0 - tx),
+               (x1 - x0) * 4);
+      }
+      _openslide_cache_entry_unref(cache_entry);
+      copied += (x1 - x0) * (y1 - y0) * 4;
+    }
+  }
+
+  cairo_surface_mark_dirty_rectangle(cairo_get_group_target(cr),
+                                     clip_x0, clip_y0,
+                                     clip_x1 - clip_x0, clip_y1 - clip_y0);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, copied);
+  return true;
+}
+
 static bool simple_paint_region(struct _openslide_grid *_grid,
                                 cairo_t *cr,
                                 void *arg,
                                 double x, double y,
                                 struct _openslide_level *level,
                                 int32_t w, int32_t h,
+                                bool pristine,
                                 GError **err) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
   struct region region;
@@ -271,6 +447,24 @@ static bool simple_paint_region(struct _openslide_grid *_grid,
     return true;
   }
 
+  // find the empty tiles before reading any
+  if (grid->tile_empty &&
+      !_openslide_grid_get_occupancy(_grid, arg, level, err)) {
+    return false;
+  }
+
+  // tiles on whole pixels can be copied directly
+  if (pristine && grid->fetch_tile &&
+      !_openslide_debug(OPENSLIDE_DEBUG_TILES)) {
+    bool handled;
+    if (!simple_copy_tiles(grid, cr, level, &region, arg, &handled, err)) {
+      return false;
+    }
+    if (handled) {
+      return true;
+    }
+  }
+
   // save
   cairo_matrix_t matrix;
   cairo_get_matrix(cr, &matrix);
@@ -306,14 +500,47 @@ static bool simple_read_tile(struct _openslide_grid *_grid,
                              GError **err) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
 
-  if (!grid->read_tile(grid->base.osr, cr, level,
-                       tile_col, tile_row, arg, err)) {
+  if (simple_tile_is_empty(grid, tile_col, tile_row)) {
+    // nothing to paint
+    label_tile(_grid, cr, tile_col, tile_row);
+    return true;
+  }
+
+  _openslide_trace_tile_begin(grid->base.osr, level, tile_col, tile_row);
+  bool success = grid->read_tile(grid->base.osr, cr, level,
+                                 tile_col, tile_row, arg, err);
+  _openslide_trace_tile_end(success);
+  if (!success) {
     return false;
   }
   label_tile(_grid, cr, tile_col, tile_row);
   return true;
 }
 
+static bool simple_build_occupancy(struct _openslide_grid *_grid,
+                                   void *arg,
+                                   struct _openslide_level *level,
+                                   struct _openslide_occupancy *occ,
+                                   GError **err) {
+  struct simple_grid *grid = (struct simple_grid *) _grid;
+
+  occupancy_init(occ, _grid, grid->tiles_across, grid->tiles_down);
+  for (int64_t row = 0; row < occ->rows; row++) {
+    for (int64_t col = 0; col < occ->cols; col++) {
+      bool is_empty = false;
+      if (grid->tile_empty &&
+          !grid->tile_empty(grid->base.osr, level, col, row, arg,
+                            &is_empty, err)) {
+        return false;
+      }
+      if (!is_empty) {
+        occupancy_set(occ, col, row);
+      }
+    }
+  }
+  return true;
+}
+
 static void simple_destroy(struct _openslide_grid *_grid) {
   struct simple_grid *grid = (struct simple_grid *) _grid;
 
@@ -325,6 +552,7 @@ const struct grid_ops simple_grid_ops = {
   .get_tile_size = simple_get_tile_size,
   .paint_region = simple_paint_region,
   .read_tile = simple_read_tile,
+  .build_occupancy = simple_build_occupancy,
   .destroy = simple_destroy,
 };
 
@@ -339,34 +567,150 @@ struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
   grid->base.ops = &simple_grid_ops;
   grid->base.tile_advance_x = tile_w;
   grid->base.tile_advance_y = tile_h;
+  grid->base.occupancy_lock = g_mutex_new();
   grid->tiles_across = tiles_across;
   grid->tiles_down = tiles_down;
   grid->read_tile = read_tile;
   return (struct _openslide_grid *) grid;
 }
 
+void _openslide_grid_simple_set_fetch_tile(struct _openslide_grid *_grid,
+                                           _openslide_tilefetch_fn fetch_tile) {
+  struct simple_grid *grid = (struct simple_grid *) _grid;
+  g_assert(grid->base.ops == &simple_grid_ops);
+  grid->fetch_tile = fetch_tile;
+}
 
+void _openslide_grid_simple_set_tile_empty(struct _openslide_grid *_grid,
+                                           _openslide_tileempty_fn tile_empty) {
+  struct simple_grid *grid = (struct simple_grid *) _grid;
+  g_assert(grid->base.ops == &simple_grid_ops);
+  grid->tile_empty = tile_empty;
+}
 
-static guint grid_tile_hash_func(gconstpointer key) {
-  const struct grid_tile *tile = key;
 
-  // assume 32-bit hash
-  return (guint) ((34369 * (uint64_t) tile->row) + ((uint64_t) tile->col));
+
+static int tile_coords_compare(int32_t row_a, int32_t col_a,
+                               int32_t row_b, int32_t col_b) {
+  if (row_a != row_b) {
+    return row_a < row_b ? -1 : 1;
+  }
+  if (col_a != col_b) {
+    return col_a < col_b ? -1 : 1;
+  }
+  return 0;
 }
 
-static gboolean grid_tile_hash_key_equal(gconstpointer a, gconstpointer b) {
-  const struct grid_tile *c_a = a;
-  const struct grid_tile *c_b = b;
+struct sort_entry {
+  int32_t row;
+  int32_t col;
+  int32_t pos;
+};
 
-  return (c_a->col == c_b->col) && (c_a->row == c_b->row);
+static int sort_entry_compare(const void *a, const void *b) {
+  const struct sort_entry *ea = a;
+  const struct sort_entry *eb = b;
+  int cmp = tile_coords_compare(ea->row, ea->col, eb->row, eb->col);
+  if (cmp) {
+    return cmp;
+  }
+  // later additions replace earlier ones
+  return ea->pos < eb->pos ? -1 : ea->pos > eb->pos;
 }
 
-static void grid_tile_hash_destroy_value(gpointer data) {
-  struct grid_tile *tile = data;
-  if (tile->grid->destroy_tile && tile->data) {
-    tile->grid->destroy_tile(tile->data);
+static void tilemap_set_capacity(struct tilemap_grid *grid, int64_t capacity) {
+  grid->cols = g_renew(int32_t, grid->cols, capacity);
+  grid->rows = g_renew(int32_t, grid->rows, capacity);
+  grid->offsets_x = g_renew(float, grid->offsets_x, capacity);
+  grid->offsets_y = g_renew(float, grid->offsets_y, capacity);
+  grid->widths = g_renew(float, grid->widths, capacity);
+  grid->heights = g_renew(float, grid->heights, capacity);
+  grid->data = g_renew(void *, grid->data, capacity);
+  grid->tile_capacity = capacity;
+}
+
+// sort tiles added out of order, dropping all but the last tile added
+// at each position
+static void tilemap_sort(struct tilemap_grid *grid) {
+  int64_t count = grid->tile_count;
+  struct sort_entry *entries = g_new(struct sort_entry, count);
+  for (int64_t i = 0; i < count; i++) {
+    entries[i].row = grid->rows[i];
+    entries[i].col = grid->cols[i];
+    entries[i].pos = i;
+  }
+  qsort(entries, count, sizeof(*entries), sort_entry_compare);
+
+  int32_t *cols = g_new(int32_t, count);
+  int32_t *rows = g_new(int32_t, count);
+  float *offsets_x = g_new(float, count);
+  float *offsets_y = g_new(float, count);
+  float *widths = g_new(float, count);
+  float *heights = g_new(float, count);
+  void **data = g_new(void *, count);
+  int64_t out = 0;
+  for (int64_t i = 0; i < count; i++) {
+    int32_t pos = entries[i].pos;
+    if (i + 1 < count &&
+        entries[i + 1].row == entries[i].row &&
+        entries[i + 1].col == entries[i].col) {
+      // replaced
+      if (grid->destroy_tile && grid->data[pos]) {
+        grid->destroy_tile(grid->data[pos]);
+      }
+      continue;
+    }
+    cols[out] = grid->cols[pos];
+    rows[out] = grid->rows[pos];
+    offsets_x[out] = grid->offsets_x[pos];
+    offsets_y[out] = grid->offsets_y[pos];
+    widths[out] = grid->widths[pos];
+    heights[out] = grid->heights[pos];
+    data[out] = grid->data[pos];
+    out++;
+  }
+  g_free(entries);
+
+  g_free(grid->cols);
+  g_free(grid->rows);
+  g_free(grid->offsets_x);
+  g_free(grid->offsets_y);
+  g_free(grid->widths);
+  g_free(grid->heights);
+  g_free(grid->data);
+  grid->cols = cols;
+  grid->rows = rows;
+  grid->offsets_x = offsets_x;
+  grid->offsets_y = offsets_y;
+  grid->widths = widths;
+  grid->heights = heights;
+  grid->data = data;
+  grid->tile_capacity = count;
+  grid->tile_count = out;
+  grid->sorted = true;
+}
+
+// position of the tile in the arrays, or -1.  the grid must be sorted.
+static int64_t tilemap_lookup(struct tilemap_grid *grid,
+                              int64_t col, int64_t row) {
+  if (col < INT32_MIN || col > INT32_MAX ||
+      row < INT32_MIN || row > INT32_MAX) {
+    return -1;
+  }
+  int64_t lo = 0;
+  int64_t hi = grid->tile_count;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    int cmp = tile_coords_compare(grid->rows[mid], grid->cols[mid], row, col);
+    if (cmp == 0) {
+      return mid;
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
-  g_slice_free(struct grid_tile, tile);
+  return -1;
 }
 
 static void tilemap_get_bounds(struct _openslide_grid *_grid,
@@ -381,66 +725,188 @@ static void tilemap_get_bounds(struct _openslide_grid *_grid,
   }
 }
 
+static double tile_left(struct tilemap_grid *grid, int64_t tile) {
+  return grid->cols[tile] * grid->base.tile_advance_x +
+         grid->offsets_x[tile];
+}
+
+static double tile_top(struct tilemap_grid *grid, int64_t tile) {
+  return grid->rows[tile] * grid->base.tile_advance_y +
+         grid->offsets_y[tile];
+}
+
+struct index_entry {
+  int64_t band;
+  double left;
+  int32_t tile;
+};
+
+static int index_entry_compare(const void *a, const void *b) {
+  const struct index_entry *ea = a;
+  const struct index_entry *eb = b;
+  if (ea->band != eb->band) {
+    return ea->band < eb->band ? -1 : 1;
+  }
+  if (ea->left != eb->left) {
+    return ea->left < eb->left ? -1 : 1;
+  }
+  return 0;
+}
+
+static void tile_index_destroy(struct tile_index *index) {
+  if (index == NULL) {
+    return;
+  }
+  g_free(index->tiles);
+  g_free(index->band_starts);
+  g_slice_free(struct tile_index, index);
+}
+
+static struct tile_index *tile_index_create(struct tilemap_grid *grid) {
+  struct tile_index *index = g_slice_new0(struct tile_index);
+  int64_t count = grid->tile_count;
+  if (count == 0) {
+    return index;
+  }
+
+  struct index_entry *entries = g_new(struct index_entry, count);
+  for (int64_t i = 0; i < count; i++) {
+    entries[i].band = floor(tile_top(grid, i) / grid->base.tile_advance_y);
+    entries[i].left = tile_left(grid, i);
+    entries[i].tile = i;
+    index->max_w = MAX(index->max_w, grid->widths[i]);
+    index->max_h = MAX(index->max_h, grid->heights[i]);
+  }
+  qsort(entries, count, sizeof(*entries), index_entry_compare);
+
+  index->first_band = entries[0].band;
+  index->band_count = entries[count - 1].band - index->first_band + 1;
+  index->band_starts = g_new0(int64_t, index->band_count + 1);
+  index->tiles = g_new(int32_t, count);
+  for (int64_t i = 0; i < count; i++) {
+    index->tiles[i] = entries[i].tile;
+    index->band_starts[entries[i].band - index->first_band + 1]++;
+  }
+  for (int64_t band = 0; band < index->band_count; band++) {
+    index->band_starts[band + 1] += index->band_starts[band];
+  }
+  g_free(entries);
+  return index;
+}
+
+// sort the tiles if needed and optionally build the index.  a backend
+// may populate a map lazily, on the first read of its level rather than
+// at open time, but it adds every tile under its own lock before the
+// grid is first queried or painted (see MIRAX load_level_tiles()).  so
+// once this returns, the arrays are stable.
+static struct tile_index *tilemap_prepare(struct tilemap_grid *grid,
+                                          bool want_index) {
+  g_mutex_lock(grid->index_lock);
+  if (!grid->sorted) {
+    tilemap_sort(grid);
+  }
+  if (want_index && grid->index == NULL) {
+    // painting has started, so the map is complete
+    if (grid->tile_capacity > grid->tile_count) {
+      tilemap_set_capacity(grid, grid->tile_count);
+    }
+    grid->index = tile_index_create(grid);
+  }
+  struct tile_index *index = grid->index;
+  g_mutex_unlock(grid->index_lock);
+  return index;
+}
+
 static void tilemap_get_tile_size(struct _openslide_grid *_grid,
                                   int64_t tile_col, int64_t tile_row,
                                   struct bounds *bounds) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
 
-  struct grid_tile coords = {
-    .col = tile_col,
-    .row = tile_row,
-  };
-  struct grid_tile *tile = g_hash_table_lookup(grid->tiles, &coords);
-  if (tile == NULL) {
+  tilemap_prepare(grid, false);
+  int64_t tile = tilemap_lookup(grid, tile_col, tile_row);
+  if (tile == -1) {
     return;
   }
 
-  bounds->w = tile->w;
-  bounds->h = tile->h;
+  bounds->w = grid->widths[tile];
+  bounds->h = grid->heights[tile];
 }
 
-static bool tilemap_read_tile(struct _openslide_grid *_grid,
-                              struct region *region,
-                              cairo_t *cr,
-                              struct _openslide_level *level,
-                              int64_t tile_col, int64_t tile_row,
-                              void *arg,
-                              GError **err) {
-  struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
+// paint in the order the unindexed grid used: bottom-right first.
+// the arrays are sorted by (row, col), so that's descending position.
+static gint tile_paint_order(gconstpointer a, gconstpointer b) {
+  int32_t ta = *(const int32_t *) a;
+  int32_t tb = *(const int32_t *) b;
+  return tb < ta ? -1 : tb > ta;
+}
 
-  struct grid_tile coords = {
-    .col = tile_col,
-    .row = tile_row,
-  };
-  struct grid_tile *tile = g_hash_table_lookup(grid->tiles, &coords);
-  if (tile == NULL) {
-    //g_debug("no tile at %"G_GINT64_FORMAT", %"G_GINT64_FORMAT, tile_col, tile_row);
-    return true;
+// add the tiles whose bounds intersect the region to tiles
+static void tilemap_find_tiles(struct tilemap_grid *grid,
+                               struct tile_index *index,
+                               double x, double y,
+                               int32_t w, int32_t h,
+                               GArray *tiles) {
+  if (index->band_count == 0) {
+    return;
   }
+  double advance_y = grid->base.tile_advance_y;
+  int64_t band_start = floor((y - index->max_h) / advance_y);
+  int64_t band_end = floor((y + h) / advance_y);
+  band_start = MAX(band_start, index->first_band);
+  band_end = MIN(band_end, index->first_band + index->band_count - 1);
+
+  for (int64_t band = band_start; band <= band_end; band++) {
+    int64_t lo = index->band_starts[band - index->first_band];
+    int64_t hi = index->band_starts[band - index->first_band + 1];
+
+    // first tile that could reach the region's left edge
+    double min_left = x - index->max_w;
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (tile_left(grid, index->tiles[mid]) <= min_left) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
 
-  double x = tile_col * grid->base.tile_advance_x + tile->offset_x;
-  double y = tile_row * grid->base.tile_advance_y + tile->offset_y;
-
-  // skip the tile if it's outside the requested region
-  // (i.e., extra_tiles_* gave us an irrelevant tile)
-  if (x + tile->w <= region->x ||
-      y + tile->h <= region->y ||
-      x >= region->x + region->w ||
-      y >= region->y + region->h) {
-    //g_debug("skip x %g w %g y %g h %g, region x %g w %"G_GINT32_FORMAT" y %g h %"G_GINT32_FORMAT, x, tile->w, y, tile->h, region->x, region->w, region->y, region->h);
-    return true;
+    hi = index->band_starts[band - index->first_band + 1];
+    for (int64_t i = lo; i < hi; i++) {
+      int32_t tile = index->tiles[i];
+      double tx = tile_left(grid, tile);
+      double ty = tile_top(grid, tile);
+      if (tx >= x + w) {
+        break;
+      }
+      if (tx + grid->widths[tile] <= x ||
+          ty + grid->heights[tile] <= y || ty >= y + h) {
+        continue;
+      }
+      g_array_append_val(tiles, tile);
+    }
   }
+}
 
-  //g_debug("tilemap read_tile: %" G_GINT64_FORMAT " %" G_GINT64_FORMAT ", offset: %g %g, dim: %g %g", tile_col, tile_row, tile->offset_x, tile->offset_y, tile->w, tile->h);
+static bool tilemap_read_tile(struct tilemap_grid *grid,
+                              cairo_t *cr,
+                              struct _openslide_level *level,
+                              int64_t tile,
+                              void *arg,
+                              GError **err) {
+  int64_t col = grid->cols[tile];
+  int64_t row = grid->rows[tile];
+  //g_debug("tilemap read_tile: %" G_GINT64_FORMAT " %" G_GINT64_FORMAT ", offset: %g %g, dim: %g %g", col, row, grid->offsets_x[tile], grid->offsets_y[tile], grid->widths[tile], grid->heights[tile]);
 
   cairo_matrix_t matrix;
   cairo_get_matrix(cr, &matrix);
-  cairo_translate(cr, tile->offset_x, tile->offset_y);
+  cairo_translate(cr, grid->offsets_x[tile], grid->offsets_y[tile]);
+  _openslide_trace_tile_begin(grid->base.osr, level, col, row);
   bool success = grid->read_tile(grid->base.osr, cr, level,
-                                 tile->col, tile->row, tile->data,
+                                 col, row, grid->data[tile],
                                  arg, err);
+  _openslide_trace_tile_end(success);
   if (success) {
-    label_tile(_grid, cr, tile_col, tile_row);
+    label_tile((struct _openslide_grid *) grid, cr, col, row);
   }
   cairo_set_matrix(cr, &matrix);
   return success;
@@ -452,6 +918,7 @@ static bool tilemap_paint_region(struct _openslide_grid *_grid,
                                  double x, double y,
                                  struct _openslide_level *level,
                                  int32_t w, int32_t h,
+                                 bool pristine G_GNUC_UNUSED,
                                  GError **err) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
   struct region region;
@@ -462,32 +929,102 @@ static bool tilemap_paint_region(struct _openslide_grid *_grid,
   //g_debug("advances: %g %g", grid->base.tile_advance_x, grid->base.tile_advance_y);
   //g_debug("start tile: %" G_GINT64_FORMAT " %" G_GINT64_FORMAT ", end tile: %" G_GINT64_FORMAT " %" G_GINT64_FORMAT, start_tile_x, start_tile_y, end_tile_x, end_tile_y);
 
+  // find the tiles that intersect the region
+  GArray *tiles = g_array_new(false, false, sizeof(int32_t));
+  tilemap_find_tiles(grid, tilemap_prepare(grid, true), x, y, w, h, tiles);
+  g_array_sort(tiles, tile_paint_order);
+
   // save
   cairo_matrix_t matrix;
   cairo_get_matrix(cr, &matrix);
 
-  // accommodate extra tiles being drawn
+  // position tiles exactly as a walk over every cell would, including
+  // the margin for offset tiles
   region.start_tile_x -= grid->extra_tiles_left;
   region.start_tile_y -= grid->extra_tiles_top;
-  region.end_tile_x += grid->extra_tiles_right;
-  region.end_tile_y += grid->extra_tiles_bottom;
   cairo_translate(cr,
                   -grid->extra_tiles_left * grid->base.tile_advance_x,
                   -grid->extra_tiles_top * grid->base.tile_advance_y);
+  cairo_matrix_t region_matrix;
+  cairo_get_matrix(cr, &region_matrix);
 
   // read
-  bool result = read_tiles(cr, level, _grid, &region, arg, err);
+  bool result = true;
+  for (guint i = 0; i < tiles->len; i++) {
+    int32_t tile = g_array_index(tiles, int32_t, i);
+    double translate_x = ((grid->cols[tile] - region.start_tile_x) *
+                          grid->base.tile_advance_x) - region.offset_x;
+    double translate_y = ((grid->rows[tile] - region.start_tile_y) *
+                          grid->base.tile_advance_y) - region.offset_y;
+    cairo_translate(cr, translate_x, translate_y);
+    result = tilemap_read_tile(grid, cr, level, tile, arg, err);
+    cairo_set_matrix(cr, &region_matrix);
+    if (!result) {
+      break;
+    }
+  }
 
   // restore
   cairo_set_matrix(cr, &matrix);
+  g_array_free(tiles, true);
 
   return result;
 }
 
+static bool tilemap_build_occupancy(struct _openslide_grid *_grid,
+                                    void *arg G_GNUC_UNUSED,
+                                    struct _openslide_level *level G_GNUC_UNUSED,
+                                    struct _openslide_occupancy *occ,
+                                    GError **err G_GNUC_UNUSED) {
+  struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
+  double adv_x = grid->base.tile_advance_x;
+  double adv_y = grid->base.tile_advance_y;
+
+  if (isinf(grid->left)) {
+    // no tiles
+    occupancy_init(occ, _grid, 0, 0);
+    return true;
+  }
+  occupancy_init(occ, _grid, ceil(grid->right / adv_x),
+                 ceil(grid->bottom / adv_y));
+
+  // mark every cell a tile can paint into
+  tilemap_prepare(grid, false);
+  for (int64_t i = 0; i < grid->tile_count; i++) {
+    double left = tile_left(grid, i);
+    double top = tile_top(grid, i);
+    int64_t col0 = MAX(floor(left / adv_x), 0);
+    int64_t row0 = MAX(floor(top / adv_y), 0);
+    int64_t col1 = MIN(ceil((left + grid->widths[i]) / adv_x), occ->cols);
+    int64_t row1 = MIN(ceil((top + grid->heights[i]) / adv_y), occ->rows);
+    for (int64_t row = row0; row < row1; row++) {
+      for (int64_t col = col0; col < col1; col++) {
+        occupancy_set(occ, col, row);
+      }
+    }
+  }
+  return true;
+}
+
 static void tilemap_destroy(struct _openslide_grid *_grid) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
 
-  g_hash_table_destroy(grid->tiles);
+  if (grid->destroy_tile) {
+    for (int64_t i = 0; i < grid->tile_count; i++) {
+      if (grid->data[i]) {
+        grid->destroy_tile(grid->data[i]);
+      }
+    }
+  }
+  tile_index_destroy(grid->index);
+  g_mutex_free(grid->index_lock);
+  g_free(grid->cols);
+  g_free(grid->rows);
+  g_free(grid->offsets_x);
+  g_free(grid->offsets_y);
+  g_free(grid->widths);
+  g_free(grid->heights);
+  g_free(grid->data);
   g_slice_free(struct tilemap_grid, grid);
 }
 
@@ -495,7 +1032,7 @@ const struct grid_ops tilemap_grid_ops = {
   .get_bounds = tilemap_get_bounds,
   .get_tile_size = tilemap_get_tile_size,
   .paint_region = tilemap_paint_region,
-  .read_tile = tilemap_read_tile,
+  .build_occupancy = tilemap_build_occupancy,
   .destroy = tilemap_destroy,
 };
 
@@ -506,18 +1043,41 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
                                       void *data) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
   g_assert(grid->base.ops == &tilemap_grid_ops);
+  g_assert(col >= INT32_MIN && col <= INT32_MAX);
+  g_assert(row >= INT32_MIN && row <= INT32_MAX);
+
+  int64_t tile = grid->tile_count;
+  if (tile > 0 && grid->sorted) {
+    int cmp = tile_coords_compare(grid->rows[tile - 1], grid->cols[tile - 1],
+                                  row, col);
+    if (cmp == 0) {
+      // replace the last tile in place
+      tile--;
+      if (grid->destroy_tile && grid->data[tile]) {
+        grid->destroy_tile(grid->data[tile]);
+      }
+    } else if (cmp > 0) {
+      grid->sorted = false;
+    }
+  }
+  if (tile == grid->tile_count) {
+    g_assert(tile < INT32_MAX);
+    if (tile == grid->tile_capacity) {
+      tilemap_set_capacity(grid, MAX(2 * grid->tile_capacity, 64));
+    }
+    grid->tile_count++;
+  }
 
-  struct grid_tile *tile = g_slice_new0(struct grid_tile);
-  tile->grid = grid;
-  tile->col = col;
-  tile->row = row;
-  tile->offset_x = offset_x;
-  tile->offset_y = offset_y;
-  tile->w = w;
-  tile->h = h;
-  tile->data = data;
+  grid->cols[tile] = col;
+  grid->rows[tile] = row;
+  grid->offsets_x[tile] = offset_x;
+  grid->offsets_y[tile] = offset_y;
+  grid->widths[tile] = w;
+  grid->heights[tile] = h;
+  grid->data[tile] = data;
 
-  g_hash_table_replace(grid->tiles, tile, tile);
+  tile_index_destroy(grid->index);
+  grid->index = NULL;
 
   grid->left = MIN(col * grid->base.tile_advance_x + offset_x,
                    grid->left);
@@ -533,7 +1093,7 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
     int32_t extra_right = ceil(-offset_x / grid->base.tile_advance_x);
     grid->extra_tiles_right = MAX(grid->extra_tiles_right, extra_right);
   }
-  double offset_xr = offset_x + (tile->w - grid->base.tile_advance_x);
+  double offset_xr = offset_x + (w - grid->base.tile_advance_x);
   if (offset_xr > 0) {
     // extra on left
     int32_t extra_left = ceil(offset_xr / grid->base.tile_advance_x);
@@ -545,7 +1105,7 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
     int32_t extra_bottom = ceil(-offset_y / grid->base.tile_advance_y);
     grid->extra_tiles_bottom = MAX(grid->extra_tiles_bottom, extra_bottom);
   }
-  double offset_yr = offset_y + (tile->h - grid->base.tile_advance_y);
+  double offset_yr = offset_y + (h - grid->base.tile_advance_y);
   if (offset_yr > 0) {
     // extra on top
     int32_t extra_top = ceil(offset_yr / grid->base.tile_advance_y);
@@ -559,25 +1119,29 @@ void *_openslide_grid_tilemap_get_tile(struct _openslide_grid *_grid,
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
   g_assert(grid->base.ops == &tilemap_grid_ops);
 
-  struct grid_tile coords = {
-    .col = col,
-    .row = row,
-  };
-  struct grid_tile *tile = g_hash_table_lookup(grid->tiles, &coords);
-  if (tile == NULL) {
+  tilemap_prepare(grid, false);
+  int64_t tile = tilemap_lookup(grid, col, row);
+  if (tile == -1) {
     return NULL;
   }
-  return tile->data;
+  return grid->data[tile];
 }
 
-static void tilemap_foreach_func(void *key G_GNUC_UNUSED,
-                                 void *value,
-                                 void *data) {
-  struct tilemap_foreach_args *args = data;
-  struct grid_tile *tile = value;
-  g_assert(value != NULL);
+bool _openslide_grid_tilemap_get_tile_offset(struct _openslide_grid *_grid,
+                                             int64_t col, int64_t row,
+                                             double *offset_x,
+                                             double *offset_y) {
+  struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
+  g_assert(grid->base.ops == &tilemap_grid_ops);
 
-  args->func(args->grid, tile->col, tile->row, tile->data, args->arg);
+  tilemap_prepare(grid, false);
+  int64_t tile = tilemap_lookup(grid, col, row);
+  if (tile == -1) {
+    return false;
+  }
+  *offset_x = grid->offsets_x[tile];
+  *offset_y = grid->offsets_y[tile];
+  return true;
 }
 
 void _openslide_grid_tilemap_foreach(struct _openslide_grid *_grid,
@@ -586,12 +1150,11 @@ void _openslide_grid_tilemap_foreach(struct _openslide_grid *_grid,
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
   g_assert(grid->base.ops == &tilemap_grid_ops);
 
-  struct tilemap_foreach_args args = {
-    .grid = _grid,
-    .func = func,
-    .arg = arg,
-  };
-  g_hash_table_foreach(grid->tiles, tilemap_foreach_func, &args);
+  // in (row, col) order
+  tilemap_prepare(grid, false);
+  for (int64_t i = 0; i < grid->tile_count; i++) {
+    func(_grid, grid->cols[i], grid->rows[i], grid->data[i], arg);
+  }
 }
 
 struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
@@ -606,22 +1169,19 @@ struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
   grid->base.tile_advance_y = tile_advance_y;
   grid->read_tile = read_tile;
   grid->destroy_tile = destroy_tile;
+  grid->index_lock = g_mutex_new();
+  grid->base.occupancy_lock = g_mutex_new();
+  grid->sorted = true;
 
   grid->top = INFINITY;
   grid->bottom = -INFINITY;
   grid->left = INFINITY;
   grid->right = -INFINITY;
 
-  grid->tiles = g_hash_table_new_full(grid_tile_hash_func,
-                                      grid_tile_hash_key_equal,
-                                      NULL,
-                                      grid_tile_hash_destroy_value);
-
   return (struct _openslide_grid *) grid;
 }
 
 
-
 void _openslide_grid_get_bounds(struct _openslide_grid *grid,
                                 double *x, double *y,
                                 double *w, double *h) {
@@ -642,6 +1202,31 @@ void _openslide_grid_get_bounds(struct _openslide_grid *grid,
   }
 }
 
+const struct _openslide_occupancy *_openslide_grid_get_occupancy(struct _openslide_grid *grid,
+                                                                 void *arg,
+                                                                 struct _openslide_level *level,
+                                                                 GError **err) {
+  struct _openslide_occupancy *occ = get_built_occupancy(grid);
+  if (occ) {
+    return occ;
+  }
+
+  g_mutex_lock(grid->occupancy_lock);
+  occ = grid->occupancy;
+  if (occ == NULL) {
+    occ = g_slice_new0(struct _openslide_occupancy);
+    if (grid->ops->build_occupancy(grid, arg, level, occ, err)) {
+      g_atomic_pointer_set((gpointer *) &grid->occupancy, occ);
+    } else {
+      g_free(occ->bits);
+      g_slice_free(struct _openslide_occupancy, occ);
+      occ = NULL;
+    }
+  }
+  g_mutex_unlock(grid->occupancy_lock);
+  return occ;
+}
+
 bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   cairo_t *cr,
                                   void *arg,
@@ -649,16 +1234,116 @@ bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   struct _openslide_level *level,
                                   int32_t w, int32_t h,
                                   GError **err) {
-  return grid->ops->paint_region(grid, cr, arg, x, y, level, w, h, err);
+  // once anything is painted, the surface is no longer pristine
+  cairo_surface_t *target = cairo_get_group_target(cr);
+  bool pristine = _openslide_is_surface_pristine(target);
+  if (pristine) {
+    _openslide_set_surface_pristine(target, false);
+  }
+
+  return grid->ops->paint_region(grid, cr, arg, x, y, level, w, h,
+                                 pristine, err);
+}
+
+uint32_t *_openslide_grid_get_tile(struct _openslide_grid *_grid,
+                                   void *arg,
+                                   struct _openslide_level *level,
+                                   int64_t tile_col, int64_t tile_row,
+                                   int32_t *w, int32_t *h,
+                                   struct _openslide_cache_entry **cache_entry,
+                                   GError **err) {
+  if (_grid->ops != &simple_grid_ops ||
+      ((struct simple_grid *) _grid)->fetch_tile == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Grid does not support fetching tiles");
+    return NULL;
+  }
+  struct simple_grid *grid = (struct simple_grid *) _grid;
+
+  if (tile_col < 0 || tile_col >= grid->tiles_across ||
+      tile_row < 0 || tile_row >= grid->tiles_down) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "No such tile: %"G_GINT64_FORMAT", %"G_GINT64_FORMAT,
+                tile_col, tile_row);
+    return NULL;
+  }
+
+  uint32_t *tiledata = grid->fetch_tile(grid->base.osr, level,
+                                        tile_col, tile_row, arg,
+                                        cache_entry, err);
+  if (tiledata) {
+    *w = grid->base.tile_advance_x;
+    *h = grid->base.tile_advance_y;
+  }
+  return tiledata;
 }
 
 void _openslide_grid_destroy(struct _openslide_grid *grid) {
   if (grid == NULL) {
     return;
   }
+  if (grid->occupancy) {
+    g_free(grid->occupancy->bits);
+    g_slice_free(struct _openslide_occupancy, grid->occupancy);
+  }
+  g_mutex_free(grid->occupancy_lock);
   grid->ops->destroy(grid);
 }
 
+bool _openslide_grid_paint_subimage(cairo_t *cr,
+                                    const uint32_t *data,
+                                    cairo_format_t format,
+                                    int32_t image_w, int32_t image_h,
+                                    double src_x, double src_y,
+                                    double w, double h,
+                                    GError **err) {
+  int64_t perf_start = _openslide_perf_start();
+  cairo_surface_t *surface;
+  bool in_place = src_x == floor(src_x) && src_y == floor(src_y) &&
+                  src_x >= 0 && src_y >= 0 &&
+                  src_x < image_w && src_y < image_h;
+  if (in_place) {
+    // whole-pixel offset: borrow the rows in place
+    int32_t x = src_x;
+    int32_t y = src_y;
+    int32_t sub_w = MIN(ceil(w), image_w - x);
+    int32_t sub_h = MIN(ceil(h), image_h - y);
+    surface = cairo_image_surface_create_for_data((unsigned char *) (data + (int64_t) y * image_w + x),
+                                                  format,
+                                                  sub_w, sub_h,
+                                                  image_w * 4);
+  } else {
+    surface = cairo_image_surface_create_for_data((unsigned char *) data,
+                                                  format,
+                                                  image_w, image_h,
+                                                  image_w * 4);
+  }
+
+  // don't paint a surface we failed to create
+  cairo_status_t status = cairo_surface_status(surface);
+  if (status) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_CAIRO_ERROR,
+                "cairo error: %s", cairo_status_to_string(status));
+    cairo_surface_destroy(surface);
+    return false;
+  }
+
+  if (in_place) {
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_surface_destroy(surface);
+    cairo_paint(cr);
+  } else {
+    // clip the destination instead
+    cairo_set_source_surface(cr, surface, -src_x, -src_y);
+    cairo_surface_destroy(surface);
+    cairo_rectangle(cr, 0, 0, ceil(w), ceil(h));
+    cairo_fill(cr);
+  }
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start,
+                      (int64_t) ceil(w) * (int64_t) ceil(h) * 4);
+  return _openslide_check_cairo_status(cr, err);
+}
+
 void _openslide_grid_draw_tile_info(cairo_t *cr, const char *fmt, ...) {
   if (!_openslide_debug(OPENSLIDE_DEBUG_TILES)) {
     return;
@@ -29,8 +29,12 @@
 #include <string.h>
 #include <glib.h>
 
+#ifdef HAVE_POSIX_FADVISE
+#include <fcntl.h>
+#endif
+
 struct _openslide_hash {
-  GChecksum *checksum;
+  GChecksum *checksum;  // NULL for a probe
   bool enabled;
 };
 
@@ -42,9 +46,21 @@ struct _openslide_hash *_openslide_hash_quickhash1_create(void) {
   return hash;
 }
 
+struct _openslide_hash *_openslide_hash_probe_create(void) {
+  struct _openslide_hash *hash = g_slice_new(struct _openslide_hash);
+  hash->checksum = NULL;
+  hash->enabled = true;
+
+  return hash;
+}
+
+bool _openslide_hash_is_probe(struct _openslide_hash *hash) {
+  return hash && hash->checksum == NULL;
+}
+
 void _openslide_hash_data(struct _openslide_hash *hash, const void *data,
                           int32_t datalen) {
-  if (hash && hash->enabled && data && datalen) {
+  if (hash && hash->enabled && hash->checksum && data && datalen) {
     g_checksum_update(hash->checksum, data, datalen);
   }
 }
@@ -59,13 +75,43 @@ bool _openslide_hash_file(struct _openslide_hash *hash, const char *filename,
   return _openslide_hash_file_part(hash, filename, 0, -1, err);
 }
 
+// read size for streaming a file through the hash
+#define HASH_BLOCK_SIZE (1 << 20)
+
+// parts read concurrently are buffered in memory, up to this much at once
+#define PARALLEL_WINDOW_SIZE (32 << 20)
+
+static FILE *open_sequential(const char *filename, int64_t offset,
+                             GError **err) {
+  FILE *f = _openslide_fopen(filename, "rb", err);
+  if (f == NULL) {
+    return NULL;
+  }
+#ifdef HAVE_POSIX_FADVISE
+  // advisory only
+  posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  if (fseeko(f, offset, SEEK_SET) == -1) {
+    _openslide_io_error(err, "Can't seek in %s", filename);
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
 bool _openslide_hash_file_part(struct _openslide_hash *hash,
 			       const char *filename,
 			       int64_t offset, int64_t size,
 			       GError **err) {
   bool success = false;
+  uint8_t *buf = NULL;
 
-  FILE *f = _openslide_fopen(filename, "rb", err);
+  if (hash == NULL || _openslide_hash_is_probe(hash)) {
+    // not hashing this time
+    return true;
+  }
+
+  FILE *f = open_sequential(filename, offset, err);
   if (f == NULL) {
     return false;
   }
@@ -82,18 +128,18 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
       goto DONE;
     }
     size = len - offset;
+    if (fseeko(f, offset, SEEK_SET) == -1) {
+      _openslide_io_error(err, "Can't seek in %s", filename);
+      goto DONE;
+    }
   }
 
-  uint8_t buf[4096];
-
-  if (fseeko(f, offset, SEEK_SET) == -1) {
-    _openslide_io_error(err, "Can't seek in %s", filename);
-    goto DONE;
-  }
+  int64_t buf_size = MIN(size, HASH_BLOCK_SIZE);
+  buf = g_malloc(MAX(buf_size, 1));
 
   int64_t bytes_left = size;
   while (bytes_left > 0) {
-    int64_t bytes_to_read = MIN((int64_t) sizeof buf, bytes_left);
+    int64_t bytes_to_read = MIN(buf_size, bytes_left);
     int64_t bytes_read = fread(buf, 1, bytes_to_read, f);
 
     if (bytes_read != bytes_to_read) {
@@ -112,10 +158,141 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
   success = true;
 
 DONE:
+  g_free(buf);
   fclose(f);
   return success;
 }
 
+// a run of consecutive parts, read by one task
+struct read_parts_task {
+  const struct _openslide_hash_part *parts;
+  uint8_t **bufs;
+  int64_t count;
+  GError *err;  // for the first part that failed
+  int64_t failed;  // index of that part, or count
+};
+
+static void read_parts(void *data) {
+  struct read_parts_task *task = data;
+  FILE *f = NULL;
+  const char *cur_filename = NULL;
+
+  task->failed = task->count;
+  for (int64_t i = 0; i < task->count; i++) {
+    const struct _openslide_hash_part *part = &task->parts[i];
+    // reuse the handle across parts of the same file
+    if (f == NULL || strcmp(part->filename, cur_filename)) {
+      if (f) {
+        fclose(f);
+      }
+      f = open_sequential(part->filename, part->offset, &task->err);
+      cur_filename = part->filename;
+    } else if (fseeko(f, part->offset, SEEK_SET) == -1) {
+      _openslide_io_error(&task->err, "Can't seek in %s", part->filename);
+      fclose(f);
+      f = NULL;
+    }
+    if (f == NULL) {
+      task->failed = i;
+      return;
+    }
+
+    task->bufs[i] = g_malloc(MAX(part->size, 1));
+    if (fread(task->bufs[i], 1, part->size, f) != (size_t) part->size) {
+      g_set_error(&task->err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Can't read from %s", part->filename);
+      task->failed = i;
+      break;
+    }
+  }
+  if (f) {
+    fclose(f);
+  }
+}
+
+// read a window of parts concurrently, then hash them in order
+static bool hash_window(struct _openslide_hash *hash,
+                        const struct _openslide_hash_part *parts,
+                        int64_t count,
+                        GError **err) {
+  uint8_t **bufs = g_new0(uint8_t *, count);
+  int64_t task_count = MAX(1, MIN(count, _openslide_get_worker_count()));
+  struct read_parts_task *tasks = g_new0(struct read_parts_task, task_count);
+
+  struct _openslide_taskgroup *tg = _openslide_taskgroup_create();
+  int64_t start = 0;
+  for (int64_t t = 0; t < task_count; t++) {
+    int64_t end = count * (t + 1) / task_count;
+    tasks[t].parts = parts + start;
+    tasks[t].bufs = bufs + start;
+    tasks[t].count = end - start;
+    _openslide_taskgroup_push(tg, read_parts, &tasks[t]);
+    start = end;
+  }
+  _openslide_taskgroup_finish(tg);
+
+  // feed the hash in order, stopping at the first failure
+  bool success = true;
+  for (int64_t t = 0; t < task_count; t++) {
+    struct read_parts_task *task = &tasks[t];
+    if (success) {
+      for (int64_t i = 0; i < task->failed; i++) {
+        _openslide_hash_data(hash, task->bufs[i], task->parts[i].size);
+      }
+      if (task->err) {
+        g_propagate_error(err, task->err);
+        task->err = NULL;
+        success = false;
+      }
+    }
+    g_clear_error(&task->err);
+  }
+
+  for (int64_t i = 0; i < count; i++) {
+    g_free(bufs[i]);
+  }
+  g_free(tasks);
+  g_free(bufs);
+  return success;
+}
+
+bool _openslide_hash_file_parts(struct _openslide_hash *hash,
+                                const struct _openslide_hash_part *parts,
+                                int64_t count,
+                                GError **err) {
+  if (hash == NULL || _openslide_hash_is_probe(hash)) {
+    // not hashing this time
+    return true;
+  }
+
+  int64_t start = 0;
+  while (start < count) {
+    if (parts[start].size > PARALLEL_WINDOW_SIZE) {
+      // too big to buffer; stream it
+      if (!_openslide_hash_file_part(hash, parts[start].filename,
+                                     parts[start].offset, parts[start].size,
+                                     err)) {
+        return false;
+      }
+      start++;
+      continue;
+    }
+
+    // gather as many parts as fit in the window
+    int64_t end = start;
+    int64_t window = 0;
+    while (end < count && parts[end].size <= PARALLEL_WINDOW_SIZE - window) {
+      window += parts[end].size;
+      end++;
+    }
+    if (!hash_window(hash, parts + start, end - start, err)) {
+      return false;
+    }
+    start = end;
+  }
+  return true;
+}
+
 // Invalidate this hash.  Use if this slide is unhashable for some reason.
 void _openslide_hash_disable(struct _openslide_hash *hash) {
   if (hash) {
@@ -123,7 +300,12 @@ void _openslide_hash_disable(struct _openslide_hash *hash) {
   }
 }
 
+bool _openslide_hash_is_enabled(struct _openslide_hash *hash) {
+  return hash->enabled;
+}
+
 const char *_openslide_hash_get_string(struct _openslide_hash *hash) {
+  g_assert(!_openslide_hash_is_probe(hash));
   if (hash->enabled) {
     return g_checksum_get_string(hash->checksum);
   } else {
@@ -132,6 +314,8 @@ const char *_openslide_hash_get_string(struct _openslide_hash *hash) {
 }
 
 void _openslide_hash_destroy(struct _openslide_hash *hash) {
-  g_checksum_free(hash->checksum);
+  if (hash->checksum) {
+    g_checksum_free(hash->checksum);
+  }
   g_slice_free(struct _openslide_hash, hash);
 }
@@ -33,8 +33,12 @@
 
 struct _openslide_hash;
 
-// constructor
+// constructors
 struct _openslide_hash *_openslide_hash_quickhash1_create(void);
+// a probe hashes nothing and reads no files; it only records whether
+// the backend disabled it, i.e. whether the slide can be hashed
+struct _openslide_hash *_openslide_hash_probe_create(void);
+bool _openslide_hash_is_probe(struct _openslide_hash *hash);
 
 // hashers
 void _openslide_hash_data(struct _openslide_hash *hash, const void *data,
@@ -47,10 +51,25 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
 			       int64_t offset, int64_t size,
 			       GError **err);
 
+// a region of a file, for _openslide_hash_file_parts()
+struct _openslide_hash_part {
+  const char *filename;
+  int64_t offset;
+  int64_t size;  // must be known
+};
+
+// hash the parts in order, reading them concurrently
+bool _openslide_hash_file_parts(struct _openslide_hash *hash,
+                                const struct _openslide_hash_part *parts,
+                                int64_t count,
+                                GError **err);
+
 // lockout
 void _openslide_hash_disable(struct _openslide_hash *hash);
 
-// accessor
+// accessors
+bool _openslide_hash_is_enabled(struct _openslide_hash *hash);
+// not valid for a probe
 const char *_openslide_hash_get_string(struct _openslide_hash *hash);
 
 // destructor
@@ -104,7 +104,9 @@ static boolean fill_input_buffer (j_decompress_ptr cinfo)
   my_src_ptr src = (my_src_ptr) cinfo->src;
   size_t nbytes;
 
+  int64_t perf_start = _openslide_perf_start();
   nbytes = fread(src->buffer, 1, INPUT_BUF_SIZE, src->infile);
+  _openslide_perf_end(OPENSLIDE_PERF_FILE_IO, perf_start, nbytes);
 
   if (nbytes <= 0) {
     if (src->start_of_file)	/* Treat empty input file as fatal error */
@@ -0,0 +1,187 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Performance counters.
+ *
+ * Each thread updates its own counters without locking.  The list of
+ * threads is only locked to sum the counters, and when a thread exits
+ * and folds its counters into the retired totals.  Resetting records a
+ * baseline to subtract, so it never writes to another thread's
+ * counters.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <glib.h>
+
+#define STAGES OPENSLIDE_PERF_STAGE_COUNT
+
+static const char *const stage_names[STAGES] = {
+  [OPENSLIDE_PERF_FILE_IO] = "file-io",
+  [OPENSLIDE_PERF_DECODE_JPEG] = "decode-jpeg",
+  [OPENSLIDE_PERF_DECODE_JP2K] = "decode-jp2k",
+  [OPENSLIDE_PERF_DECODE_PNG] = "decode-png",
+  [OPENSLIDE_PERF_DECODE_GDKPIXBUF] = "decode-gdkpixbuf",
+  [OPENSLIDE_PERF_DECODE_TIFF] = "decode-tiff",
+  [OPENSLIDE_PERF_CACHE_GET] = "cache-get",
+  [OPENSLIDE_PERF_CACHE_PUT] = "cache-put",
+  [OPENSLIDE_PERF_COMPOSITE] = "composite",
+  [OPENSLIDE_PERF_TIFF_DIRECTORY] = "tiff-directory",
+};
+
+struct thread_counters {
+  openslide_perf_counter_t c[STAGES];
+  GTimer *timer;
+};
+
+static struct {
+  GStaticMutex lock;
+  GList *threads;                          // struct thread_counters
+  openslide_perf_counter_t retired[STAGES];  // from exited threads
+  openslide_perf_counter_t baseline[STAGES]; // totals at the last reset
+} perf = {
+  .lock = G_STATIC_MUTEX_INIT,
+};
+
+static GStaticPrivate counters_key = G_STATIC_PRIVATE_INIT;
+
+static void add_counters(openslide_perf_counter_t *dest,
+                         const openslide_perf_counter_t *src) {
+  for (int i = 0; i < STAGES; i++) {
+    dest[i].count += src[i].count;
+    dest[i].nsec += src[i].nsec;
+    dest[i].bytes += src[i].bytes;
+  }
+}
+
+static void thread_counters_free(gpointer data) {
+  struct thread_counters *tc = data;
+  g_static_mutex_lock(&perf.lock);
+  add_counters(perf.retired, tc->c);
+  perf.threads = g_list_remove(perf.threads, tc);
+  g_static_mutex_unlock(&perf.lock);
+  g_timer_destroy(tc->timer);
+  g_slice_free(struct thread_counters, tc);
+}
+
+static struct thread_counters *get_thread_counters(void) {
+  struct thread_counters *tc = g_static_private_get(&counters_key);
+  if (tc == NULL) {
+    tc = g_slice_new0(struct thread_counters);
+    tc->timer = g_timer_new();
+    g_static_mutex_lock(&perf.lock);
+    perf.threads = g_list_prepend(perf.threads, tc);
+    g_static_mutex_unlock(&perf.lock);
+    g_static_private_set(&counters_key, tc, thread_counters_free);
+  }
+  return tc;
+}
+
+static int64_t now_nsec(struct thread_counters *tc) {
+  return g_timer_elapsed(tc->timer, NULL) * 1e9;
+}
+
+int64_t _openslide_perf_start(void) {
+  if (!_openslide_debug(OPENSLIDE_DEBUG_PERFORMANCE) &&
+      !_openslide_trace_enabled()) {
+    return -1;
+  }
+  return now_nsec(get_thread_counters());
+}
+
+void _openslide_perf_end(openslide_perf_stage_t stage, int64_t start,
+                         int64_t bytes) {
+  if (start < 0) {
+    return;
+  }
+  struct thread_counters *tc = get_thread_counters();
+  int64_t nsec = MAX(now_nsec(tc) - start, 0);
+  bytes = MAX(bytes, 0);
+  _openslide_trace_stage(stage, nsec, bytes);
+  if (_openslide_debug(OPENSLIDE_DEBUG_PERFORMANCE)) {
+    openslide_perf_counter_t *c = &tc->c[stage];
+    c->count++;
+    c->nsec += nsec;
+    c->bytes += bytes;
+  }
+}
+
+// perf lock must be held
+static void get_totals(openslide_perf_counter_t *totals) {
+  memcpy(totals, perf.retired, sizeof(perf.retired));
+  for (GList *l = perf.threads; l; l = l->next) {
+    struct thread_counters *tc = l->data;
+    add_counters(totals, tc->c);
+  }
+}
+
+int32_t openslide_get_perf_counters(openslide_perf_counter_t *counters,
+                                    int32_t count) {
+  openslide_perf_counter_t totals[STAGES];
+  g_static_mutex_lock(&perf.lock);
+  get_totals(totals);
+  for (int i = 0; i < STAGES; i++) {
+    // unsigned, so this wraps to the true difference
+    totals[i].count -= perf.baseline[i].count;
+    totals[i].nsec -= perf.baseline[i].nsec;
+    totals[i].bytes -= perf.baseline[i].bytes;
+  }
+  g_static_mutex_unlock(&perf.lock);
+
+  if (counters && count > 0) {
+    memset(counters, 0, count * sizeof(*counters));
+    memcpy(counters, totals, MIN(count, STAGES) * sizeof(*counters));
+  }
+  return STAGES;
+}
+
+const char *openslide_get_perf_stage_name(openslide_perf_stage_t stage) {
+  if (stage < 0 || stage >= STAGES) {
+    return NULL;
+  }
+  return stage_names[stage];
+}
+
+void openslide_reset_perf_counters(void) {
+  g_static_mutex_lock(&perf.lock);
+  get_totals(perf.baseline);
+  g_static_mutex_unlock(&perf.lock);
+}
+
+void _openslide_perf_log(void) {
+  if (!_openslide_debug(OPENSLIDE_DEBUG_PERFORMANCE)) {
+    return;
+  }
+  openslide_perf_counter_t counters[STAGES];
+  openslide_get_perf_counters(counters, STAGES);
+  for (int i = 0; i < STAGES; i++) {
+    if (counters[i].count) {
+      g_message("%-16s %10"G_GUINT64_FORMAT" calls %12.3f ms "
+                "%14"G_GUINT64_FORMAT" bytes",
+                stage_names[i], counters[i].count,
+                counters[i].nsec / 1e6, counters[i].bytes);
+    }
+  }
+}
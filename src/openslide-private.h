@@ -51,15 +51,41 @@ struct _openslide_associated_image_ops {
   bool (*get_argb_data)(struct _openslide_associated_image *img,
                         uint32_t *dest,
                         GError **err);
+  // optional; decode at 1/scale_denom size, where scale_denom is 2, 4,
+  // or 8.  dest has the dimensions from
+  // _openslide_associated_image_get_scaled_dimensions().
+  bool (*get_argb_data_scaled)(struct _openslide_associated_image *img,
+                               int32_t scale_denom,
+                               uint32_t *dest,
+                               GError **err);
   void (*destroy)(struct _openslide_associated_image *img);
 };
 
+struct _openslide_cache_entry;
+
+// dimensions at 1/scale_denom size, rounded up as libjpeg does
+void _openslide_associated_image_get_scaled_dimensions(struct _openslide_associated_image *img,
+                                                       int32_t scale_denom,
+                                                       int64_t *w, int64_t *h);
+
+// decode at 1/scale_denom size through the tile cache.  scale_denom
+// must be 1 or supported by get_argb_data_scaled.  images bigger than
+// an eighth of the cache are returned without being cached.  returns the
+// pixels, owned by *cache_entry, which the caller must unref.
+const uint32_t *_openslide_associated_image_read(openslide_t *osr,
+                                                 struct _openslide_associated_image *img,
+                                                 int32_t scale_denom,
+                                                 struct _openslide_cache_entry **cache_entry,
+                                                 GError **err);
+
 /* the main structure */
 struct _openslide {
   const struct _openslide_ops *ops;
   struct _openslide_level **levels;
   void *data;
   int32_t level_count;
+  // trailing levels added by OpenSlide, not by the backend
+  int32_t synthetic_level_count;
 
   // associated images
   GHashTable *associated_images;  // created automatically
@@ -69,8 +95,30 @@ struct _openslide {
   GHashTable *properties; // created automatically
   const char **property_names; // filled in automatically from hashtable
 
+  // for computing quickhash1 on first request; filled in automatically
+  const struct _openslide_format *format;
+  char *filename;
+  GMutex *quickhash1_lock;
+  char *quickhash1;
+  bool quickhash1_done;
+
   // cache
-  struct _openslide_cache *cache;
+  struct _openslide_cache_binding *cache;
+
+  // background reads for prefetch hints; created automatically
+  struct _openslide_prefetcher *prefetcher;
+
+  // asynchronous reads in progress; created automatically
+  struct _openslide_async_reads *async_reads;
+
+  // messages handed out in read request error fields, freed on close;
+  // created automatically
+  GMutex *request_errors_lock;
+  GPtrArray *request_errors;
+
+  // opened only to compute quickhash1 and then closed; backends may
+  // skip setup that is only needed for reading
+  bool hash_only;
 
   // error handling, NULL if no error
   gpointer error; // must use g_atomic_pointer!
@@ -89,16 +137,41 @@ struct _openslide_level {
 };
 
 /* the function pointer structure for backends */
+struct _openslide_cache_entry;
+struct _openslide_occupancy;
+
 struct _openslide_ops {
   bool (*paint_region)(openslide_t *osr, cairo_t *cr,
 		       int64_t x, int64_t y,
 		       struct _openslide_level *level,
 		       int32_t w, int32_t h,
 		       GError **err);
+  // optional; fails with OPENSLIDE_ERROR_NO_VALUE if the tile can't be
+  // had in decoded form
+  uint32_t *(*get_tile)(openslide_t *osr,
+                        struct _openslide_level *level,
+                        int64_t tile_col, int64_t tile_row,
+                        int32_t *w, int32_t *h,
+                        struct _openslide_cache_entry **cache_entry,
+                        GError **err);
+  // optional; fails with OPENSLIDE_ERROR_NO_VALUE if the tile's
+  // compressed data can't be returned as a standalone image
+  bool (*read_raw_tile)(openslide_t *osr,
+                        struct _openslide_level *level,
+                        int64_t tile_col, int64_t tile_row,
+                        void **buf, int64_t *len,
+                        openslide_tile_format_t *format,
+                        int32_t *w, int32_t *h,
+                        GError **err);
+  // optional; the cells of the level that may hold image data
+  const struct _openslide_occupancy *(*get_occupancy)(openslide_t *osr,
+                                                      struct _openslide_level *level,
+                                                      GError **err);
   void (*destroy)(openslide_t *osr);
 };
 
 struct _openslide_tifflike;
+struct _openslide_snapshot;
 
 /* vendor detection and parsing */
 
@@ -116,14 +189,34 @@ struct _openslide_tifflike;
  * Suggested data to hash:
  * easily available image metadata + raw compressed lowest resolution image
  */
+
+// what detect_format() learns from the first bytes of a file, before
+// calling any detect function
+enum _openslide_container {
+  _OPENSLIDE_CONTAINER_ANY,      // no expectations
+  _OPENSLIDE_CONTAINER_TIFF,     // TIFF or BigTIFF header
+  _OPENSLIDE_CONTAINER_SQLITE,   // SQLite 3 database header
+  _OPENSLIDE_CONTAINER_NON_TIFF, // anything without a TIFF header
+};
+
 struct _openslide_format {
   const char *name;
   const char *vendor;
+  // files of other kinds are skipped without calling detect.  detect is
+  // passed a tifflike if and only if this is _OPENSLIDE_CONTAINER_TIFF.
+  enum _openslide_container container;
+  const char *extension;  // optional; required filename suffix
   bool (*detect)(const char *filename, struct _openslide_tifflike *tl,
                  GError **err);
   bool (*open)(openslide_t *osr, const char *filename,
                struct _openslide_tifflike *tl,
                struct _openslide_hash *quickhash1, GError **err);
+
+  // optional: record the state built by open, and rebuild it later
+  // without parsing the slide.  properties are handled by the caller.
+  bool (*save_snapshot)(openslide_t *osr, struct _openslide_snapshot *snap);
+  bool (*open_snapshot)(openslide_t *osr, const char *filename,
+                        struct _openslide_snapshot *snap, GError **err);
 };
 
 extern const struct _openslide_format _openslide_format_aperio;
@@ -150,6 +243,51 @@ bool _openslide_read_key_file(GKeyFile *key_file, const char *filename,
 /* fopen() wrapper which properly sets FD_CLOEXEC */
 FILE *_openslide_fopen(const char *path, const char *mode, GError **err);
 
+/* A file kept open for thread-safe positional reads */
+struct _openslide_file;
+
+struct _openslide_file *_openslide_file_open(const char *path,
+                                             GError **err);
+
+// returns bytes read, which is short only at end of file, or -1 on error
+int64_t _openslide_file_read_at(struct _openslide_file *file,
+                                void *buf, int64_t size,
+                                int64_t offset);
+
+// size when opened
+int64_t _openslide_file_get_size(struct _openslide_file *file);
+
+// returns a pointer into the file's memory mapping, or NULL if the file
+// isn't mapped or the range extends past the size seen at open time.
+// valid until the file is closed.
+const void *_openslide_file_get_mapped(struct _openslide_file *file,
+                                       int64_t size, int64_t offset);
+
+// whether files opened afterward are memory-mapped; defaults to the
+// OPENSLIDE_MMAP environment variable
+void _openslide_file_set_mmap_enabled(bool enabled);
+
+// fail if the path now refers to a different file
+bool _openslide_file_check_unchanged(struct _openslide_file *file,
+                                     GError **err);
+
+void _openslide_file_close(struct _openslide_file *file);
+
+// borrow a read-only stdio handle for path from the pool of idle handles,
+// or open a new one.  the handle is positioned at the start of the file.
+FILE *_openslide_pool_fopen(const char *path, GError **err);
+
+// return a handle from _openslide_pool_fopen() to the idle pool, which
+// may close it.  the pool size defaults to 32 and can be set with the
+// OPENSLIDE_FILE_POOL_SIZE environment variable; 0 disables pooling.
+void _openslide_pool_fclose(const char *path, FILE *f);
+
+// close any idle handles for path
+void _openslide_pool_evict(const char *path);
+
+// absolute path with symlinks resolved, or NULL if filename doesn't exist
+char *_openslide_canonicalize_path(const char *filename);
+
 /* Parse string to double, returning NAN on failure.  Accept both comma
    and period as decimal separator. */
 double _openslide_parse_double(const char *value);
@@ -173,6 +311,12 @@ bool _openslide_clip_tile(uint32_t *tiledata,
                           int64_t clip_w, int64_t clip_h,
                           GError **err);
 
+// track whether a surface has been painted since it was cleared
+void _openslide_set_surface_pristine(cairo_surface_t *surface,
+                                     bool pristine);
+
+bool _openslide_is_surface_pristine(cairo_surface_t *surface);
+
 
 // Grid helpers
 struct _openslide_grid;
@@ -184,6 +328,15 @@ typedef bool (*_openslide_tileread_fn)(openslide_t *osr,
                                        void *arg,
                                        GError **err);
 
+// returns the decoded tile, tile_w * tile_h premultiplied ARGB pixels,
+// owned by *cache_entry, which the caller must unref
+typedef uint32_t *(*_openslide_tilefetch_fn)(openslide_t *osr,
+                                             struct _openslide_level *level,
+                                             int64_t tile_col, int64_t tile_row,
+                                             void *arg,
+                                             struct _openslide_cache_entry **cache_entry,
+                                             GError **err);
+
 typedef bool (*_openslide_tilemap_fn)(openslide_t *osr,
                                       cairo_t *cr,
                                       struct _openslide_level *level,
@@ -198,6 +351,27 @@ typedef void (*_openslide_tilemap_foreach_fn)(struct _openslide_grid *grid,
                                               void *tile,
                                               void *arg);
 
+typedef bool (*_openslide_tileempty_fn)(openslide_t *osr,
+                                        struct _openslide_level *level,
+                                        int64_t tile_col, int64_t tile_row,
+                                        void *arg,
+                                        bool *is_empty,
+                                        GError **err);
+
+// which cells of a grid may hold image data.  cells are one tile
+// advance in size and start at the origin of the level.
+struct _openslide_occupancy {
+  double cell_w;
+  double cell_h;
+  int64_t cols;
+  int64_t rows;
+  uint8_t *bits;  // row-major, set if the cell is occupied
+};
+
+// false for cells outside the map
+bool _openslide_occupancy_test(const struct _openslide_occupancy *occ,
+                               int64_t col, int64_t row);
+
 struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
                                                       int64_t tiles_across,
                                                       int64_t tiles_down,
@@ -205,6 +379,15 @@ struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
                                                       int32_t tile_h,
                                                       _openslide_tileread_fn read_tile);
 
+// optional; lets the grid copy tile data without going through cairo
+void _openslide_grid_simple_set_fetch_tile(struct _openslide_grid *grid,
+                                           _openslide_tilefetch_fn fetch_tile);
+
+// optional; tiles reported empty are left transparent without being
+// read.  without it, every tile of a simple grid is occupied.
+void _openslide_grid_simple_set_tile_empty(struct _openslide_grid *grid,
+                                           _openslide_tileempty_fn tile_empty);
+
 struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
                                                        double tile_advance_x,
                                                        double tile_advance_y,
@@ -220,6 +403,12 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *grid,
 void *_openslide_grid_tilemap_get_tile(struct _openslide_grid *_grid,
                                        int64_t col, int64_t row);
 
+// false if there is no such tile
+bool _openslide_grid_tilemap_get_tile_offset(struct _openslide_grid *grid,
+                                             int64_t col, int64_t row,
+                                             double *offset_x,
+                                             double *offset_y);
+
 void _openslide_grid_tilemap_foreach(struct _openslide_grid *grid,
                                      _openslide_tilemap_foreach_fn func,
                                      void *arg);
@@ -228,6 +417,13 @@ void _openslide_grid_get_bounds(struct _openslide_grid *grid,
                                 double *x, double *y,
                                 double *w, double *h);
 
+// built on first call and owned by the grid.  tilemap cells are occupied
+// if any tile overlaps them, so tiles must all be added first.
+const struct _openslide_occupancy *_openslide_grid_get_occupancy(struct _openslide_grid *grid,
+                                                                 void *arg,
+                                                                 struct _openslide_level *level,
+                                                                 GError **err);
+
 bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   cairo_t *cr,
                                   void *arg,
@@ -236,12 +432,36 @@ bool _openslide_grid_paint_region(struct _openslide_grid *grid,
                                   int32_t w, int32_t h,
                                   GError **err);
 
+// get the decoded data of a single tile, if the grid supports it.
+// otherwise fails with OPENSLIDE_ERROR_NO_VALUE.
+uint32_t *_openslide_grid_get_tile(struct _openslide_grid *grid,
+                                   void *arg,
+                                   struct _openslide_level *level,
+                                   int64_t tile_col, int64_t tile_row,
+                                   int32_t *w, int32_t *h,
+                                   struct _openslide_cache_entry **cache_entry,
+                                   GError **err);
+
 void _openslide_grid_draw_tile_info(cairo_t *cr, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
 
+// paint the w x h rectangle at (src_x, src_y) of a cached image at the
+// origin, without copying it to an intermediate surface; fails on cairo
+// errors
+bool _openslide_grid_paint_subimage(cairo_t *cr,
+                                    const uint32_t *data,
+                                    cairo_format_t format,
+                                    int32_t image_w, int32_t image_h,
+                                    double src_x, double src_y,
+                                    double w, double h,
+                                    GError **err);
+
 void _openslide_grid_destroy(struct _openslide_grid *grid);
 
 
-/* Bounds properties helper */
+/* Bounds properties helpers */
+void _openslide_set_bounds_props(openslide_t *osr,
+                                 double x, double y, double w, double h);
+
 void _openslide_set_bounds_props_from_grid(openslide_t *osr,
                                            struct _openslide_grid *grid);
 
@@ -251,35 +471,194 @@ void _openslide_set_bounds_props_from_grid(openslide_t *osr,
 
 struct _openslide_cache_entry;
 
-// constructor/destructor
-struct _openslide_cache *_openslide_cache_create(int capacity_in_bytes);
+// constructor; returns with one reference
+struct _openslide_cache *_openslide_cache_create(int64_t capacity_in_bytes,
+                                                 openslide_cache_policy_t policy);
 
-void _openslide_cache_destroy(struct _openslide_cache *cache);
+// frees the cache when the last reference is dropped
+void _openslide_cache_unref(struct _openslide_cache *cache);
 
 // cache size
-int _openslide_cache_get_capacity(struct _openslide_cache *cache);
+int64_t _openslide_cache_get_capacity(struct _openslide_cache *cache);
 
 void _openslide_cache_set_capacity(struct _openslide_cache *cache,
-				   int capacity_in_bytes);
+				   int64_t capacity_in_bytes);
+
+// binding of an openslide_t to a (possibly shared) cache
+// creates a private cache of the specified size
+struct _openslide_cache_binding *_openslide_cache_binding_create(int64_t capacity_in_bytes);
+
+// switch to a different cache; takes a reference to the new cache
+void _openslide_cache_binding_set(struct _openslide_cache_binding *cb,
+                                  struct _openslide_cache *cache);
+
+void _openslide_cache_binding_destroy(struct _openslide_cache_binding *cb);
+
+// returns a reference to the cache currently in use
+struct _openslide_cache *_openslide_cache_binding_get_cache(struct _openslide_cache_binding *cb);
+
+// capacity for new private caches: openslide_set_default_cache_capacity(),
+// or else OPENSLIDE_CACHE_SIZE, or else _OPENSLIDE_USEFUL_CACHE_SIZE
+int64_t _openslide_cache_get_default_capacity(void);
 
 // put and get
-void _openslide_cache_put(struct _openslide_cache *cache,
+void _openslide_cache_put(struct _openslide_cache_binding *cb,
 			  void *plane,  // coordinate plane (level or grid)
 			  int64_t x,
 			  int64_t y,
 			  void *data,
-			  int size_in_bytes,
+			  int64_t size_in_bytes,
 			  struct _openslide_cache_entry **entry);
 
-void *_openslide_cache_get(struct _openslide_cache *cache,
+void *_openslide_cache_get(struct _openslide_cache_binding *cb,
 			   void *plane,
 			   int64_t x,
 			   int64_t y,
 			   struct _openslide_cache_entry **entry);
 
+// compressed tier, for formats that decode tiles from a buffer.  data
+// must come from g_slice_alloc(size_in_bytes).  puts while the tier is
+// disabled just hand the entry to the caller.
+bool _openslide_cache_compressed_enabled(struct _openslide_cache_binding *cb);
+
+void _openslide_cache_put_compressed(struct _openslide_cache_binding *cb,
+                                     void *plane,
+                                     int64_t x,
+                                     int64_t y,
+                                     void *data,
+                                     int64_t size_in_bytes,
+                                     struct _openslide_cache_entry **entry);
+
+const void *_openslide_cache_get_compressed(struct _openslide_cache_binding *cb,
+                                            void *plane,
+                                            int64_t x,
+                                            int64_t y,
+                                            int64_t *size_in_bytes,
+                                            struct _openslide_cache_entry **entry);
+
 // value unref
 void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry);
 
+/* Cache-owned buffers */
+// decoded tiles handed to the cache should come from here; the cache
+// frees all data with _openslide_buffer_free().  large buffers are
+// recycled through a per-size pool, so only use this for sizes that
+// recur.  data of variable length, such as compressed tiles, should come
+// from g_slice_alloc(), which _openslide_buffer_free() also accepts.
+void *_openslide_buffer_alloc(size_t size);
+void _openslide_buffer_free(size_t size, void *buf);
+
+// while set, puts from the calling thread hand the entry to the caller
+// without caching it.  returns the previous setting.
+bool _openslide_cache_set_thread_bypass(bool bypass);
+
+
+/* Asynchronous reads */
+struct _openslide_async_reads *_openslide_async_reads_create(void);
+void _openslide_async_reads_destroy(struct _openslide_async_reads *ar);
+
+/* Worker threads */
+struct _openslide_taskgroup;
+
+typedef void (*_openslide_task_fn)(void *data);
+
+// number of threads in the worker pool, or 0 if tasks run in the caller
+int _openslide_get_worker_count(void);
+
+// whether the calling thread is running a task, so other workers are
+// likely busy too
+bool _openslide_in_task(void);
+
+struct _openslide_taskgroup *_openslide_taskgroup_create(void);
+
+// queue a task; it may run in any thread
+void _openslide_taskgroup_push(struct _openslide_taskgroup *tg,
+                               _openslide_task_fn fn,
+                               void *data);
+
+// run queued tasks in the calling thread, wait for the rest, and free
+// the group
+void _openslide_taskgroup_finish(struct _openslide_taskgroup *tg);
+
+// run fn(data) on a worker without waiting for it.  runs it in the
+// caller if there are no workers.
+void _openslide_run_detached(_openslide_task_fn fn, void *data);
+
+// run fn(data) on a low-priority background thread, after earlier
+// background work.  runs it in the caller if there are no background
+// threads.
+void _openslide_run_in_background(_openslide_task_fn fn, void *data);
+
+// a buffer of at least size bytes owned by the calling thread, valid
+// until its next call.  freed when the thread exits.
+void *_openslide_get_scratch(size_t size);
+
+
+/* Synthetic levels */
+// whether slides opened afterward get synthetic levels; defaults to the
+// OPENSLIDE_SYNTHETIC_LEVELS environment variable
+void _openslide_synthetic_set_enabled(bool enabled);
+
+// backends that can decode their smallest level at reduced size should
+// only add those levels if this is set, since they change the level count
+bool _openslide_synthetic_get_enabled(void);
+
+// append power-of-two levels below the smallest native level, if
+// enabled.  backends must not see them, so they are removed again before
+// the backend is destroyed.
+void _openslide_synthetic_add_levels(openslide_t *osr);
+void _openslide_synthetic_remove_levels(openslide_t *osr);
+
+// counterparts of the backend ops for synthetic levels
+bool _openslide_synthetic_paint_region(openslide_t *osr, cairo_t *cr,
+                                       int64_t x, int64_t y,
+                                       struct _openslide_level *level,
+                                       int32_t w, int32_t h,
+                                       GError **err);
+uint32_t *_openslide_synthetic_get_tile(openslide_t *osr,
+                                        struct _openslide_level *level,
+                                        int64_t tile_col, int64_t tile_row,
+                                        int32_t *w, int32_t *h,
+                                        struct _openslide_cache_entry **cache_entry,
+                                        GError **err);
+const struct _openslide_occupancy *_openslide_synthetic_get_occupancy(openslide_t *osr,
+                                                                      struct _openslide_level *level,
+                                                                      GError **err);
+
+
+/* Pixel conversion */
+// convert TIFFRGBAImage ABGR pixels to ARGB in place
+void _openslide_abgr_to_argb(uint32_t *pixels, size_t count);
+
+// convert rows of 8-bit component samples to ARGB
+void _openslide_ycbcr_to_argb(uint32_t *dest,
+                              const int32_t *y, const int32_t *cb,
+                              const int32_t *cr, int32_t count);
+void _openslide_rgb_to_argb(uint32_t *dest,
+                            const int32_t *r, const int32_t *g,
+                            const int32_t *b, int32_t count);
+
+// interleave 8-bit R, G, and B planes into opaque ARGB
+void _openslide_planes_to_argb(uint32_t *dest,
+                               const uint8_t *r, const uint8_t *g,
+                               const uint8_t *b, int32_t count);
+
+// convert premultiplied ARGB to the public output formats.  rgba
+// needs a 4-byte-aligned dest, and may convert in place.
+void _openslide_argb_to_rgba(uint8_t *dest, const uint32_t *src,
+                             size_t count);
+void _openslide_argb_to_rgb24(uint8_t *dest, const uint32_t *src,
+                              size_t count);
+void _openslide_argb_to_bgr24(uint8_t *dest, const uint32_t *src,
+                              size_t count);
+void _openslide_argb_to_gray8(uint8_t *dest, const uint32_t *src,
+                              size_t count);
+
+// add the 4 channels of each ARGB pixel, in memory order, to
+// acc[4 * i] through acc[4 * i + 3]
+void _openslide_accumulate_argb(uint32_t *acc, const uint32_t *src,
+                                size_t count);
+
 
 /* Internal error propagation */
 enum OpenSlideError {
@@ -297,11 +676,42 @@ void _openslide_io_error(GError **err, const char *fmt, ...) G_GNUC_PRINTF(2, 3)
 
 bool _openslide_check_cairo_status(cairo_t *cr, GError **err);
 
+/* Performance counters */
+// the current time for _openslide_perf_end(), or -1 if counters are off
+int64_t _openslide_perf_start(void);
+
+// add the time since start, and bytes, to the calling thread's counter
+// for stage
+void _openslide_perf_end(openslide_perf_stage_t stage, int64_t start,
+                         int64_t bytes);
+
+// log the counters, if enabled
+void _openslide_perf_log(void);
+
+/* Tracing */
+// whether a trace callback is registered
+bool _openslide_trace_enabled(void);
+
+// bracket a backend's read of one tile
+void _openslide_trace_tile_begin(openslide_t *osr,
+                                 struct _openslide_level *level,
+                                 int64_t tile_col, int64_t tile_row);
+void _openslide_trace_tile_end(bool success);
+
+// report to the tile being traced on this thread, if any
+void _openslide_trace_cache_get(bool hit, int64_t bytes);
+void _openslide_trace_cache_put(int64_t bytes);
+void _openslide_trace_stage(openslide_perf_stage_t stage,
+                            int64_t nsec, int64_t bytes);
+
 /* Debug flags */
 enum _openslide_debug_flag {
   OPENSLIDE_DEBUG_DETECTION,
   OPENSLIDE_DEBUG_JPEG_MARKERS,
   OPENSLIDE_DEBUG_TILES,
+  OPENSLIDE_DEBUG_NO_SIMD,
+  OPENSLIDE_DEBUG_HANDLES,
+  OPENSLIDE_DEBUG_PERFORMANCE,
 };
 
 void _openslide_debug_init(void);
@@ -316,25 +726,6 @@ bool _openslide_debug(enum _openslide_debug_flag flag);
 #define _OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_TILE_WIDTH "openslide.level[%d].tile-width"
 #define _OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_TILE_HEIGHT "openslide.level[%d].tile-height"
 
-/* Tables */
-// YCbCr -> RGB chroma contributions
-extern const int16_t _openslide_R_Cr[256];
-extern const int16_t _openslide_G_CbCr[256][256];
-extern const int16_t _openslide_B_Cb[256];
-
-// deprecated prefetch stuff (maybe we'll undeprecate it someday),
-// still needs these declarations for ABI compat
-// TODO: remove if soname bump
-#undef openslide_give_prefetch_hint
-OPENSLIDE_PUBLIC()
-int openslide_give_prefetch_hint(openslide_t *osr,
-				 int64_t x, int64_t y,
-				 int32_t level,
-				 int64_t w, int64_t h);
-#undef openslide_cancel_prefetch_hint
-OPENSLIDE_PUBLIC()
-void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id);
-
 /* Prevent use of dangerous functions and functions with mandatory wrappers.
    Every @p replacement must be unique to avoid conflicting-type errors. */
 #define _OPENSLIDE_POISON(replacement) error__use_ ## replacement ## _instead
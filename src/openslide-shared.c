@@ -0,0 +1,338 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Shared handles.
+ *
+ * Entries are keyed by canonical path, and remember the device, inode,
+ * size, and mtime of the file they opened.  A lookup that finds a
+ * different file at the same path, or a handle in error state, detaches
+ * the old entry; it stays alive until its last reference is released,
+ * and is then closed at once.
+ *
+ * The first caller for a path opens the slide without holding the lock;
+ * later callers find the entry in the opening state and wait for it.
+ * Released handles with no references are closed by a reaper thread once
+ * they have been idle for the timeout.  The thread exits when nothing is
+ * idle.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define DEFAULT_IDLE_TIMEOUT_MS 30000
+
+struct shared_entry {
+  char *path;
+
+  // identity of the file when it was opened
+  int64_t dev;
+  int64_t ino;
+  int64_t size;
+  int64_t mtime;
+
+  openslide_t *osr;
+  bool opening;
+  bool detached;
+  int refcount;
+  GTimeVal idle_since;
+};
+
+// everything below is protected by shared_lock
+static GStaticMutex shared_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *entries_by_path;
+static GHashTable *entries_by_osr;
+static GCond *opened_cond;
+static GCond *reaper_cond;
+static bool reaper_running;
+static int64_t idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+
+static void init_registry_unlocked(void) {
+  if (entries_by_path == NULL) {
+    entries_by_path = g_hash_table_new(g_str_hash, g_str_equal);
+    entries_by_osr = g_hash_table_new(g_direct_hash, g_direct_equal);
+    opened_cond = g_cond_new();
+    reaper_cond = g_cond_new();
+  }
+}
+
+static bool stat_identity(const char *path, struct shared_entry *entry) {
+  struct stat st;
+  if (g_stat(path, &st)) {
+    return false;
+  }
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtime;
+  return true;
+}
+
+static bool same_identity(const struct shared_entry *a,
+                          const struct shared_entry *b) {
+  return a->dev == b->dev && a->ino == b->ino &&
+         a->size == b->size && a->mtime == b->mtime;
+}
+
+static void detach_entry_unlocked(struct shared_entry *entry) {
+  if (!entry->detached) {
+    g_hash_table_remove(entries_by_path, entry->path);
+    entry->detached = true;
+  }
+}
+
+// remove the entry from the registry and return its handle for closing
+// outside the lock
+static openslide_t *remove_entry_unlocked(struct shared_entry *entry) {
+  openslide_t *osr = entry->osr;
+  detach_entry_unlocked(entry);
+  if (osr) {
+    g_hash_table_remove(entries_by_osr, osr);
+  }
+  g_free(entry->path);
+  g_slice_free(struct shared_entry, entry);
+  return osr;
+}
+
+static int64_t idle_ms(const struct shared_entry *entry, const GTimeVal *now) {
+  return (now->tv_sec - entry->idle_since.tv_sec) * 1000 +
+         (now->tv_usec - entry->idle_since.tv_usec) / 1000;
+}
+
+struct reap_data {
+  GTimeVal now;
+  GList *expired;
+  int64_t next_ms;  // until the next entry expires, or -1 if none is idle
+};
+
+static void find_expired(gpointer key G_GNUC_UNUSED, gpointer value,
+                         gpointer user_data) {
+  struct shared_entry *entry = value;
+  struct reap_data *data = user_data;
+  if (entry->opening || entry->refcount) {
+    return;
+  }
+  int64_t remaining = idle_timeout_ms - idle_ms(entry, &data->now);
+  if (remaining <= 0) {
+    data->expired = g_list_prepend(data->expired, entry);
+  } else if (data->next_ms == -1 || remaining < data->next_ms) {
+    data->next_ms = remaining;
+  }
+}
+
+static gpointer reaper_thread_func(gpointer arg G_GNUC_UNUSED) {
+  g_static_mutex_lock(&shared_lock);
+  while (true) {
+    struct reap_data data = {
+      .expired = NULL,
+      .next_ms = -1,
+    };
+    g_get_current_time(&data.now);
+    g_hash_table_foreach(entries_by_path, find_expired, &data);
+
+    if (data.expired) {
+      GList *handles = NULL;
+      for (GList *cur = data.expired; cur; cur = cur->next) {
+        handles = g_list_prepend(handles, remove_entry_unlocked(cur->data));
+      }
+      g_list_free(data.expired);
+
+      // closing can be slow
+      g_static_mutex_unlock(&shared_lock);
+      for (GList *cur = handles; cur; cur = cur->next) {
+        openslide_close(cur->data);
+      }
+      g_list_free(handles);
+      g_static_mutex_lock(&shared_lock);
+      continue;
+    }
+
+    if (data.next_ms == -1) {
+      break;
+    }
+    GTimeVal deadline = data.now;
+    g_time_val_add(&deadline, data.next_ms * 1000);
+    g_cond_timed_wait(reaper_cond, g_static_mutex_get_mutex(&shared_lock),
+                      &deadline);
+  }
+  reaper_running = false;
+  g_static_mutex_unlock(&shared_lock);
+  return NULL;
+}
+
+static void wake_reaper_unlocked(void) {
+  if (reaper_running) {
+    g_cond_signal(reaper_cond);
+    return;
+  }
+  GError *tmp_err = NULL;
+  GThread *thread = g_thread_create(reaper_thread_func, NULL, FALSE,
+                                    &tmp_err);
+  if (thread) {
+    reaper_running = true;
+  } else {
+    // idle handles stay open until they are reused or a later release
+    // manages to start the thread
+    g_warning("Couldn't start shared handle reaper: %s", tmp_err->message);
+    g_clear_error(&tmp_err);
+  }
+}
+
+openslide_t *openslide_open_shared(const char *filename) {
+  char *path = _openslide_canonicalize_path(filename);
+  if (path == NULL) {
+    // nonexistent; openslide_open() would not recognize it either
+    return NULL;
+  }
+  struct shared_entry identity = { .path = NULL };
+  if (!stat_identity(path, &identity)) {
+    g_free(path);
+    return NULL;
+  }
+
+  g_static_mutex_lock(&shared_lock);
+  init_registry_unlocked();
+  struct shared_entry *entry;
+  while ((entry = g_hash_table_lookup(entries_by_path, path)) != NULL) {
+    if (!same_identity(entry, &identity)) {
+      // file was replaced; leave the old handle to its current users
+      detach_entry_unlocked(entry);
+      if (!entry->opening && !entry->refcount) {
+        openslide_t *osr = remove_entry_unlocked(entry);
+        g_static_mutex_unlock(&shared_lock);
+        openslide_close(osr);
+        g_static_mutex_lock(&shared_lock);
+      }
+      continue;
+    }
+    if (entry->opening) {
+      // coalesce with the open in progress
+      entry->refcount++;
+      while (entry->opening) {
+        g_cond_wait(opened_cond, g_static_mutex_get_mutex(&shared_lock));
+      }
+      openslide_t *osr = entry->osr;
+      if (osr == NULL) {
+        // not a slide; the opener has dropped the entry
+        if (--entry->refcount == 0) {
+          remove_entry_unlocked(entry);
+        }
+      }
+      g_static_mutex_unlock(&shared_lock);
+      g_free(path);
+      return osr;
+    }
+    if (openslide_get_error(entry->osr)) {
+      // errors are sticky; don't hand out a broken handle again
+      detach_entry_unlocked(entry);
+      if (!entry->refcount) {
+        openslide_t *osr = remove_entry_unlocked(entry);
+        g_static_mutex_unlock(&shared_lock);
+        openslide_close(osr);
+        g_static_mutex_lock(&shared_lock);
+      }
+      continue;
+    }
+    entry->refcount++;
+    openslide_t *osr = entry->osr;
+    g_static_mutex_unlock(&shared_lock);
+    g_free(path);
+    return osr;
+  }
+
+  // we are the first; open without holding the lock
+  entry = g_slice_new(struct shared_entry);
+  *entry = identity;
+  entry->path = path;
+  entry->opening = true;
+  entry->refcount = 1;
+  g_hash_table_insert(entries_by_path, entry->path, entry);
+  g_static_mutex_unlock(&shared_lock);
+
+  openslide_t *osr = openslide_open(path);
+
+  g_static_mutex_lock(&shared_lock);
+  entry->opening = false;
+  entry->osr = osr;
+  if (osr) {
+    g_hash_table_insert(entries_by_osr, osr, entry);
+    if (openslide_get_error(osr)) {
+      // waiters get the same result, but later opens retry
+      detach_entry_unlocked(entry);
+    }
+  } else {
+    detach_entry_unlocked(entry);
+    if (--entry->refcount == 0) {
+      remove_entry_unlocked(entry);
+    }
+  }
+  g_cond_broadcast(opened_cond);
+  g_static_mutex_unlock(&shared_lock);
+  return osr;
+}
+
+void openslide_release_shared(openslide_t *osr) {
+  if (osr == NULL) {
+    return;
+  }
+
+  g_static_mutex_lock(&shared_lock);
+  init_registry_unlocked();
+  struct shared_entry *entry = g_hash_table_lookup(entries_by_osr, osr);
+  if (entry == NULL) {
+    g_static_mutex_unlock(&shared_lock);
+    g_warning("Releasing OpenSlide object not opened with "
+              "openslide_open_shared()");
+    return;
+  }
+  g_assert(entry->refcount > 0);
+  if (--entry->refcount) {
+    g_static_mutex_unlock(&shared_lock);
+    return;
+  }
+
+  if (entry->detached || idle_timeout_ms == 0) {
+    remove_entry_unlocked(entry);
+    g_static_mutex_unlock(&shared_lock);
+    openslide_close(osr);
+    return;
+  }
+  g_get_current_time(&entry->idle_since);
+  wake_reaper_unlocked();
+  g_static_mutex_unlock(&shared_lock);
+}
+
+void openslide_set_shared_idle_timeout(int64_t timeout_ms) {
+  g_static_mutex_lock(&shared_lock);
+  init_registry_unlocked();
+  idle_timeout_ms = MAX(timeout_ms, 0);
+  // reap now-expired handles, or recompute the wait
+  if (reaper_running || g_hash_table_size(entries_by_path)) {
+    wake_reaper_unlocked();
+  }
+  g_static_mutex_unlock(&shared_lock);
+}
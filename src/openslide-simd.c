@@ -0,0 +1,631 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Pixel format conversion kernels.
+ *
+ * Each operation has a portable scalar implementation and, where the
+ * target supports it, vector implementations.  SSE2 and NEON are used
+ * whenever the compiler targets them; AVX2 is selected at runtime if the
+ * compiler can build it and the CPU supports it.  The "no-simd" debug
+ * flag forces the scalar code.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_X86_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+typedef void (*convert_fn)(uint32_t *pixels, size_t count);
+typedef void (*planar_fn)(uint32_t *dest,
+                          const int32_t *c0, const int32_t *c1,
+                          const int32_t *c2, int32_t count);
+
+typedef void (*planar8_fn)(uint32_t *dest,
+                           const uint8_t *c0, const uint8_t *c1,
+                           const uint8_t *c2, int32_t count);
+
+typedef void (*unpack_fn)(uint8_t *dest, const uint32_t *src, size_t count);
+typedef void (*accumulate_fn)(uint32_t *acc, const uint32_t *src,
+                              size_t count);
+
+static convert_fn abgr_to_argb_impl;
+static planar_fn ycbcr_to_argb_impl;
+static planar_fn rgb_to_argb_impl;
+static planar8_fn planes_to_argb_impl;
+static unpack_fn argb_to_rgb24_impl;
+static unpack_fn argb_to_bgr24_impl;
+static unpack_fn argb_to_gray8_impl;
+static accumulate_fn accumulate_argb_impl;
+
+// straight component for each alpha and premultiplied component
+static uint8_t unpremultiply[256][256];
+
+// YCbCr -> RGB in 2.14 fixed point.  The SIMD kernels compute exactly
+// the same values, so output doesn't depend on the CPU.
+#define YCC_SHIFT 14
+#define YCC_HALF (1 << (YCC_SHIFT - 1))
+#define YCC_R_CR 22970   // 1.402
+#define YCC_G_CB 5638    // 0.34414
+#define YCC_G_CR 11700   // 0.71414
+#define YCC_B_CB 29032   // 1.772
+
+// BT.601 luma in 8.8 fixed point, summing to 256 so white stays 255
+#define LUMA_R 77
+#define LUMA_G 150
+#define LUMA_B 29
+
+// 0xAABBGGRR -> 0xAARRGGBB
+static void abgr_to_argb_scalar(uint32_t *p, size_t count) {
+  for (uint32_t *end = p + count; p < end; p++) {
+    uint32_t val = GUINT32_SWAP_LE_BE(*p);
+    *p = (val << 24) | (val >> 8);
+  }
+}
+
+static void ycbcr_to_argb_scalar(uint32_t *dest,
+                                 const int32_t *y, const int32_t *cb,
+                                 const int32_t *cr, int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    int32_t Y = CLAMP(y[i], 0, 255);
+    int32_t Cb = CLAMP(cb[i], 0, 255) - 128;
+    int32_t Cr = CLAMP(cr[i], 0, 255) - 128;
+
+    int32_t R = Y + ((YCC_R_CR * Cr + YCC_HALF) >> YCC_SHIFT);
+    int32_t G = Y + ((-YCC_G_CB * Cb - YCC_G_CR * Cr + YCC_HALF) >>
+                     YCC_SHIFT);
+    int32_t B = Y + ((YCC_B_CB * Cb + YCC_HALF) >> YCC_SHIFT);
+
+    R = CLAMP(R, 0, 255);
+    G = CLAMP(G, 0, 255);
+    B = CLAMP(B, 0, 255);
+
+    dest[i] = 0xff000000 | R << 16 | G << 8 | B;
+  }
+}
+
+static void rgb_to_argb_scalar(uint32_t *dest,
+                               const int32_t *r, const int32_t *g,
+                               const int32_t *b, int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    dest[i] = 0xff000000 |
+              CLAMP(r[i], 0, 255) << 16 |
+              CLAMP(g[i], 0, 255) << 8 |
+              CLAMP(b[i], 0, 255);
+  }
+}
+
+static void planes_to_argb_scalar(uint32_t *dest,
+                                  const uint8_t *r, const uint8_t *g,
+                                  const uint8_t *b, int32_t count) {
+  for (int32_t i = 0; i < count; i++) {
+    dest[i] = 0xff000000 | r[i] << 16 | g[i] << 8 | b[i];
+  }
+}
+
+static void argb_to_rgb24_scalar(uint8_t *dest, const uint32_t *src,
+                                 size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t p = src[i];
+    dest[3 * i] = p >> 16;
+    dest[3 * i + 1] = p >> 8;
+    dest[3 * i + 2] = p;
+  }
+}
+
+static void argb_to_bgr24_scalar(uint8_t *dest, const uint32_t *src,
+                                 size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t p = src[i];
+    dest[3 * i] = p;
+    dest[3 * i + 1] = p >> 8;
+    dest[3 * i + 2] = p >> 16;
+  }
+}
+
+static void argb_to_gray8_scalar(uint8_t *dest, const uint32_t *src,
+                                 size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t p = src[i];
+    dest[i] = (LUMA_R * ((p >> 16) & 0xff) +
+               LUMA_G * ((p >> 8) & 0xff) +
+               LUMA_B * (p & 0xff) + 128) >> 8;
+  }
+}
+
+// add each pixel's channels, in memory order, to 4 counters per pixel
+static void accumulate_argb_scalar(uint32_t *acc, const uint32_t *src,
+                                   size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t *p = (const uint8_t *) (src + i);
+    acc[4 * i] += p[0];
+    acc[4 * i + 1] += p[1];
+    acc[4 * i + 2] += p[2];
+    acc[4 * i + 3] += p[3];
+  }
+}
+
+static inline uint32_t unpremultiply_pixel(uint32_t p) {
+  uint8_t a = p >> 24;
+  uint32_t r = unpremultiply[a][(p >> 16) & 0xff];
+  uint32_t g = unpremultiply[a][(p >> 8) & 0xff];
+  uint32_t b = unpremultiply[a][p & 0xff];
+  return GUINT32_TO_LE(r | (g << 8) | (b << 16) | ((uint32_t) a << 24));
+}
+
+// opaque pixels only need R and B swapped, which the compiler can
+// vectorize, so only blocks containing translucency use the table
+static void argb_to_rgba(uint8_t *dest, const uint32_t *src, size_t count) {
+  uint32_t *out = (uint32_t *) dest;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint32_t alpha = 0xff000000;
+    for (int j = 0; j < 8; j++) {
+      alpha &= src[i + j];
+    }
+    if (alpha == 0xff000000) {
+      for (int j = 0; j < 8; j++) {
+        uint32_t p = src[i + j];
+        out[i + j] = GUINT32_TO_LE((p & 0xff00ff00) |
+                                   ((p >> 16) & 0xff) |
+                                   ((p & 0xff) << 16));
+      }
+    } else {
+      for (int j = 0; j < 8; j++) {
+        out[i + j] = unpremultiply_pixel(src[i + j]);
+      }
+    }
+  }
+  for (; i < count; i++) {
+    out[i] = unpremultiply_pixel(src[i]);
+  }
+}
+
+#if defined(__SSE2__)
+// load 8 components, clamped to 0-255, as 16-bit values
+static inline __m128i load_components_sse2(const int32_t *p) {
+  __m128i a = _mm_loadu_si128((const __m128i *) p);
+  __m128i b = _mm_loadu_si128((const __m128i *) (p + 4));
+  __m128i v = _mm_packs_epi32(a, b);
+  v = _mm_packus_epi16(v, v);
+  return _mm_unpacklo_epi8(v, _mm_setzero_si128());
+}
+
+// pairs of 16-bit values times pairs of coefficients, rounded and shifted
+static inline __m128i madd_shift_sse2(__m128i lo, __m128i hi,
+                                      __m128i coef, __m128i round) {
+  __m128i rlo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, coef),
+                                             round), YCC_SHIFT);
+  __m128i rhi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, coef),
+                                             round), YCC_SHIFT);
+  return _mm_packs_epi32(rlo, rhi);
+}
+
+// interleave 8-bit planes into 4 ARGB pixels each
+static inline void store_argb_sse2(uint32_t *dest,
+                                   __m128i r, __m128i g, __m128i b) {
+  __m128i r8 = _mm_packus_epi16(r, r);
+  __m128i g8 = _mm_packus_epi16(g, g);
+  __m128i b8 = _mm_packus_epi16(b, b);
+  __m128i bg = _mm_unpacklo_epi8(b8, g8);
+  __m128i ra = _mm_unpacklo_epi8(r8, _mm_set1_epi8((char) 0xff));
+  _mm_storeu_si128((__m128i *) dest, _mm_unpacklo_epi16(bg, ra));
+  _mm_storeu_si128((__m128i *) (dest + 4), _mm_unpackhi_epi16(bg, ra));
+}
+
+static void ycbcr_to_argb_sse2(uint32_t *dest,
+                               const int32_t *y, const int32_t *cb,
+                               const int32_t *cr, int32_t count) {
+  const __m128i offset = _mm_set1_epi16(128);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(YCC_HALF);
+  const __m128i coef_r = _mm_set1_epi32(YCC_R_CR);
+  const __m128i coef_b = _mm_set1_epi32(YCC_B_CB);
+  const __m128i coef_g = _mm_set1_epi32((int) ((uint32_t) -YCC_G_CR << 16 |
+                                               (uint16_t) -YCC_G_CB));
+  int32_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i Y = load_components_sse2(y + i);
+    __m128i Cb = _mm_sub_epi16(load_components_sse2(cb + i), offset);
+    __m128i Cr = _mm_sub_epi16(load_components_sse2(cr + i), offset);
+
+    __m128i R = madd_shift_sse2(_mm_unpacklo_epi16(Cr, zero),
+                                _mm_unpackhi_epi16(Cr, zero),
+                                coef_r, round);
+    __m128i G = madd_shift_sse2(_mm_unpacklo_epi16(Cb, Cr),
+                                _mm_unpackhi_epi16(Cb, Cr),
+                                coef_g, round);
+    __m128i B = madd_shift_sse2(_mm_unpacklo_epi16(Cb, zero),
+                                _mm_unpackhi_epi16(Cb, zero),
+                                coef_b, round);
+
+    store_argb_sse2(dest + i,
+                    _mm_add_epi16(Y, R),
+                    _mm_add_epi16(Y, G),
+                    _mm_add_epi16(Y, B));
+  }
+  ycbcr_to_argb_scalar(dest + i, y + i, cb + i, cr + i, count - i);
+}
+
+static void rgb_to_argb_sse2(uint32_t *dest,
+                             const int32_t *r, const int32_t *g,
+                             const int32_t *b, int32_t count) {
+  int32_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    store_argb_sse2(dest + i,
+                    load_components_sse2(r + i),
+                    load_components_sse2(g + i),
+                    load_components_sse2(b + i));
+  }
+  rgb_to_argb_scalar(dest + i, r + i, g + i, b + i, count - i);
+}
+
+static void planes_to_argb_sse2(uint32_t *dest,
+                                const uint8_t *r, const uint8_t *g,
+                                const uint8_t *b, int32_t count) {
+  const __m128i alpha = _mm_set1_epi8((char) 0xff);
+  int32_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i R = _mm_loadu_si128((const __m128i *) (r + i));
+    __m128i G = _mm_loadu_si128((const __m128i *) (g + i));
+    __m128i B = _mm_loadu_si128((const __m128i *) (b + i));
+    __m128i bg_lo = _mm_unpacklo_epi8(B, G);
+    __m128i bg_hi = _mm_unpackhi_epi8(B, G);
+    __m128i ra_lo = _mm_unpacklo_epi8(R, alpha);
+    __m128i ra_hi = _mm_unpackhi_epi8(R, alpha);
+    _mm_storeu_si128((__m128i *) (dest + i),
+                     _mm_unpacklo_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128((__m128i *) (dest + i + 4),
+                     _mm_unpackhi_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128((__m128i *) (dest + i + 8),
+                     _mm_unpacklo_epi16(bg_hi, ra_hi));
+    _mm_storeu_si128((__m128i *) (dest + i + 12),
+                     _mm_unpackhi_epi16(bg_hi, ra_hi));
+  }
+  planes_to_argb_scalar(dest + i, r + i, g + i, b + i, count - i);
+}
+
+static void abgr_to_argb_sse2(uint32_t *p, size_t count) {
+  const __m128i ag = _mm_set1_epi32((int) 0xFF00FF00);
+  const __m128i low = _mm_set1_epi32(0x000000FF);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((__m128i *) (p + i));
+    __m128i r = _mm_and_si128(v, ag);
+    r = _mm_or_si128(r, _mm_and_si128(_mm_srli_epi32(v, 16), low));
+    r = _mm_or_si128(r, _mm_slli_epi32(_mm_and_si128(v, low), 16));
+    _mm_storeu_si128((__m128i *) (p + i), r);
+  }
+  abgr_to_argb_scalar(p + i, count - i);
+}
+
+// luma of 4 pixels as 32-bit values
+static inline __m128i luma_sse2(__m128i v) {
+  // 16-bit lanes of B, R and of G, A
+  const __m128i coef_br = _mm_set1_epi32(LUMA_R << 16 | LUMA_B);
+  const __m128i coef_ga = _mm_set1_epi32(LUMA_G);
+  __m128i br = _mm_and_si128(v, _mm_set1_epi16(0xff));
+  __m128i ga = _mm_srli_epi16(v, 8);
+  __m128i sum = _mm_add_epi32(_mm_madd_epi16(br, coef_br),
+                              _mm_madd_epi16(ga, coef_ga));
+  return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+}
+
+static void accumulate_argb_sse2(uint32_t *acc, const uint32_t *src,
+                                 size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i *a = (__m128i *) (acc + 4 * i);
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a),
+                                      _mm_unpacklo_epi16(lo, zero)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1),
+                                          _mm_unpackhi_epi16(lo, zero)));
+    _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2),
+                                          _mm_unpacklo_epi16(hi, zero)));
+    _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3),
+                                          _mm_unpackhi_epi16(hi, zero)));
+  }
+  accumulate_argb_scalar(acc + 4 * i, src + i, count - i);
+}
+
+static void argb_to_gray8_sse2(uint8_t *dest, const uint32_t *src,
+                               size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m128i *s = (const __m128i *) (src + i);
+    __m128i lo = _mm_packs_epi32(luma_sse2(_mm_loadu_si128(s)),
+                                 luma_sse2(_mm_loadu_si128(s + 1)));
+    __m128i hi = _mm_packs_epi32(luma_sse2(_mm_loadu_si128(s + 2)),
+                                 luma_sse2(_mm_loadu_si128(s + 3)));
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(lo, hi));
+  }
+  argb_to_gray8_scalar(dest + i, src + i, count - i);
+}
+#endif
+
+#ifdef HAVE_X86_CPU_DISPATCH
+// pack 8 pixels into 24 bytes with a per-lane shuffle.  Each 16-byte
+// store writes 4 bytes past its pixels, so the caller must leave room
+// for them.
+__attribute__((target("avx2")))
+static inline void pack24_avx2(uint8_t *dest, const uint32_t *src,
+                               __m256i shuf) {
+  __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) src),
+                                  shuf);
+  _mm_storeu_si128((__m128i *) dest, _mm256_castsi256_si128(v));
+  _mm_storeu_si128((__m128i *) (dest + 12), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static void argb_to_rgb24_avx2(uint8_t *dest, const uint32_t *src,
+                               size_t count) {
+  const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                        8, 14, 13, 12, -1, -1, -1, -1,
+                                        2, 1, 0, 6, 5, 4, 10, 9,
+                                        8, 14, 13, 12, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 10 <= count; i += 8) {
+    pack24_avx2(dest + 3 * i, src + i, shuf);
+  }
+  argb_to_rgb24_scalar(dest + 3 * i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void argb_to_bgr24_avx2(uint8_t *dest, const uint32_t *src,
+                               size_t count) {
+  const __m256i shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                        10, 12, 13, 14, -1, -1, -1, -1,
+                                        0, 1, 2, 4, 5, 6, 8, 9,
+                                        10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i = 0;
+  for (; i + 10 <= count; i += 8) {
+    pack24_avx2(dest + 3 * i, src + i, shuf);
+  }
+  argb_to_bgr24_scalar(dest + 3 * i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void abgr_to_argb_avx2(uint32_t *p, size_t count) {
+  // swap bytes 0 and 2 of each little-endian pixel
+  const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((__m256i *) (p + i));
+    _mm256_storeu_si256((__m256i *) (p + i), _mm256_shuffle_epi8(v, shuf));
+  }
+  abgr_to_argb_scalar(p + i, count - i);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void abgr_to_argb_neon(uint32_t *p, size_t count) {
+  const uint32x4_t ag = vdupq_n_u32(0xFF00FF00);
+  const uint32x4_t low = vdupq_n_u32(0x000000FF);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint32x4_t v = vld1q_u32(p + i);
+    uint32x4_t r = vandq_u32(v, ag);
+    r = vorrq_u32(r, vandq_u32(vshrq_n_u32(v, 16), low));
+    r = vorrq_u32(r, vshlq_n_u32(vandq_u32(v, low), 16));
+    vst1q_u32(p + i, r);
+  }
+  abgr_to_argb_scalar(p + i, count - i);
+}
+
+static void planes_to_argb_neon(uint32_t *dest,
+                                const uint8_t *r, const uint8_t *g,
+                                const uint8_t *b, int32_t count) {
+  // little-endian ARGB is B, G, R, A in memory
+  int32_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v;
+    v.val[0] = vld1q_u8(b + i);
+    v.val[1] = vld1q_u8(g + i);
+    v.val[2] = vld1q_u8(r + i);
+    v.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8((uint8_t *) (dest + i), v);
+  }
+  planes_to_argb_scalar(dest + i, r + i, g + i, b + i, count - i);
+}
+
+// little-endian ARGB is B, G, R, A in memory
+static void argb_to_rgb24_neon(uint8_t *dest, const uint32_t *src,
+                               size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+    uint8x16x3_t out;
+    out.val[0] = v.val[2];
+    out.val[1] = v.val[1];
+    out.val[2] = v.val[0];
+    vst3q_u8(dest + 3 * i, out);
+  }
+  argb_to_rgb24_scalar(dest + 3 * i, src + i, count - i);
+}
+
+static void argb_to_bgr24_neon(uint8_t *dest, const uint32_t *src,
+                               size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+    uint8x16x3_t out;
+    out.val[0] = v.val[0];
+    out.val[1] = v.val[1];
+    out.val[2] = v.val[2];
+    vst3q_u8(dest + 3 * i, out);
+  }
+  argb_to_bgr24_scalar(dest + 3 * i, src + i, count - i);
+}
+
+static void accumulate_argb_neon(uint32_t *acc, const uint32_t *src,
+                                 size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint16x8_t v = vmovl_u8(vld1_u8((const uint8_t *) (src + i)));
+    uint16x8_t w = vmovl_u8(vld1_u8((const uint8_t *) (src + i + 2)));
+    uint32_t *a = acc + 4 * i;
+    vst1q_u32(a, vaddw_u16(vld1q_u32(a), vget_low_u16(v)));
+    vst1q_u32(a + 4, vaddw_u16(vld1q_u32(a + 4), vget_high_u16(v)));
+    vst1q_u32(a + 8, vaddw_u16(vld1q_u32(a + 8), vget_low_u16(w)));
+    vst1q_u32(a + 12, vaddw_u16(vld1q_u32(a + 12), vget_high_u16(w)));
+  }
+  accumulate_argb_scalar(acc + 4 * i, src + i, count - i);
+}
+
+static void argb_to_gray8_neon(uint8_t *dest, const uint32_t *src,
+                               size_t count) {
+  const uint8x8_t cr = vdup_n_u8(LUMA_R);
+  const uint8x8_t cg = vdup_n_u8(LUMA_G);
+  const uint8x8_t cb = vdup_n_u8(LUMA_B);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t v = vld4_u8((const uint8_t *) (src + i));
+    uint16x8_t sum = vmull_u8(v.val[2], cr);
+    sum = vmlal_u8(sum, v.val[1], cg);
+    sum = vmlal_u8(sum, v.val[0], cb);
+    // rounding shift adds the same 128 as the scalar code
+    vst1_u8(dest + i, vrshrn_n_u16(sum, 8));
+  }
+  argb_to_gray8_scalar(dest + i, src + i, count - i);
+}
+#endif
+
+static void select_kernels(void) {
+  static gsize initialized;
+
+  if (g_once_init_enter(&initialized)) {
+    abgr_to_argb_impl = abgr_to_argb_scalar;
+    ycbcr_to_argb_impl = ycbcr_to_argb_scalar;
+    rgb_to_argb_impl = rgb_to_argb_scalar;
+    planes_to_argb_impl = planes_to_argb_scalar;
+    argb_to_rgb24_impl = argb_to_rgb24_scalar;
+    argb_to_bgr24_impl = argb_to_bgr24_scalar;
+    argb_to_gray8_impl = argb_to_gray8_scalar;
+    accumulate_argb_impl = accumulate_argb_scalar;
+    for (int a = 1; a < 256; a++) {
+      for (int c = 0; c < 256; c++) {
+        unpremultiply[a][c] = MIN((c * 255 + a / 2) / a, 255);
+      }
+    }
+    if (!_openslide_debug(OPENSLIDE_DEBUG_NO_SIMD)) {
+#if defined(__SSE2__)
+      abgr_to_argb_impl = abgr_to_argb_sse2;
+      ycbcr_to_argb_impl = ycbcr_to_argb_sse2;
+      rgb_to_argb_impl = rgb_to_argb_sse2;
+      planes_to_argb_impl = planes_to_argb_sse2;
+      argb_to_gray8_impl = argb_to_gray8_sse2;
+      accumulate_argb_impl = accumulate_argb_sse2;
+#endif
+#ifdef HAVE_X86_CPU_DISPATCH
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        abgr_to_argb_impl = abgr_to_argb_avx2;
+        argb_to_rgb24_impl = argb_to_rgb24_avx2;
+        argb_to_bgr24_impl = argb_to_bgr24_avx2;
+      }
+#endif
+#ifdef HAVE_NEON
+      abgr_to_argb_impl = abgr_to_argb_neon;
+      planes_to_argb_impl = planes_to_argb_neon;
+      argb_to_rgb24_impl = argb_to_rgb24_neon;
+      argb_to_bgr24_impl = argb_to_bgr24_neon;
+      argb_to_gray8_impl = argb_to_gray8_neon;
+      accumulate_argb_impl = accumulate_argb_neon;
+#endif
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+}
+
+void _openslide_abgr_to_argb(uint32_t *pixels, size_t count) {
+  select_kernels();
+  abgr_to_argb_impl(pixels, count);
+}
+
+void _openslide_ycbcr_to_argb(uint32_t *dest,
+                              const int32_t *y, const int32_t *cb,
+                              const int32_t *cr, int32_t count) {
+  select_kernels();
+  ycbcr_to_argb_impl(dest, y, cb, cr, count);
+}
+
+void _openslide_rgb_to_argb(uint32_t *dest,
+                            const int32_t *r, const int32_t *g,
+                            const int32_t *b, int32_t count) {
+  select_kernels();
+  rgb_to_argb_impl(dest, r, g, b, count);
+}
+
+void _openslide_planes_to_argb(uint32_t *dest,
+                               const uint8_t *r, const uint8_t *g,
+                               const uint8_t *b, int32_t count) {
+  select_kernels();
+  planes_to_argb_impl(dest, r, g, b, count);
+}
+
+void _openslide_argb_to_rgba(uint8_t *dest, const uint32_t *src,
+                             size_t count) {
+  select_kernels();
+  argb_to_rgba(dest, src, count);
+}
+
+void _openslide_argb_to_rgb24(uint8_t *dest, const uint32_t *src,
+                              size_t count) {
+  select_kernels();
+  argb_to_rgb24_impl(dest, src, count);
+}
+
+void _openslide_argb_to_bgr24(uint8_t *dest, const uint32_t *src,
+                              size_t count) {
+  select_kernels();
+  argb_to_bgr24_impl(dest, src, count);
+}
+
+void _openslide_argb_to_gray8(uint8_t *dest, const uint32_t *src,
+                              size_t count) {
+  select_kernels();
+  argb_to_gray8_impl(dest, src, count);
+}
+
+void _openslide_accumulate_argb(uint32_t *acc, const uint32_t *src,
+                                size_t count) {
+  select_kernels();
+  accumulate_argb_impl(acc, src, count);
+}
@@ -0,0 +1,331 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+#include "openslide-snapshot.h"
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+// each value is a one-byte kind followed by little-endian data
+#define KIND_INT 'i'
+#define KIND_DOUBLE 'd'
+#define KIND_STRING 's'
+#define KIND_FILE 'f'
+
+static const char SNAPSHOT_MAGIC[] = "OSLDSNAP";
+
+// bump when any format changes what it saves
+#define SNAPSHOT_REVISION 5
+
+struct _openslide_snapshot {
+  GByteArray *buf;
+  guint pos;
+  bool ok;
+};
+
+char *_openslide_get_cache_path(const char *filename, const char *suffix) {
+  const char *dir = g_getenv("OPENSLIDE_INDEX_CACHE_DIR");
+  if (dir == NULL || *dir == 0) {
+    return NULL;
+  }
+  char *digest = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+                                               filename, -1);
+  char *name = g_strconcat(digest, suffix, NULL);
+  char *path = g_build_filename(dir, name, NULL);
+  g_free(name);
+  g_free(digest);
+  return path;
+}
+
+struct _openslide_snapshot *_openslide_snapshot_new(void) {
+  struct _openslide_snapshot *snap = g_slice_new0(struct _openslide_snapshot);
+  snap->buf = g_byte_array_new();
+  snap->ok = true;
+  return snap;
+}
+
+static void put_raw_int(struct _openslide_snapshot *snap, int64_t value) {
+  value = GINT64_TO_LE(value);
+  g_byte_array_append(snap->buf, (const guint8 *) &value, sizeof(value));
+}
+
+static void put_kind(struct _openslide_snapshot *snap, guint8 kind) {
+  g_byte_array_append(snap->buf, &kind, 1);
+}
+
+void _openslide_snapshot_put_int(struct _openslide_snapshot *snap,
+                                 int64_t value) {
+  put_kind(snap, KIND_INT);
+  put_raw_int(snap, value);
+}
+
+void _openslide_snapshot_put_double(struct _openslide_snapshot *snap,
+                                    double value) {
+  int64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  put_kind(snap, KIND_DOUBLE);
+  put_raw_int(snap, bits);
+}
+
+void _openslide_snapshot_put_string(struct _openslide_snapshot *snap,
+                                    const char *str) {
+  put_kind(snap, KIND_STRING);
+  if (str == NULL) {
+    put_raw_int(snap, -1);
+    return;
+  }
+  int64_t len = strlen(str);
+  put_raw_int(snap, len);
+  g_byte_array_append(snap->buf, (const guint8 *) str, len);
+}
+
+// enough to notice a file that was replaced, or rewritten in place
+struct file_stamp {
+  int64_t dev;
+  int64_t ino;
+  int64_t size;
+  int64_t mtime;
+  int64_t mtime_nsec;
+};
+
+static bool stat_file(const char *path, struct file_stamp *stamp) {
+  struct stat st;
+  if (g_stat(path, &st)) {
+    return false;
+  }
+  stamp->dev = st.st_dev;
+  stamp->ino = st.st_ino;
+  stamp->size = st.st_size;
+  stamp->mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  stamp->mtime_nsec = st.st_mtim.tv_nsec;
+#else
+  stamp->mtime_nsec = 0;
+#endif
+  return true;
+}
+
+bool _openslide_snapshot_put_file(struct _openslide_snapshot *snap,
+                                  const char *path) {
+  struct file_stamp stamp;
+  if (!stat_file(path, &stamp)) {
+    snap->ok = false;
+    return false;
+  }
+  put_kind(snap, KIND_FILE);
+  put_raw_int(snap, stamp.dev);
+  put_raw_int(snap, stamp.ino);
+  put_raw_int(snap, stamp.size);
+  put_raw_int(snap, stamp.mtime);
+  put_raw_int(snap, stamp.mtime_nsec);
+  return true;
+}
+
+static bool get_bytes(struct _openslide_snapshot *snap,
+                      void *dest, guint len) {
+  if (!snap->ok || len > snap->buf->len - snap->pos) {
+    snap->ok = false;
+    return false;
+  }
+  memcpy(dest, snap->buf->data + snap->pos, len);
+  snap->pos += len;
+  return true;
+}
+
+static int64_t get_raw_int(struct _openslide_snapshot *snap) {
+  int64_t value;
+  if (!get_bytes(snap, &value, sizeof(value))) {
+    return 0;
+  }
+  return GINT64_FROM_LE(value);
+}
+
+static bool get_kind(struct _openslide_snapshot *snap, guint8 expected) {
+  guint8 kind;
+  if (!get_bytes(snap, &kind, 1) || kind != expected) {
+    snap->ok = false;
+    return false;
+  }
+  return true;
+}
+
+int64_t _openslide_snapshot_get_int(struct _openslide_snapshot *snap) {
+  if (!get_kind(snap, KIND_INT)) {
+    return 0;
+  }
+  return get_raw_int(snap);
+}
+
+double _openslide_snapshot_get_double(struct _openslide_snapshot *snap) {
+  if (!get_kind(snap, KIND_DOUBLE)) {
+    return 0;
+  }
+  int64_t bits = get_raw_int(snap);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+char *_openslide_snapshot_get_string(struct _openslide_snapshot *snap) {
+  if (!get_kind(snap, KIND_STRING)) {
+    return NULL;
+  }
+  int64_t len = get_raw_int(snap);
+  if (len < 0 || len > snap->buf->len - snap->pos) {
+    if (len != -1) {
+      snap->ok = false;
+    }
+    return NULL;
+  }
+  char *str = g_malloc(len + 1);
+  get_bytes(snap, str, len);
+  str[len] = 0;
+  return str;
+}
+
+bool _openslide_snapshot_check_file(struct _openslide_snapshot *snap,
+                                    const char *path) {
+  if (!get_kind(snap, KIND_FILE)) {
+    return false;
+  }
+  struct file_stamp saved;
+  saved.dev = get_raw_int(snap);
+  saved.ino = get_raw_int(snap);
+  saved.size = get_raw_int(snap);
+  saved.mtime = get_raw_int(snap);
+  saved.mtime_nsec = get_raw_int(snap);
+  struct file_stamp cur;
+  if (!snap->ok || !stat_file(path, &cur) ||
+      saved.dev != cur.dev || saved.ino != cur.ino ||
+      saved.size != cur.size || saved.mtime != cur.mtime ||
+      saved.mtime_nsec != cur.mtime_nsec) {
+    snap->ok = false;
+    return false;
+  }
+  return true;
+}
+
+bool _openslide_snapshot_ok(struct _openslide_snapshot *snap) {
+  return snap->ok;
+}
+
+// snapshots are keyed by canonical path, so every spelling of a slide's
+// path shares one snapshot
+static char *get_snapshot_path(const char *filename, char **canonical_OUT) {
+  char *canonical = _openslide_canonicalize_path(filename);
+  if (canonical == NULL) {
+    return NULL;
+  }
+  char *path = _openslide_get_cache_path(canonical, ".snapshot");
+  if (path == NULL) {
+    g_free(canonical);
+    return NULL;
+  }
+  *canonical_OUT = canonical;
+  return path;
+}
+
+struct _openslide_snapshot *_openslide_snapshot_load(const char *filename) {
+  char *canonical;
+  char *path = get_snapshot_path(filename, &canonical);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  char *contents;
+  gsize len;
+  bool loaded = g_file_get_contents(path, &contents, &len, NULL);
+  g_free(path);
+  if (!loaded) {
+    g_free(canonical);
+    return NULL;
+  }
+
+  struct _openslide_snapshot *snap = g_slice_new0(struct _openslide_snapshot);
+  snap->buf = g_byte_array_new();
+  g_byte_array_append(snap->buf, (const guint8 *) contents, len);
+  snap->ok = true;
+  g_free(contents);
+
+  // check header: magic, library version, revision, slide file
+  char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+  get_bytes(snap, magic, sizeof(magic));
+  char *version = _openslide_snapshot_get_string(snap);
+  int64_t revision = _openslide_snapshot_get_int(snap);
+  char *name = _openslide_snapshot_get_string(snap);
+  bool ok = snap->ok &&
+            !memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) &&
+            !g_strcmp0(version, SUFFIXED_VERSION) &&
+            revision == SNAPSHOT_REVISION &&
+            !g_strcmp0(name, canonical) &&
+            _openslide_snapshot_check_file(snap, canonical);
+  g_free(version);
+  g_free(name);
+  g_free(canonical);
+  if (!ok) {
+    _openslide_snapshot_destroy(snap);
+    return NULL;
+  }
+  return snap;
+}
+
+void _openslide_snapshot_save(struct _openslide_snapshot *snap,
+                              const char *filename) {
+  if (!snap->ok) {
+    return;
+  }
+  char *canonical;
+  char *path = get_snapshot_path(filename, &canonical);
+  if (path == NULL) {
+    return;
+  }
+
+  struct _openslide_snapshot *out = _openslide_snapshot_new();
+  g_byte_array_append(out->buf, (const guint8 *) SNAPSHOT_MAGIC,
+                      sizeof(SNAPSHOT_MAGIC) - 1);
+  _openslide_snapshot_put_string(out, SUFFIXED_VERSION);
+  _openslide_snapshot_put_int(out, SNAPSHOT_REVISION);
+  _openslide_snapshot_put_string(out, canonical);
+  if (_openslide_snapshot_put_file(out, canonical)) {
+    g_byte_array_append(out->buf, snap->buf->data, snap->buf->len);
+    // written atomically; failure only costs a full open next time
+    GError *tmp_err = NULL;
+    if (!g_file_set_contents(path, (const char *) out->buf->data,
+                             out->buf->len, &tmp_err)) {
+      g_debug("Couldn't save snapshot: %s", tmp_err->message);
+      g_clear_error(&tmp_err);
+    }
+  }
+  _openslide_snapshot_destroy(out);
+  g_free(canonical);
+  g_free(path);
+}
+
+void _openslide_snapshot_destroy(struct _openslide_snapshot *snap) {
+  g_byte_array_free(snap->buf, true);
+  g_slice_free(struct _openslide_snapshot, snap);
+}
@@ -0,0 +1,81 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OPENSLIDE_OPENSLIDE_SNAPSHOT_H_
+#define OPENSLIDE_OPENSLIDE_SNAPSHOT_H_
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Snapshots of the state built by a format's open function, kept in the
+ * index cache directory so that later opens can skip parsing the slide.
+ * A snapshot is a flat sequence of values, read back in the order they
+ * were written.  Reads past the end or of the wrong kind mark the
+ * snapshot as bad and return zero values; check _openslide_snapshot_ok()
+ * before trusting the results.
+ */
+
+struct _openslide_snapshot;
+
+// path in the index cache directory for data about filename, or NULL if
+// no directory is configured.  filename is hashed as given, so callers
+// should canonicalize it.
+char *_openslide_get_cache_path(const char *filename, const char *suffix);
+
+// constructor, for writing
+struct _openslide_snapshot *_openslide_snapshot_new(void);
+
+// writers
+void _openslide_snapshot_put_int(struct _openslide_snapshot *snap,
+                                 int64_t value);
+void _openslide_snapshot_put_double(struct _openslide_snapshot *snap,
+                                    double value);
+void _openslide_snapshot_put_string(struct _openslide_snapshot *snap,
+                                    const char *str);  // may be NULL
+// record the device, inode, size, and mtime of a file, so later reads can
+// check it's unchanged
+bool _openslide_snapshot_put_file(struct _openslide_snapshot *snap,
+                                  const char *path);
+
+// readers
+int64_t _openslide_snapshot_get_int(struct _openslide_snapshot *snap);
+double _openslide_snapshot_get_double(struct _openslide_snapshot *snap);
+char *_openslide_snapshot_get_string(struct _openslide_snapshot *snap);
+// false (and marks the snapshot bad) if the file has changed
+bool _openslide_snapshot_check_file(struct _openslide_snapshot *snap,
+                                    const char *path);
+
+bool _openslide_snapshot_ok(struct _openslide_snapshot *snap);
+
+// storage, keyed by canonical slide path.  load returns NULL if there is
+// no current snapshot for the file.
+struct _openslide_snapshot *_openslide_snapshot_load(const char *filename);
+void _openslide_snapshot_save(struct _openslide_snapshot *snap,
+                              const char *filename);
+
+// destructor
+void _openslide_snapshot_destroy(struct _openslide_snapshot *snap);
+
+#endif
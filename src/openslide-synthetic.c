@@ -0,0 +1,430 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Synthetic levels.
+ *
+ * Each synthetic level halves the one before it, starting from the
+ * smallest level the backend provides, until the level fits in a single
+ * tile.  A synthetic tile is built by area-averaging the 2x2 block of
+ * tiles under it in the next finer level.  Synthetic parents are fetched
+ * recursively and halved straight into the tile.  Native tiles are copied
+ * from the backend's cache where it can hand them out, and otherwise
+ * painted by the backend; either way the public read path isn't
+ * re-entered.  Tiles are kept in the tile cache under their own level.
+ *
+ * Synthetic levels follow the native ones in osr->levels, so native
+ * level numbers don't change.  Backends never see them: they are added
+ * after the backend has opened the slide, and removed before the backend
+ * is destroyed.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <glib.h>
+
+#define SYNTHETIC_TILE_SIZE 256
+
+struct synthetic_level {
+  struct _openslide_level base;
+  int32_t index;  // in osr->levels
+  int64_t tiles_across;
+  int64_t tiles_down;
+  struct _openslide_grid *grid;
+};
+
+// -1 until initialized from the environment
+static volatile gint synthetic_enabled = -1;
+
+void _openslide_synthetic_set_enabled(bool enabled) {
+  g_atomic_int_set(&synthetic_enabled, enabled);
+}
+
+bool _openslide_synthetic_get_enabled(void) {
+  int enabled = g_atomic_int_get(&synthetic_enabled);
+  if (enabled == -1) {
+    const char *value = g_getenv("OPENSLIDE_SYNTHETIC_LEVELS");
+    enabled = value != NULL && *value && strcmp(value, "0");
+    // don't override a concurrent explicit setting
+    g_atomic_int_compare_and_exchange(&synthetic_enabled, -1, enabled);
+    enabled = g_atomic_int_get(&synthetic_enabled);
+  }
+  return enabled;
+}
+
+static bool is_synthetic(openslide_t *osr, struct _openslide_level *level) {
+  for (int32_t i = osr->level_count - osr->synthetic_level_count;
+       i < osr->level_count; i++) {
+    if (osr->levels[i] == level) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// area-average the valid src_w x src_h part of src into dest, which has
+// a stride of SYNTHETIC_TILE_SIZE
+static void halve(const uint32_t *src, int64_t src_stride,
+                  int64_t src_w, int64_t src_h,
+                  uint32_t *dest) {
+  int64_t perf_start = _openslide_perf_start();
+  int64_t dest_w = (src_w + 1) / 2;
+  int64_t dest_h = (src_h + 1) / 2;
+  for (int64_t y = 0; y < dest_h; y++) {
+    int64_t rows = MIN(2, src_h - 2 * y);
+    for (int64_t x = 0; x < dest_w; x++) {
+      int64_t cols = MIN(2, src_w - 2 * x);
+      uint32_t sum[4] = {0, 0, 0, 0};
+      for (int64_t sy = 0; sy < rows; sy++) {
+        const uint32_t *p = src + (2 * y + sy) * src_stride + 2 * x;
+        for (int64_t sx = 0; sx < cols; sx++) {
+          for (int c = 0; c < 4; c++) {
+            sum[c] += (p[sx] >> (8 * c)) & 0xff;
+          }
+        }
+      }
+      uint32_t n = rows * cols;
+      uint32_t pixel = 0;
+      for (int c = 0; c < 4; c++) {
+        pixel |= ((sum[c] + n / 2) / n) << (8 * c);
+      }
+      dest[y * SYNTHETIC_TILE_SIZE + x] = pixel;
+    }
+  }
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start,
+                      dest_w * dest_h * 4);
+}
+
+static uint32_t *fetch_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            void *arg,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err);
+
+// halve the 2x2 synthetic tiles under a tile straight into its quadrants
+static bool halve_synthetic_parent(openslide_t *osr,
+                                   struct synthetic_level *parent,
+                                   int64_t tile_col, int64_t tile_row,
+                                   uint32_t *dest, GError **err) {
+  const int64_t t = SYNTHETIC_TILE_SIZE;
+  for (int64_t dy = 0; dy < 2; dy++) {
+    for (int64_t dx = 0; dx < 2; dx++) {
+      int64_t col = 2 * tile_col + dx;
+      int64_t row = 2 * tile_row + dy;
+      if (col >= parent->tiles_across || row >= parent->tiles_down) {
+        continue;
+      }
+      struct _openslide_cache_entry *child_entry;
+      uint32_t *child = fetch_tile(osr, &parent->base, col, row, NULL,
+                                   &child_entry, err);
+      if (!child) {
+        return false;
+      }
+      halve(child, t,
+            MIN(t, parent->base.w - col * t),
+            MIN(t, parent->base.h - row * t),
+            dest + dy * (t / 2) * t + dx * (t / 2));
+      _openslide_cache_entry_unref(child_entry);
+    }
+  }
+  return true;
+}
+
+// copy the native tiles under the 2T x 2T rectangle at (x, y) in the
+// parent level into src.  sets *unsupported and returns false if the
+// backend can't hand out tiles of this level.
+static bool copy_native_tiles(openslide_t *osr,
+                              struct _openslide_level *parent,
+                              int64_t x, int64_t y,
+                              uint32_t *src,
+                              bool *unsupported,
+                              GError **err) {
+  const int64_t t2 = 2 * SYNTHETIC_TILE_SIZE;
+  const int64_t tw = parent->tile_w;
+  const int64_t th = parent->tile_h;
+  int64_t col_end = (MIN(x + t2, parent->w) + tw - 1) / tw;
+  int64_t row_end = (MIN(y + t2, parent->h) + th - 1) / th;
+  for (int64_t row = y / th; row < row_end; row++) {
+    for (int64_t col = x / tw; col < col_end; col++) {
+      GError *tmp_err = NULL;
+      struct _openslide_cache_entry *entry;
+      int32_t w, h;
+      uint32_t *tile = osr->ops->get_tile(osr, parent, col, row, &w, &h,
+                                          &entry, &tmp_err);
+      if (tile == NULL) {
+        if (g_error_matches(tmp_err, OPENSLIDE_ERROR,
+                            OPENSLIDE_ERROR_NO_VALUE)) {
+          g_clear_error(&tmp_err);
+          *unsupported = true;
+        } else {
+          g_propagate_error(err, tmp_err);
+        }
+        return false;
+      }
+      if (w != tw || h != th) {
+        // the hints don't describe the grid
+        _openslide_cache_entry_unref(entry);
+        *unsupported = true;
+        return false;
+      }
+
+      int64_t x0 = MAX(col * tw, x);
+      int64_t x1 = MIN((col + 1) * tw, x + t2);
+      int64_t y0 = MAX(row * th, y);
+      int64_t y1 = MIN((row + 1) * th, y + t2);
+      for (int64_t yy = y0; yy < y1; yy++) {
+        memcpy(src + (yy - y) * t2 + (x0 - x),
+               tile + (yy - row * th) * tw + (x0 - col * tw),
+               (x1 - x0) * 4);
+      }
+      _openslide_cache_entry_unref(entry);
+    }
+  }
+  return true;
+}
+
+// have the backend paint the 2T x 2T rectangle at (x, y) in the parent
+// level into src, which is clear
+static bool paint_native(openslide_t *osr,
+                         struct _openslide_level *parent,
+                         int64_t x, int64_t y,
+                         uint32_t *src,
+                         GError **err) {
+  const int64_t t2 = 2 * SYNTHETIC_TILE_SIZE;
+  cairo_surface_t *surface =
+    cairo_image_surface_create_for_data((unsigned char *) src,
+                                        CAIRO_FORMAT_ARGB32,
+                                        t2, t2, t2 * 4);
+  _openslide_set_surface_pristine(surface, true);
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+
+  // as in read_region(), so seams between tiles saturate away
+  cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
+  bool success = osr->ops->paint_region(osr, cr,
+                                        x * parent->downsample,
+                                        y * parent->downsample,
+                                        parent, t2, t2, err);
+  if (success) {
+    success = _openslide_check_cairo_status(cr, err);
+  }
+  cairo_destroy(cr);
+  return success;
+}
+
+// halve the native pixels under a tile into dest
+static bool halve_native_parent(openslide_t *osr,
+                                struct _openslide_level *parent,
+                                int64_t tile_col, int64_t tile_row,
+                                uint32_t *dest, GError **err) {
+  const int64_t t2 = 2 * SYNTHETIC_TILE_SIZE;
+  const size_t src_size = t2 * t2 * 4;
+  int64_t x = tile_col * t2;
+  int64_t y = tile_row * t2;
+
+  // a fixed size, so the buffer pool recycles it
+  uint32_t *src = _openslide_buffer_alloc(src_size);
+  memset(src, 0, src_size);
+
+  bool success = false;
+  bool unsupported = !osr->ops->get_tile ||
+                     parent->tile_w <= 0 || parent->tile_h <= 0;
+  if (!unsupported) {
+    success = copy_native_tiles(osr, parent, x, y, src, &unsupported, err);
+  }
+  if (unsupported) {
+    memset(src, 0, src_size);
+    success = paint_native(osr, parent, x, y, src, err);
+  }
+
+  // only the parent pixels inside the parent level count, so edge
+  // pixels aren't darkened by the transparent area beyond them
+  if (success) {
+    halve(src, t2, MIN(t2, parent->w - x), MIN(t2, parent->h - y), dest);
+  }
+  _openslide_buffer_free(src_size, src);
+  return success;
+}
+
+static uint32_t *fetch_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            void *arg G_GNUC_UNUSED,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
+  struct synthetic_level *l = (struct synthetic_level *) level;
+  const int64_t t = SYNTHETIC_TILE_SIZE;
+
+  // cache
+  uint32_t *tiledata = _openslide_cache_get(osr->cache,
+                                            level, tile_col, tile_row,
+                                            cache_entry);
+  if (tiledata) {
+    return tiledata;
+  }
+
+  tiledata = _openslide_buffer_alloc(t * t * 4);
+  memset(tiledata, 0, t * t * 4);
+  struct _openslide_level *parent = osr->levels[l->index - 1];
+  bool success;
+  if (is_synthetic(osr, parent)) {
+    success = halve_synthetic_parent(osr, (struct synthetic_level *) parent,
+                                     tile_col, tile_row, tiledata, err);
+  } else {
+    success = halve_native_parent(osr, parent, tile_col, tile_row,
+                                  tiledata, err);
+  }
+  if (!success) {
+    _openslide_buffer_free(t * t * 4, tiledata);
+    return NULL;
+  }
+
+  _openslide_cache_put(osr->cache, level, tile_col, tile_row,
+                       tiledata, t * t * 4, cache_entry);
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = fetch_tile(osr, level, tile_col, tile_row, arg,
+                                  &cache_entry, err);
+  if (!tiledata) {
+    return false;
+  }
+
+  bool success = _openslide_grid_paint_subimage(cr, tiledata,
+                                                CAIRO_FORMAT_ARGB32,
+                                                SYNTHETIC_TILE_SIZE,
+                                                SYNTHETIC_TILE_SIZE,
+                                                0, 0,
+                                                SYNTHETIC_TILE_SIZE,
+                                                SYNTHETIC_TILE_SIZE,
+                                                err);
+  _openslide_cache_entry_unref(cache_entry);
+  return success;
+}
+
+void _openslide_synthetic_add_levels(openslide_t *osr) {
+  g_assert(osr->synthetic_level_count == 0);
+  if (!_openslide_synthetic_get_enabled() || osr->level_count == 0) {
+    return;
+  }
+
+  const int64_t t = SYNTHETIC_TILE_SIZE;
+  bool tile_hints = osr->levels[0]->tile_w > 0;
+  GPtrArray *levels = g_ptr_array_new();
+  for (int32_t i = 0; i < osr->level_count; i++) {
+    g_ptr_array_add(levels, osr->levels[i]);
+  }
+
+  struct _openslide_level *parent = osr->levels[osr->level_count - 1];
+  while (parent->w > t || parent->h > t) {
+    struct synthetic_level *l = g_slice_new0(struct synthetic_level);
+    l->index = levels->len;
+    l->base.downsample = parent->downsample * 2;
+    l->base.w = (parent->w + 1) / 2;
+    l->base.h = (parent->h + 1) / 2;
+    if (tile_hints) {
+      l->base.tile_w = t;
+      l->base.tile_h = t;
+    }
+    l->tiles_across = (l->base.w + t - 1) / t;
+    l->tiles_down = (l->base.h + t - 1) / t;
+    l->grid = _openslide_grid_create_simple(osr,
+                                            l->tiles_across,
+                                            l->tiles_down,
+                                            t, t,
+                                            read_tile);
+    _openslide_grid_simple_set_fetch_tile(l->grid, fetch_tile);
+    g_ptr_array_add(levels, l);
+    parent = &l->base;
+  }
+
+  int32_t added = levels->len - osr->level_count;
+  if (added) {
+    // backends allocate the level array with glib
+    g_free(osr->levels);
+    osr->level_count = levels->len;
+    osr->synthetic_level_count = added;
+    osr->levels = (struct _openslide_level **) g_ptr_array_free(levels,
+                                                                false);
+  } else {
+    g_ptr_array_free(levels, true);
+  }
+}
+
+bool _openslide_synthetic_paint_region(openslide_t *osr, cairo_t *cr,
+                                       int64_t x, int64_t y,
+                                       struct _openslide_level *level,
+                                       int32_t w, int32_t h,
+                                       GError **err) {
+  struct synthetic_level *l = (struct synthetic_level *) level;
+  g_assert(is_synthetic(osr, level));
+
+  return _openslide_grid_paint_region(l->grid, cr, NULL,
+                                      x / level->downsample,
+                                      y / level->downsample,
+                                      level, w, h,
+                                      err);
+}
+
+uint32_t *_openslide_synthetic_get_tile(openslide_t *osr,
+                                        struct _openslide_level *level,
+                                        int64_t tile_col, int64_t tile_row,
+                                        int32_t *w, int32_t *h,
+                                        struct _openslide_cache_entry **cache_entry,
+                                        GError **err) {
+  struct synthetic_level *l = (struct synthetic_level *) level;
+  g_assert(is_synthetic(osr, level));
+
+  return _openslide_grid_get_tile(l->grid, NULL, level, tile_col, tile_row,
+                                  w, h, cache_entry, err);
+}
+
+const struct _openslide_occupancy *_openslide_synthetic_get_occupancy(openslide_t *osr,
+                                                                      struct _openslide_level *level,
+                                                                      GError **err) {
+  struct synthetic_level *l = (struct synthetic_level *) level;
+  g_assert(is_synthetic(osr, level));
+
+  return _openslide_grid_get_occupancy(l->grid, NULL, level, err);
+}
+
+void _openslide_synthetic_remove_levels(openslide_t *osr) {
+  for (int32_t i = osr->level_count - osr->synthetic_level_count;
+       i < osr->level_count; i++) {
+    struct synthetic_level *l = (struct synthetic_level *) osr->levels[i];
+    _openslide_grid_destroy(l->grid);
+    g_slice_free(struct synthetic_level, l);
+    osr->levels[i] = NULL;
+  }
+  osr->level_count -= osr->synthetic_level_count;
+  osr->synthetic_level_count = 0;
+}
@@ -0,0 +1,327 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Thumbnails and scaled associated images.
+ *
+ * The source is whichever of the pyramid levels and the "thumbnail"
+ * associated image has the fewest pixels while still being at least as
+ * large as the result.  Levels synthesized by reduced-size decoding are
+ * part of the pyramid, so they are considered too.  The source is read
+ * in bands a few megabytes in size, and each band is area-averaged into
+ * the result as it arrives.
+ *
+ * Associated images are decoded at the smallest reduced size, if the
+ * format supports one, that is at least as large as the result, and
+ * then area-averaged.  The decoded image is kept in the tile cache.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <glib.h>
+
+#define THUMBNAIL_IMAGE "thumbnail"
+
+// upper bound on the source pixels read at once
+#define BAND_BYTES (8 << 20)
+
+// the associated image must have the slide's aspect ratio to within this
+#define ASPECT_TOLERANCE 0.01
+
+// the largest size with the aspect ratio of w0 x h0 that fits in
+// max_w x max_h without enlarging
+static void fit_dimensions(int64_t w0, int64_t h0,
+                           int64_t max_w, int64_t max_h,
+                           int64_t *w, int64_t *h) {
+  if (w0 <= 0 || h0 <= 0 || max_w <= 0 || max_h <= 0) {
+    *w = 0;
+    *h = 0;
+    return;
+  }
+
+  // never enlarge
+  double scale = MAX(MAX((double) w0 / max_w, (double) h0 / max_h), 1);
+  *w = CLAMP((int64_t) (w0 / scale + 0.5), 1, max_w);
+  *h = CLAMP((int64_t) (h0 / scale + 0.5), 1, max_h);
+}
+
+void openslide_get_thumbnail_dimensions(openslide_t *osr,
+                                        int64_t max_w, int64_t max_h,
+                                        int64_t *w, int64_t *h) {
+  *w = -1;
+  *h = -1;
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  int64_t w0, h0;
+  openslide_get_level0_dimensions(osr, &w0, &h0);
+  fit_dimensions(w0, h0, max_w, max_h, w, h);
+}
+
+// the "thumbnail" associated image, if it can stand in for the slide at
+// this size
+static struct _openslide_associated_image *get_thumbnail_image(openslide_t *osr,
+                                                               int64_t tw,
+                                                               int64_t th) {
+  struct _openslide_associated_image *img =
+    g_hash_table_lookup(osr->associated_images, THUMBNAIL_IMAGE);
+  if (img == NULL || img->w < tw || img->h < th) {
+    return NULL;
+  }
+
+  int64_t w0, h0;
+  openslide_get_level0_dimensions(osr, &w0, &h0);
+  double slide_aspect = (double) w0 / h0;
+  double image_aspect = (double) img->w / img->h;
+  if (ABS(image_aspect / slide_aspect - 1) > ASPECT_TOLERANCE) {
+    return NULL;
+  }
+  return img;
+}
+
+// area-average source rows into dest as they arrive.  rows must be
+// added in order.
+struct downscaler {
+  uint32_t *dest;
+  int64_t dest_w;
+  int64_t dest_h;
+  int64_t src_w;
+  int64_t src_h;
+  int64_t *x_start;   // first source column for each dest column, + 1 end
+  uint32_t *acc;      // per source column
+  int64_t dest_row;
+  int64_t src_row;
+};
+
+static int64_t row_start(struct downscaler *ds, int64_t dest_row) {
+  return dest_row * ds->src_h / ds->dest_h;
+}
+
+static void downscaler_init(struct downscaler *ds, uint32_t *dest,
+                            int64_t dest_w, int64_t dest_h,
+                            int64_t src_w, int64_t src_h) {
+  ds->dest = dest;
+  ds->dest_w = dest_w;
+  ds->dest_h = dest_h;
+  ds->src_w = src_w;
+  ds->src_h = src_h;
+  ds->x_start = g_new(int64_t, dest_w + 1);
+  for (int64_t x = 0; x <= dest_w; x++) {
+    ds->x_start[x] = x * src_w / dest_w;
+  }
+  ds->acc = g_new0(uint32_t, src_w * 4);
+  ds->dest_row = 0;
+  ds->src_row = 0;
+}
+
+static void downscaler_emit_row(struct downscaler *ds) {
+  int64_t rows = row_start(ds, ds->dest_row + 1) - row_start(ds, ds->dest_row);
+  uint32_t *out = ds->dest + ds->dest_row * ds->dest_w;
+  for (int64_t x = 0; x < ds->dest_w; x++) {
+    uint64_t sum[4] = {0, 0, 0, 0};
+    for (int64_t sx = ds->x_start[x]; sx < ds->x_start[x + 1]; sx++) {
+      for (int c = 0; c < 4; c++) {
+        sum[c] += ds->acc[4 * sx + c];
+      }
+    }
+    uint64_t n = (ds->x_start[x + 1] - ds->x_start[x]) * rows;
+    uint8_t *p = (uint8_t *) &out[x];
+    for (int c = 0; c < 4; c++) {
+      p[c] = (sum[c] + n / 2) / n;
+    }
+  }
+  memset(ds->acc, 0, ds->src_w * 4 * sizeof(*ds->acc));
+  ds->dest_row++;
+}
+
+static void downscaler_add_rows(struct downscaler *ds,
+                                const uint32_t *rows, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    _openslide_accumulate_argb(ds->acc, rows + i * ds->src_w, ds->src_w);
+    ds->src_row++;
+    if (ds->src_row == row_start(ds, ds->dest_row + 1)) {
+      downscaler_emit_row(ds);
+    }
+  }
+}
+
+static void downscaler_destroy(struct downscaler *ds) {
+  g_free(ds->x_start);
+  g_free(ds->acc);
+}
+
+// decode the image at the smallest supported size that is at least
+// tw x th, and area-average it into dest
+static bool read_from_image(openslide_t *osr,
+                            struct _openslide_associated_image *img,
+                            uint32_t *dest, int64_t tw, int64_t th,
+                            GError **err) {
+  int32_t scale_denom = 1;
+  int64_t sw = img->w;
+  int64_t sh = img->h;
+  if (img->ops->get_argb_data_scaled) {
+    for (int32_t denom = 8; denom > 1; denom /= 2) {
+      int64_t w, h;
+      _openslide_associated_image_get_scaled_dimensions(img, denom, &w, &h);
+      if (w >= tw && h >= th) {
+        scale_denom = denom;
+        sw = w;
+        sh = h;
+        break;
+      }
+    }
+  }
+
+  struct _openslide_cache_entry *cache_entry;
+  const uint32_t *buf = _openslide_associated_image_read(osr, img,
+                                                         scale_denom,
+                                                         &cache_entry, err);
+  if (buf == NULL) {
+    return false;
+  }
+  if (sw == tw && sh == th) {
+    memcpy(dest, buf, tw * th * 4);
+  } else {
+    struct downscaler ds;
+    downscaler_init(&ds, dest, tw, th, sw, sh);
+    downscaler_add_rows(&ds, buf, sh);
+    downscaler_destroy(&ds);
+  }
+  _openslide_cache_entry_unref(cache_entry);
+  return true;
+}
+
+static bool read_from_level(openslide_t *osr, int32_t level,
+                            uint32_t *dest, int64_t tw, int64_t th) {
+  int64_t lw, lh;
+  openslide_get_level_dimensions(osr, level, &lw, &lh);
+  double downsample = openslide_get_level_downsample(osr, level);
+
+  int64_t band_h = CLAMP(BAND_BYTES / (lw * 4), 1, lh);
+  openslide_read_request_t req = {
+    .x = 0,
+    .level = level,
+    .w = lw,
+    .dest = g_new(uint32_t, lw * band_h),
+  };
+
+  struct downscaler ds;
+  downscaler_init(&ds, dest, tw, th, lw, lh);
+  bool success = true;
+  for (int64_t row = 0; row < lh; row += band_h) {
+    req.y = row * downsample;
+    req.h = MIN(band_h, lh - row);
+    // parallelized across the worker pool
+    if (openslide_read_regions(osr, &req, 1)) {
+      success = false;
+      break;
+    }
+    downscaler_add_rows(&ds, req.dest, req.h);
+  }
+  downscaler_destroy(&ds);
+  g_free(req.dest);
+  return success;
+}
+
+void openslide_read_thumbnail(openslide_t *osr,
+                              int64_t max_w, int64_t max_h,
+                              uint32_t *dest) {
+  int64_t tw, th;
+  openslide_get_thumbnail_dimensions(osr, max_w, max_h, &tw, &th);
+  if (tw <= 0 || th <= 0) {
+    // error, or nothing to read
+    return;
+  }
+  memset(dest, 0, tw * th * 4);
+
+  // smallest level at least as large as the thumbnail
+  int32_t level = 0;
+  for (int32_t i = openslide_get_level_count(osr) - 1; i > 0; i--) {
+    int64_t lw, lh;
+    openslide_get_level_dimensions(osr, i, &lw, &lh);
+    if (lw >= tw && lh >= th) {
+      level = i;
+      break;
+    }
+  }
+  int64_t lw, lh;
+  openslide_get_level_dimensions(osr, level, &lw, &lh);
+
+  struct _openslide_associated_image *img = get_thumbnail_image(osr, tw, th);
+  if (img && img->w * img->h < lw * lh) {
+    GError *tmp_err = NULL;
+    if (read_from_image(osr, img, dest, tw, th, &tmp_err)) {
+      return;
+    }
+    // the pyramid can still produce a thumbnail, so fall back to it
+    g_clear_error(&tmp_err);
+    memset(dest, 0, tw * th * 4);
+  }
+
+  if (!read_from_level(osr, level, dest, tw, th)) {
+    // ensure we don't return a partial result
+    memset(dest, 0, tw * th * 4);
+  }
+}
+
+void openslide_get_associated_image_scaled_dimensions(openslide_t *osr,
+                                                      const char *name,
+                                                      int64_t max_w,
+                                                      int64_t max_h,
+                                                      int64_t *w,
+                                                      int64_t *h) {
+  *w = -1;
+  *h = -1;
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  struct _openslide_associated_image *img =
+    g_hash_table_lookup(osr->associated_images, name);
+  if (img) {
+    fit_dimensions(img->w, img->h, max_w, max_h, w, h);
+  }
+}
+
+void openslide_read_associated_image_scaled(openslide_t *osr,
+                                            const char *name,
+                                            int64_t max_w, int64_t max_h,
+                                            uint32_t *dest) {
+  int64_t w, h;
+  openslide_get_associated_image_scaled_dimensions(osr, name, max_w, max_h,
+                                                   &w, &h);
+  if (w <= 0 || h <= 0) {
+    // error, no such image, or nothing to read
+    return;
+  }
+
+  struct _openslide_associated_image *img =
+    g_hash_table_lookup(osr->associated_images, name);
+  GError *tmp_err = NULL;
+  if (!read_from_image(osr, img, dest, w, h, &tmp_err)) {
+    memset(dest, 0, w * h * 4);
+    _openslide_propagate_error(osr, tmp_err);
+  }
+}
@@ -0,0 +1,213 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Tile-event tracing.
+ *
+ * While a callback is registered, the grid opens a trace for each tile
+ * it asks a backend to read.  The trace lives in thread-private storage,
+ * so the cache and the performance probes further down the stack can
+ * add to it without being told which tile they are working for.  Reading
+ * a tile can read tiles of another level, as synthetic levels do, so
+ * each thread keeps a stack of traces; the hooks report to the innermost
+ * one.  With no callback, every hook returns after testing one flag.
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <string.h>
+#include <glib.h>
+
+struct tile_trace {
+  openslide_trace_event_t event;
+  GTimer *timer;
+};
+
+// per-thread
+struct trace_stack {
+  GArray *frames;  // struct tile_trace; slots beyond depth are reused
+  guint depth;
+};
+
+static struct {
+  GStaticMutex lock;
+  openslide_trace_fn callback;
+  void *data;
+} trace = {
+  .lock = G_STATIC_MUTEX_INIT,
+};
+
+// nonzero while a callback is registered
+static volatile gint enabled;
+// nonzero once any callback has been registered, so traces may be open
+static volatile gint ever_enabled;
+
+static GStaticPrivate trace_key = G_STATIC_PRIVATE_INIT;
+
+static void trace_stack_free(gpointer data) {
+  struct trace_stack *ts = data;
+  for (guint i = 0; i < ts->frames->len; i++) {
+    struct tile_trace *tt = &g_array_index(ts->frames, struct tile_trace, i);
+    g_timer_destroy(tt->timer);
+  }
+  g_array_free(ts->frames, true);
+  g_slice_free(struct trace_stack, ts);
+}
+
+// the innermost trace on this thread, or NULL if none
+static struct tile_trace *get_top(struct trace_stack *ts) {
+  if (ts == NULL || ts->depth == 0) {
+    return NULL;
+  }
+  return &g_array_index(ts->frames, struct tile_trace, ts->depth - 1);
+}
+
+// returns NULL unless a tile is being traced on this thread
+static struct tile_trace *get_active_trace(void) {
+  if (!g_atomic_int_get(&enabled)) {
+    return NULL;
+  }
+  return get_top(g_static_private_get(&trace_key));
+}
+
+static void emit(struct tile_trace *tt, openslide_trace_event_type_t type) {
+  g_static_mutex_lock(&trace.lock);
+  openslide_trace_fn callback = trace.callback;
+  void *data = trace.data;
+  g_static_mutex_unlock(&trace.lock);
+
+  if (callback) {
+    tt->event.type = type;
+    tt->event.elapsed_nsec = g_timer_elapsed(tt->timer, NULL) * 1e9;
+    callback(&tt->event, data);
+  }
+}
+
+bool _openslide_trace_enabled(void) {
+  return g_atomic_int_get(&enabled);
+}
+
+void _openslide_trace_tile_begin(openslide_t *osr,
+                                 struct _openslide_level *level,
+                                 int64_t tile_col, int64_t tile_row) {
+  if (!g_atomic_int_get(&enabled)) {
+    return;
+  }
+
+  struct trace_stack *ts = g_static_private_get(&trace_key);
+  if (ts == NULL) {
+    ts = g_slice_new0(struct trace_stack);
+    ts->frames = g_array_new(false, true, sizeof(struct tile_trace));
+    g_static_private_set(&trace_key, ts, trace_stack_free);
+  }
+  if (ts->depth == ts->frames->len) {
+    g_array_set_size(ts->frames, ts->depth + 1);
+  }
+  struct tile_trace *tt = &g_array_index(ts->frames, struct tile_trace,
+                                         ts->depth++);
+  if (tt->timer == NULL) {
+    tt->timer = g_timer_new();
+  }
+
+  memset(&tt->event, 0, sizeof(tt->event));
+  tt->event.osr = osr;
+  tt->event.level = -1;
+  for (int32_t i = 0; i < osr->level_count; i++) {
+    if (osr->levels[i] == level) {
+      tt->event.level = i;
+      break;
+    }
+  }
+  tt->event.tile_col = tile_col;
+  tt->event.tile_row = tile_row;
+  g_timer_start(tt->timer);
+  emit(tt, OPENSLIDE_TRACE_TILE_BEGIN);
+}
+
+void _openslide_trace_tile_end(bool success) {
+  // pop even if the callback was just unregistered, so the stack stays
+  // balanced; emit() then has nobody to tell
+  if (!g_atomic_int_get(&ever_enabled)) {
+    return;
+  }
+  struct trace_stack *ts = g_static_private_get(&trace_key);
+  struct tile_trace *tt = get_top(ts);
+  if (tt == NULL) {
+    return;
+  }
+  tt->event.success = success;
+  emit(tt, OPENSLIDE_TRACE_TILE_END);
+  ts->depth--;
+}
+
+void _openslide_trace_cache_get(bool hit, int64_t bytes) {
+  struct tile_trace *tt = get_active_trace();
+  if (tt == NULL) {
+    return;
+  }
+  tt->event.cache_hit = hit;
+  tt->event.bytes = bytes;
+  emit(tt, hit ? OPENSLIDE_TRACE_CACHE_HIT : OPENSLIDE_TRACE_CACHE_MISS);
+}
+
+void _openslide_trace_cache_put(int64_t bytes) {
+  struct tile_trace *tt = get_active_trace();
+  if (tt == NULL) {
+    return;
+  }
+  tt->event.bytes = bytes;
+  emit(tt, OPENSLIDE_TRACE_CACHE_PUT);
+}
+
+void _openslide_trace_stage(openslide_perf_stage_t stage,
+                            int64_t nsec, int64_t bytes) {
+  struct tile_trace *tt = get_active_trace();
+  if (tt == NULL) {
+    return;
+  }
+  switch (stage) {
+  case OPENSLIDE_PERF_FILE_IO:
+    tt->event.bytes_read += bytes;
+    break;
+  case OPENSLIDE_PERF_DECODE_JPEG:
+  case OPENSLIDE_PERF_DECODE_JP2K:
+  case OPENSLIDE_PERF_DECODE_PNG:
+  case OPENSLIDE_PERF_DECODE_GDKPIXBUF:
+  case OPENSLIDE_PERF_DECODE_TIFF:
+    tt->event.decode_nsec += nsec;
+    break;
+  default:
+    break;
+  }
+}
+
+void openslide_set_trace_callback(openslide_trace_fn callback, void *data) {
+  g_static_mutex_lock(&trace.lock);
+  trace.callback = callback;
+  trace.data = data;
+  g_atomic_int_set(&enabled, callback != NULL);
+  if (callback) {
+    g_atomic_int_set(&ever_enabled, 1);
+  }
+  g_static_mutex_unlock(&trace.lock);
+}
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <errno.h>
@@ -46,8 +47,13 @@ static const struct debug_option {
   const char *desc;
 } debug_options[] = {
   {"detection", OPENSLIDE_DEBUG_DETECTION, "log format detection errors"},
+  {"handles", OPENSLIDE_DEBUG_HANDLES,
+   "report TIFF handle cache statistics"},
   {"jpeg-markers", OPENSLIDE_DEBUG_JPEG_MARKERS,
    "verify Hamamatsu restart markers"},
+  {"no-simd", OPENSLIDE_DEBUG_NO_SIMD, "disable SIMD pixel conversion"},
+  {"performance", OPENSLIDE_DEBUG_PERFORMANCE,
+   "count time spent in each stage of reading"},
   {"tiles", OPENSLIDE_DEBUG_TILES, "render tile outlines"},
   {NULL, 0, NULL}
 };
@@ -187,6 +193,21 @@ FILE *_openslide_fopen(const char *path, const char *mode, GError **err)
 }
 #define fopen _OPENSLIDE_POISON(_openslide_fopen)
 
+char *_openslide_canonicalize_path(const char *filename) {
+#ifdef WIN32
+  char *path = _fullpath(NULL, filename, 0);
+#else
+  char *path = realpath(filename, NULL);
+#endif
+  if (path == NULL) {
+    return NULL;
+  }
+  // return glib-allocated memory
+  char *result = g_strdup(path);
+  free(path);
+  return result;
+}
+
 #undef g_ascii_strtod
 double _openslide_parse_double(const char *value) {
   // Canonicalize comma to decimal point, since the locale of the
@@ -256,14 +277,11 @@ void _openslide_set_background_color_prop(openslide_t *osr,
                       g_strdup_printf("%.02X%.02X%.02X", r, g, b));
 }
 
-void _openslide_set_bounds_props_from_grid(openslide_t *osr,
-                                           struct _openslide_grid *grid) {
+void _openslide_set_bounds_props(openslide_t *osr,
+                                 double x, double y, double w, double h) {
   g_return_if_fail(g_hash_table_lookup(osr->properties,
                                        OPENSLIDE_PROPERTY_NAME_BOUNDS_X) == NULL);
 
-  double x, y, w, h;
-  _openslide_grid_get_bounds(grid, &x, &y, &w, &h);
-
   g_hash_table_insert(osr->properties,
                       g_strdup(OPENSLIDE_PROPERTY_NAME_BOUNDS_X),
                       g_strdup_printf("%"G_GINT64_FORMAT,
@@ -282,34 +300,46 @@ void _openslide_set_bounds_props_from_grid(openslide_t *osr,
                                       (int64_t) (ceil(y + h) - floor(y))));
 }
 
+void _openslide_set_bounds_props_from_grid(openslide_t *osr,
+                                           struct _openslide_grid *grid) {
+  double x, y, w, h;
+  _openslide_grid_get_bounds(grid, &x, &y, &w, &h);
+  _openslide_set_bounds_props(osr, x, y, w, h);
+}
+
 bool _openslide_clip_tile(uint32_t *tiledata,
                           int64_t tile_w, int64_t tile_h,
                           int64_t clip_w, int64_t clip_h,
-                          GError **err) {
+                          GError **err G_GNUC_UNUSED) {
   if (clip_w >= tile_w && clip_h >= tile_h) {
     return true;
   }
+  clip_w = CLAMP(clip_w, 0, tile_w);
+  clip_h = CLAMP(clip_h, 0, tile_h);
 
-  cairo_surface_t *surface =
-    cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                        CAIRO_FORMAT_ARGB32,
-                                        tile_w, tile_h,
-                                        tile_w * 4);
-  cairo_t *cr = cairo_create(surface);
-  cairo_surface_destroy(surface);
-
-  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  // clear to transparent; memset is already vectorized
+  for (int64_t y = 0; y < clip_h && clip_w < tile_w; y++) {
+    memset(tiledata + y * tile_w + clip_w, 0, (tile_w - clip_w) * 4);
+  }
+  memset(tiledata + clip_h * tile_w, 0, (tile_h - clip_h) * tile_w * 4);
 
-  cairo_rectangle(cr, clip_w, 0, tile_w - clip_w, tile_h);
-  cairo_fill(cr);
+  return true;
+}
 
-  cairo_rectangle(cr, 0, clip_h, tile_w, tile_h - clip_h);
-  cairo_fill(cr);
+// a pristine surface has been cleared and nothing has been painted on it
+// since, so tile data can be written into it directly
+static const cairo_user_data_key_t pristine_surface_key;
 
-  bool success = _openslide_check_cairo_status(cr, err);
-  cairo_destroy(cr);
+void _openslide_set_surface_pristine(cairo_surface_t *surface,
+                                     bool pristine) {
+  // on failure the surface is merely treated as not pristine
+  cairo_surface_set_user_data(surface, &pristine_surface_key,
+                              pristine ? (void *) &pristine_surface_key : NULL,
+                              NULL);
+}
 
-  return success;
+bool _openslide_is_surface_pristine(cairo_surface_t *surface) {
+  return cairo_surface_get_user_data(surface, &pristine_surface_key) != NULL;
 }
 
 // note: g_getenv() is not reentrant
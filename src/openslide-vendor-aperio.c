@@ -54,6 +54,7 @@ struct level {
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
   uint16_t compression;
+  int32_t scale_denom;  // > 1 if synthesized by reduced-size decoding
 };
 
 static void destroy_data(struct aperio_ops_data *data,
@@ -112,7 +113,21 @@ static bool check_for_empty_tile(struct _openslide_tiff_level *tiffl,
   return true;
 }
 
-static bool decode_tile(struct level *l,
+static bool tile_empty(openslide_t *osr G_GNUC_UNUSED,
+                       struct _openslide_level *level,
+                       int64_t tile_col, int64_t tile_row,
+                       void *arg,
+                       bool *is_empty,
+                       GError **err) {
+  struct level *l = (struct level *) level;
+  TIFF *tiff = arg;
+  return check_for_empty_tile(&l->tiffl, tiff, tile_col, tile_row,
+                              is_empty, err);
+}
+
+// cb may be NULL to skip the compressed tile cache
+static bool decode_tile(struct _openslide_cache_binding *cb,
+                        struct level *l,
                         TIFF *tiff,
                         uint32_t *dest,
                         int64_t tile_col, int64_t tile_row,
@@ -129,7 +144,8 @@ static bool decode_tile(struct level *l,
   }
   if (is_empty) {
     // fill with transparent
-    memset(dest, 0, tiffl->tile_w * tiffl->tile_h * 4);
+    memset(dest, 0, (tiffl->tile_w / l->scale_denom) *
+                    (tiffl->tile_h / l->scale_denom) * 4);
     return true;
   }
 
@@ -144,72 +160,129 @@ static bool decode_tile(struct level *l,
     break;
   default:
     // not for us? fallback
+    if (l->scale_denom > 1) {
+      return _openslide_tiff_read_tile_scaled(tiffl, tiff, dest,
+                                              tile_col, tile_row,
+                                              l->scale_denom,
+                                              err);
+    }
     return _openslide_tiff_read_tile(tiffl, tiff, dest,
                                      tile_col, tile_row,
                                      err);
   }
 
-  // read raw tile
-  void *buf;
+  // read raw tile, from the compressed tile cache or in place if the
+  // file is mapped
+  const void *buf = NULL;
   int32_t buflen;
-  if (!_openslide_tiff_read_tile_data(tiffl, tiff,
-                                      &buf, &buflen,
-                                      tile_col, tile_row,
-                                      err)) {
-    return false;  // ok, haven't allocated anything yet
+  void *buf_to_free = NULL;
+  struct _openslide_cache_entry *compressed_entry = NULL;
+  if (cb) {
+    int64_t len;
+    buf = _openslide_cache_get_compressed(cb, l, tile_col, tile_row,
+                                          &len, &compressed_entry);
+    buflen = len;
+  }
+  if (buf == NULL) {
+    if (!_openslide_tiff_map_tile_data(tiffl, tiff,
+                                       &buf, &buflen, &buf_to_free,
+                                       tile_col, tile_row,
+                                       err)) {
+      return false;  // ok, haven't allocated anything yet
+    }
+    if (cb && _openslide_cache_compressed_enabled(cb)) {
+      void *copy = g_slice_copy(buflen, buf);
+      g_free(buf_to_free);
+      buf_to_free = NULL;
+      _openslide_cache_put_compressed(cb, l, tile_col, tile_row,
+                                      copy, buflen, &compressed_entry);
+      buf = copy;
+    }
   }
 
   // decompress
-  bool success = _openslide_jp2k_decode_buffer(dest,
-                                               tiffl->tile_w, tiffl->tile_h,
-                                               buf, buflen,
-                                               space,
-                                               err);
+  // for synthesized levels, skip the finest resolution levels
+  bool success =
+    _openslide_jp2k_decode_buffer_reduced(dest,
+                                          tiffl->tile_w / l->scale_denom,
+                                          tiffl->tile_h / l->scale_denom,
+                                          g_bit_nth_lsf(l->scale_denom, -1),
+                                          buf, buflen,
+                                          space,
+                                          err);
 
   // clean up
-  g_free(buf);
+  g_free(buf_to_free);
+  if (compressed_entry) {
+    _openslide_cache_entry_unref(compressed_entry);
+  }
 
   return success;
 }
 
-static bool read_tile(openslide_t *osr,
-		      cairo_t *cr,
-		      struct _openslide_level *level,
-		      int64_t tile_col, int64_t tile_row,
-		      void *arg,
-		      GError **err) {
+static uint32_t *fetch_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            void *arg,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
 
   // tile size
-  int64_t tw = tiffl->tile_w;
-  int64_t th = tiffl->tile_h;
+  int64_t tw = tiffl->tile_w / l->scale_denom;
+  int64_t th = tiffl->tile_h / l->scale_denom;
 
   // cache
-  struct _openslide_cache_entry *cache_entry;
   uint32_t *tiledata = _openslide_cache_get(osr->cache,
                                             level, tile_col, tile_row,
-                                            &cache_entry);
+                                            cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!decode_tile(l, tiff, tiledata, tile_col, tile_row, err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!decode_tile(osr->cache, l, tiff, tiledata, tile_col, tile_row,
+                     err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // clip, if necessary
-    if (!_openslide_tiff_clip_tile(tiffl, tiledata,
-                                   tile_col, tile_row,
-                                   err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+    if (!_openslide_tiff_clip_tile_scaled(tiffl, tiledata,
+                                          tile_col, tile_row,
+                                          l->scale_denom,
+                                          err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // put it in the cache
     _openslide_cache_put(osr->cache, level, tile_col, tile_row,
 			 tiledata, tw * th * 4,
-			 &cache_entry);
+			 cache_entry);
+  }
+
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+		      cairo_t *cr,
+		      struct _openslide_level *level,
+		      int64_t tile_col, int64_t tile_row,
+		      void *arg,
+		      GError **err) {
+  struct level *l = (struct level *) level;
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+
+  // tile size
+  int64_t tw = tiffl->tile_w / l->scale_denom;
+  int64_t th = tiffl->tile_h / l->scale_denom;
+
+  // cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = fetch_tile(osr, level, tile_col, tile_row, arg,
+                                  &cache_entry, err);
+  if (!tiledata) {
+    return false;
   }
 
   // draw it
@@ -219,7 +292,9 @@ static bool read_tile(openslide_t *osr,
 								 tw * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * th * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -235,7 +310,7 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   struct aperio_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
 
-  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
   if (tiff == NULL) {
     return false;
   }
@@ -250,8 +325,83 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static uint32_t *get_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          int32_t *w, int32_t *h,
+                          struct _openslide_cache_entry **cache_entry,
+                          GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return NULL;
+  }
+
+  uint32_t *tiledata = _openslide_grid_get_tile(l->grid, tiff, level,
+                                                tile_col, tile_row, w, h,
+                                                cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return tiledata;
+}
+
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int64_t *len,
+                          openslide_tile_format_t *format,
+                          int32_t *w, int32_t *h,
+                          GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  if (l->scale_denom > 1) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Level is synthesized");
+    return false;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  bool success = _openslide_tiff_read_raw_tile(&l->tiffl, tiff,
+                                               tile_col, tile_row,
+                                               buf, len, format, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  if (success) {
+    *w = l->tiffl.tile_w;
+    *h = l->tiffl.tile_h;
+  }
+  return success;
+}
+
+static const struct _openslide_occupancy *get_occupancy(openslide_t *osr,
+                                                       struct _openslide_level *level,
+                                                       GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return NULL;
+  }
+
+  const struct _openslide_occupancy *occ =
+    _openslide_grid_get_occupancy(l->grid, tiff, level, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return occ;
+}
+
 static const struct _openslide_ops aperio_ops = {
   .paint_region = paint_region,
+  .get_tile = get_tile,
+  .read_raw_tile = read_raw_tile,
+  .get_occupancy = get_occupancy,
   .destroy = destroy,
 };
 
@@ -382,11 +532,37 @@ static bool test_tile_decoding(struct level *l,
   int64_t th = l->tiffl.tile_h;
 
   uint32_t *dest = g_slice_alloc(tw * th * 4);
-  bool ok = decode_tile(l, tiff, dest, 0, 0, err);
+  bool ok = decode_tile(NULL, l, tiff, dest, 0, 0, err);
   g_slice_free1(tw * th * 4, dest);
   return ok;
 }
 
+// the largest factor by which the codec can shrink tiles of this level
+static int32_t get_max_scale(struct level *l, TIFF *tiff) {
+  if (l->tiffl.native_jpeg) {
+    return 8;
+  }
+  if (l->compression != APERIO_COMPRESSION_JP2K_YCBCR &&
+      l->compression != APERIO_COMPRESSION_JP2K_RGB) {
+    return 1;
+  }
+
+  // ask the first tile how many resolution levels it has
+  const void *buf;
+  int32_t buflen;
+  void *buf_to_free;
+  if (!_openslide_tiff_map_tile_data(&l->tiffl, tiff, &buf, &buflen,
+                                     &buf_to_free, 0, 0, NULL)) {
+    return 1;
+  }
+  int32_t reduce = 0;
+  if (buflen > 0) {
+    reduce = _openslide_jp2k_get_max_reduce(buf, buflen);
+  }
+  g_free(buf_to_free);
+  return 1 << MIN(reduce, 3);
+}
+
 static bool aperio_open(openslide_t *osr,
                         const char *filename,
                         struct _openslide_tifflike *tl,
@@ -478,6 +654,7 @@ static bool aperio_open(openslide_t *osr,
                                       err)) {
         goto FAIL;
       }
+      l->scale_denom = 1;
 
       l->grid = _openslide_grid_create_simple(osr,
                                               tiffl->tiles_across,
@@ -485,6 +662,8 @@ static bool aperio_open(openslide_t *osr,
                                               tiffl->tile_w,
                                               tiffl->tile_h,
                                               read_tile);
+      _openslide_grid_simple_set_fetch_tile(l->grid, fetch_tile);
+      _openslide_grid_simple_set_tile_empty(l->grid, tile_empty);
 
       // get compression
       if (!TIFFGetField(tiff, TIFFTAG_COMPRESSION, &l->compression)) {
@@ -529,6 +708,39 @@ static bool aperio_open(openslide_t *osr,
     goto FAIL;
   }
 
+  // add smaller levels by decoding the smallest one at reduced size, if
+  // synthetic levels are enabled.  append them, so existing level numbers
+  // don't change.  skip probing the codec otherwise.
+  struct level *smallest = levels[level_count - 1];
+  int32_t max_scale = 1;
+  if (_openslide_synthetic_get_enabled()) {
+    max_scale = get_max_scale(smallest, tiff);
+  }
+  for (int32_t s = 2; s <= max_scale; s *= 2) {
+    if (!_openslide_tiff_level_can_scale(&smallest->tiffl, s)) {
+      break;
+    }
+    levels = g_renew(struct level *, levels, level_count + 1);
+    struct level *l = g_slice_new0(struct level);
+    levels[level_count++] = l;
+
+    l->tiffl = smallest->tiffl;
+    l->compression = smallest->compression;
+    l->scale_denom = s;
+    l->base.w = (l->tiffl.image_w + s - 1) / s;
+    l->base.h = (l->tiffl.image_h + s - 1) / s;
+    l->base.tile_w = l->tiffl.tile_w / s;
+    l->base.tile_h = l->tiffl.tile_h / s;
+    l->grid = _openslide_grid_create_simple(osr,
+                                            l->tiffl.tiles_across,
+                                            l->tiffl.tiles_down,
+                                            l->base.tile_w,
+                                            l->base.tile_h,
+                                            read_tile);
+    _openslide_grid_simple_set_fetch_tile(l->grid, fetch_tile);
+    _openslide_grid_simple_set_tile_empty(l->grid, tile_empty);
+  }
+
   // store osr data
   g_assert(osr->data == NULL);
   g_assert(osr->levels == NULL);
@@ -553,6 +765,7 @@ FAIL:
 const struct _openslide_format _openslide_format_aperio = {
   .name = "aperio",
   .vendor = "aperio",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = aperio_detect,
   .open = aperio_open,
 };
@@ -46,6 +46,7 @@ struct level {
   struct _openslide_level base;
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
+  int32_t scale_denom;  // > 1 if synthesized by scaled JPEG decoding
 };
 
 static void destroy(openslide_t *osr) {
@@ -61,46 +62,79 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+static uint32_t *fetch_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            void *arg,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
 
   // tile size
-  int64_t tw = tiffl->tile_w;
-  int64_t th = tiffl->tile_h;
+  int64_t tw = tiffl->tile_w / l->scale_denom;
+  int64_t th = tiffl->tile_h / l->scale_denom;
 
   // cache
-  struct _openslide_cache_entry *cache_entry;
   uint32_t *tiledata = _openslide_cache_get(osr->cache,
                                             level, tile_col, tile_row,
-                                            &cache_entry);
+                                            cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!_openslide_tiff_read_tile(tiffl, tiff,
-                                   tiledata, tile_col, tile_row,
-                                   err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    bool success;
+    if (l->scale_denom > 1) {
+      success = _openslide_tiff_read_tile_scaled(tiffl, tiff, tiledata,
+                                                 tile_col, tile_row,
+                                                 l->scale_denom,
+                                                 err);
+    } else {
+      success = _openslide_tiff_read_tile(tiffl, tiff,
+                                          tiledata, tile_col, tile_row,
+                                          err);
+    }
+    if (!success) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // clip, if necessary
-    if (!_openslide_tiff_clip_tile(tiffl, tiledata,
-                                   tile_col, tile_row,
-                                   err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+    if (!_openslide_tiff_clip_tile_scaled(tiffl, tiledata,
+                                          tile_col, tile_row,
+                                          l->scale_denom,
+                                          err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // put it in the cache
     _openslide_cache_put(osr->cache, level, tile_col, tile_row,
                          tiledata, tw * th * 4,
-                         &cache_entry);
+                         cache_entry);
+  }
+
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+
+  // tile size
+  int64_t tw = tiffl->tile_w / l->scale_denom;
+  int64_t th = tiffl->tile_h / l->scale_denom;
+
+  // cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = fetch_tile(osr, level, tile_col, tile_row, arg,
+                                  &cache_entry, err);
+  if (!tiledata) {
+    return false;
   }
 
   // draw it
@@ -110,7 +144,9 @@ static bool read_tile(openslide_t *osr,
                                                                  tw * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * th * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -126,7 +162,7 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   struct generic_tiff_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
 
-  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
   if (tiff == NULL) {
     return false;
   }
@@ -141,8 +177,64 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static uint32_t *get_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          int32_t *w, int32_t *h,
+                          struct _openslide_cache_entry **cache_entry,
+                          GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return NULL;
+  }
+
+  uint32_t *tiledata = _openslide_grid_get_tile(l->grid, tiff, level,
+                                                tile_col, tile_row, w, h,
+                                                cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return tiledata;
+}
+
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int64_t *len,
+                          openslide_tile_format_t *format,
+                          int32_t *w, int32_t *h,
+                          GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  if (l->scale_denom > 1) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Level is synthesized");
+    return false;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  bool success = _openslide_tiff_read_raw_tile(&l->tiffl, tiff,
+                                               tile_col, tile_row,
+                                               buf, len, format, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  if (success) {
+    *w = l->tiffl.tile_w;
+    *h = l->tiffl.tile_h;
+  }
+  return success;
+}
+
 static const struct _openslide_ops generic_tiff_ops = {
   .paint_region = paint_region,
+  .get_tile = get_tile,
+  .read_raw_tile = read_raw_tile,
   .destroy = destroy,
 };
 
@@ -236,12 +328,14 @@ static bool generic_tiff_open(openslide_t *osr,
       g_slice_free(struct level, l);
       goto FAIL;
     }
+    l->scale_denom = 1;
     l->grid = _openslide_grid_create_simple(osr,
                                             tiffl->tiles_across,
                                             tiffl->tiles_down,
                                             tiffl->tile_w,
                                             tiffl->tile_h,
                                             read_tile);
+    _openslide_grid_simple_set_fetch_tile(l->grid, fetch_tile);
 
     // add to array
     g_ptr_array_add(level_array, l);
@@ -259,6 +353,32 @@ static bool generic_tiff_open(openslide_t *osr,
     goto FAIL;
   }
 
+  // add smaller levels by decoding the smallest one at reduced size, if
+  // synthetic levels are enabled.  append them, so existing level numbers
+  // don't change
+  for (int32_t s = 2; s <= 8; s *= 2) {
+    if (!_openslide_synthetic_get_enabled() ||
+        !top_level->tiffl.native_jpeg ||
+        !_openslide_tiff_level_can_scale(&top_level->tiffl, s)) {
+      break;
+    }
+    struct level *l = g_slice_new0(struct level);
+    l->tiffl = top_level->tiffl;
+    l->scale_denom = s;
+    l->base.w = (l->tiffl.image_w + s - 1) / s;
+    l->base.h = (l->tiffl.image_h + s - 1) / s;
+    l->base.tile_w = l->tiffl.tile_w / s;
+    l->base.tile_h = l->tiffl.tile_h / s;
+    l->grid = _openslide_grid_create_simple(osr,
+                                            l->tiffl.tiles_across,
+                                            l->tiffl.tiles_down,
+                                            l->base.tile_w,
+                                            l->base.tile_h,
+                                            read_tile);
+    _openslide_grid_simple_set_fetch_tile(l->grid, fetch_tile);
+    g_ptr_array_add(level_array, l);
+  }
+
   // unwrap level array
   int32_t level_count = level_array->len;
   struct level **levels =
@@ -302,6 +422,7 @@ static bool generic_tiff_open(openslide_t *osr,
 const struct _openslide_format _openslide_format_generic_tiff = {
   .name = "generic-tiff",
   .vendor = "generic-tiff",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = generic_tiff_detect,
   .open = generic_tiff_open,
 };
@@ -43,20 +43,34 @@
 #include "openslide-decode-tifflike.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <jpeglib.h>
 #include <tiff.h>
 #include <cairo.h>
 
 #include "openslide-hash.h"
+#include "openslide-snapshot.h"
 
 #define NGR_TILE_HEIGHT 64
 
+// JPEGs without restart markers are served in strips of about this size,
+// in rows that are a multiple of the largest iMCU height at 1/8 scale
+#define STRIP_BYTES (4 << 20)
+#define STRIP_ROW_ALIGN 128
+
+// parallel restart marker scanners per slide
+#define MAX_MARKER_SCANNERS 4
+// tiles scanned before a scanner checks for higher-priority work
+#define MARKER_SCAN_STEP 64
+
 // VMS/VMU
 static const char GROUP_VMS[] = "Virtual Microscope Specimen";
 static const char GROUP_VMU[] = "Uncompressed Virtual Microscope Specimen";
@@ -112,6 +126,14 @@ struct jpeg {
 
   int64_t sof_position;
   int64_t header_stop_position;
+
+  // protects mcu_starts
+  GMutex *mcu_lock;
+  // all restart markers are known; accessed atomically
+  volatile gint scan_done;
+  // protected by restart_marker_mutex
+  bool scan_claimed;    // a scanner thread is working on it
+  bool scan_wanted;     // in the wanted queue
 };
 
 struct jpeg_level {
@@ -128,6 +150,19 @@ struct jpeg_level {
   int32_t tile_height;
 
   int32_t scale_denom;
+
+  // tiles are horizontal strips of a single JPEG without restart markers
+  bool strips;
+  // a strip decoder stopped partway through the JPEG; g_atomic_pointer
+  struct strip_decoder *parked;
+};
+
+// a decompressor kept between strips, since without restart markers a
+// strip can only be reached by decoding everything above it
+struct strip_decoder {
+  struct jpeg_decompress_struct cinfo;
+  struct _openslide_jpeg_error_mgr jerr;
+  struct _openslide_cache_entry *compressed_entry;
 };
 
 struct hamamatsu_jpeg_ops_data {
@@ -135,14 +170,13 @@ struct hamamatsu_jpeg_ops_data {
   struct jpeg **all_jpegs;
 
   // thread stuff, for background search of restart markers
-  GTimer *restart_marker_timer;
-  GMutex *restart_marker_mutex;
-  GThread *restart_marker_thread;
-
-  GCond *restart_marker_cond;
-  GMutex *restart_marker_cond_mutex;
-  uint32_t restart_marker_users;
-  bool restart_marker_thread_stop;
+  GThread **restart_marker_threads;
+  int32_t restart_marker_thread_count;
+  volatile gint restart_marker_thread_stop;  // accessed atomically
+
+  GMutex *restart_marker_mutex;   // protects everything below
+  GQueue *restart_marker_wanted;  // struct jpeg, most urgent first
+  int32_t restart_marker_next;    // next JPEG to scan in file order
   GError *restart_marker_thread_error;
 };
 
@@ -254,6 +288,7 @@ static bool jpeg_random_access_src(j_decompress_ptr cinfo,
 
   // read in the 2 parts
   //  g_debug("reading header from %"G_GINT64_FORMAT, header_start_position);
+  int64_t perf_start = _openslide_perf_start();
   if (fseeko(infile, header_start_position, SEEK_SET)) {
     _openslide_io_error(err, "Couldn't seek to header start");
     return false;
@@ -286,6 +321,7 @@ static bool jpeg_random_access_src(j_decompress_ptr cinfo,
     }
     src->buffer[src->buffer_size - 1] = JPEG_EOI;
   }
+  _openslide_perf_end(OPENSLIDE_PERF_FILE_IO, perf_start, src->buffer_size);
 
   // check for overlarge or 0 X/Y in SOF (some NDPI JPEGs have this)
   // change them to a value libjpeg will accept
@@ -308,15 +344,64 @@ static bool jpeg_random_access_src(j_decompress_ptr cinfo,
   return true;
 }
 
+// read from data assembled earlier by jpeg_random_access_src(), which
+// we don't own
+static void jpeg_assembled_src(j_decompress_ptr cinfo,
+                               const void *buf, int len) {
+  if (cinfo->src == NULL) {     /* first time for this JPEG object? */
+    cinfo->src = (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo,
+                                             JPOOL_PERMANENT,
+                                             sizeof(struct my_src_mgr));
+  }
+
+  struct my_src_mgr *src = (struct my_src_mgr *) cinfo->src;
+  src->pub.init_source = init_source;
+  src->pub.fill_input_buffer = NULL;  /* this should never be called */
+  src->pub.skip_input_data = skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart; /* use default method */
+  src->pub.term_source = term_source;
+  src->pub.next_input_byte = buf;
+  src->pub.bytes_in_buffer = len;
+  src->buffer = NULL;
+  src->buffer_size = 0;
+}
+
+// hand the assembled data to the compressed tile cache, which will free
+// it with the entry
+static void random_access_src_cache(openslide_t *osr,
+                                    j_decompress_ptr cinfo,
+                                    void *plane, int64_t tileno,
+                                    struct _openslide_cache_entry **entry) {
+  struct my_src_mgr *src = (struct my_src_mgr *) cinfo->src;
+  _openslide_cache_put_compressed(osr->cache, plane, tileno, 0,
+                                  src->buffer, src->buffer_size, entry);
+  src->buffer = NULL;
+  src->buffer_size = 0;
+}
+
 // does not destroy cinfo
 static void random_access_src_destroy(j_decompress_ptr cinfo) {
   struct my_src_mgr *src = (struct my_src_mgr *) cinfo->src;   // sorry
-  g_slice_free1(src->buffer_size, src->buffer);
+  if (src) {
+    g_slice_free1(src->buffer_size, src->buffer);
+  }
+}
+
+static void strip_decoder_destroy(struct strip_decoder *dec) {
+  random_access_src_destroy(&dec->cinfo);
+  jpeg_destroy_decompress(&dec->cinfo);
+  if (dec->compressed_entry) {
+    _openslide_cache_entry_unref(dec->compressed_entry);
+  }
+  g_slice_free(struct strip_decoder, dec);
 }
 
 static void jpeg_level_free(gpointer data) {
   //g_debug("level_free: %p", data);
   struct jpeg_level *l = data;
+  if (l->parked) {
+    strip_decoder_destroy(l->parked);
+  }
   g_free(l->jpegs);
   _openslide_grid_destroy(l->grid);
   g_slice_free(struct jpeg_level, l);
@@ -328,9 +413,13 @@ static void jpeg_destroy_data(int32_t num_jpegs, struct jpeg **jpegs,
   // each jpeg in turn
   for (int32_t i = 0; i < num_jpegs; i++) {
     struct jpeg *jpeg = jpegs[i];
+    _openslide_pool_evict(jpeg->filename);
     g_free(jpeg->filename);
     g_free(jpeg->mcu_starts);
     g_free(jpeg->unreliable_mcu_starts);
+    if (jpeg->mcu_lock) {
+      g_mutex_free(jpeg->mcu_lock);
+    }
     g_slice_free(struct jpeg, jpeg);
   }
 
@@ -560,6 +649,26 @@ static bool _compute_mcu_start(struct jpeg *jpeg,
   return true;
 }
 
+// move the JPEG to the front of the scanners' queue
+static void want_restart_markers(openslide_t *osr, struct jpeg *jpeg) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+
+  if (jpeg->tile_count <= 1 || g_atomic_int_get(&jpeg->scan_done) ||
+      data->restart_marker_thread_count == 0) {
+    return;
+  }
+
+  g_mutex_lock(data->restart_marker_mutex);
+  if (!jpeg->scan_claimed) {
+    if (jpeg->scan_wanted) {
+      g_queue_remove(data->restart_marker_wanted, jpeg);
+    }
+    jpeg->scan_wanted = true;
+    g_queue_push_head(data->restart_marker_wanted, jpeg);
+  }
+  g_mutex_unlock(data->restart_marker_mutex);
+}
+
 static bool compute_mcu_start(openslide_t *osr,
 			      struct jpeg *jpeg,
 			      FILE *f,
@@ -567,7 +676,6 @@ static bool compute_mcu_start(openslide_t *osr,
 			      int64_t *start_position,
 			      int64_t *stop_position,
 			      GError **err) {
-  struct hamamatsu_jpeg_ops_data *data = osr->data;
   bool success = false;
 
   if (tileno < 0 || tileno >= jpeg->tile_count) {
@@ -576,7 +684,9 @@ static bool compute_mcu_start(openslide_t *osr,
     return false;
   }
 
-  g_mutex_lock(data->restart_marker_mutex);
+  want_restart_markers(osr, jpeg);
+
+  g_mutex_lock(jpeg->mcu_lock);
 
   if (!_compute_mcu_start(jpeg, f, tileno, err)) {
     goto OUT;
@@ -605,7 +715,7 @@ static bool compute_mcu_start(openslide_t *osr,
   success = true;
 
 OUT:
-  g_mutex_unlock(data->restart_marker_mutex);
+  g_mutex_unlock(jpeg->mcu_lock);
   return success;
 }
 
@@ -617,11 +727,24 @@ static bool read_from_jpeg(openslide_t *osr,
                            int32_t w, int32_t h,
                            GError **err) {
   bool success = false;
+  FILE *f = NULL;
+
+  // the tile's compressed data may already be cached; it is the same
+  // for every level using this JPEG
+  struct _openslide_cache_entry *entry;
+  int64_t compressed_len;
+  const void *compressed =
+    _openslide_cache_get_compressed(osr->cache, jpeg, tileno, 0,
+                                    &compressed_len, &entry);
+  // set after setjmp and read after longjmp
+  struct _openslide_cache_entry * volatile compressed_entry = entry;
 
   // open file
-  FILE *f = _openslide_fopen(jpeg->filename, "rb", err);
-  if (f == NULL) {
-    return false;
+  if (compressed == NULL) {
+    f = _openslide_pool_fopen(jpeg->filename, err);
+    if (f == NULL) {
+      return false;
+    }
   }
 
   // begin decompress
@@ -629,19 +752,14 @@ static bool read_from_jpeg(openslide_t *osr,
   struct _openslide_jpeg_error_mgr jerr;
   jmp_buf env;
 
-  volatile gsize row_size = 0;  // preserve across longjmp
-
-  JSAMPARRAY buffer = g_slice_alloc0(sizeof(JSAMPROW) * MAX_SAMP_FACTOR);
-  cinfo.rec_outbuf_height = 0;
-
   if (setjmp(env) == 0) {
     // figure out where to start the data stream
     int64_t start_position;
     int64_t stop_position;
-    if (!compute_mcu_start(osr, jpeg, f, tileno,
-                           &start_position,
-                           &stop_position,
-                           err)) {
+    if (f && !compute_mcu_start(osr, jpeg, f, tileno,
+                                &start_position,
+                                &stop_position,
+                                err)) {
       goto OUT;
     }
 
@@ -651,14 +769,22 @@ static bool read_from_jpeg(openslide_t *osr,
     // start decompressing
     jpeg_create_decompress(&cinfo);
 
-    if (!jpeg_random_access_src(&cinfo, f,
-                                jpeg->start_in_file,
-                                jpeg->sof_position,
-                                jpeg->header_stop_position,
-                                start_position,
-                                stop_position,
-                                err)) {
-      goto OUT_JPEG;
+    if (compressed) {
+      jpeg_assembled_src(&cinfo, compressed, compressed_len);
+    } else {
+      if (!jpeg_random_access_src(&cinfo, f,
+                                  jpeg->start_in_file,
+                                  jpeg->sof_position,
+                                  jpeg->header_stop_position,
+                                  start_position,
+                                  stop_position,
+                                  err)) {
+        goto OUT_JPEG;
+      }
+      if (_openslide_cache_compressed_enabled(osr->cache)) {
+        random_access_src_cache(osr, &cinfo, jpeg, tileno, &entry);
+        compressed_entry = entry;
+      }
     }
 
     jpeg_read_header(&cinfo, TRUE);
@@ -666,20 +792,13 @@ static bool read_from_jpeg(openslide_t *osr,
     cinfo.scale_denom = scale_denom;
     cinfo.image_width = jpeg->tile_width;  // cunning
     cinfo.image_height = jpeg->tile_height;
-    cinfo.out_color_space = JCS_RGB;
+    _openslide_jpeg_set_argb_output(&cinfo);
 
     jpeg_start_decompress(&cinfo);
 
     //    g_debug("output_width: %d", cinfo.output_width);
     //    g_debug("output_height: %d", cinfo.output_height);
 
-    // allocate scanline buffers
-    row_size = sizeof(JSAMPLE) * cinfo.output_width * cinfo.output_components;
-    for (int i = 0; i < cinfo.rec_outbuf_height; i++) {
-      buffer[i] = g_slice_alloc(row_size);
-      //g_debug("buffer[%d]: %p", i, buffer[i]);
-    }
-
     if ((cinfo.output_width != (unsigned int) w) || (cinfo.output_height != (unsigned int) h)) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Dimensional mismatch in read_from_jpeg, "
@@ -689,30 +808,7 @@ static bool read_from_jpeg(openslide_t *osr,
     }
 
     // decompress
-    uint32_t *jpeg_dest = dest;
-    while (cinfo.output_scanline < cinfo.output_height) {
-      JDIMENSION rows_read = jpeg_read_scanlines(&cinfo,
-                                                 buffer,
-                                                 cinfo.rec_outbuf_height);
-      //g_debug("just read scanline %d", cinfo.output_scanline - rows_read);
-      //g_debug(" rows read: %d", rows_read);
-      int cur_buffer = 0;
-      while (rows_read > 0) {
-        // copy a row
-        int32_t dest_i = 0;
-        for (int32_t i = 0; i < w; i++) {
-          jpeg_dest[dest_i++] = 0xFF000000 |      // A
-            buffer[cur_buffer][i * 3 + 0] << 16 | // R
-            buffer[cur_buffer][i * 3 + 1] << 8 |  // G
-            buffer[cur_buffer][i * 3 + 2];        // B
-        }
-
-        // advance everything 1 row
-        cur_buffer++;
-        jpeg_dest += cinfo.output_width;
-        rows_read--;
-      }
-    }
+    _openslide_jpeg_read_argb(&cinfo, dest);
     success = true;
   } else {
     // setjmp returns again
@@ -727,17 +823,167 @@ OUT_JPEG:
   jpeg_destroy_decompress(&cinfo);
 
 OUT:
-  // free buffers
-  for (int i = 0; i < cinfo.rec_outbuf_height; i++) {
-    g_slice_free1(row_size, buffer[i]);
+  if (f) {
+    _openslide_pool_fclose(jpeg->filename, f);
+  }
+  if (compressed_entry) {
+    _openslide_cache_entry_unref(compressed_entry);
   }
-  g_slice_free1(sizeof(JSAMPROW) * MAX_SAMP_FACTOR, buffer);
-
-  fclose(f);
 
   return success;
 }
 
+// a decoder for the whole of a single-tile JPEG, ready for its first
+// scanline
+static struct strip_decoder *strip_decoder_create(openslide_t *osr,
+                                                  struct jpeg *jpeg,
+                                                  int32_t scale_denom,
+                                                  int32_t w,
+                                                  GError **err) {
+  struct strip_decoder *dec = g_slice_new0(struct strip_decoder);
+  FILE *f = NULL;
+
+  // the compressed data may already be cached
+  int64_t compressed_len;
+  const void *compressed =
+    _openslide_cache_get_compressed(osr->cache, jpeg, 0, 0,
+                                    &compressed_len,
+                                    &dec->compressed_entry);
+  if (compressed == NULL) {
+    f = _openslide_pool_fopen(jpeg->filename, err);
+    if (f == NULL) {
+      g_slice_free(struct strip_decoder, dec);
+      return NULL;
+    }
+  }
+
+  // set after setjmp and read after longjmp
+  volatile bool created = false;
+  jmp_buf env;
+
+  if (setjmp(env) == 0) {
+    int64_t start_position;
+    int64_t stop_position;
+    if (f && !compute_mcu_start(osr, jpeg, f, 0,
+                                &start_position,
+                                &stop_position,
+                                err)) {
+      goto FAIL;
+    }
+
+    dec->cinfo.err = _openslide_jpeg_set_error_handler(&dec->jerr, &env);
+    jpeg_create_decompress(&dec->cinfo);
+    created = true;
+
+    if (compressed) {
+      jpeg_assembled_src(&dec->cinfo, compressed, compressed_len);
+    } else {
+      if (!jpeg_random_access_src(&dec->cinfo, f,
+                                  jpeg->start_in_file,
+                                  jpeg->sof_position,
+                                  jpeg->header_stop_position,
+                                  start_position,
+                                  stop_position,
+                                  err)) {
+        goto FAIL;
+      }
+      if (_openslide_cache_compressed_enabled(osr->cache)) {
+        random_access_src_cache(osr, &dec->cinfo, jpeg, 0,
+                                &dec->compressed_entry);
+      }
+    }
+
+    jpeg_read_header(&dec->cinfo, TRUE);
+    dec->cinfo.scale_num = 1;
+    dec->cinfo.scale_denom = scale_denom;
+    dec->cinfo.image_width = jpeg->tile_width;  // cunning
+    dec->cinfo.image_height = jpeg->tile_height;
+    _openslide_jpeg_set_argb_output(&dec->cinfo);
+
+    jpeg_start_decompress(&dec->cinfo);
+
+    if (dec->cinfo.output_width != (unsigned int) w) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Dimensional mismatch in strip_decoder_create, "
+                  "expected width %d, got %d",
+                  w, dec->cinfo.output_width);
+      goto FAIL;
+    }
+
+    // the data is in memory now
+    if (f) {
+      _openslide_pool_fclose(jpeg->filename, f);
+    }
+    return dec;
+  } else {
+    // setjmp returns again
+    g_propagate_error(err, dec->jerr.err);
+  }
+
+FAIL:
+  if (f) {
+    _openslide_pool_fclose(jpeg->filename, f);
+  }
+  if (created) {
+    random_access_src_destroy(&dec->cinfo);
+    jpeg_destroy_decompress(&dec->cinfo);
+  }
+  if (dec->compressed_entry) {
+    _openslide_cache_entry_unref(dec->compressed_entry);
+  }
+  g_slice_free(struct strip_decoder, dec);
+  return NULL;
+}
+
+// decode rows of a strip, continuing from a parked decoder if one
+// hasn't passed the strip yet
+static bool read_jpeg_strip(openslide_t *osr,
+                            struct jpeg_level *l,
+                            int64_t strip,
+                            uint32_t *dest,
+                            int32_t rows,
+                            GError **err) {
+  int64_t first_row = strip * l->tile_height;
+
+  struct strip_decoder *dec = g_atomic_pointer_get(&l->parked);
+  if (dec && !g_atomic_pointer_compare_and_exchange(&l->parked, dec, NULL)) {
+    // another thread took it
+    dec = NULL;
+  }
+  if (dec && dec->cinfo.output_scanline > first_row) {
+    strip_decoder_destroy(dec);
+    dec = NULL;
+  }
+  if (dec == NULL) {
+    dec = strip_decoder_create(osr, l->jpegs[0], l->scale_denom,
+                               l->tile_width, err);
+    if (dec == NULL) {
+      return false;
+    }
+  }
+
+  jmp_buf env;
+  dec->jerr.env = &env;
+  if (setjmp(env) == 0) {
+    _openslide_jpeg_skip_rows(&dec->cinfo,
+                              first_row - dec->cinfo.output_scanline);
+    _openslide_jpeg_read_argb_rows(&dec->cinfo, dest, rows);
+  } else {
+    // setjmp returns again
+    g_propagate_error(err, dec->jerr.err);
+    strip_decoder_destroy(dec);
+    return false;
+  }
+
+  // park it for a later strip, unless it's finished or another decoder
+  // got there first
+  if (dec->cinfo.output_scanline >= dec->cinfo.output_height ||
+      !g_atomic_pointer_compare_and_exchange(&l->parked, NULL, dec)) {
+    strip_decoder_destroy(dec);
+  }
+  return true;
+}
+
 static bool read_jpeg_tile(openslide_t *osr,
                            cairo_t *cr,
                            struct _openslide_level *level,
@@ -746,20 +992,10 @@ static bool read_jpeg_tile(openslide_t *osr,
                            GError **err) {
   struct jpeg_level *l = (struct jpeg_level *) level;
 
-  int32_t jpeg_col = tile_col / l->jpegs[0]->tiles_across;
-  int32_t jpeg_row = tile_row / l->jpegs[0]->tiles_down;
-  int32_t local_tile_col = tile_col % l->jpegs[0]->tiles_across;
-  int32_t local_tile_row = tile_row % l->jpegs[0]->tiles_down;
-
-  // grid should ensure tile col/row are in bounds
-  g_assert(jpeg_col >= 0 && jpeg_col < l->jpegs_across);
-  g_assert(jpeg_row >= 0 && jpeg_row < l->jpegs_down);
-
-  struct jpeg *jp = l->jpegs[jpeg_row * l->jpegs_across + jpeg_col];
-  int32_t tileno = local_tile_row * jp->tiles_across + local_tile_col;
-
   int32_t tw = l->tile_width;
   int32_t th = l->tile_height;
+  // the last strip may be short
+  int32_t rows = l->strips ? MIN(th, l->base.h - tile_row * th) : th;
 
   //g_debug("hamamatsu read_tile: jpeg %d %d, local %d %d, tile %d, dim %d %d", jpeg_col, jpeg_row, local_tile_col, local_tile_row, tileno, tw, th);
 
@@ -770,15 +1006,35 @@ static bool read_jpeg_tile(openslide_t *osr,
                                             &cache_entry);
 
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!read_from_jpeg(osr,
-                        jp, tileno,
-                        l->scale_denom,
-                        tiledata, tw, th,
-                        err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    int64_t perf_start = _openslide_perf_start();
+    bool success;
+    if (l->strips) {
+      success = read_jpeg_strip(osr, l, tile_row, tiledata, rows, err);
+    } else {
+      int32_t jpeg_col = tile_col / l->jpegs[0]->tiles_across;
+      int32_t jpeg_row = tile_row / l->jpegs[0]->tiles_down;
+      int32_t local_tile_col = tile_col % l->jpegs[0]->tiles_across;
+      int32_t local_tile_row = tile_row % l->jpegs[0]->tiles_down;
+
+      // grid should ensure tile col/row are in bounds
+      g_assert(jpeg_col >= 0 && jpeg_col < l->jpegs_across);
+      g_assert(jpeg_row >= 0 && jpeg_row < l->jpegs_down);
+
+      struct jpeg *jp = l->jpegs[jpeg_row * l->jpegs_across + jpeg_col];
+      int32_t tileno = local_tile_row * jp->tiles_across + local_tile_col;
+
+      success = read_from_jpeg(osr,
+                               jp, tileno,
+                               l->scale_denom,
+                               tiledata, tw, th,
+                               err);
+    }
+    if (!success) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
+    _openslide_perf_end(OPENSLIDE_PERF_DECODE_JPEG, perf_start, tw * th * 4);
 
     _openslide_cache_put(osr->cache,
 			 level, tile_col, tile_row,
@@ -790,12 +1046,14 @@ static bool read_jpeg_tile(openslide_t *osr,
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
 								 CAIRO_FORMAT_RGB24,
-								 tw, th,
+								 tw, rows,
 								 tw * 4);
 
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * rows * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -812,66 +1070,51 @@ static bool jpeg_paint_region(openslide_t *osr, cairo_t *cr,
   struct hamamatsu_jpeg_ops_data *data = osr->data;
   struct jpeg_level *l = (struct jpeg_level *) level;
 
-  g_mutex_lock(data->restart_marker_cond_mutex);
+  g_mutex_lock(data->restart_marker_mutex);
   // check for background errors
   if (data->restart_marker_thread_error) {
     // propagate error
     g_propagate_error(err, data->restart_marker_thread_error);
     data->restart_marker_thread_error = NULL;
-    g_mutex_unlock(data->restart_marker_cond_mutex);
+    g_mutex_unlock(data->restart_marker_mutex);
     return false;
   }
-  // tell the background thread to pause
-  data->restart_marker_users++;
-  //  g_debug("telling thread to pause");
-  g_mutex_unlock(data->restart_marker_cond_mutex);
+  g_mutex_unlock(data->restart_marker_mutex);
 
   // paint
-  bool success = _openslide_grid_paint_region(l->grid, cr, NULL,
-                                              x / level->downsample,
-                                              y / level->downsample,
-                                              level, w, h,
-                                              err);
+  return _openslide_grid_paint_region(l->grid, cr, NULL,
+                                      x / level->downsample,
+                                      y / level->downsample,
+                                      level, w, h,
+                                      err);
+}
 
-  // maybe tell the background thread to resume
-  g_mutex_lock(data->restart_marker_cond_mutex);
-  if (!--data->restart_marker_users) {
-    g_timer_start(data->restart_marker_timer);
-    //  g_debug("telling thread to awaken");
-    g_cond_signal(data->restart_marker_cond);
+static void join_restart_marker_threads(struct hamamatsu_jpeg_ops_data *data) {
+  for (int32_t i = 0; i < data->restart_marker_thread_count; i++) {
+    g_thread_join(data->restart_marker_threads[i]);
   }
-  g_mutex_unlock(data->restart_marker_cond_mutex);
-
-  return success;
+  g_free(data->restart_marker_threads);
+  data->restart_marker_threads = NULL;
+  data->restart_marker_thread_count = 0;
 }
 
 static void jpeg_do_destroy(openslide_t *osr) {
   struct hamamatsu_jpeg_ops_data *data = osr->data;
 
-  // tell the thread to finish and wait
-  g_mutex_lock(data->restart_marker_cond_mutex);
-  g_warn_if_fail(data->restart_marker_users == 0);
-  data->restart_marker_thread_stop = true;
-  g_cond_signal(data->restart_marker_cond);
-  g_mutex_unlock(data->restart_marker_cond_mutex);
-  if (data->restart_marker_thread) {
-    g_thread_join(data->restart_marker_thread);
-  }
+  // tell the threads to finish and wait
+  g_atomic_int_set(&data->restart_marker_thread_stop, 1);
+  join_restart_marker_threads(data);
 
   // jpegs and levels
   jpeg_destroy_data(data->jpeg_count, data->all_jpegs,
                     osr->level_count, (struct jpeg_level **) osr->levels);
 
   // the background stuff
-  g_mutex_lock(data->restart_marker_cond_mutex);
   if (data->restart_marker_thread_error) {
     g_error_free(data->restart_marker_thread_error);
   }
-  g_mutex_unlock(data->restart_marker_cond_mutex);
+  g_queue_free(data->restart_marker_wanted);
   g_mutex_free(data->restart_marker_mutex);
-  g_timer_destroy(data->restart_marker_timer);
-  g_cond_free(data->restart_marker_cond);
-  g_mutex_free(data->restart_marker_cond_mutex);
 
   // the structure
   g_slice_free(struct hamamatsu_jpeg_ops_data, data);
@@ -982,98 +1225,232 @@ static bool verify_mcu_starts(int32_t num_jpegs, struct jpeg **jpegs,
   return true;
 }
 
-static gpointer restart_marker_thread_func(gpointer d) {
-  openslide_t *osr = d;
-  struct hamamatsu_jpeg_ops_data *data = osr->data;
+/*
+ * Optional on-disk index of restart marker offsets, one file per JPEG,
+ * stored in the directory named by OPENSLIDE_INDEX_CACHE_DIR.  Saved
+ * offsets are loaded as unreliable MCU starts, so each one is still
+ * checked against the file before use.  All fields are little-endian.
+ */
+#define MCU_INDEX_MAGIC "OSMCUIDX"
+#define MCU_INDEX_VERSION 1
 
-  int32_t current_jpeg = 0;
-  int32_t current_mcu_start = 0;
+struct mcu_index_header {
+  char magic[8];
+  uint32_t version;
+  int32_t tile_count;
+  int64_t file_size;
+  int64_t file_mtime;
+  int64_t start_in_file;
+  int64_t header_stop_position;
+};
 
-  FILE *current_file = NULL;
+static char *get_mcu_index_path(struct jpeg *jp) {
+  char *canonical = _openslide_canonicalize_path(jp->filename);
+  if (canonical == NULL) {
+    return NULL;
+  }
+  // NDPI files hold several JPEGs
+  char *key = g_strdup_printf("%s:%"G_GINT64_FORMAT,
+                              canonical, jp->start_in_file);
+  char *path = _openslide_get_cache_path(key, ".mcu");
+  g_free(key);
+  g_free(canonical);
+  return path;
+}
 
-  GError *tmp_err = NULL;
+static bool make_mcu_index_header(struct jpeg *jp,
+                                  struct mcu_index_header *hdr) {
+  struct stat st;
+  if (g_stat(jp->filename, &st)) {
+    return false;
+  }
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, MCU_INDEX_MAGIC, sizeof(hdr->magic));
+  hdr->version = GUINT32_TO_LE(MCU_INDEX_VERSION);
+  hdr->tile_count = GINT32_TO_LE(jp->tile_count);
+  hdr->file_size = GINT64_TO_LE((int64_t) st.st_size);
+  hdr->file_mtime = GINT64_TO_LE((int64_t) st.st_mtime);
+  hdr->start_in_file = GINT64_TO_LE(jp->start_in_file);
+  hdr->header_stop_position = GINT64_TO_LE(jp->header_stop_position);
+  return true;
+}
+
+// returns unreliable MCU starts, or NULL if there's no usable index
+static int64_t *load_mcu_index(struct jpeg *jp) {
+  char *path = get_mcu_index_path(jp);
+  if (path == NULL) {
+    return NULL;
+  }
 
-  while(current_jpeg < data->jpeg_count) {
-    g_mutex_lock(data->restart_marker_cond_mutex);
+  int64_t *result = NULL;
+  char *buf = NULL;
+  gsize len;
+  struct mcu_index_header expected;
+  if (!make_mcu_index_header(jp, &expected) ||
+      !g_file_get_contents(path, &buf, &len, NULL)) {
+    goto DONE;
+  }
+  if (len != sizeof(expected) + jp->tile_count * sizeof(int64_t) ||
+      memcmp(buf, &expected, sizeof(expected))) {
+    // stale or foreign
+    goto DONE;
+  }
 
-    // should we pause?
-    while (data->restart_marker_users && !data->restart_marker_thread_stop) {
-      //      g_debug("thread paused");
-      g_cond_wait(data->restart_marker_cond,
-		  data->restart_marker_cond_mutex); // zzz
-      //      g_debug("thread awoken");
+  result = g_new(int64_t, jp->tile_count);
+  const char *p = buf + sizeof(expected);
+  for (int32_t i = 0; i < jp->tile_count; i++) {
+    int64_t offset;
+    memcpy(&offset, p + i * sizeof(offset), sizeof(offset));
+    result[i] = GINT64_FROM_LE(offset);
+  }
+
+DONE:
+  g_free(buf);
+  g_free(path);
+  return result;
+}
+
+// mcu_starts must be complete
+static void save_mcu_index(struct jpeg *jp, const int64_t *mcu_starts) {
+  char *path = get_mcu_index_path(jp);
+  if (path == NULL) {
+    return;
+  }
+
+  struct mcu_index_header hdr;
+  if (make_mcu_index_header(jp, &hdr)) {
+    gsize len = sizeof(hdr) + jp->tile_count * sizeof(int64_t);
+    char *buf = g_malloc(len);
+    memcpy(buf, &hdr, sizeof(hdr));
+    char *p = buf + sizeof(hdr);
+    for (int32_t i = 0; i < jp->tile_count; i++) {
+      int64_t offset = GINT64_TO_LE(mcu_starts[i]);
+      memcpy(p + i * sizeof(offset), &offset, sizeof(offset));
     }
+    // written atomically; failure only costs a rescan next time
+    GError *tmp_err = NULL;
+    if (!g_file_set_contents(path, buf, len, &tmp_err)) {
+      g_debug("Couldn't save restart marker index: %s", tmp_err->message);
+      g_clear_error(&tmp_err);
+    }
+    g_free(buf);
+  }
+  g_free(path);
+}
 
-    // should we stop?
-    if (data->restart_marker_thread_stop) {
-      //      g_debug("thread stopping");
-      g_mutex_unlock(data->restart_marker_cond_mutex);
+// the JPEG a reader most recently asked for, or else the next one in
+// file order
+static struct jpeg *claim_jpeg_to_scan(struct hamamatsu_jpeg_ops_data *data) {
+  struct jpeg *jp;
+
+  g_mutex_lock(data->restart_marker_mutex);
+  while ((jp = g_queue_pop_head(data->restart_marker_wanted)) != NULL) {
+    jp->scan_wanted = false;
+    if (!jp->scan_claimed) {
       break;
     }
+  }
+  while (jp == NULL && data->restart_marker_next < data->jpeg_count) {
+    struct jpeg *candidate = data->all_jpegs[data->restart_marker_next++];
+    if (candidate->tile_count > 1 && !candidate->scan_claimed) {
+      jp = candidate;
+      if (jp->scan_wanted) {
+        g_queue_remove(data->restart_marker_wanted, jp);
+        jp->scan_wanted = false;
+      }
+    }
+  }
+  if (jp) {
+    jp->scan_claimed = true;
+  }
+  g_mutex_unlock(data->restart_marker_mutex);
+  return jp;
+}
 
-    // should we sleep?
-    double time_to_sleep = 1.0 - g_timer_elapsed(data->restart_marker_timer,
-						 NULL);
-    if (time_to_sleep > 0) {
-      GTimeVal abstime;
-      gulong sleep_time = G_USEC_PER_SEC * time_to_sleep;
-
-      g_get_current_time(&abstime);
-      g_time_val_add(&abstime, sleep_time);
+// give the JPEG back if readers are waiting for a different one.  the
+// markers found so far are kept.
+static bool yield_jpeg_to_scan(struct hamamatsu_jpeg_ops_data *data,
+                               struct jpeg *jp) {
+  bool yielded = false;
 
-      //      g_debug("zz: %lu", sleep_time);
-      g_cond_timed_wait(data->restart_marker_cond,
-			data->restart_marker_cond_mutex,
-			&abstime);
-      //      g_debug("running again");
-      g_mutex_unlock(data->restart_marker_cond_mutex);
-      continue;
+  g_mutex_lock(data->restart_marker_mutex);
+  if (!g_queue_is_empty(data->restart_marker_wanted)) {
+    jp->scan_claimed = false;
+    if (!jp->scan_wanted) {
+      // behind the JPEGs that readers asked for
+      jp->scan_wanted = true;
+      g_queue_push_tail(data->restart_marker_wanted, jp);
     }
+    yielded = true;
+  }
+  g_mutex_unlock(data->restart_marker_mutex);
+  return yielded;
+}
 
-    // we are finally able to run
-    g_mutex_unlock(data->restart_marker_cond_mutex);
+static bool scan_jpeg(openslide_t *osr, struct jpeg *jp, GError **err) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
 
-    //g_debug("current_jpeg: %d, current_mcu_start: %d",
-    //        current_jpeg, current_mcu_start);
+  FILE *f = _openslide_fopen(jp->filename, "rb", err);
+  if (f == NULL) {
+    return false;
+  }
 
-    struct jpeg *jp = data->all_jpegs[current_jpeg];
-    if (jp->tile_count > 1) {
-      if (current_file == NULL) {
-	current_file = _openslide_fopen(jp->filename, "rb", &tmp_err);
-	if (current_file == NULL) {
-	  //g_debug("restart_marker_thread_func fopen failed");
-	  break;
-	}
-      }
+  for (int32_t tile = 0; tile < jp->tile_count; tile += MARKER_SCAN_STEP) {
+    if (g_atomic_int_get(&data->restart_marker_thread_stop) ||
+        (tile > 0 && yield_jpeg_to_scan(data, jp))) {
+      fclose(f);
+      return true;
+    }
+    int32_t target = MIN(tile + MARKER_SCAN_STEP, jp->tile_count) - 1;
+    if (!compute_mcu_start(osr, jp, f, target, NULL, NULL, err)) {
+      fclose(f);
+      return false;
+    }
+  }
+  fclose(f);
+  g_atomic_int_set(&jp->scan_done, 1);
 
-      if (!compute_mcu_start(osr, jp, current_file, current_mcu_start,
-                             NULL, NULL, &tmp_err)) {
-        //g_debug("restart_marker_thread_func compute_mcu_start failed");
-        fclose(current_file);
-        break;
-      }
+  // remember the offsets for next time
+  if (jp->unreliable_mcu_starts == NULL) {
+    g_mutex_lock(jp->mcu_lock);
+    int64_t *mcu_starts = g_memdup(jp->mcu_starts,
+                                   jp->tile_count * sizeof(int64_t));
+    g_mutex_unlock(jp->mcu_lock);
+    save_mcu_index(jp, mcu_starts);
+    g_free(mcu_starts);
+  }
+  return true;
+}
 
-      current_mcu_start++;
-      if (current_mcu_start >= jp->tile_count) {
-	current_mcu_start = 0;
-	current_jpeg++;
-	fclose(current_file);
-	current_file = NULL;
-      }
-    } else {
-      current_jpeg++;
+static gpointer restart_marker_thread_func(gpointer d) {
+  openslide_t *osr = d;
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+
+  GError *tmp_err = NULL;
+
+  while (!g_atomic_int_get(&data->restart_marker_thread_stop)) {
+    struct jpeg *jp = claim_jpeg_to_scan(data);
+    if (jp == NULL) {
+      // nothing left
+      break;
+    }
+    if (!scan_jpeg(osr, jp, &tmp_err)) {
+      break;
     }
   }
 
   // store error, if any
   if (tmp_err) {
     //g_debug("restart_marker_thread_func failed: %s", tmp_err->message);
-    g_mutex_lock(data->restart_marker_cond_mutex);
-    data->restart_marker_thread_error = tmp_err;
-    g_mutex_unlock(data->restart_marker_cond_mutex);
+    g_mutex_lock(data->restart_marker_mutex);
+    if (data->restart_marker_thread_error == NULL) {
+      data->restart_marker_thread_error = tmp_err;
+    } else {
+      g_error_free(tmp_err);
+    }
+    g_mutex_unlock(data->restart_marker_mutex);
   }
 
-  //  g_debug("restart_marker_thread_func done!");
   return NULL;
 }
 
@@ -1306,6 +1683,7 @@ static void create_scaled_jpeg_levels(openslide_t *osr,
       // create a derived level
       struct jpeg_level *sd_l = g_slice_new0(struct jpeg_level);
       sd_l->scale_denom = scale_denom;
+      sd_l->strips = l->strips;
 
       sd_l->base.w = l->base.w / scale_denom;
       sd_l->base.h = l->base.h / scale_denom;
@@ -1397,38 +1775,47 @@ static bool init_jpeg_ops(openslide_t *osr,
   osr->level_count = level_count;
   osr->levels = (struct _openslide_level **) levels;
 
-  // init background thread for finding restart markers
-  data->restart_marker_timer = g_timer_new();
+  // init background threads for finding restart markers
   data->restart_marker_mutex = g_mutex_new();
-  data->restart_marker_cond = g_cond_new();
-  data->restart_marker_cond_mutex = g_mutex_new();
+  data->restart_marker_wanted = g_queue_new();
+  int32_t scannable = 0;
+  for (int32_t i = 0; i < num_jpegs; i++) {
+    jpegs[i]->mcu_lock = g_mutex_new();
+    if (jpegs[i]->tile_count > 1) {
+      scannable++;
+    }
+  }
   if (background_thread) {
-    data->restart_marker_thread = g_thread_create(restart_marker_thread_func,
-                                                  osr,
-                                                  TRUE,
-                                                  NULL);
+    int32_t count = MIN(CLAMP(_openslide_get_worker_count(), 1,
+                              MAX_MARKER_SCANNERS), scannable);
+    data->restart_marker_threads = g_new(GThread *, MAX(count, 1));
+    for (int32_t i = 0; i < count; i++) {
+      GThread *thread = g_thread_create(restart_marker_thread_func,
+                                        osr, TRUE, NULL);
+      if (thread == NULL) {
+        break;
+      }
+      data->restart_marker_threads[data->restart_marker_thread_count++] =
+        thread;
+    }
   }
 
   // for debugging
   if (_openslide_debug(OPENSLIDE_DEBUG_JPEG_MARKERS)) {
-    // run background thread to completion
-    if (background_thread) {
-      g_thread_join(data->restart_marker_thread);
-      data->restart_marker_thread = NULL;
+    // run background threads to completion
+    if (data->restart_marker_thread_count) {
+      join_restart_marker_threads(data);
     } else {
       restart_marker_thread_func(osr);
     }
 
     // check for errors
-    g_mutex_lock(data->restart_marker_cond_mutex);
     if (data->restart_marker_thread_error) {
       g_propagate_error(err, data->restart_marker_thread_error);
       data->restart_marker_thread_error = NULL;
-      g_mutex_unlock(data->restart_marker_cond_mutex);
       jpeg_do_destroy(osr);
       return false;
     }
-    g_mutex_unlock(data->restart_marker_cond_mutex);
 
     // verify results
     if (!verify_mcu_starts(num_jpegs, jpegs, err)) {
@@ -1468,6 +1855,18 @@ static struct jpeg_level *create_jpeg_level(openslide_t *osr,
   l->tile_height = jpegs[0]->tile_height;
   l->scale_denom = 1;
 
+  // a lone JPEG without restart markers is a single huge tile; serve it
+  // in strips instead, so a small read doesn't decode and cache all of it
+  if (jpeg_cols == 1 && jpeg_rows == 1 && jpegs[0]->tile_count == 1) {
+    int64_t strip_rows = STRIP_BYTES / ((int64_t) l->tile_width * 4);
+    strip_rows = MAX(strip_rows / STRIP_ROW_ALIGN, 1) * STRIP_ROW_ALIGN;
+    if (l->base.h > strip_rows) {
+      l->strips = true;
+      l->tile_height = strip_rows;
+      l->tiles_down = (l->base.h + strip_rows - 1) / strip_rows;
+    }
+  }
+
   // jpeg array
   int32_t num_jpegs = l->jpegs_across * l->jpegs_down;
   l->jpegs = g_new(struct jpeg *, num_jpegs);
@@ -1614,6 +2013,10 @@ static bool hamamatsu_vms_part2(openslide_t *osr,
       // the optimisation file is useless, ignore it
       optimisation_file = NULL;
     }
+    // otherwise use our own saved index, if any
+    if (jp->unreliable_mcu_starts == NULL && jp->tile_count > 1) {
+      jp->unreliable_mcu_starts = load_mcu_index(jp);
+    }
   }
 
   // create levels: base image + map
@@ -1649,6 +2052,7 @@ FAIL:
 static void ngr_destroy(openslide_t *osr) {
   for (int i = 0; i < osr->level_count; i++) {
     struct ngr_level *l = (struct ngr_level *) osr->levels[i];
+    _openslide_pool_evict(l->filename);
     g_free(l->filename);
     _openslide_grid_destroy(l->grid);
     g_slice_free(struct ngr_level, l);
@@ -1674,7 +2078,7 @@ static bool ngr_read_tile(openslide_t *osr,
 
   if (!tiledata) {
     // read the tile data
-    FILE *f = _openslide_fopen(l->filename, "rb", err);
+    FILE *f = _openslide_pool_fopen(l->filename, err);
     if (!f) {
       return false;
     }
@@ -1688,7 +2092,7 @@ static bool ngr_read_tile(openslide_t *osr,
     //      "seeking to %" G_GINT64_FORMAT, tile_x, tile_y, offset);
     if (fseeko(f, offset, SEEK_SET)) {
       _openslide_io_error(err, "Couldn't seek to tile offset");
-      fclose(f);
+      _openslide_pool_fclose(l->filename, f);
       return false;
     }
 
@@ -1696,17 +2100,20 @@ static bool ngr_read_tile(openslide_t *osr,
     int buf_size = tw * th * 6;
     uint16_t *buf = g_slice_alloc(buf_size);
 
-    if (fread(buf, buf_size, 1, f) != 1) {
+    int64_t perf_start = _openslide_perf_start();
+    bool ok = fread(buf, buf_size, 1, f) == 1;
+    _openslide_perf_end(OPENSLIDE_PERF_FILE_IO, perf_start, buf_size);
+    if (!ok) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot read file %s", l->filename);
-      fclose(f);
+      _openslide_pool_fclose(l->filename, f);
       g_slice_free1(buf_size, buf);
       return false;
     }
-    fclose(f);
+    _openslide_pool_fclose(l->filename, f);
 
     // got the data, now convert to 8-bit xRGB
-    tiledata = g_slice_alloc(tilesize);
+    tiledata = _openslide_buffer_alloc(tilesize);
     for (int i = 0; i < tw * th; i++) {
       // scale down from 12 bits
       uint8_t r = GINT16_FROM_LE(buf[(i * 3)]) >> 4;
@@ -1731,7 +2138,9 @@ static bool ngr_read_tile(openslide_t *osr,
                                                                  tw * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * th * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -2173,6 +2582,7 @@ static bool hamamatsu_vms_vmu_open(openslide_t *osr, const char *filename,
 const struct _openslide_format _openslide_format_hamamatsu_vms_vmu = {
   .name = "hamamatsu-vms-vmu",
   .vendor = "hamamatsu",
+  .container = _OPENSLIDE_CONTAINER_NON_TIFF,
   .detect = hamamatsu_vms_vmu_detect,
   .open = hamamatsu_vms_vmu_open,
 };
@@ -2460,6 +2870,10 @@ static bool hamamatsu_ndpi_open(openslide_t *osr, const char *filename,
           }
         }
 
+        if (jp->unreliable_mcu_starts == NULL) {
+          // maybe we scanned before
+          jp->unreliable_mcu_starts = load_mcu_index(jp);
+        }
         if (jp->unreliable_mcu_starts == NULL) {
           // no marker positions; scan for them in the background
           //g_debug("enabling restart marker thread for directory %"G_GINT64_FORMAT, dir);
@@ -2528,9 +2942,123 @@ FAIL:
                        restart_marker_scan, err);
 }
 
+static bool hamamatsu_ndpi_save_snapshot(openslide_t *osr,
+                                         struct _openslide_snapshot *snap) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+
+  if (!_openslide_jpeg_snapshot_associated_images(osr, snap)) {
+    return false;
+  }
+
+  // one JPEG per unscaled level
+  _openslide_snapshot_put_int(snap, data->jpeg_count);
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jp = data->all_jpegs[i];
+    _openslide_snapshot_put_int(snap, jp->start_in_file);
+    _openslide_snapshot_put_int(snap, jp->end_in_file);
+    _openslide_snapshot_put_int(snap, jp->width);
+    _openslide_snapshot_put_int(snap, jp->height);
+    _openslide_snapshot_put_int(snap, jp->tile_width);
+    _openslide_snapshot_put_int(snap, jp->tile_height);
+    _openslide_snapshot_put_int(snap, jp->sof_position);
+    _openslide_snapshot_put_int(snap, jp->header_stop_position);
+    if (jp->unreliable_mcu_starts) {
+      _openslide_snapshot_put_int(snap, jp->tile_count);
+      for (int32_t tile = 0; tile < jp->tile_count; tile++) {
+        _openslide_snapshot_put_int(snap, jp->unreliable_mcu_starts[tile]);
+      }
+    } else {
+      _openslide_snapshot_put_int(snap, 0);
+    }
+  }
+  return _openslide_snapshot_ok(snap);
+}
+
+static bool hamamatsu_ndpi_open_snapshot(openslide_t *osr,
+                                         const char *filename,
+                                         struct _openslide_snapshot *snap,
+                                         GError **err) {
+  GPtrArray *jpeg_array = g_ptr_array_new();
+  GPtrArray *level_array = g_ptr_array_new();
+  bool success = false;
+  bool restart_marker_scan = false;
+
+  if (!_openslide_jpeg_restore_associated_images(osr, snap)) {
+    goto FAIL;
+  }
+
+  int64_t count = _openslide_snapshot_get_int(snap);
+  for (int64_t i = 0; i < count && _openslide_snapshot_ok(snap); i++) {
+    struct jpeg *jp = g_slice_new0(struct jpeg);
+    jp->filename = g_strdup(filename);
+    g_ptr_array_add(jpeg_array, jp);
+
+    jp->start_in_file = _openslide_snapshot_get_int(snap);
+    jp->end_in_file = _openslide_snapshot_get_int(snap);
+    jp->width = _openslide_snapshot_get_int(snap);
+    jp->height = _openslide_snapshot_get_int(snap);
+    jp->tile_width = _openslide_snapshot_get_int(snap);
+    jp->tile_height = _openslide_snapshot_get_int(snap);
+    jp->sof_position = _openslide_snapshot_get_int(snap);
+    jp->header_stop_position = _openslide_snapshot_get_int(snap);
+    if (!_openslide_snapshot_ok(snap) ||
+        jp->tile_width <= 0 || jp->tile_height <= 0 ||
+        jp->width % jp->tile_width || jp->height % jp->tile_height) {
+      goto FAIL;
+    }
+    jp->tiles_across = jp->width / jp->tile_width;
+    jp->tiles_down = jp->height / jp->tile_height;
+    jp->tile_count = jp->tiles_across * jp->tiles_down;
+    jp->mcu_starts = g_new(int64_t, jp->tile_count);
+    for (int32_t tile = 0; tile < jp->tile_count; tile++) {
+      jp->mcu_starts[tile] = -1;
+    }
+
+    int64_t mcu_start_count = _openslide_snapshot_get_int(snap);
+    if (mcu_start_count == jp->tile_count) {
+      jp->unreliable_mcu_starts = g_new(int64_t, jp->tile_count);
+      for (int32_t tile = 0; tile < jp->tile_count; tile++) {
+        jp->unreliable_mcu_starts[tile] = _openslide_snapshot_get_int(snap);
+      }
+    } else if (mcu_start_count != 0) {
+      goto FAIL;
+    }
+    if (jp->tile_count > 1 && jp->unreliable_mcu_starts == NULL) {
+      restart_marker_scan = true;
+    }
+
+    struct jpeg_level *l = create_jpeg_level(osr, &jp, 1, 1);
+    g_ptr_array_add(level_array, l);
+  }
+  success = _openslide_snapshot_ok(snap) && level_array->len > 0;
+
+FAIL:
+  ;
+  int32_t num_jpegs = jpeg_array->len;
+  struct jpeg **jpegs = (struct jpeg **) g_ptr_array_free(jpeg_array, false);
+  int32_t level_count = level_array->len;
+  struct jpeg_level **levels =
+    (struct jpeg_level **) g_ptr_array_free(level_array, false);
+
+  if (!success) {
+    jpeg_destroy_data(num_jpegs, jpegs, level_count, levels);
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Snapshot is invalid");
+    return false;
+  }
+
+  return init_jpeg_ops(osr,
+                       level_count, levels,
+                       num_jpegs, jpegs,
+                       restart_marker_scan, err);
+}
+
 const struct _openslide_format _openslide_format_hamamatsu_ndpi = {
   .name = "hamamatsu-ndpi",
   .vendor = "hamamatsu",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = hamamatsu_ndpi_detect,
   .open = hamamatsu_ndpi_open,
+  .save_snapshot = hamamatsu_ndpi_save_snapshot,
+  .open_snapshot = hamamatsu_ndpi_open_snapshot,
 };
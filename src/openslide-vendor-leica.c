@@ -141,12 +141,12 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level G_GNUC_UNUSED,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+static uint32_t *fetch_tile(openslide_t *osr,
+                            struct _openslide_level *level G_GNUC_UNUSED,
+                            int64_t tile_col, int64_t tile_row,
+                            void *arg,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
   struct read_tile_args *args = arg;
   struct _openslide_tiff_level *tiffl = &args->area->tiffl;
 
@@ -155,32 +155,55 @@ static bool read_tile(openslide_t *osr,
   int64_t th = tiffl->tile_h;
 
   // cache
-  struct _openslide_cache_entry *cache_entry;
   uint32_t *tiledata = _openslide_cache_get(osr->cache,
                                             args->area, tile_col, tile_row,
-                                            &cache_entry);
+                                            cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, args->tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // clip, if necessary
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // put it in the cache
     _openslide_cache_put(osr->cache,
 			 args->area, tile_col, tile_row,
 			 tiledata, tw * th * 4,
-			 &cache_entry);
+			 cache_entry);
+  }
+
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct read_tile_args *args = arg;
+  struct _openslide_tiff_level *tiffl = &args->area->tiffl;
+
+  // tile size
+  int64_t tw = tiffl->tile_w;
+  int64_t th = tiffl->tile_h;
+
+  // cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = fetch_tile(osr, level, tile_col, tile_row, arg,
+                                  &cache_entry, err);
+  if (!tiledata) {
+    return false;
   }
 
   // draw it
@@ -190,7 +213,9 @@ static bool read_tile(openslide_t *osr,
                                                                  tw * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * th * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -691,6 +716,7 @@ static bool create_levels_from_collection(openslide_t *osr,
                                                  tiffl->tile_w,
                                                  tiffl->tile_h,
                                                  read_tile);
+      _openslide_grid_simple_set_fetch_tile(area->grid, fetch_tile);
     }
 
     // set quickhash directory in legacy mode
@@ -877,6 +903,7 @@ FAIL:
 const struct _openslide_format _openslide_format_leica = {
   .name = "leica",
   .vendor = "leica",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = leica_detect,
   .open = leica_open,
 };
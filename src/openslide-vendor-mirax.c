@@ -44,6 +44,7 @@
 #include <zlib.h>
 
 #include "openslide-hash.h"
+#include "openslide-snapshot.h"
 
 static const char MRXS_EXT[] = ".mrxs";
 static const char SLIDEDAT_INI[] = "Slidedat.ini";
@@ -177,19 +178,16 @@ struct slide_zoom_level_params {
   double tile_advance_y;
 };
 
+// tiles carry the index of their image in the level's image array.
+// their offsets are in the grid.
 struct image {
   int32_t fileno;
   int64_t start_in_file;
-  int32_t imageno;   // used only for cache lookup
-  int refcount;
-};
-
-struct tile {
-  struct image *image;
+  int32_t length;
 
-  // location in the image
-  double src_x;
-  double src_y;
+  // the tile at the image's top left
+  int32_t tile_col;
+  int32_t tile_row;
 };
 
 struct level {
@@ -202,22 +200,93 @@ struct level {
 
   double tile_w;
   double tile_h;
+
+  double tile_advance_x;
+  double tile_advance_y;
+
+  struct image *images;
+  int32_t image_count;
+
+  // tiles are built from the index on first use
+  int32_t index_page;        // first data page of this level
+  volatile gint tiles_built; // accessed atomically
+};
+
+// what we need to turn index entries into tiles
+struct image_layout {
+  int datafile_count;
+  char **datafile_paths;
+  int zoom_levels;
+  int images_across;
+  int images_down;
+  int image_divisions;
+  struct slide_zoom_level_params *slide_zoom_level_params;
+  int32_t *slide_positions;
+  GHashTable *active_positions;  // positions present at zoom level 0
+};
+
+// results of the pass over the index at open time
+struct level_scan {
+  GArray *hash_parts;
+  // extent of zoom level 0
+  bool have_bounds;
+  double left;
+  double top;
+  double right;
+  double bottom;
 };
 
 struct mirax_ops_data {
   gchar **datafile_paths;
+
+  // for building tiles; unused when opened from a snapshot
+  GMutex *tiles_lock;
+  struct image_layout layout;
+
+  // for snapshots
+  char *slidedat_path;
+  char *index_path;
 };
 
-static void image_unref(struct image *image) {
-  if (!--image->refcount) {
-    g_slice_free(struct image, image);
+// decode a JPEG image through the compressed tile cache
+static bool read_jpeg_cached(openslide_t *osr,
+                             struct image *image,
+                             uint32_t *dest,
+                             int w, int h,
+                             GError **err) {
+  struct mirax_ops_data *data = osr->data;
+  const char *filename = data->datafile_paths[image->fileno];
+
+  struct _openslide_cache_entry *entry;
+  int64_t len;
+  const void *buf = _openslide_cache_get_compressed(osr->cache, image, 0, 0,
+                                                    &len, &entry);
+  if (buf == NULL) {
+    FILE *f = _openslide_pool_fopen(filename, err);
+    if (f == NULL) {
+      return false;
+    }
+    len = image->length;
+    void *newbuf = g_slice_alloc(len);
+    int64_t perf_start = _openslide_perf_start();
+    if (fseeko(f, image->start_in_file, SEEK_SET) ||
+        fread(newbuf, len, 1, f) != 1) {
+      _openslide_io_error(err, "Couldn't read image at %"G_GINT64_FORMAT
+                          " in %s", image->start_in_file, filename);
+      g_slice_free1(len, newbuf);
+      _openslide_pool_fclose(filename, f);
+      return false;
+    }
+    _openslide_perf_end(OPENSLIDE_PERF_FILE_IO, perf_start, len);
+    _openslide_pool_fclose(filename, f);
+    _openslide_cache_put_compressed(osr->cache, image, 0, 0, newbuf, len,
+                                    &entry);
+    buf = newbuf;
   }
-}
 
-static void tile_free(gpointer data) {
-  struct tile *tile = data;
-  image_unref(tile->image);
-  g_slice_free(struct tile, tile);
+  bool result = _openslide_jpeg_decode_buffer(buf, len, dest, w, h, err);
+  _openslide_cache_entry_unref(entry);
+  return result;
 }
 
 static uint32_t *read_image(openslide_t *osr,
@@ -228,10 +297,16 @@ static uint32_t *read_image(openslide_t *osr,
   struct mirax_ops_data *data = osr->data;
   bool result = false;
 
-  uint32_t *dest = g_slice_alloc(w * h * 4);
+  uint32_t *dest = _openslide_buffer_alloc(w * h * 4);
 
   switch (format) {
   case FORMAT_JPEG:
+    // the index gives the compressed length, so we can keep the
+    // compressed data if asked
+    if (image->length > 0 && _openslide_cache_compressed_enabled(osr->cache)) {
+      result = read_jpeg_cached(osr, image, dest, w, h, err);
+      break;
+    }
     result = _openslide_jpeg_read(data->datafile_paths[image->fileno],
                                   image->start_in_file,
                                   dest, w, h,
@@ -254,7 +329,7 @@ static uint32_t *read_image(openslide_t *osr,
   }
 
   if (!result) {
-    g_slice_free1(w * h * 4, dest);
+    _openslide_buffer_free(w * h * 4, dest);
     return NULL;
   }
   return dest;
@@ -263,72 +338,51 @@ static uint32_t *read_image(openslide_t *osr,
 static bool read_tile(openslide_t *osr,
                       cairo_t *cr,
                       struct _openslide_level *level,
-                      int64_t tile_col G_GNUC_UNUSED,
-                      int64_t tile_row G_GNUC_UNUSED,
+                      int64_t tile_col,
+                      int64_t tile_row,
                       void *data,
                       void *arg G_GNUC_UNUSED,
                       GError **err) {
   struct level *l = (struct level *) level;
-  struct tile *tile = data;
-  bool success = true;
+  int32_t imageno = GPOINTER_TO_INT(data);
+  struct image *image = &l->images[imageno];
 
   int iw = l->image_width;
   int ih = l->image_height;
 
-  //g_debug("mirax read_tile: src: %g %g, dim: %d %d, tile dim: %g %g, region %g %g %g %g", tile->src_x, tile->src_y, l->image_width, l->image_height, l->tile_w, l->tile_h, x, y, w, h);
+  // location in the image
+  double src_x = (tile_col - image->tile_col) * l->tile_w;
+  double src_y = (tile_row - image->tile_row) * l->tile_h;
+
+  //g_debug("mirax read_tile: src: %g %g, dim: %d %d, tile dim: %g %g", src_x, src_y, l->image_width, l->image_height, l->tile_w, l->tile_h);
 
   // get the image data, possibly from cache
   struct _openslide_cache_entry *cache_entry;
   uint32_t *tiledata = _openslide_cache_get(osr->cache,
                                             level,
-                                            tile->image->imageno,
+                                            imageno,
                                             0,
                                             &cache_entry);
 
   if (!tiledata) {
-    tiledata = read_image(osr, tile->image, l->image_format, iw, ih, err);
+    tiledata = read_image(osr, image, l->image_format, iw, ih, err);
     if (tiledata == NULL) {
       return false;
     }
 
     _openslide_cache_put(osr->cache,
-                         level, tile->image->imageno, 0,
+                         level, imageno, 0,
                          tiledata,
                          iw * ih * 4,
                          &cache_entry);
   }
 
-  // draw it
-  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                                                 CAIRO_FORMAT_RGB24,
-                                                                 iw, ih,
-                                                                 iw * 4);
-
-  // if we are drawing a subregion of the tile, we must do an additional copy,
-  // because cairo lacks source clipping
-  if ((l->image_width > l->tile_w) ||
-      (l->image_height > l->tile_h)) {
-    cairo_surface_t *surface2 = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                           ceil(l->tile_w),
-                                                           ceil(l->tile_h));
-    cairo_t *cr2 = cairo_create(surface2);
-    cairo_set_source_surface(cr2, surface, -tile->src_x, -tile->src_y);
-
-    // replace original image surface
-    cairo_surface_destroy(surface);
-    surface = surface2;
-
-    cairo_rectangle(cr2, 0, 0,
-                    ceil(l->tile_w),
-                    ceil(l->tile_h));
-    cairo_fill(cr2);
-    success = _openslide_check_cairo_status(cr2, err);
-    cairo_destroy(cr2);
-  }
-
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_surface_destroy(surface);
-  cairo_paint(cr);
+  // draw it, or the subregion of it that makes up this tile
+  bool success = _openslide_grid_paint_subimage(cr, tiledata,
+                                                CAIRO_FORMAT_RGB24, iw, ih,
+                                                src_x, src_y,
+                                                l->tile_w, l->tile_h,
+                                                err);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -336,13 +390,19 @@ static bool read_tile(openslide_t *osr,
   return success;
 }
 
-static bool paint_region(openslide_t *osr G_GNUC_UNUSED, cairo_t *cr,
+static bool load_level_tiles(openslide_t *osr, struct level *l, GError **err);
+
+static bool paint_region(openslide_t *osr, cairo_t *cr,
                          int64_t x, int64_t y,
                          struct _openslide_level *level,
                          int32_t w, int32_t h,
                          GError **err) {
   struct level *l = (struct level *) level;
 
+  if (!load_level_tiles(osr, l, err)) {
+    return false;
+  }
+
   return _openslide_grid_paint_region(l->grid, cr, NULL,
                                       x / level->downsample,
                                       y / level->downsample,
@@ -357,6 +417,7 @@ static void destroy(openslide_t *osr) {
   for (int32_t i = 0; i < osr->level_count; i++) {
     struct level *l = (struct level *) osr->levels[i];
     _openslide_grid_destroy(l->grid);
+    g_free(l->images);
     g_slice_free(struct level, l);
   }
 
@@ -364,12 +425,39 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 
   // the ops data
+  for (char **path = data->datafile_paths; *path; path++) {
+    _openslide_pool_evict(*path);
+  }
   g_strfreev(data->datafile_paths);
+  g_free(data->slidedat_path);
+  g_free(data->index_path);
+  if (data->tiles_lock) {
+    g_mutex_free(data->tiles_lock);
+  }
+  g_free(data->layout.slide_zoom_level_params);
+  g_free(data->layout.slide_positions);
+  if (data->layout.active_positions) {
+    g_hash_table_unref(data->layout.active_positions);
+  }
   g_slice_free(struct mirax_ops_data, data);
 }
 
+static const struct _openslide_occupancy *get_occupancy(openslide_t *osr,
+                                                       struct _openslide_level *level,
+                                                       GError **err) {
+  struct level *l = (struct level *) level;
+
+  if (!load_level_tiles(osr, l, err)) {
+    return NULL;
+  }
+
+  // positions the scanner skipped have no tiles
+  return _openslide_grid_get_occupancy(l->grid, NULL, level, err);
+}
+
 static const struct _openslide_ops mirax_ops = {
   .paint_region = paint_region,
+  .get_occupancy = get_occupancy,
   .destroy = destroy,
 };
 
@@ -565,47 +653,58 @@ static bool read_nonhier_record(FILE *f,
 
 static void insert_tile(struct level *l,
                         const struct slide_zoom_level_params *lp,
-                        struct image *image,
+                        int32_t imageno,
                         double pos_x, double pos_y,
-                        double src_x, double src_y,
                         int tile_x, int tile_y,
                         int zoom_level) {
-  // increment image refcount
-  image->refcount++;
-
-  // generate tile
-  struct tile *tile = g_slice_new0(struct tile);
-  tile->image = image;
-  tile->src_x = src_x;
-  tile->src_y = src_y;
-
   // compute offset
   double offset_x = pos_x - (tile_x * lp->tile_advance_x);
   double offset_y = pos_y - (tile_y * lp->tile_advance_y);
 
-  // we only issue tile size hints if:
-  // - advances are integers (checked below)
-  // - tiles do not overlap (checked below)
-  // - no tile has a delta from the standard advance
-  if (offset_x || offset_y) {
-    // clear
-    l->base.tile_w = 0;
-    l->base.tile_h = 0;
-  }
-
   // insert
   _openslide_grid_tilemap_add_tile(l->grid,
                                    tile_x, tile_y,
                                    offset_x, offset_y,
                                    l->tile_w, l->tile_h,
-                                   tile);
+                                   GINT_TO_POINTER(imageno));
 
   if (!true) {
     g_debug("zoom %d, tile %d %d, pos %.10g %.10g, offset %.10g %.10g",
 	    zoom_level, tile_x, tile_y, pos_x, pos_y, offset_x, offset_y);
+  }
+}
+
+// account for a tile without building it
+static void scan_tile(struct level *l,
+                      const struct slide_zoom_level_params *lp,
+                      struct level_scan *scan,
+                      double pos_x, double pos_y,
+                      int tile_x, int tile_y,
+                      int zoom_level) {
+  // we only issue tile size hints if:
+  // - advances are integers (checked in mirax_open)
+  // - tiles do not overlap (checked in mirax_open)
+  // - no tile has a delta from the standard advance
+  if (pos_x != tile_x * lp->tile_advance_x ||
+      pos_y != tile_y * lp->tile_advance_y) {
+    // clear
+    l->base.tile_w = 0;
+    l->base.tile_h = 0;
+  }
 
-    g_debug(" src %.10g %.10g dim %.10g %.10g",
-	    tile->src_x, tile->src_y, l->tile_w, l->tile_h);
+  // level 0 extent, for the bounds properties
+  if (zoom_level == 0) {
+    if (!scan->have_bounds) {
+      scan->left = pos_x;
+      scan->top = pos_y;
+      scan->right = pos_x + l->tile_w;
+      scan->bottom = pos_y + l->tile_h;
+      scan->have_bounds = true;
+    }
+    scan->left = MIN(scan->left, pos_x);
+    scan->top = MIN(scan->top, pos_y);
+    scan->right = MAX(scan->right, pos_x + l->tile_w);
+    scan->bottom = MAX(scan->bottom, pos_y + l->tile_h);
   }
 }
 
@@ -655,9 +754,12 @@ static bool get_tile_position(int32_t *slide_positions,
       return false;
     }
 
-    int *key = g_new(int, 1);
-    *key = cp;
-    g_hash_table_insert(active_positions, key, NULL);
+    // already known if the level is being built after the open-time scan
+    if (!g_hash_table_lookup_extended(active_positions, &cp, NULL, NULL)) {
+      int *key = g_new(int, 1);
+      *key = cp;
+      g_hash_table_insert(active_positions, key, NULL);
+    }
     return true;
 
   } else {
@@ -677,31 +779,201 @@ static bool get_tile_position(int32_t *slide_positions,
   }
 }
 
+// walk the data pages of one level.  with a scan, validate the entries
+// and collect what we need at open time; otherwise build the tiles,
+// appending their images to images.
+static bool read_level_pages(FILE *f,
+                             int32_t page_ptr,
+                             const struct image_layout *layout,
+                             struct level **levels,
+                             int zoom_level,
+                             struct level_scan *scan,
+                             bool hash_only,
+                             GArray *images,
+                             GError **err) {
+  struct level *l = levels[zoom_level];
+  const struct slide_zoom_level_params *lp =
+    layout->slide_zoom_level_params + zoom_level;
+
+  // seek to offset
+  if (fseeko(f, page_ptr, SEEK_SET) == -1) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Can't seek to initial data page");
+    return false;
+  }
+
+  int32_t next_ptr;
+  do {
+    // read length
+    int32_t page_len = read_le_int32_from_file(f);
+    if (page_len == -1) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Can't read page length");
+      return false;
+    }
+
+    //    g_debug("page_len: %d", page_len);
+
+    // read "next" pointer
+    next_ptr = read_le_int32_from_file(f);
+    if (next_ptr == -1) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Cannot read \"next\" pointer");
+      return false;
+    }
+
+    // read all the data into the list
+    for (int i = 0; i < page_len; i++) {
+      int32_t image_index = read_le_int32_from_file(f);
+      int32_t offset = read_le_int32_from_file(f);
+      int32_t length = read_le_int32_from_file(f);
+      int32_t fileno = read_le_int32_from_file(f);
+
+      if (image_index < 0) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "image_index < 0");
+        return false;
+      }
+      if (offset < 0) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "offset < 0");
+        return false;
+      }
+      if (length < 0) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "length < 0");
+        return false;
+      }
+      if (fileno < 0) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "fileno < 0");
+        return false;
+      }
+
+      // we have only encountered slides with exactly power-of-two scale
+      // factors, and there appears to be no clear way to specify otherwise,
+      // so require it
+      int32_t x = image_index % layout->images_across;
+      int32_t y = image_index / layout->images_across;
+
+      if (y >= layout->images_down) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "y (%d) outside of bounds for zoom level (%d)",
+                    y, zoom_level);
+        return false;
+      }
+
+      if (x % lp->image_concat) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "x (%d) not correct multiple for zoom level (%d)",
+                    x, zoom_level);
+        return false;
+      }
+      if (y % lp->image_concat) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "y (%d) not correct multiple for zoom level (%d)",
+                    y, zoom_level);
+        return false;
+      }
+
+      // save filename
+      if (fileno >= layout->datafile_count) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "Invalid fileno");
+        return false;
+      }
+
+      // hash in the lowest-res images, once we've seen them all
+      if (scan && zoom_level == layout->zoom_levels - 1) {
+        struct _openslide_hash_part part = {
+          .filename = layout->datafile_paths[fileno],
+          .offset = offset,
+          .size = length,
+        };
+        g_array_append_val(scan->hash_parts, part);
+      }
+
+      if (scan && hash_only) {
+        continue;
+      }
+
+      // populate the image structure
+      int32_t imageno = -1;
+      if (!scan) {
+        struct image image = {
+          .fileno = fileno,
+          .start_in_file = offset,
+          .length = length,
+          .tile_col = x / lp->tile_count_divisor,
+          .tile_row = y / lp->tile_count_divisor,
+        };
+        imageno = images->len;
+        g_array_append_val(images, image);
+      }
+
+      // start processing 1 image into tiles_per_image^2 tiles
+      for (int yi = 0; yi < lp->tiles_per_image; yi++) {
+        int yy = y + (yi * layout->image_divisions);
+        if (yy >= layout->images_down) {
+          break;
+        }
+
+        for (int xi = 0; xi < lp->tiles_per_image; xi++) {
+          int xx = x + (xi * layout->image_divisions);
+          if (xx >= layout->images_across) {
+            break;
+          }
+
+          // xx and yy are the image coordinates in level0 space
+
+          // position in level 0
+          int pos0_x;
+          int pos0_y;
+          if (!get_tile_position(layout->slide_positions,
+                                 layout->active_positions,
+                                 layout->slide_zoom_level_params,
+                                 levels,
+                                 layout->images_across,
+                                 layout->image_divisions,
+                                 zoom_level,
+                                 xx, yy,
+                                 &pos0_x, &pos0_y)) {
+            // no such position
+            continue;
+          }
+
+          // position in this level
+          const double pos_x = ((double) pos0_x) / lp->image_concat;
+          const double pos_y = ((double) pos0_y) / lp->image_concat;
+
+          const int tile_x = x / lp->tile_count_divisor + xi;
+          const int tile_y = y / lp->tile_count_divisor + yi;
+          if (scan) {
+            scan_tile(l, lp, scan, pos_x, pos_y, tile_x, tile_y, zoom_level);
+          } else {
+            insert_tile(l, lp,
+                        imageno,
+                        pos_x, pos_y,
+                        tile_x, tile_y,
+                        zoom_level);
+          }
+        }
+      }
+    }
+  } while (next_ptr != 0);
+
+  return true;
+}
+
 static bool process_hier_data_pages_from_indexfile(FILE *f,
 						   int64_t seek_location,
-						   int datafile_count,
-						   char **datafile_paths,
-						   int zoom_levels,
+						   const struct image_layout *layout,
 						   struct level **levels,
-						   int images_across,
-						   int images_down,
-						   int image_divisions,
-						   const struct slide_zoom_level_params *slide_zoom_level_params,
-						   int32_t *slide_positions,
+						   struct level_scan *scan,
 						   struct _openslide_hash *quickhash1,
+						   bool hash_only,
 						   GError **err) {
-  int32_t image_number = 0;
-
-  bool success = false;
-
-  // used for storing which positions actually have data
-  GHashTable *active_positions = g_hash_table_new_full(g_int_hash, g_int_equal,
-						       g_free, NULL);
-
-  for (int zoom_level = 0; zoom_level < zoom_levels; zoom_level++) {
-    struct level *l = levels[zoom_level];
-    const struct slide_zoom_level_params *lp = slide_zoom_level_params +
-        zoom_level;
+  for (int zoom_level = 0; zoom_level < layout->zoom_levels; zoom_level++) {
     int32_t ptr;
 
     //    g_debug("reading zoom_level %d", zoom_level);
@@ -709,26 +981,26 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
     if (fseeko(f, seek_location, SEEK_SET) == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot seek to zoom level pointer %d", zoom_level);
-      goto DONE;
+      return false;
     }
 
     ptr = read_le_int32_from_file(f);
     if (ptr == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Can't read zoom level pointer");
-      goto DONE;
+      return false;
     }
     if (fseeko(f, ptr, SEEK_SET) == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot seek to start of data pages");
-      goto DONE;
+      return false;
     }
 
     // read initial 0
     if (read_le_int32_from_file(f) != 0) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Expected 0 value at beginning of data page");
-      goto DONE;
+      return false;
     }
 
     // read pointer
@@ -736,181 +1008,79 @@ static bool process_hier_data_pages_from_indexfile(FILE *f,
     if (ptr == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Can't read initial data page pointer");
-      goto DONE;
+      return false;
     }
+    levels[zoom_level]->index_page = ptr;
 
-    // seek to offset
-    if (fseeko(f, ptr, SEEK_SET) == -1) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Can't seek to initial data page");
-      goto DONE;
+    // when only hashing, we only need the lowest-res images
+    if (!hash_only || zoom_level == layout->zoom_levels - 1) {
+      if (!read_level_pages(f, ptr, layout, levels, zoom_level,
+                            scan, hash_only, NULL, err)) {
+        return false;
+      }
     }
 
-    int32_t next_ptr;
-    do {
-      // read length
-      int32_t page_len = read_le_int32_from_file(f);
-      if (page_len == -1) {
-        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                    "Can't read page length");
-        goto DONE;
-      }
+    // advance for next zoom level
+    seek_location += 4;
+  }
 
-      //    g_debug("page_len: %d", page_len);
+  if (!_openslide_hash_file_parts(quickhash1,
+                                  (const void *) scan->hash_parts->data,
+                                  scan->hash_parts->len, err)) {
+    g_prefix_error(err, "Can't hash images: ");
+    return false;
+  }
 
-      // read "next" pointer
-      next_ptr = read_le_int32_from_file(f);
-      if (next_ptr == -1) {
-        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                    "Cannot read \"next\" pointer");
-        goto DONE;
-      }
+  return true;
+}
 
-      // read all the data into the list
-      for (int i = 0; i < page_len; i++) {
-	int32_t image_index = read_le_int32_from_file(f);
-	int32_t offset = read_le_int32_from_file(f);
-	int32_t length = read_le_int32_from_file(f);
-	int32_t fileno = read_le_int32_from_file(f);
-
-	if (image_index < 0) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "image_index < 0");
-          goto DONE;
-	}
-	if (offset < 0) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "offset < 0");
-          goto DONE;
-	}
-	if (length < 0) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "length < 0");
-          goto DONE;
-	}
-	if (fileno < 0) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "fileno < 0");
-          goto DONE;
-	}
-
-	// we have only encountered slides with exactly power-of-two scale
-	// factors, and there appears to be no clear way to specify otherwise,
-	// so require it
-	int32_t x = image_index % images_across;
-	int32_t y = image_index / images_across;
-
-	if (y >= images_down) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "y (%d) outside of bounds for zoom level (%d)",
-                      y, zoom_level);
-          goto DONE;
-	}
-
-	if (x % lp->image_concat) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "x (%d) not correct multiple for zoom level (%d)",
-                      x, zoom_level);
-          goto DONE;
-	}
-	if (y % lp->image_concat) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "y (%d) not correct multiple for zoom level (%d)",
-                      y, zoom_level);
-          goto DONE;
-	}
-
-	// save filename
-	if (fileno >= datafile_count) {
-          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                      "Invalid fileno");
-          goto DONE;
-	}
-
-	// hash in the lowest-res images
-	if (zoom_level == zoom_levels - 1) {
-	  if (!_openslide_hash_file_part(quickhash1, datafile_paths[fileno],
-	                                 offset, length, err)) {
-            g_prefix_error(err, "Can't hash images: ");
-            goto DONE;
-	  }
-	}
-
-	// populate the image structure
-	struct image *image = g_slice_new0(struct image);
-	image->fileno = fileno;
-	image->start_in_file = offset;
-	image->imageno = image_number++;
-	image->refcount = 1;
-
-	/*
-	g_debug("image_concat: %d, tiles_per_image: %d",
-		lp->image_concat, lp->tiles_per_image);
-	g_debug("found %d %d from file", x, y);
-	*/
-
-
-	// start processing 1 image into tiles_per_image^2 tiles
-	for (int yi = 0; yi < lp->tiles_per_image; yi++) {
-	  int yy = y + (yi * image_divisions);
-	  if (yy >= images_down) {
-	    break;
-	  }
-
-	  for (int xi = 0; xi < lp->tiles_per_image; xi++) {
-	    int xx = x + (xi * image_divisions);
-	    if (xx >= images_across) {
-	      break;
-	    }
-
-	    // xx and yy are the image coordinates in level0 space
-
-	    // position in level 0
-            int pos0_x;
-            int pos0_y;
-            if (!get_tile_position(slide_positions,
-                                   active_positions,
-                                   slide_zoom_level_params,
-                                   levels,
-                                   images_across,
-                                   image_divisions,
-                                   zoom_level,
-                                   xx, yy,
-                                   &pos0_x, &pos0_y)) {
-              // no such position
-              continue;
-            }
-
-	    // position in this level
-	    const double pos_x = ((double) pos0_x) / lp->image_concat;
-	    const double pos_y = ((double) pos0_y) / lp->image_concat;
-
-	    //g_debug("pos0: %d %d, pos: %g %g", pos0_x, pos0_y, pos_x, pos_y);
-
-	    insert_tile(l, lp,
-                        image,
-                        pos_x, pos_y,
-                        l->tile_w * xi, l->tile_h * yi,
-                        x / lp->tile_count_divisor + xi,
-                        y / lp->tile_count_divisor + yi,
-                        zoom_level);
-	  }
-	}
+static bool load_level_tiles(openslide_t *osr, struct level *l, GError **err) {
+  struct mirax_ops_data *data = osr->data;
 
-	// drop initial reference, possibly free
-	image_unref(image);
-      }
-    } while (next_ptr != 0);
+  if (g_atomic_int_get(&l->tiles_built)) {
+    return true;
+  }
 
-    // advance for next zoom level
-    seek_location += 4;
+  int zoom_level = 0;
+  while (osr->levels[zoom_level] != &l->base) {
+    zoom_level++;
   }
 
-  success = true;
+  bool success = false;
+  FILE *f = NULL;
+  g_mutex_lock(data->tiles_lock);
+  if (g_atomic_int_get(&l->tiles_built)) {
+    success = true;
+    goto DONE;
+  }
 
- DONE:
-  g_hash_table_unref(active_positions);
+  f = _openslide_fopen(data->index_path, "rb", err);
+  if (f == NULL) {
+    goto DONE;
+  }
+  GArray *images = g_array_new(false, false, sizeof(struct image));
+  success = read_level_pages(f, l->index_page, &data->layout,
+                             (struct level **) osr->levels, zoom_level,
+                             NULL, false, images, err);
+  fclose(f);
 
+  if (success) {
+    l->image_count = images->len;
+    l->images = (struct image *) g_array_free(images, false);
+    g_atomic_int_set(&l->tiles_built, 1);
+  } else {
+    g_array_free(images, true);
+    // discard the partial tile map so the next read can retry
+    g_prefix_error(err, "Can't read tiles for level %d: ", zoom_level);
+    _openslide_grid_destroy(l->grid);
+    l->grid = _openslide_grid_create_tilemap(osr,
+                                             l->tile_advance_x,
+                                             l->tile_advance_y,
+                                             read_tile, NULL);
+  }
+
+DONE:
+  g_mutex_unlock(data->tiles_lock);
   return success;
 }
 
@@ -1079,26 +1249,29 @@ static bool add_associated_image(openslide_t *osr,
 }
 
 
+// fills in the slide positions and active positions of the layout
 static bool process_indexfile(openslide_t *osr,
 			      const char *uuid,
-			      int datafile_count,
-			      char **datafile_paths,
+			      struct image_layout *layout,
 			      int vimslide_position_record,
 			      int stitching_position_record,
 			      int macro_record,
 			      int label_record,
 			      int thumbnail_record,
-			      int zoom_levels,
-			      int images_x,
-			      int images_y,
 			      double overlap_x,
 			      double overlap_y,
-			      int image_divisions,
-			      const struct slide_zoom_level_params *slide_zoom_level_params,
 			      FILE *indexfile,
 			      struct level **levels,
 			      struct _openslide_hash *quickhash1,
 			      GError **err) {
+  const int datafile_count = layout->datafile_count;
+  char **datafile_paths = layout->datafile_paths;
+  const int images_x = layout->images_across;
+  const int images_y = layout->images_down;
+  const int image_divisions = layout->image_divisions;
+  const struct slide_zoom_level_params *slide_zoom_level_params =
+    layout->slide_zoom_level_params;
+
   char *teststr = NULL;
   bool match;
 
@@ -1114,6 +1287,10 @@ static bool process_indexfile(openslide_t *osr,
   bool success = false;
 
   int32_t *slide_positions = NULL;
+  struct level_scan scan = {
+    .hash_parts = g_array_new(false, false,
+                              sizeof(struct _openslide_hash_part)),
+  };
 
   rewind(indexfile);
 
@@ -1270,28 +1447,37 @@ static bool process_indexfile(openslide_t *osr,
     goto DONE;
   }
 
-  // read these pages in
+  // walk the pages, leaving the tiles to be built on first use
+  layout->slide_positions = slide_positions;
+  slide_positions = NULL;
+  layout->active_positions = g_hash_table_new_full(g_int_hash, g_int_equal,
+                                                   g_free, NULL);
   if (!process_hier_data_pages_from_indexfile(indexfile,
 					      ptr,
-					      datafile_count,
-					      datafile_paths,
-					      zoom_levels,
+					      layout,
 					      levels,
-					      images_x,
-					      images_y,
-					      image_divisions,
-					      slide_zoom_level_params,
-					      slide_positions,
+					      &scan,
 					      quickhash1,
+					      osr->hash_only,
 					      err)) {
     goto DONE;
   }
 
+  // set bounds properties
+  if (scan.have_bounds) {
+    _openslide_set_bounds_props(osr, scan.left, scan.top,
+                                scan.right - scan.left,
+                                scan.bottom - scan.top);
+  } else {
+    _openslide_set_bounds_props(osr, 0, 0, 0, 0);
+  }
+
   success = true;
 
  DONE:
   // deallocate
   g_free(slide_positions);
+  g_array_free(scan.hash_parts, true);
 
   return success;
 }
@@ -1504,6 +1690,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   int objective_magnification = 0;
 
   char *index_filename = NULL;
+  char *index_path = NULL;
   int zoom_levels = 0;
   int hier_count = 0;
   int nonhier_count = 0;
@@ -1524,6 +1711,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   char **datafile_paths = NULL;
 
   FILE *indexfile = NULL;
+  struct image_layout layout = {0};
 
   int64_t base_w = 0;
   int64_t base_h = 0;
@@ -1778,10 +1966,8 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   */
 
   // read indexfile
-  tmp = g_build_filename(dirname, index_filename, NULL);
-  indexfile = _openslide_fopen(tmp, "rb", err);
-  g_free(tmp);
-  tmp = NULL;
+  index_path = g_build_filename(dirname, index_filename, NULL);
+  indexfile = _openslide_fopen(index_path, "rb", err);
 
   if (!indexfile) {
     goto FAIL;
@@ -1928,29 +2114,34 @@ static bool mirax_open(openslide_t *osr, const char *filename,
                          slide_zoom_level_params[0].image_concat;
 
     // create grid
+    l->tile_advance_x = lp->tile_advance_x;
+    l->tile_advance_y = lp->tile_advance_y;
     l->grid = _openslide_grid_create_tilemap(osr,
                                              lp->tile_advance_x,
                                              lp->tile_advance_y,
-                                             read_tile, tile_free);
+                                             read_tile, NULL);
 
     //g_debug("level %d tile advance %.10g %.10g, dim %" G_GINT64_FORMAT " %" G_GINT64_FORMAT ", image size %d %d, tile %g %g, image_concat %d, tile_count_divisor %d, positions_per_tile %d", i, lp->tile_advance_x, lp->tile_advance_y, l->base.w, l->base.h, l->image_width, l->image_height, l->tile_w, l->tile_h, lp->image_concat, lp->tile_count_divisor, lp->positions_per_tile);
   }
 
-  // load the position map and build up the tiles
+  // load the position map and scan the tiles
+  layout.datafile_count = datafile_count;
+  layout.datafile_paths = datafile_paths;
+  layout.zoom_levels = zoom_levels;
+  layout.images_across = images_x;
+  layout.images_down = images_y;
+  layout.image_divisions = image_divisions;
+  layout.slide_zoom_level_params = slide_zoom_level_params;
   if (!process_indexfile(osr,
 			 slide_id,
-			 datafile_count, datafile_paths,
+			 &layout,
 			 position_nonhier_vimslide_offset,
 			 position_nonhier_stitching_offset,
 			 macro_nonhier_offset,
 			 label_nonhier_offset,
 			 thumbnail_nonhier_offset,
-			 zoom_levels,
-			 images_x, images_y,
 			 slide_zoom_level_sections[0].overlap_x,
 			 slide_zoom_level_sections[0].overlap_y,
-			 image_divisions,
-			 slide_zoom_level_params,
 			 indexfile,
 			 levels,
 			 quickhash1,
@@ -1959,7 +2150,6 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   }
 
   // set properties
-  _openslide_set_bounds_props_from_grid(osr, levels[0]->grid);
   uint32_t fill = slide_zoom_level_sections[0].fill_rgb;
   _openslide_set_background_color_prop(osr,
                                        (fill >> 16) & 0xFF,
@@ -2010,6 +2200,14 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   struct mirax_ops_data *data = g_slice_new0(struct mirax_ops_data);
   data->datafile_paths = datafile_paths;
   datafile_paths = NULL;
+  data->slidedat_path = g_build_filename(dirname, SLIDEDAT_INI, NULL);
+  data->index_path = index_path;
+  index_path = NULL;
+  data->tiles_lock = g_mutex_new();
+  data->layout = layout;
+  slide_zoom_level_params = NULL;
+  layout.slide_positions = NULL;
+  layout.active_positions = NULL;
   osr->data = data;
 
   // set ops
@@ -2038,10 +2236,15 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   g_free(slide_version);
   g_free(slide_id);
   g_free(index_filename);
+  g_free(index_path);
   g_strfreev(datafile_paths);
   g_strfreev(slide_zoom_level_section_names);
   g_free(slide_zoom_level_sections);
   g_free(slide_zoom_level_params);
+  g_free(layout.slide_positions);
+  if (layout.active_positions) {
+    g_hash_table_unref(layout.active_positions);
+  }
   g_free(key_slide_zoom_level_name);
   g_free(key_slide_zoom_level_count);
 
@@ -2055,9 +2258,274 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   return success;
 }
 
+struct snapshot_tile {
+  int64_t col;
+  int64_t row;
+  int32_t imageno;
+};
+
+static void collect_tile(struct _openslide_grid *grid G_GNUC_UNUSED,
+                         int64_t tile_col, int64_t tile_row,
+                         void *data, void *arg) {
+  GArray *tiles = arg;
+  struct snapshot_tile st = {
+    .col = tile_col,
+    .row = tile_row,
+    .imageno = GPOINTER_TO_INT(data),
+  };
+  g_array_append_val(tiles, st);
+}
+
+static void save_level_snapshot(struct level *l,
+                                struct _openslide_snapshot *snap) {
+  _openslide_snapshot_put_int(snap, l->base.w);
+  _openslide_snapshot_put_int(snap, l->base.h);
+  _openslide_snapshot_put_double(snap, l->base.downsample);
+  _openslide_snapshot_put_int(snap, l->base.tile_w);
+  _openslide_snapshot_put_int(snap, l->base.tile_h);
+  _openslide_snapshot_put_int(snap, l->image_format);
+  _openslide_snapshot_put_int(snap, l->image_width);
+  _openslide_snapshot_put_int(snap, l->image_height);
+  _openslide_snapshot_put_double(snap, l->tile_w);
+  _openslide_snapshot_put_double(snap, l->tile_h);
+  _openslide_snapshot_put_double(snap, l->tile_advance_x);
+  _openslide_snapshot_put_double(snap, l->tile_advance_y);
+
+  _openslide_snapshot_put_int(snap, l->image_count);
+  for (int32_t i = 0; i < l->image_count; i++) {
+    struct image *image = &l->images[i];
+    _openslide_snapshot_put_int(snap, image->fileno);
+    _openslide_snapshot_put_int(snap, image->start_in_file);
+    _openslide_snapshot_put_int(snap, image->length);
+    _openslide_snapshot_put_int(snap, image->tile_col);
+    _openslide_snapshot_put_int(snap, image->tile_row);
+  }
+
+  GArray *tiles = g_array_new(false, false, sizeof(struct snapshot_tile));
+  _openslide_grid_tilemap_foreach(l->grid, collect_tile, tiles);
+  _openslide_snapshot_put_int(snap, tiles->len);
+  for (guint i = 0; i < tiles->len; i++) {
+    struct snapshot_tile *st = &g_array_index(tiles, struct snapshot_tile, i);
+    double offset_x = 0;
+    double offset_y = 0;
+    _openslide_grid_tilemap_get_tile_offset(l->grid, st->col, st->row,
+                                            &offset_x, &offset_y);
+    _openslide_snapshot_put_int(snap, st->col);
+    _openslide_snapshot_put_int(snap, st->row);
+    _openslide_snapshot_put_int(snap, st->imageno);
+    _openslide_snapshot_put_double(snap, offset_x);
+    _openslide_snapshot_put_double(snap, offset_y);
+  }
+  g_array_free(tiles, true);
+}
+
+static bool mirax_save_snapshot(openslide_t *osr,
+                                struct _openslide_snapshot *snap) {
+  struct mirax_ops_data *data = osr->data;
+
+  // the files we read, so we can tell when they change
+  _openslide_snapshot_put_file(snap, data->slidedat_path);
+  _openslide_snapshot_put_string(snap, data->index_path);
+  _openslide_snapshot_put_file(snap, data->index_path);
+  _openslide_snapshot_put_int(snap, g_strv_length(data->datafile_paths));
+  for (char **path = data->datafile_paths; *path; path++) {
+    _openslide_snapshot_put_string(snap, *path);
+    _openslide_snapshot_put_file(snap, *path);
+  }
+
+  if (!_openslide_jpeg_snapshot_associated_images(osr, snap)) {
+    return false;
+  }
+
+  // the snapshot holds every tile, so saving reads the whole index once,
+  // even for levels the lazy tile maps haven't needed yet.  Later opens
+  // then skip the index entirely.
+  for (int32_t i = 0; i < osr->level_count; i++) {
+    GError *tmp_err = NULL;
+    if (!load_level_tiles(osr, (struct level *) osr->levels[i], &tmp_err)) {
+      g_debug("Couldn't snapshot MIRAX slide: %s", tmp_err->message);
+      g_clear_error(&tmp_err);
+      return false;
+    }
+  }
+
+  _openslide_snapshot_put_int(snap, osr->level_count);
+  for (int32_t i = 0; i < osr->level_count; i++) {
+    save_level_snapshot((struct level *) osr->levels[i], snap);
+  }
+  return _openslide_snapshot_ok(snap);
+}
+
+static struct level *open_level_snapshot(openslide_t *osr,
+                                         struct _openslide_snapshot *snap,
+                                         int datafile_count) {
+  struct level *l = g_slice_new0(struct level);
+  l->base.w = _openslide_snapshot_get_int(snap);
+  l->base.h = _openslide_snapshot_get_int(snap);
+  l->base.downsample = _openslide_snapshot_get_double(snap);
+  l->base.tile_w = _openslide_snapshot_get_int(snap);
+  l->base.tile_h = _openslide_snapshot_get_int(snap);
+  l->image_format = _openslide_snapshot_get_int(snap);
+  l->image_width = _openslide_snapshot_get_int(snap);
+  l->image_height = _openslide_snapshot_get_int(snap);
+  l->tile_w = _openslide_snapshot_get_double(snap);
+  l->tile_h = _openslide_snapshot_get_double(snap);
+  l->tile_advance_x = _openslide_snapshot_get_double(snap);
+  l->tile_advance_y = _openslide_snapshot_get_double(snap);
+  l->grid = _openslide_grid_create_tilemap(osr,
+                                           l->tile_advance_x,
+                                           l->tile_advance_y,
+                                           read_tile, NULL);
+  if (l->image_format != FORMAT_JPEG &&
+      l->image_format != FORMAT_PNG &&
+      l->image_format != FORMAT_BMP) {
+    goto FAIL;
+  }
+
+  // images
+  int64_t image_count = _openslide_snapshot_get_int(snap);
+  if (image_count < 0 || image_count > G_MAXINT32 ||
+      !_openslide_snapshot_ok(snap)) {
+    goto FAIL;
+  }
+  l->images = g_new0(struct image, image_count);
+  for (l->image_count = 0;
+       l->image_count < image_count && _openslide_snapshot_ok(snap);
+       l->image_count++) {
+    struct image *image = &l->images[l->image_count];
+    image->fileno = _openslide_snapshot_get_int(snap);
+    image->start_in_file = _openslide_snapshot_get_int(snap);
+    image->length = _openslide_snapshot_get_int(snap);
+    image->tile_col = _openslide_snapshot_get_int(snap);
+    image->tile_row = _openslide_snapshot_get_int(snap);
+    if (image->fileno < 0 || image->fileno >= datafile_count) {
+      goto FAIL;
+    }
+  }
+  if (!_openslide_snapshot_ok(snap)) {
+    goto FAIL;
+  }
+
+  // tiles
+  int64_t tile_count = _openslide_snapshot_get_int(snap);
+  for (int64_t i = 0; i < tile_count && _openslide_snapshot_ok(snap); i++) {
+    int64_t col = _openslide_snapshot_get_int(snap);
+    int64_t row = _openslide_snapshot_get_int(snap);
+    int64_t imageno = _openslide_snapshot_get_int(snap);
+    double offset_x = _openslide_snapshot_get_double(snap);
+    double offset_y = _openslide_snapshot_get_double(snap);
+    if (!_openslide_snapshot_ok(snap) ||
+        imageno < 0 || imageno >= l->image_count ||
+        col < 0 || col > G_MAXINT32 || row < 0 || row > G_MAXINT32) {
+      goto FAIL;
+    }
+    _openslide_grid_tilemap_add_tile(l->grid, col, row,
+                                     offset_x, offset_y,
+                                     l->tile_w, l->tile_h,
+                                     GINT_TO_POINTER(imageno));
+  }
+
+  if (_openslide_snapshot_ok(snap)) {
+    l->tiles_built = 1;
+    return l;
+  }
+
+FAIL:
+  _openslide_grid_destroy(l->grid);
+  g_free(l->images);
+  g_slice_free(struct level, l);
+  return NULL;
+}
+
+static bool mirax_open_snapshot(openslide_t *osr,
+                                const char *filename,
+                                struct _openslide_snapshot *snap,
+                                GError **err) {
+  struct level **levels = NULL;
+  int32_t level_count = 0;
+  bool success = false;
+
+  struct mirax_ops_data *data = g_slice_new0(struct mirax_ops_data);
+  char *dirname = g_strndup(filename, strlen(filename) - strlen(MRXS_EXT));
+  data->slidedat_path = g_build_filename(dirname, SLIDEDAT_INI, NULL);
+  g_free(dirname);
+
+  // check the files
+  _openslide_snapshot_check_file(snap, data->slidedat_path);
+  data->index_path = _openslide_snapshot_get_string(snap);
+  if (data->index_path) {
+    _openslide_snapshot_check_file(snap, data->index_path);
+  }
+  int64_t datafile_count = _openslide_snapshot_get_int(snap);
+  if (datafile_count < 0 || datafile_count > G_MAXINT ||
+      !_openslide_snapshot_ok(snap)) {
+    goto DONE;
+  }
+  data->datafile_paths = g_new0(char *, datafile_count + 1);
+  for (int64_t i = 0; i < datafile_count; i++) {
+    data->datafile_paths[i] = _openslide_snapshot_get_string(snap);
+    if (data->datafile_paths[i] == NULL ||
+        !_openslide_snapshot_check_file(snap, data->datafile_paths[i])) {
+      goto DONE;
+    }
+  }
+
+  if (!_openslide_jpeg_restore_associated_images(osr, snap)) {
+    goto DONE;
+  }
+
+  // levels
+  int64_t count = _openslide_snapshot_get_int(snap);
+  if (count < 1 || count > G_MAXINT32 || !_openslide_snapshot_ok(snap)) {
+    goto DONE;
+  }
+  levels = g_new0(struct level *, count);
+  for (level_count = 0; level_count < count; level_count++) {
+    levels[level_count] = open_level_snapshot(osr, snap, datafile_count);
+    if (levels[level_count] == NULL) {
+      goto DONE;
+    }
+  }
+
+  g_assert(osr->levels == NULL);
+  osr->level_count = level_count;
+  osr->levels = (struct _openslide_level **) levels;
+  levels = NULL;
+  g_assert(osr->data == NULL);
+  osr->data = data;
+  data = NULL;
+  osr->ops = &mirax_ops;
+  success = true;
+
+DONE:
+  if (levels) {
+    for (int32_t i = 0; i < level_count; i++) {
+      _openslide_grid_destroy(levels[i]->grid);
+      g_free(levels[i]->images);
+      g_slice_free(struct level, levels[i]);
+    }
+    g_free(levels);
+  }
+  if (data) {
+    g_strfreev(data->datafile_paths);
+    g_free(data->slidedat_path);
+    g_free(data->index_path);
+    g_slice_free(struct mirax_ops_data, data);
+  }
+  if (!success) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Snapshot is stale or invalid");
+  }
+  return success;
+}
+
 const struct _openslide_format _openslide_format_mirax = {
   .name = "mirax",
   .vendor = "mirax",
+  .container = _OPENSLIDE_CONTAINER_NON_TIFF,
+  .extension = MRXS_EXT,
   .detect = mirax_detect,
   .open = mirax_open,
+  .save_snapshot = mirax_save_snapshot,
+  .open_snapshot = mirax_open_snapshot,
 };
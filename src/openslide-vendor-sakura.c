@@ -86,8 +86,7 @@ enum color_indexes {
   } while (0)
 
 struct sakura_ops_data {
-  char *filename;
-  char *data_sql;
+  struct _openslide_sqlite_pool *pool;  // tile blob by id
   int32_t tile_size;
 };
 
@@ -197,8 +196,7 @@ static void destroy_level(struct level *l) {
 
 static void destroy(openslide_t *osr) {
   struct sakura_ops_data *data = osr->data;
-  g_free(data->filename);
-  g_free(data->data_sql);
+  _openslide_sqlite_pool_destroy(data->pool);
   g_slice_free(struct sakura_ops_data, data);
 
   for (int32_t i = 0; i < osr->level_count; i++) {
@@ -207,59 +205,99 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_channel(uint8_t *channeldata,
-                         const char *tileid,
-                         int32_t tile_size,
-                         sqlite3_stmt *stmt,
-                         GError **err) {
-  // retrieve compressed tile
+struct channel {
+  const char *tileid;
+  const void *buf;  // compressed
+  int64_t buflen;
+  struct _openslide_cache_entry *entry;  // owns buf
+  uint8_t *dest;
+  int32_t tile_size;
+  GError *err;
+};
+
+static bool fetch_channel(struct _openslide_cache_binding *cb,
+                          struct channel *ch,
+                          sqlite3_stmt *stmt,
+                          GError **err) {
+  // the tile ID string is a stable key for the blob
+  void *plane = (void *) ch->tileid;
+  ch->buf = _openslide_cache_get_compressed(cb, plane, 0, 0,
+                                            &ch->buflen, &ch->entry);
+  if (ch->buf) {
+    return true;
+  }
+
+  // retrieve compressed tile; the blob is only valid until the next step
   sqlite3_reset(stmt);
-  BIND_TEXT_OR_FAIL(stmt, 1, tileid);
+  BIND_TEXT_OR_FAIL(stmt, 1, ch->tileid);
   STEP_OR_FAIL(stmt);
-  const void *buf = sqlite3_column_blob(stmt, 0);
-  int buflen = sqlite3_column_bytes(stmt, 0);
-
-  // decompress
-  return _openslide_jpeg_decode_buffer_gray(buf, buflen, channeldata,
-                                            tile_size, tile_size, err);
+  ch->buflen = sqlite3_column_bytes(stmt, 0);
+  void *buf = g_slice_copy(ch->buflen, sqlite3_column_blob(stmt, 0));
+  _openslide_cache_put_compressed(cb, plane, 0, 0, buf, ch->buflen,
+                                  &ch->entry);
+  ch->buf = buf;
+  return true;
 
 FAIL:
   return false;
 }
 
-static bool read_image(uint32_t *tiledata,
+static void decode_channel(void *data) {
+  struct channel *ch = data;
+  _openslide_jpeg_decode_buffer_gray(ch->buf, ch->buflen, ch->dest,
+                                     ch->tile_size, ch->tile_size,
+                                     &ch->err);
+}
+
+static bool read_image(struct _openslide_cache_binding *cb,
+                       uint32_t *tiledata,
                        const struct tile *tile,
                        int32_t tile_size,
                        sqlite3_stmt *stmt,
                        GError **err) {
-  uint8_t *red_channel = g_slice_alloc(tile_size * tile_size);
-  uint8_t *green_channel = g_slice_alloc(tile_size * tile_size);
-  uint8_t *blue_channel = g_slice_alloc(tile_size * tile_size);
+  int32_t plane_size = tile_size * tile_size;
+  uint8_t *planes = _openslide_get_scratch(3 * plane_size);
+  struct channel channels[3] = {
+    {.tileid = tile->id_red, .dest = planes},
+    {.tileid = tile->id_green, .dest = planes + plane_size},
+    {.tileid = tile->id_blue, .dest = planes + 2 * plane_size},
+  };
   bool success = false;
 
-  if (!read_channel(red_channel, tile->id_red, tile_size, stmt, err)) {
-    goto OUT;
+  // fetch compressed channels
+  for (int i = 0; i < 3; i++) {
+    channels[i].tile_size = tile_size;
+    if (!fetch_channel(cb, &channels[i], stmt, err)) {
+      goto OUT;
+    }
   }
-  if (!read_channel(green_channel, tile->id_green, tile_size, stmt, err)) {
-    goto OUT;
+
+  // decode them concurrently
+  struct _openslide_taskgroup *tg = _openslide_taskgroup_create();
+  for (int i = 0; i < 3; i++) {
+    _openslide_taskgroup_push(tg, decode_channel, &channels[i]);
   }
-  if (!read_channel(blue_channel, tile->id_blue, tile_size, stmt, err)) {
-    goto OUT;
+  _openslide_taskgroup_finish(tg);
+  for (int i = 0; i < 3; i++) {
+    if (channels[i].err) {
+      g_propagate_error(err, channels[i].err);
+      channels[i].err = NULL;
+      goto OUT;
+    }
   }
 
-  for (int32_t i = 0; i < tile_size * tile_size; i++) {
-    tiledata[i] = 0xff000000 |
-                  (red_channel[i] << 16) |
-                  (green_channel[i] << 8) |
-                  blue_channel[i];
-  }
+  _openslide_planes_to_argb(tiledata, channels[0].dest, channels[1].dest,
+                            channels[2].dest, plane_size);
 
   success = true;
 
 OUT:
-  g_slice_free1(tile_size * tile_size, red_channel);
-  g_slice_free1(tile_size * tile_size, green_channel);
-  g_slice_free1(tile_size * tile_size, blue_channel);
+  for (int i = 0; i < 3; i++) {
+    g_clear_error(&channels[i].err);
+    if (channels[i].entry) {
+      _openslide_cache_entry_unref(channels[i].entry);
+    }
+  }
   return success;
 }
 
@@ -281,11 +319,11 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tile_size * tile_size * 4);
+    tiledata = _openslide_buffer_alloc(tile_size * tile_size * 4);
 
     // read tile
-    if (!read_image(tiledata, tile, tile_size, stmt, err)) {
-      g_slice_free1(tile_size * tile_size * 4, tiledata);
+    if (!read_image(osr->cache, tiledata, tile, tile_size, stmt, err)) {
+      _openslide_buffer_free(tile_size * tile_size * 4, tiledata);
       return false;
     }
 
@@ -295,7 +333,7 @@ static bool read_tile(openslide_t *osr,
                               l->base.w - tile_col * tile_size,
                               l->base.h - tile_row * tile_size,
                               err)) {
-      g_slice_free1(tile_size * tile_size * 4, tiledata);
+      _openslide_buffer_free(tile_size * tile_size * 4, tiledata);
       return false;
     }
 
@@ -313,7 +351,9 @@ static bool read_tile(openslide_t *osr,
                                                                  tile_size * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tile_size * tile_size * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -328,24 +368,18 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
                          GError **err) {
   struct sakura_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
-  sqlite3_stmt *stmt = NULL;
-  bool success = false;
 
-  sqlite3 *db = _openslide_sqlite_open(data->filename, err);
-  if (!db) {
+  sqlite3_stmt *stmt = _openslide_sqlite_pool_get(data->pool, err);
+  if (!stmt) {
     return false;
   }
-  PREPARE_OR_FAIL(stmt, db, data->data_sql);
-
-  success = _openslide_grid_paint_region(l->grid, cr, stmt,
-                                         x / l->base.downsample,
-                                         y / l->base.downsample,
-                                         level, w, h,
-                                         err);
 
-FAIL:
-  sqlite3_finalize(stmt);
-  _openslide_sqlite_close(db);
+  bool success = _openslide_grid_paint_region(l->grid, cr, stmt,
+                                              x / l->base.downsample,
+                                              y / l->base.downsample,
+                                              level, w, h,
+                                              err);
+  _openslide_sqlite_pool_put(data->pool, stmt);
   return success;
 }
 
@@ -354,10 +388,10 @@ static const struct _openslide_ops sakura_ops = {
   .destroy = destroy,
 };
 
-static bool get_associated_image_data(struct _openslide_associated_image *_img,
-                                      uint32_t *dest,
-                                      GError **err) {
-  struct associated_image *img = (struct associated_image *) _img;
+static bool read_associated_image(struct associated_image *img,
+                                  int32_t scale_denom,
+                                  uint32_t *dest,
+                                  GError **err) {
   bool success = false;
 
   //g_debug("read Sakura associated image: %s", img->data_sql);
@@ -376,8 +410,12 @@ static bool get_associated_image_data(struct _openslide_associated_image *_img,
   int buflen = sqlite3_column_bytes(stmt, 0);
 
   // decode it
-  success = _openslide_jpeg_decode_buffer(buf, buflen, dest,
-                                          img->base.w, img->base.h, err);
+  int64_t w, h;
+  _openslide_associated_image_get_scaled_dimensions(&img->base, scale_denom,
+                                                    &w, &h);
+  success = _openslide_jpeg_decode_buffer_scaled(buf, buflen, NULL, 0,
+                                                 JCS_UNKNOWN, dest,
+                                                 scale_denom, w, h, err);
 
 FAIL:
   sqlite3_finalize(stmt);
@@ -385,6 +423,21 @@ FAIL:
   return success;
 }
 
+static bool get_associated_image_data(struct _openslide_associated_image *_img,
+                                      uint32_t *dest,
+                                      GError **err) {
+  struct associated_image *img = (struct associated_image *) _img;
+  return read_associated_image(img, 1, dest, err);
+}
+
+static bool get_associated_image_data_scaled(struct _openslide_associated_image *_img,
+                                             int32_t scale_denom,
+                                             uint32_t *dest,
+                                             GError **err) {
+  struct associated_image *img = (struct associated_image *) _img;
+  return read_associated_image(img, scale_denom, dest, err);
+}
+
 static void destroy_associated_image(struct _openslide_associated_image *_img) {
   struct associated_image *img = (struct associated_image *) _img;
 
@@ -395,6 +448,7 @@ static void destroy_associated_image(struct _openslide_associated_image *_img) {
 
 static const struct _openslide_associated_image_ops sakura_associated_ops = {
   .get_argb_data = get_associated_image_data,
+  .get_argb_data_scaled = get_associated_image_data_scaled,
   .destroy = destroy_associated_image,
 };
 
@@ -714,6 +768,11 @@ static void compute_quickhash1(struct _openslide_hash *quickhash1,
                                sqlite3 *db,
                                struct level *l,
                                const char *unique_table_name) {
+  if (quickhash1 == NULL || _openslide_hash_is_probe(quickhash1)) {
+    // not hashing this time; only errors make Sakura slides unhashable
+    return;
+  }
+
   if (!hash_columns(quickhash1, db, "SELECT SlideId, Date, Creator, "
                     "Description, Keywords FROM SVSlideDataXPO "
                     "ORDER BY OID", NULL)) {
@@ -778,9 +837,12 @@ static bool sakura_open(openslide_t *osr, const char *filename,
   }
 
   // create levels
-  // copy tile table into tilemap grid, since the table has no useful indexes
+  // copy tile table into tilemap grid, since the table has no useful
+  // indexes.  the grid stores tiles in (row, col) order, so fetching them
+  // that way lets it append without re-sorting.
   PREPARE_OR_FAIL(stmt, db, "SELECT PYRAMIDLEVEL, COLUMNINDEX, ROWINDEX, "
-                  "COLORINDEX, TILEID FROM tile");
+                  "COLORINDEX, TILEID FROM tile "
+                  "ORDER BY PYRAMIDLEVEL, ROWINDEX, COLUMNINDEX");
   int ret;
   while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
     int64_t downsample = sqlite3_column_int64(stmt, 0);
@@ -914,9 +976,10 @@ static bool sakura_open(openslide_t *osr, const char *filename,
 
   // build ops data
   struct sakura_ops_data *data = g_slice_new0(struct sakura_ops_data);
-  data->filename = g_strdup(filename);
-  data->data_sql =
+  char *data_sql =
     g_strdup_printf("SELECT data FROM %s WHERE id=?", unique_table_name);
+  data->pool = _openslide_sqlite_pool_create(filename, data_sql);
+  g_free(data_sql);
   data->tile_size = tile_size;
 
   // commit
@@ -947,6 +1010,7 @@ FAIL:
 const struct _openslide_format _openslide_format_sakura = {
   .name = "sakura",
   .vendor = "sakura",
+  .container = _OPENSLIDE_CONTAINER_SQLITE,
   .detect = sakura_detect,
   .open = sakura_open,
 };
@@ -52,6 +52,7 @@ struct level {
   struct _openslide_level base;
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
+  bool overlapped;  // adjacent tiles overlap
 };
 
 static void destroy_data(struct trestle_ops_data *data,
@@ -100,11 +101,11 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -112,7 +113,7 @@ static bool read_tile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -129,7 +130,9 @@ static bool read_tile(openslide_t *osr,
                                                                  tw * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * th * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -145,7 +148,7 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   struct trestle_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
 
-  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
   if (tiff == NULL) {
     return false;
   }
@@ -160,8 +163,41 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int64_t *len,
+                          openslide_tile_format_t *format,
+                          int32_t *w, int32_t *h,
+                          GError **err) {
+  struct trestle_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  if (l->overlapped) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE,
+                "Tiles overlap");
+    return false;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  bool success = _openslide_tiff_read_raw_tile(&l->tiffl, tiff,
+                                               tile_col, tile_row,
+                                               buf, len, format, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  if (success) {
+    *w = l->tiffl.tile_w;
+    *h = l->tiffl.tile_h;
+  }
+  return success;
+}
+
 static const struct _openslide_ops trestle_ops = {
   .paint_region = paint_region,
+  .read_raw_tile = read_raw_tile,
   .destroy = destroy,
 };
 
@@ -365,6 +401,7 @@ static bool trestle_open(openslide_t *osr, const char *filename,
       // application
       if (overlap_x || overlap_y) {
         report_geometry = false;
+        l->overlapped = true;
       }
     }
 
@@ -447,6 +484,7 @@ FAIL:
 const struct _openslide_format _openslide_format_trestle = {
   .name = "trestle",
   .vendor = "trestle",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = trestle_detect,
   .open = trestle_open,
 };
@@ -153,7 +153,6 @@ static bool read_subtile(openslide_t *osr,
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
   const int64_t subtiles_per_tile = l->base.downsample;
-  bool success = true;
 
   // tile size and coordinates
   int64_t tile_col = subtile_col / subtiles_per_tile;
@@ -173,11 +172,11 @@ static bool read_subtile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -185,7 +184,7 @@ static bool read_subtile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -195,36 +194,12 @@ static bool read_subtile(openslide_t *osr,
                          &cache_entry);
   }
 
-  // draw
-  cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                                                 CAIRO_FORMAT_ARGB32,
-                                                                 tw, th,
-                                                                 tw * 4);
-
-  // if we are drawing a subtile, we must do an additional copy,
-  // because cairo lacks source clipping
-  if (subtiles_per_tile > 1) {
-    cairo_surface_t *surface2 = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                                           ceil(subtile_w),
-                                                           ceil(subtile_h));
-    cairo_t *cr2 = cairo_create(surface2);
-    cairo_set_source_surface(cr2, surface, -subtile_x, -subtile_y);
-
-    // replace original image surface
-    cairo_surface_destroy(surface);
-    surface = surface2;
-
-    cairo_rectangle(cr2, 0, 0,
-                    ceil(subtile_w),
-                    ceil(subtile_h));
-    cairo_fill(cr2);
-    success = _openslide_check_cairo_status(cr2, err);
-    cairo_destroy(cr2);
-  }
-
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_surface_destroy(surface);
-  cairo_paint(cr);
+  // draw the subtile
+  bool success = _openslide_grid_paint_subimage(cr, tiledata,
+                                                CAIRO_FORMAT_ARGB32, tw, th,
+                                                subtile_x, subtile_y,
+                                                subtile_w, subtile_h,
+                                                err);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -240,7 +215,7 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   struct ventana_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
 
-  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
   if (tiff == NULL) {
     return false;
   }
@@ -255,8 +230,51 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static uint32_t *get_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          int32_t *w, int32_t *h,
+                          struct _openslide_cache_entry **cache_entry,
+                          GError **err) {
+  struct ventana_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return NULL;
+  }
+
+  uint32_t *tiledata = _openslide_grid_get_tile(l->grid, tiff, level,
+                                                tile_col, tile_row, w, h,
+                                                cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return tiledata;
+}
+
+static const struct _openslide_occupancy *get_occupancy(openslide_t *osr,
+                                                       struct _openslide_level *level,
+                                                       GError **err) {
+  struct ventana_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get_dir(data->tc, l->tiffl.dir, err);
+  if (tiff == NULL) {
+    return NULL;
+  }
+
+  // cells outside the scanned areas have no tiles
+  const struct _openslide_occupancy *occ =
+    _openslide_grid_get_occupancy(l->grid, tiff, level, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return occ;
+}
+
 static const struct _openslide_ops ventana_ops = {
   .paint_region = paint_region,
+  .get_tile = get_tile,
+  .get_occupancy = get_occupancy,
   .destroy = destroy,
 };
 
@@ -831,12 +849,12 @@ static struct _openslide_grid *create_grid(openslide_t *osr,
 }
 
 //from vendor generic
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+static uint32_t *fetch_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            void *arg,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
@@ -846,31 +864,54 @@ static bool read_tile(openslide_t *osr,
   int64_t th = tiffl->tile_h;
 
   // cache
-  struct _openslide_cache_entry *cache_entry;
   uint32_t *tiledata = _openslide_cache_get(osr->cache,
                                             level, tile_col, tile_row,
-                                            &cache_entry);
+                                            cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // clip, if necessary
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
-      return false;
+      _openslide_buffer_free(tw * th * 4, tiledata);
+      return NULL;
     }
 
     // put it in the cache
     _openslide_cache_put(osr->cache, level, tile_col, tile_row,
                          tiledata, tw * th * 4,
-                         &cache_entry);
+                         cache_entry);
+  }
+
+  return tiledata;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+
+  // tile size
+  int64_t tw = tiffl->tile_w;
+  int64_t th = tiffl->tile_h;
+
+  // cache
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata = fetch_tile(osr, level, tile_col, tile_row, arg,
+                                  &cache_entry, err);
+  if (!tiledata) {
+    return false;
   }
 
   // draw it
@@ -880,7 +921,9 @@ static bool read_tile(openslide_t *osr,
                                                                  tw * 4);
   cairo_set_source_surface(cr, surface, 0, 0);
   cairo_surface_destroy(surface);
+  int64_t perf_start = _openslide_perf_start();
   cairo_paint(cr);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, tw * th * 4);
 
   // done with the cache entry, release it
   _openslide_cache_entry_unref(cache_entry);
@@ -1026,6 +1069,7 @@ static bool ventana_tif_open(openslide_t *osr, const char *filename,
                                               tiffl->tile_w,
                                               tiffl->tile_h,
                                               read_tile);
+      _openslide_grid_simple_set_fetch_tile(l->grid, fetch_tile);
       // the format doesn't seem to record the level size, so make it
       // large enough for all the pixels
       double x, y, w, h;
@@ -1329,6 +1373,7 @@ FAIL:
 const struct _openslide_format _openslide_format_ventana = {
   .name = "ventana",
   .vendor = "ventana",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = ventana_detect,
   .open = ventana_open,
 };
@@ -1336,6 +1381,7 @@ const struct _openslide_format _openslide_format_ventana = {
 const struct _openslide_format _openslide_format_ventana_tif = {
   .name = "ventana tif",
   .vendor = "ventana",
+  .container = _OPENSLIDE_CONTAINER_TIFF,
   .detect = ventana_tif_detect,
   .open = ventana_tif_open,
 };
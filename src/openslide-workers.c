@@ -0,0 +1,280 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+ * A process-wide pool of worker threads, and task groups that run on it.
+ *
+ * Tasks are queued on their group, not on the pool; the pool only learns
+ * that a group has work.  A thread waiting on a group runs that group's
+ * queued tasks itself.  Thus a task may safely create and wait on a group
+ * of its own, and a group always makes progress even if every worker is
+ * busy elsewhere.
+ *
+ * Background work, such as prefetching, goes to a separate, smaller pool
+ * so that it never holds up a foreground read waiting for a worker.
+ */
+
+struct task {
+  _openslide_task_fn fn;
+  void *data;
+};
+
+struct _openslide_taskgroup {
+  GMutex *mutex;
+  GCond *cond;
+  GQueue *pending;
+  int running;
+  int refcount;  // creator plus one per item pushed to the pool
+};
+
+static GThreadPool *worker_pool;
+static GThreadPool *background_pool;
+
+// non-NULL while the current thread is running a task
+static GStaticPrivate in_task = G_STATIC_PRIVATE_INIT;
+
+struct scratch {
+  void *buf;
+  size_t size;
+};
+
+static GStaticPrivate scratch_key = G_STATIC_PRIVATE_INIT;
+
+static int get_processor_count(void) {
+#ifdef WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (count > 0) {
+    return MIN(count, G_MAXINT);
+  }
+  return 1;
+#else
+  return 1;
+#endif
+}
+
+// taskgroup mutex must be held; returns with it released
+static void taskgroup_unref_unlock(struct _openslide_taskgroup *tg) {
+  bool last = --tg->refcount == 0;
+  g_mutex_unlock(tg->mutex);
+  if (last) {
+    g_assert(g_queue_is_empty(tg->pending));
+    g_queue_free(tg->pending);
+    g_cond_free(tg->cond);
+    g_mutex_free(tg->mutex);
+    g_slice_free(struct _openslide_taskgroup, tg);
+  }
+}
+
+// taskgroup mutex must be held.  returns false if there was nothing to
+// run.
+static bool run_one_task(struct _openslide_taskgroup *tg) {
+  struct task *task = g_queue_pop_head(tg->pending);
+  if (task == NULL) {
+    return false;
+  }
+  tg->running++;
+  g_mutex_unlock(tg->mutex);
+
+  gpointer outer = g_static_private_get(&in_task);
+  g_static_private_set(&in_task, GINT_TO_POINTER(1), NULL);
+  task->fn(task->data);
+  g_static_private_set(&in_task, outer, NULL);
+  g_slice_free(struct task, task);
+
+  g_mutex_lock(tg->mutex);
+  tg->running--;
+  if (tg->running == 0 && g_queue_is_empty(tg->pending)) {
+    g_cond_broadcast(tg->cond);
+  }
+  return true;
+}
+
+static void worker(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct _openslide_taskgroup *tg = data;
+
+  // the task may already have been run by the waiting thread
+  g_mutex_lock(tg->mutex);
+  run_one_task(tg);
+  taskgroup_unref_unlock(tg);
+}
+
+static GThreadPool *get_pool(void) {
+  static gsize initialized;
+
+  if (g_once_init_enter(&initialized)) {
+    int count = get_processor_count();
+    if (count > 1) {
+      GError *tmp_err = NULL;
+      worker_pool = g_thread_pool_new(worker, NULL, count, FALSE, &tmp_err);
+      if (worker_pool == NULL) {
+        // run everything in the calling thread
+        g_warning("Couldn't create worker threads: %s", tmp_err->message);
+        g_clear_error(&tmp_err);
+      }
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+  return worker_pool;
+}
+
+struct background_task {
+  _openslide_task_fn fn;
+  void *data;
+};
+
+static void background_worker(gpointer data,
+                              gpointer user_data G_GNUC_UNUSED) {
+  struct background_task *task = data;
+  g_static_private_set(&in_task, GINT_TO_POINTER(1), NULL);
+  task->fn(task->data);
+  g_static_private_set(&in_task, NULL, NULL);
+  g_slice_free(struct background_task, task);
+}
+
+static GThreadPool *get_background_pool(void) {
+  static gsize initialized;
+
+  if (g_once_init_enter(&initialized)) {
+    // at least one thread, even on a single processor
+    int count = MAX(1, get_processor_count() / 4);
+    GError *tmp_err = NULL;
+    background_pool = g_thread_pool_new(background_worker, NULL, count,
+                                        FALSE, &tmp_err);
+    if (background_pool == NULL) {
+      g_warning("Couldn't create background threads: %s", tmp_err->message);
+      g_clear_error(&tmp_err);
+    }
+    g_once_init_leave(&initialized, 1);
+  }
+  return background_pool;
+}
+
+void _openslide_run_in_background(_openslide_task_fn fn, void *data) {
+  GThreadPool *pool = get_background_pool();
+  if (pool == NULL) {
+    fn(data);
+    return;
+  }
+  struct background_task *task = g_slice_new(struct background_task);
+  task->fn = fn;
+  task->data = data;
+  g_thread_pool_push(pool, task, NULL);
+}
+
+int _openslide_get_worker_count(void) {
+  GThreadPool *pool = get_pool();
+  return pool ? g_thread_pool_get_max_threads(pool) : 0;
+}
+
+bool _openslide_in_task(void) {
+  return g_static_private_get(&in_task) != NULL;
+}
+
+struct _openslide_taskgroup *_openslide_taskgroup_create(void) {
+  struct _openslide_taskgroup *tg =
+    g_slice_new0(struct _openslide_taskgroup);
+  tg->mutex = g_mutex_new();
+  tg->cond = g_cond_new();
+  tg->pending = g_queue_new();
+  tg->refcount = 1;
+  return tg;
+}
+
+void _openslide_taskgroup_push(struct _openslide_taskgroup *tg,
+                               _openslide_task_fn fn,
+                               void *data) {
+  struct task *task = g_slice_new(struct task);
+  task->fn = fn;
+  task->data = data;
+
+  GThreadPool *pool = get_pool();
+
+  g_mutex_lock(tg->mutex);
+  g_queue_push_tail(tg->pending, task);
+  if (pool) {
+    tg->refcount++;
+  }
+  g_mutex_unlock(tg->mutex);
+
+  if (pool) {
+    g_thread_pool_push(pool, tg, NULL);
+  }
+}
+
+void _openslide_taskgroup_finish(struct _openslide_taskgroup *tg) {
+  g_mutex_lock(tg->mutex);
+  // help out
+  while (run_one_task(tg)) {
+  }
+  // wait for tasks running in workers
+  while (tg->running) {
+    g_cond_wait(tg->cond, tg->mutex);
+  }
+  taskgroup_unref_unlock(tg);
+}
+
+void _openslide_run_detached(_openslide_task_fn fn, void *data) {
+  if (get_pool() == NULL) {
+    fn(data);
+    return;
+  }
+  // a group that frees itself when its only task is done
+  struct _openslide_taskgroup *tg = _openslide_taskgroup_create();
+  _openslide_taskgroup_push(tg, fn, data);
+  g_mutex_lock(tg->mutex);
+  taskgroup_unref_unlock(tg);
+}
+
+static void scratch_free(gpointer data) {
+  struct scratch *scratch = data;
+  g_free(scratch->buf);
+  g_slice_free(struct scratch, scratch);
+}
+
+void *_openslide_get_scratch(size_t size) {
+  struct scratch *scratch = g_static_private_get(&scratch_key);
+  if (scratch == NULL) {
+    scratch = g_slice_new0(struct scratch);
+    g_static_private_set(&scratch_key, scratch, scratch_free);
+  }
+  if (scratch->size < size) {
+    g_free(scratch->buf);
+    scratch->buf = g_malloc(size);
+    scratch->size = size;
+  }
+  return scratch->buf;
+}
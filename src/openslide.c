@@ -23,6 +23,7 @@
 
 #include "openslide-private.h"
 #include "openslide-decode-tifflike.h"
+#include "openslide-snapshot.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -87,6 +88,13 @@ static bool level_in_range(openslide_t *osr, int32_t level) {
   return true;
 }
 
+static bool is_synthetic_level(openslide_t *osr, int32_t level) {
+  return level >= osr->level_count - osr->synthetic_level_count;
+}
+
+static struct _openslide_prefetcher *prefetcher_create(openslide_t *osr);
+static void prefetcher_destroy(struct _openslide_prefetcher *pf);
+
 static openslide_t *create_osr(void) {
   openslide_t *osr = g_slice_new0(openslide_t);
   osr->properties = g_hash_table_new_full(g_str_hash, g_str_equal,
@@ -94,29 +102,121 @@ static openslide_t *create_osr(void) {
   osr->associated_images = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                  g_free,
                                                  destroy_associated_image);
+  osr->quickhash1_lock = g_mutex_new();
+  osr->prefetcher = prefetcher_create(osr);
+  osr->async_reads = _openslide_async_reads_create();
+  osr->request_errors_lock = g_mutex_new();
+  osr->request_errors = g_ptr_array_new_with_free_func(g_free);
   return osr;
 }
 
+#define SNIFF_LEN 16
+
+static const uint8_t SQLITE_MAGIC[SNIFF_LEN] = "SQLite format 3";
+
+// classify a file from its first few bytes.  returns false if the file
+// can't be read at all.
+static bool sniff_container(const char *filename,
+                            enum _openslide_container *container,
+                            GError **err) {
+  FILE *f = _openslide_fopen(filename, "rb", err);
+  if (!f) {
+    return false;
+  }
+  uint8_t buf[SNIFF_LEN];
+  size_t len = fread(buf, 1, sizeof(buf), f);
+  bool failed = ferror(f);
+  fclose(f);
+  if (failed) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't read header of %s", filename);
+    return false;
+  }
+
+  *container = _OPENSLIDE_CONTAINER_NON_TIFF;
+  if (len >= 4 &&
+      ((buf[0] == 'I' && buf[1] == 'I' && buf[3] == 0 &&
+        (buf[2] == 42 || buf[2] == 43)) ||
+       (buf[0] == 'M' && buf[1] == 'M' && buf[2] == 0 &&
+        (buf[3] == 42 || buf[3] == 43)))) {
+    *container = _OPENSLIDE_CONTAINER_TIFF;
+  } else if (len == SNIFF_LEN && !memcmp(buf, SQLITE_MAGIC, SNIFF_LEN)) {
+    *container = _OPENSLIDE_CONTAINER_SQLITE;
+  }
+  return true;
+}
+
+static bool container_matches(enum _openslide_container wanted,
+                              enum _openslide_container actual) {
+  switch (wanted) {
+  case _OPENSLIDE_CONTAINER_ANY:
+    return true;
+  case _OPENSLIDE_CONTAINER_NON_TIFF:
+    return actual != _OPENSLIDE_CONTAINER_TIFF;
+  default:
+    return wanted == actual;
+  }
+}
+
 static const struct _openslide_format *detect_format(const char *filename,
                                                      struct _openslide_tifflike **tl_OUT) {
   GError *tmp_err = NULL;
 
-  struct _openslide_tifflike *tl = _openslide_tifflike_create(filename,
-                                                              &tmp_err);
-  if (!tl) {
+  // read the header once, so we can skip formats that can't match
+  enum _openslide_container container;
+  if (!sniff_container(filename, &container, &tmp_err)) {
     if (_openslide_debug(OPENSLIDE_DEBUG_DETECTION)) {
-      g_message("tifflike: %s", tmp_err->message);
+      g_message("%s", tmp_err->message);
     }
     g_clear_error(&tmp_err);
+    return NULL;
   }
 
+  // walk the IFDs only when a TIFF format needs them
+  struct _openslide_tifflike *tl = NULL;
+  bool tried_tifflike = false;
+
   for (const struct _openslide_format **cur = formats; *cur; cur++) {
     const struct _openslide_format *format = *cur;
 
     g_assert(format->name && format->vendor &&
              format->detect && format->open);
 
-    if (format->detect(filename, tl, &tmp_err)) {
+    if (!container_matches(format->container, container)) {
+      if (_openslide_debug(OPENSLIDE_DEBUG_DETECTION)) {
+        g_message("%s: Wrong file type", format->name);
+      }
+      continue;
+    }
+    if (format->extension &&
+        !g_str_has_suffix(filename, format->extension)) {
+      if (_openslide_debug(OPENSLIDE_DEBUG_DETECTION)) {
+        g_message("%s: File does not have %s extension", format->name,
+                  format->extension);
+      }
+      continue;
+    }
+
+    if (format->container == _OPENSLIDE_CONTAINER_TIFF) {
+      if (!tried_tifflike) {
+        tried_tifflike = true;
+        tl = _openslide_tifflike_create(filename, &tmp_err);
+        if (!tl) {
+          if (_openslide_debug(OPENSLIDE_DEBUG_DETECTION)) {
+            g_message("tifflike: %s", tmp_err->message);
+          }
+          g_clear_error(&tmp_err);
+        }
+      }
+      if (!tl) {
+        // the remaining formats can't do anything without one
+        continue;
+      }
+    }
+
+    if (format->detect(filename,
+                       format->container == _OPENSLIDE_CONTAINER_TIFF ?
+                       tl : NULL, &tmp_err)) {
       // success!
       if (tl_OUT) {
         *tl_OUT = tl;
@@ -142,15 +242,9 @@ static bool open_backend(openslide_t *osr,
                          const struct _openslide_format *format,
                          const char *filename,
                          struct _openslide_tifflike *tl,
-                         struct _openslide_hash **quickhash1_OUT,
+                         struct _openslide_hash *quickhash1,
                          GError **err) {
-  if (quickhash1_OUT) {
-    *quickhash1_OUT = _openslide_hash_quickhash1_create();
-  }
-
-  bool result = format->open(osr, filename, tl,
-                             quickhash1_OUT ? *quickhash1_OUT : NULL,
-                             err);
+  bool result = format->open(osr, filename, tl, quickhash1, err);
 
   // check for error-handling bugs in open function
   if (!result && err && !*err) {
@@ -164,12 +258,94 @@ static bool open_backend(openslide_t *osr,
     result = false;
   }
 
-  // if we have a hash and a false result, destroy
-  if (quickhash1_OUT && !result) {
-    _openslide_hash_destroy(*quickhash1_OUT);
+  return result;
+}
+
+static void put_property(gpointer key, gpointer value, gpointer user_data) {
+  struct _openslide_snapshot *snap = user_data;
+  _openslide_snapshot_put_string(snap, key);
+  _openslide_snapshot_put_string(snap, value);
+}
+
+// record enough state to reopen the slide without parsing it
+static void save_snapshot(openslide_t *osr,
+                          const struct _openslide_format *format,
+                          const char *filename) {
+  char *path = _openslide_get_cache_path(filename, ".snapshot");
+  if (path == NULL || format->save_snapshot == NULL) {
+    // disabled or unsupported
+    g_free(path);
+    return;
   }
+  g_free(path);
+
+  struct _openslide_snapshot *snap = _openslide_snapshot_new();
+  _openslide_snapshot_put_string(snap, format->name);
+  _openslide_snapshot_put_int(snap, g_hash_table_size(osr->properties));
+  g_hash_table_foreach(osr->properties, put_property, snap);
+  if (format->save_snapshot(osr, snap)) {
+    _openslide_snapshot_save(snap, filename);
+  }
+  _openslide_snapshot_destroy(snap);
+}
 
-  return result;
+// returns NULL if there's no usable snapshot
+static openslide_t *open_snapshot(const char *filename,
+                                  const struct _openslide_format **format_OUT) {
+  struct _openslide_snapshot *snap = _openslide_snapshot_load(filename);
+  if (snap == NULL) {
+    return NULL;
+  }
+
+  // find format
+  const struct _openslide_format *format = NULL;
+  char *name = _openslide_snapshot_get_string(snap);
+  for (const struct _openslide_format **cur = formats; *cur; cur++) {
+    if (!g_strcmp0((*cur)->name, name)) {
+      format = *cur;
+      break;
+    }
+  }
+  g_free(name);
+  if (format == NULL || format->open_snapshot == NULL) {
+    _openslide_snapshot_destroy(snap);
+    return NULL;
+  }
+
+  // properties.  quickhash1 is saved without a value when the slide
+  // can be hashed, and not at all when it can't.
+  openslide_t *osr = create_osr();
+  int64_t count = _openslide_snapshot_get_int(snap);
+  for (int64_t i = 0; i < count && _openslide_snapshot_ok(snap); i++) {
+    char *key = _openslide_snapshot_get_string(snap);
+    char *value = _openslide_snapshot_get_string(snap);
+    if (key && (value ||
+                !strcmp(key, OPENSLIDE_PROPERTY_NAME_QUICKHASH1))) {
+      g_hash_table_insert(osr->properties, key, value);
+    } else {
+      g_free(key);
+      g_free(value);
+    }
+  }
+
+  // backend state
+  GError *tmp_err = NULL;
+  bool success = _openslide_snapshot_ok(snap) &&
+                 format->open_snapshot(osr, filename, snap, &tmp_err) &&
+                 _openslide_snapshot_ok(snap);
+  _openslide_snapshot_destroy(snap);
+  if (!success) {
+    if (tmp_err) {
+      g_debug("Couldn't open %s from snapshot: %s", filename,
+              tmp_err->message);
+      g_clear_error(&tmp_err);
+    }
+    openslide_close(osr);
+    return NULL;
+  }
+
+  *format_OUT = format;
+  return osr;
 }
 
 const char *openslide_detect_vendor(const char *filename) {
@@ -214,6 +390,43 @@ static void add_key_to_strv(gpointer key,
   d->strv[d->i++] = key;
 }
 
+// add the level count, and the properties of levels from first on
+static void set_level_properties(openslide_t *osr, int32_t first) {
+  g_hash_table_insert(osr->properties,
+		      g_strdup(_OPENSLIDE_PROPERTY_NAME_LEVEL_COUNT),
+		      g_strdup_printf("%d", osr->level_count));
+  bool should_have_geometry = osr->level_count &&
+                              osr->levels[0]->tile_w > 0 &&
+                              osr->levels[0]->tile_h > 0;
+  for (int32_t i = first; i < osr->level_count; i++) {
+    struct _openslide_level *l = osr->levels[i];
+
+    g_hash_table_insert(osr->properties,
+			g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_WIDTH, i),
+			g_strdup_printf("%" G_GINT64_FORMAT, l->w));
+    g_hash_table_insert(osr->properties,
+			g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_HEIGHT, i),
+			g_strdup_printf("%" G_GINT64_FORMAT, l->h));
+    g_hash_table_insert(osr->properties,
+			g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_DOWNSAMPLE, i),
+			_openslide_format_double(l->downsample));
+
+    // tile geometry
+    bool have_geometry = (l->tile_w > 0 && l->tile_h > 0);
+    if (have_geometry != should_have_geometry) {
+      g_warning("Inconsistent tile geometry hints between levels");
+    }
+    if (have_geometry) {
+      g_hash_table_insert(osr->properties,
+                          g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_TILE_WIDTH, i),
+                          g_strdup_printf("%" G_GINT64_FORMAT, l->tile_w));
+      g_hash_table_insert(osr->properties,
+                          g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_TILE_HEIGHT, i),
+                          g_strdup_printf("%" G_GINT64_FORMAT, l->tile_h));
+    }
+  }
+}
+
 static int cmpstring(const void *p1, const void *p2) {
   return strcmp(* (char * const *) p1, * (char * const *) p2);
 }
@@ -235,26 +448,36 @@ openslide_t *openslide_open(const char *filename) {
 
   g_assert(openslide_was_dynamically_loaded);
 
-  // detect format
-  struct _openslide_tifflike *tl;
-  const struct _openslide_format *format = detect_format(filename, &tl);
-  if (!format) {
-    // not a slide file
-    return NULL;
-  }
-
-  // alloc memory
-  openslide_t *osr = create_osr();
+  // reuse a saved snapshot if we have one
+  const struct _openslide_format *format;
+  openslide_t *osr = open_snapshot(filename, &format);
+  bool from_snapshot = osr != NULL;
+  bool hashable = false;  // a snapshot lists quickhash1 itself
+
+  if (!from_snapshot) {
+    // detect format
+    struct _openslide_tifflike *tl;
+    format = detect_format(filename, &tl);
+    if (!format) {
+      // not a slide file
+      return NULL;
+    }
 
-  // open backend
-  struct _openslide_hash *quickhash1 = NULL;
-  bool success = open_backend(osr, format, filename, tl, &quickhash1,
-                              &tmp_err);
-  _openslide_tifflike_destroy(tl);
-  if (!success) {
-    // failed to read slide
-    _openslide_propagate_error(osr, tmp_err);
-    return osr;
+    // alloc memory
+    osr = create_osr();
+
+    // open backend.  quickhash1 is computed on demand, but the backend
+    // decides now whether the slide can be hashed at all.
+    struct _openslide_hash *probe = _openslide_hash_probe_create();
+    bool success = open_backend(osr, format, filename, tl, probe, &tmp_err);
+    hashable = _openslide_hash_is_enabled(probe);
+    _openslide_hash_destroy(probe);
+    _openslide_tifflike_destroy(tl);
+    if (!success) {
+      // failed to read slide
+      _openslide_propagate_error(osr, tmp_err);
+      return osr;
+    }
   }
   g_assert(osr->levels);
 
@@ -282,57 +505,37 @@ openslide_t *openslide_open(const char *filename) {
       g_warning("Downsampled images not correctly ordered: %g < %g",
 		osr->levels[i]->downsample, osr->levels[i - 1]->downsample);
       openslide_close(osr);
-      _openslide_hash_destroy(quickhash1);
       return NULL;
     }
   }
 
-  // set hash property
-  const char *hash_str = _openslide_hash_get_string(quickhash1);
-  if (hash_str != NULL) {
+  // if the slide can be hashed, list the hash property now and compute
+  // it on first request
+  osr->format = format;
+  osr->filename = g_strdup(filename);
+  if (hashable) {
     g_hash_table_insert(osr->properties,
                         g_strdup(OPENSLIDE_PROPERTY_NAME_QUICKHASH1),
-                        g_strdup(hash_str));
+                        NULL);
   }
-  _openslide_hash_destroy(quickhash1);
 
   // set other properties
   g_hash_table_insert(osr->properties,
                       g_strdup(OPENSLIDE_PROPERTY_NAME_VENDOR),
                       g_strdup(format->vendor));
-  g_hash_table_insert(osr->properties,
-		      g_strdup(_OPENSLIDE_PROPERTY_NAME_LEVEL_COUNT),
-		      g_strdup_printf("%d", osr->level_count));
-  bool should_have_geometry;
-  for (int32_t i = 0; i < osr->level_count; i++) {
-    struct _openslide_level *l = osr->levels[i];
+  set_level_properties(osr, 0);
 
-    g_hash_table_insert(osr->properties,
-			g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_WIDTH, i),
-			g_strdup_printf("%" G_GINT64_FORMAT, l->w));
-    g_hash_table_insert(osr->properties,
-			g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_HEIGHT, i),
-			g_strdup_printf("%" G_GINT64_FORMAT, l->h));
-    g_hash_table_insert(osr->properties,
-			g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_DOWNSAMPLE, i),
-			_openslide_format_double(l->downsample));
+  // save state for next time
+  if (!from_snapshot) {
+    save_snapshot(osr, format, filename);
+  }
 
-    // tile geometry
-    bool have_geometry = (l->tile_w > 0 && l->tile_h > 0);
-    if (i == 0) {
-      should_have_geometry = have_geometry;
-    }
-    if (have_geometry != should_have_geometry) {
-      g_warning("Inconsistent tile geometry hints between levels");
-    }
-    if (have_geometry) {
-      g_hash_table_insert(osr->properties,
-                          g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_TILE_WIDTH, i),
-                          g_strdup_printf("%" G_GINT64_FORMAT, l->tile_w));
-      g_hash_table_insert(osr->properties,
-                          g_strdup_printf(_OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_TILE_HEIGHT, i),
-                          g_strdup_printf("%" G_GINT64_FORMAT, l->tile_h));
-    }
+  // add synthetic levels after the snapshot, which only records what
+  // the backend provides
+  int32_t native_level_count = osr->level_count;
+  _openslide_synthetic_add_levels(osr);
+  if (osr->level_count != native_level_count) {
+    set_level_properties(osr, native_level_count);
   }
 
   // fill in names
@@ -340,14 +543,22 @@ openslide_t *openslide_open(const char *filename) {
   osr->property_names = strv_from_hashtable_keys(osr->properties);
 
   // start cache
-  osr->cache = _openslide_cache_create(_OPENSLIDE_USEFUL_CACHE_SIZE);
-  //osr->cache = _openslide_cache_create(0);
+  osr->cache = _openslide_cache_binding_create(_openslide_cache_get_default_capacity());
+  //osr->cache = _openslide_cache_binding_create(0);
 
   return osr;
 }
 
 
 void openslide_close(openslide_t *osr) {
+  // stop background reads before tearing anything down.  prefetch
+  // tasks use the backend, the levels, and the cache binding.
+  prefetcher_destroy(osr->prefetcher);
+  _openslide_async_reads_destroy(osr->async_reads);
+
+  // the backend only knows about its own levels
+  _openslide_synthetic_remove_levels(osr);
+
   if (osr->ops) {
     (osr->ops->destroy)(osr);
   }
@@ -358,13 +569,22 @@ void openslide_close(openslide_t *osr) {
   g_free(osr->associated_image_names);
   g_free(osr->property_names);
 
+  g_ptr_array_free(osr->request_errors, true);
+  g_mutex_free(osr->request_errors_lock);
+
+  g_free(osr->filename);
+  g_free(osr->quickhash1);
+  g_mutex_free(osr->quickhash1_lock);
+
   if (osr->cache) {
-    _openslide_cache_destroy(osr->cache);
+    _openslide_cache_binding_destroy(osr->cache);
   }
 
   g_free(g_atomic_pointer_get(&osr->error));
 
   g_slice_free(openslide_t, osr);
+
+  _openslide_perf_log();
 }
 
 
@@ -460,21 +680,6 @@ double openslide_get_layer_downsample(openslide_t *osr, int32_t level) {
 }
 
 
-int openslide_give_prefetch_hint(openslide_t *osr G_GNUC_UNUSED,
-				 int64_t x G_GNUC_UNUSED,
-				 int64_t y G_GNUC_UNUSED,
-				 int32_t level G_GNUC_UNUSED,
-				 int64_t w G_GNUC_UNUSED,
-				 int64_t h G_GNUC_UNUSED) {
-  g_warning("openslide_give_prefetch_hint has never been implemented and should not be called");
-  return 0;
-}
-
-void openslide_cancel_prefetch_hint(openslide_t *osr G_GNUC_UNUSED,
-				    int prefetch_id G_GNUC_UNUSED) {
-  g_warning("openslide_cancel_prefetch_hint has never been implemented and should not be called");
-}
-
 static bool read_region(openslide_t *osr,
 			cairo_t *cr,
 			int64_t x, int64_t y,
@@ -483,20 +688,31 @@ static bool read_region(openslide_t *osr,
 			GError **err) {
   bool success = true;
 
+  // if the target has just been cleared, saturating directly onto it
+  // gives the same result as going through a group, and lets grids
+  // write tile data straight into the target
+  bool pristine = _openslide_is_surface_pristine(cairo_get_target(cr));
+
   // save the old pattern, it's the only thing push/pop won't restore
   cairo_pattern_t *old_source = cairo_get_source(cr);
   cairo_pattern_reference(old_source);
 
-  // push, so that saturate works with all sorts of backends
-  cairo_push_group(cr);
-
-  // clear to set the bounds of the group (seems to be a recent cairo bug)
-  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-  cairo_rectangle(cr, 0, 0, w, h);
-  cairo_fill(cr);
+  int64_t perf_start = _openslide_perf_start();
+  if (pristine) {
+    cairo_save(cr);
+  } else {
+    // push, so that saturate works with all sorts of backends
+    cairo_push_group(cr);
+
+    // clear to set the bounds of the group (seems to be a recent cairo bug)
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(cr, 0, 0, w, h);
+    cairo_fill(cr);
+  }
 
   // saturate those seams away!
   cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start, 0);
 
   if (level_in_range(osr, level)) {
     struct _openslide_level *l = osr->levels[level];
@@ -519,16 +735,29 @@ static bool read_region(openslide_t *osr,
 
     // paint
     if (w > 0 && h > 0) {
-      success = osr->ops->paint_region(osr, cr, x, y, l, w, h, err);
+      if (is_synthetic_level(osr, level)) {
+        success = _openslide_synthetic_paint_region(osr, cr, x, y, l, w, h,
+                                                    err);
+      } else {
+        success = osr->ops->paint_region(osr, cr, x, y, l, w, h, err);
+      }
     }
   }
 
-  cairo_pop_group_to_source(cr);
+  perf_start = _openslide_perf_start();
+  if (pristine) {
+    // nothing to commit; the caller discards the target on failure
+    cairo_restore(cr);
+  } else {
+    cairo_pop_group_to_source(cr);
 
-  if (success) {
-    // commit, nothing went wrong
-    cairo_paint(cr);
+    if (success) {
+      // commit, nothing went wrong
+      cairo_paint(cr);
+    }
   }
+  _openslide_perf_end(OPENSLIDE_PERF_COMPOSITE, perf_start,
+                      pristine ? 0 : w * h * 4);
 
   // restore old source
   cairo_set_source(cr, old_source);
@@ -549,6 +778,43 @@ static bool ensure_nonnegative_dimensions(openslide_t *osr, int64_t w, int64_t h
   return true;
 }
 
+// paint a region small enough for a single cairo surface into dest,
+// which has the specified row stride in pixels
+static bool read_region_area(openslide_t *osr,
+                             uint32_t *dest, int64_t stride,
+                             int64_t x, int64_t y,
+                             int32_t level,
+                             int64_t w, int64_t h,
+                             GError **err) {
+  // create the cairo surface for the dest
+  cairo_surface_t *surface;
+  if (dest) {
+    surface = cairo_image_surface_create_for_data(
+            (unsigned char *) dest,
+            CAIRO_FORMAT_ARGB32, w, h, stride * 4);
+    // our callers have cleared dest
+    _openslide_set_surface_pristine(surface, true);
+  } else {
+    // nil surface
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+  }
+
+  // create the cairo context
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+
+  // paint
+  bool success = read_region(osr, cr, x, y, level, w, h, err);
+
+  // done
+  if (success) {
+    success = _openslide_check_cairo_status(cr, err);
+  }
+
+  cairo_destroy(cr);
+  return success;
+}
+
 void openslide_read_region(openslide_t *osr,
 			   uint32_t *dest,
 			   int64_t x, int64_t y,
@@ -587,34 +853,11 @@ void openslide_read_region(openslide_t *osr,
       int64_t sw = MIN(w - col * d, d);  // level plane
       int64_t sh = MIN(h - row * d, d);  // level plane
 
-      // create the cairo surface for the dest
-      cairo_surface_t *surface;
-      if (dest) {
-        surface = cairo_image_surface_create_for_data(
-                (unsigned char *) (dest + w * row * d + col * d),
-                CAIRO_FORMAT_ARGB32, sw, sh, w * 4);
-      } else {
-        // nil surface
-        surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
-      }
-
-      // create the cairo context
-      cairo_t *cr = cairo_create(surface);
-      cairo_surface_destroy(surface);
-
-      // paint
-      if (!read_region(osr, cr, sx, sy, level, sw, sh, &tmp_err)) {
-        cairo_destroy(cr);
-        goto OUT;
-      }
-
-      // done
-      if (!_openslide_check_cairo_status(cr, &tmp_err)) {
-        cairo_destroy(cr);
+      uint32_t *sdest = dest ? dest + w * row * d + col * d : NULL;
+      if (!read_region_area(osr, sdest, w, sx, sy, level, sw, sh,
+                            &tmp_err)) {
         goto OUT;
       }
-
-      cairo_destroy(cr);
     }
   }
 
@@ -628,6 +871,685 @@ OUT:
   }
 }
 
+int32_t openslide_get_pixel_format_size(openslide_pixel_format_t format) {
+  switch (format) {
+  case OPENSLIDE_PIXEL_FORMAT_ARGB32:
+  case OPENSLIDE_PIXEL_FORMAT_RGBA32:
+    return 4;
+  case OPENSLIDE_PIXEL_FORMAT_RGB24:
+  case OPENSLIDE_PIXEL_FORMAT_BGR24:
+    return 3;
+  case OPENSLIDE_PIXEL_FORMAT_GRAY8:
+    return 1;
+  default:
+    return -1;
+  }
+}
+
+struct format_chunk {
+  openslide_t *osr;
+  GError **err;  // first error; g_atomic_pointer
+  openslide_pixel_format_t format;
+  uint8_t *dest;
+  int64_t stride;  // pixels
+  int64_t x;
+  int64_t y;
+  int32_t level;
+  int64_t w;
+  int64_t h;
+};
+
+static void read_format_chunk(void *data) {
+  struct format_chunk *chunk = data;
+  int32_t bpp = openslide_get_pixel_format_size(chunk->format);
+  GError *tmp_err = NULL;
+
+  // 32-bit formats are read and converted in place; the others go
+  // through an ARGB buffer the size of the chunk
+  uint32_t *argb;
+  int64_t argb_stride;
+  if (bpp == 4) {
+    argb = (uint32_t *) chunk->dest;
+    argb_stride = chunk->stride;
+  } else {
+    argb = g_malloc0(chunk->w * chunk->h * 4);
+    argb_stride = chunk->w;
+  }
+
+  if (g_atomic_pointer_get(chunk->err) == NULL) {
+    if (read_region_area(chunk->osr, argb, argb_stride,
+                         chunk->x, chunk->y, chunk->level,
+                         chunk->w, chunk->h, &tmp_err)) {
+      for (int64_t row = 0; row < chunk->h; row++) {
+        uint8_t *d = chunk->dest + row * chunk->stride * bpp;
+        const uint32_t *s = argb + row * argb_stride;
+        switch (chunk->format) {
+        case OPENSLIDE_PIXEL_FORMAT_RGBA32:
+          _openslide_argb_to_rgba(d, s, chunk->w);
+          break;
+        case OPENSLIDE_PIXEL_FORMAT_RGB24:
+          _openslide_argb_to_rgb24(d, s, chunk->w);
+          break;
+        case OPENSLIDE_PIXEL_FORMAT_BGR24:
+          _openslide_argb_to_bgr24(d, s, chunk->w);
+          break;
+        case OPENSLIDE_PIXEL_FORMAT_GRAY8:
+          _openslide_argb_to_gray8(d, s, chunk->w);
+          break;
+        default:
+          g_assert_not_reached();
+        }
+      }
+    } else if (!g_atomic_pointer_compare_and_exchange(chunk->err, NULL,
+                                                      tmp_err)) {
+      g_error_free(tmp_err);
+    }
+  }
+
+  if (bpp != 4) {
+    g_free(argb);
+  }
+  g_slice_free(struct format_chunk, chunk);
+}
+
+void openslide_read_region_format(openslide_t *osr,
+                                  void *dest,
+                                  openslide_pixel_format_t format,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h) {
+  int32_t bpp = openslide_get_pixel_format_size(format);
+  if (bpp < 0) {
+    GError *tmp_err = g_error_new(OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                                  "Invalid pixel format %d", format);
+    _openslide_propagate_error(osr, tmp_err);
+    return;
+  }
+  if (format == OPENSLIDE_PIXEL_FORMAT_ARGB32 || !dest) {
+    openslide_read_region(osr, dest, x, y, level, w, h);
+    return;
+  }
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return;
+  }
+
+  // clear the dest
+  memset(dest, 0, w * h * bpp);
+
+  // now that it's cleared, return if an error occurred
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  // convert in bands a few tiles high, so the ARGB intermediate stays
+  // small, and read them in parallel.  As in openslide_read_regions(),
+  // only split on whole pixels in level 0.
+  const int64_t dw = 4096;
+  double ds = openslide_get_level_downsample(osr, level);
+  int64_t dh = 256;
+  if (ds <= 0 || dh * ds != (int64_t) (dh * ds)) {
+    dh = 4096;
+  }
+  GError *err = NULL;
+  struct _openslide_taskgroup *tg = _openslide_taskgroup_create();
+  for (int64_t row = 0; row < (h + dh - 1) / dh; row++) {
+    for (int64_t col = 0; col < (w + dw - 1) / dw; col++) {
+      struct format_chunk *chunk = g_slice_new(struct format_chunk);
+      chunk->osr = osr;
+      chunk->err = &err;
+      chunk->format = format;
+      chunk->dest = (uint8_t *) dest + (w * row * dh + col * dw) * bpp;
+      chunk->stride = w;
+      chunk->x = x + col * dw * ds;       // level 0 plane
+      chunk->y = y + row * dh * ds;       // level 0 plane
+      chunk->level = level;
+      chunk->w = MIN(w - col * dw, dw);   // level plane
+      chunk->h = MIN(h - row * dh, dh);   // level plane
+      _openslide_taskgroup_push(tg, read_format_chunk, chunk);
+    }
+  }
+  _openslide_taskgroup_finish(tg);
+
+  if (err) {
+    _openslide_propagate_error(osr, err);
+    // ensure we don't return a partial result
+    memset(dest, 0, w * h * bpp);
+  }
+}
+
+
+struct batch_request {
+  openslide_read_request_t *req;
+  GError *err;  // first error; g_atomic_pointer
+};
+
+struct batch_chunk {
+  openslide_t *osr;
+  struct batch_request *breq;
+  uint32_t *dest;
+  int64_t stride;
+  int64_t x;
+  int64_t y;
+  int64_t w;
+  int64_t h;
+};
+
+static void read_batch_chunk(void *data) {
+  struct batch_chunk *chunk = data;
+  struct batch_request *breq = chunk->breq;
+  GError *tmp_err = NULL;
+
+  // don't bother if another piece of this request already failed
+  bool no_cache = breq->req->flags & OPENSLIDE_READ_NO_CACHE;
+  bool old_bypass = _openslide_cache_set_thread_bypass(no_cache);
+  if (g_atomic_pointer_get(&breq->err) == NULL &&
+      !read_region_area(chunk->osr, chunk->dest, chunk->stride,
+                        chunk->x, chunk->y, breq->req->level,
+                        chunk->w, chunk->h, &tmp_err)) {
+    if (!g_atomic_pointer_compare_and_exchange(&breq->err, NULL, tmp_err)) {
+      g_error_free(tmp_err);
+    }
+  }
+  _openslide_cache_set_thread_bypass(old_bypass);
+  g_slice_free(struct batch_chunk, chunk);
+}
+
+// a copy of message that lives as long as the osr.  once a request fails
+// the osr is in error state, and later requests get its error instead,
+// so only one batch's worth of messages accumulates.
+static const char *keep_request_error(openslide_t *osr, const char *message) {
+  char *copy = g_strdup(message);
+  g_mutex_lock(osr->request_errors_lock);
+  g_ptr_array_add(osr->request_errors, copy);
+  g_mutex_unlock(osr->request_errors_lock);
+  return copy;
+}
+
+int32_t openslide_read_regions(openslide_t *osr,
+                               openslide_read_request_t *reqs,
+                               int32_t count) {
+  int32_t failures = 0;
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  // clear the dests, and check for early errors
+  struct batch_request *breqs = g_new0(struct batch_request, count);
+  for (int32_t i = 0; i < count; i++) {
+    openslide_read_request_t *req = &reqs[i];
+    breqs[i].req = req;
+    req->error = NULL;
+    if (req->w < 0 || req->h < 0) {
+      g_set_error(&breqs[i].err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "negative width (%"G_GINT64_FORMAT") or negative height "
+                  "(%"G_GINT64_FORMAT") not allowed", req->w, req->h);
+      continue;
+    }
+    if (req->dest) {
+      memset(req->dest, 0, req->w * req->h * 4);
+    }
+  }
+
+  // now that they're cleared, fail everything if an error occurred
+  const char *osr_err = openslide_get_error(osr);
+  if (osr_err) {
+    for (int32_t i = 0; i < count; i++) {
+      g_clear_error(&breqs[i].err);
+      reqs[i].error = osr_err;
+    }
+    g_free(breqs);
+    return count;
+  }
+
+  // queue pieces of every request.  Smaller pieces than in
+  // openslide_read_region() give the workers something to share, but
+  // only if they land on whole pixels in level 0; otherwise the result
+  // would differ from an unsplit read.
+  struct _openslide_taskgroup *tg = _openslide_taskgroup_create();
+  for (int32_t i = 0; i < count; i++) {
+    openslide_read_request_t *req = &reqs[i];
+    if (breqs[i].err) {
+      continue;
+    }
+
+    double ds = openslide_get_level_downsample(osr, req->level);
+    int64_t d = 1024;
+    if (ds <= 0 || d * ds != (int64_t) (d * ds)) {
+      d = 4096;
+    }
+    if (!req->dest) {
+      // nothing to parallelize
+      d = MAX(d, MAX(req->w, req->h));
+    }
+
+    for (int64_t row = 0; row < (req->h + d - 1) / d; row++) {
+      for (int64_t col = 0; col < (req->w + d - 1) / d; col++) {
+        struct batch_chunk *chunk = g_slice_new(struct batch_chunk);
+        chunk->osr = osr;
+        chunk->breq = &breqs[i];
+        chunk->dest = req->dest ?
+          req->dest + req->w * row * d + col * d : NULL;
+        chunk->stride = req->w;
+        chunk->x = req->x + col * d * ds;     // level 0 plane
+        chunk->y = req->y + row * d * ds;     // level 0 plane
+        chunk->w = MIN(req->w - col * d, d);  // level plane
+        chunk->h = MIN(req->h - row * d, d);  // level plane
+        _openslide_taskgroup_push(tg, read_batch_chunk, chunk);
+      }
+    }
+  }
+  _openslide_taskgroup_finish(tg);
+
+  // report errors
+  for (int32_t i = 0; i < count; i++) {
+    openslide_read_request_t *req = &reqs[i];
+    GError *err = breqs[i].err;
+    if (err) {
+      failures++;
+      req->error = keep_request_error(osr, err->message);
+      if (req->dest && req->w >= 0 && req->h >= 0) {
+        // ensure we don't return a partial result
+        memset(req->dest, 0, req->w * req->h * 4);
+      }
+      _openslide_propagate_error(osr, err);
+    }
+  }
+  g_free(breqs);
+
+  return failures;
+}
+
+
+/*
+ * Prefetching.  Each hint is split into pieces that background threads
+ * read into the tile cache, in order.  The prefetcher is refcounted
+ * because queued background tasks may outlive the OpenSlide object;
+ * once the object is closed they find nothing left to do.
+ */
+
+#define PREFETCH_CHUNK 1024
+
+struct prefetch_chunk {
+  int id;
+  int64_t x;
+  int64_t y;
+  int32_t level;
+  int64_t w;
+  int64_t h;
+};
+
+struct _openslide_prefetcher {
+  GMutex *lock;
+  GCond *cond;
+  openslide_t *osr;
+  GQueue *pending;   // struct prefetch_chunk
+  int running;
+  int next_id;
+  int refcount;      // owner plus one per queued background task
+};
+
+static struct _openslide_prefetcher *prefetcher_create(openslide_t *osr) {
+  struct _openslide_prefetcher *pf =
+    g_slice_new0(struct _openslide_prefetcher);
+  pf->lock = g_mutex_new();
+  pf->cond = g_cond_new();
+  pf->osr = osr;
+  pf->pending = g_queue_new();
+  pf->next_id = 1;
+  pf->refcount = 1;
+  return pf;
+}
+
+// prefetcher lock must be held; returns with it released
+static void prefetcher_unref_unlock(struct _openslide_prefetcher *pf) {
+  bool last = --pf->refcount == 0;
+  g_mutex_unlock(pf->lock);
+  if (last) {
+    g_assert(g_queue_is_empty(pf->pending));
+    g_queue_free(pf->pending);
+    g_cond_free(pf->cond);
+    g_mutex_free(pf->lock);
+    g_slice_free(struct _openslide_prefetcher, pf);
+  }
+}
+
+// prefetcher lock must be held
+static void prefetcher_drop(struct _openslide_prefetcher *pf,
+                            bool all, int id) {
+  GList *link = pf->pending->head;
+  while (link) {
+    GList *next = link->next;
+    struct prefetch_chunk *chunk = link->data;
+    if (all || chunk->id == id) {
+      g_queue_delete_link(pf->pending, link);
+      g_slice_free(struct prefetch_chunk, chunk);
+    }
+    link = next;
+  }
+}
+
+static void prefetcher_destroy(struct _openslide_prefetcher *pf) {
+  g_mutex_lock(pf->lock);
+  prefetcher_drop(pf, true, 0);
+  // wait for pieces already being read
+  while (pf->running) {
+    g_cond_wait(pf->cond, pf->lock);
+  }
+  pf->osr = NULL;
+  prefetcher_unref_unlock(pf);
+}
+
+static void prefetch_task(void *data) {
+  struct _openslide_prefetcher *pf = data;
+
+  g_mutex_lock(pf->lock);
+  struct prefetch_chunk *chunk = g_queue_pop_head(pf->pending);
+  if (chunk) {
+    openslide_t *osr = pf->osr;
+    pf->running++;
+    g_mutex_unlock(pf->lock);
+
+    // a hint is only a hint: failures go no further
+    GError *tmp_err = NULL;
+    if (!openslide_get_error(osr) &&
+        !read_region_area(osr, NULL, 0, chunk->x, chunk->y, chunk->level,
+                          chunk->w, chunk->h, &tmp_err)) {
+      g_debug("Couldn't prefetch region: %s", tmp_err->message);
+      g_clear_error(&tmp_err);
+    }
+    g_slice_free(struct prefetch_chunk, chunk);
+
+    g_mutex_lock(pf->lock);
+    if (--pf->running == 0) {
+      g_cond_broadcast(pf->cond);
+    }
+  }
+  prefetcher_unref_unlock(pf);
+}
+
+int openslide_give_prefetch_hint(openslide_t *osr,
+				 int64_t x, int64_t y,
+				 int32_t level,
+				 int64_t w, int64_t h) {
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return -1;
+  }
+
+  if (openslide_get_error(osr)) {
+    return -1;
+  }
+
+  struct _openslide_prefetcher *pf = osr->prefetcher;
+  int64_t count = 0;
+
+  g_mutex_lock(pf->lock);
+  int id = pf->next_id;
+  pf->next_id = id == G_MAXINT ? 1 : id + 1;
+  if (level_in_range(osr, level)) {
+    const int64_t d = PREFETCH_CHUNK;
+    double ds = osr->levels[level]->downsample;
+    for (int64_t row = 0; row < (h + d - 1) / d; row++) {
+      for (int64_t col = 0; col < (w + d - 1) / d; col++) {
+        struct prefetch_chunk *chunk = g_slice_new(struct prefetch_chunk);
+        chunk->id = id;
+        chunk->x = x + col * d * ds;     // level 0 plane
+        chunk->y = y + row * d * ds;     // level 0 plane
+        chunk->level = level;
+        chunk->w = MIN(w - col * d, d);  // level plane
+        chunk->h = MIN(h - row * d, d);  // level plane
+        g_queue_push_tail(pf->pending, chunk);
+        count++;
+      }
+    }
+    pf->refcount += count;
+  }
+  g_mutex_unlock(pf->lock);
+
+  // each task reads whichever piece is next
+  for (int64_t i = 0; i < count; i++) {
+    _openslide_run_in_background(prefetch_task, pf);
+  }
+  return id;
+}
+
+void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id) {
+  struct _openslide_prefetcher *pf = osr->prefetcher;
+  g_mutex_lock(pf->lock);
+  prefetcher_drop(pf, false, prefetch_id);
+  g_mutex_unlock(pf->lock);
+}
+
+
+const uint32_t *openslide_borrow_tile(openslide_t *osr,
+                                      int32_t level,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int64_t *w, int64_t *h,
+                                      openslide_tile_ref_t **ref) {
+  GError *tmp_err = NULL;
+
+  *w = -1;
+  *h = -1;
+  *ref = NULL;
+
+  if (openslide_get_error(osr)) {
+    return NULL;
+  }
+
+  if (!level_in_range(osr, level)) {
+    return NULL;
+  }
+
+  int32_t tw, th;
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *tiledata;
+  if (is_synthetic_level(osr, level)) {
+    tiledata = _openslide_synthetic_get_tile(osr, osr->levels[level],
+                                             tile_col, tile_row, &tw, &th,
+                                             &cache_entry, &tmp_err);
+  } else if (osr->ops->get_tile) {
+    tiledata = osr->ops->get_tile(osr, osr->levels[level],
+                                  tile_col, tile_row, &tw, &th,
+                                  &cache_entry, &tmp_err);
+  } else {
+    return NULL;
+  }
+  if (!tiledata) {
+    if (g_error_matches(tmp_err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE)) {
+      g_clear_error(&tmp_err);
+    } else {
+      _openslide_propagate_error(osr, tmp_err);
+    }
+    return NULL;
+  }
+
+  *w = tw;
+  *h = th;
+  *ref = cache_entry;
+  return tiledata;
+}
+
+void openslide_release_tile(openslide_tile_ref_t *ref) {
+  if (ref) {
+    _openslide_cache_entry_unref(ref);
+  }
+}
+
+void *openslide_read_raw_tile(openslide_t *osr,
+                              int32_t level,
+                              int64_t tile_col, int64_t tile_row,
+                              openslide_tile_format_t *format,
+                              int64_t *w, int64_t *h,
+                              int64_t *len) {
+  GError *tmp_err = NULL;
+
+  *format = OPENSLIDE_TILE_FORMAT_JPEG;
+  *w = -1;
+  *h = -1;
+  *len = -1;
+
+  if (openslide_get_error(osr)) {
+    return NULL;
+  }
+
+  // synthetic levels have no stored tiles
+  if (!level_in_range(osr, level) || is_synthetic_level(osr, level) ||
+      !osr->ops->read_raw_tile) {
+    return NULL;
+  }
+
+  void *buf;
+  int64_t buflen;
+  int32_t tw, th;
+  if (!osr->ops->read_raw_tile(osr, osr->levels[level],
+                               tile_col, tile_row,
+                               &buf, &buflen, format, &tw, &th,
+                               &tmp_err)) {
+    if (g_error_matches(tmp_err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_NO_VALUE)) {
+      g_clear_error(&tmp_err);
+    } else {
+      _openslide_propagate_error(osr, tmp_err);
+    }
+    return NULL;
+  }
+
+  *w = tw;
+  *h = th;
+  *len = buflen;
+  return buf;
+}
+
+void openslide_free_raw_tile(void *data) {
+  g_free(data);
+}
+
+// maximum thumbnail size for finding glass
+#define TISSUE_MAP_SIZE 1024
+
+static const struct _openslide_occupancy *get_occupancy(openslide_t *osr,
+                                                        int32_t level) {
+  if (openslide_get_error(osr) || !level_in_range(osr, level)) {
+    return NULL;
+  }
+
+  GError *tmp_err = NULL;
+  const struct _openslide_occupancy *occ;
+  if (is_synthetic_level(osr, level)) {
+    occ = _openslide_synthetic_get_occupancy(osr, osr->levels[level],
+                                             &tmp_err);
+  } else if (osr->ops->get_occupancy) {
+    occ = osr->ops->get_occupancy(osr, osr->levels[level], &tmp_err);
+  } else {
+    return NULL;
+  }
+  if (occ == NULL) {
+    _openslide_propagate_error(osr, tmp_err);
+  }
+  return occ;
+}
+
+void openslide_get_tile_occupancy_dimensions(openslide_t *osr,
+                                             int32_t level,
+                                             double *cell_w, double *cell_h,
+                                             int64_t *cols, int64_t *rows) {
+  *cell_w = -1;
+  *cell_h = -1;
+  *cols = -1;
+  *rows = -1;
+
+  const struct _openslide_occupancy *occ = get_occupancy(osr, level);
+  if (occ) {
+    *cell_w = occ->cell_w;
+    *cell_h = occ->cell_h;
+    *cols = occ->cols;
+    *rows = occ->rows;
+  }
+}
+
+static bool is_glass(uint32_t pixel, int32_t threshold) {
+  uint32_t a = pixel >> 24;
+  if (a == 0) {
+    return true;
+  }
+  // premultiplied
+  uint32_t limit = threshold * a / 255;
+  return ((pixel >> 16) & 0xff) >= limit &&
+         ((pixel >> 8) & 0xff) >= limit &&
+         (pixel & 0xff) >= limit;
+}
+
+// clear the cells that are all glass in a thumbnail of the slide
+static bool clear_glass_cells(openslide_t *osr, int32_t level,
+                              const struct _openslide_occupancy *occ,
+                              int32_t threshold, uint8_t *dest) {
+  int64_t tw, th;
+  openslide_get_thumbnail_dimensions(osr, TISSUE_MAP_SIZE, TISSUE_MAP_SIZE,
+                                     &tw, &th);
+  if (tw <= 0 || th <= 0) {
+    return !openslide_get_error(osr);
+  }
+  uint32_t *thumb = g_new(uint32_t, tw * th);
+  openslide_read_thumbnail(osr, TISSUE_MAP_SIZE, TISSUE_MAP_SIZE, thumb);
+  if (openslide_get_error(osr)) {
+    g_free(thumb);
+    return false;
+  }
+
+  // thumbnail pixels per level pixel
+  int64_t w0, h0;
+  openslide_get_level0_dimensions(osr, &w0, &h0);
+  double downsample = osr->levels[level]->downsample;
+  double scale_x = downsample * tw / w0;
+  double scale_y = downsample * th / h0;
+
+  for (int64_t row = 0; row < occ->rows; row++) {
+    int64_t y0 = CLAMP(floor(row * occ->cell_h * scale_y), 0, th);
+    int64_t y1 = CLAMP(ceil((row + 1) * occ->cell_h * scale_y), 0, th);
+    for (int64_t col = 0; col < occ->cols; col++) {
+      uint8_t *cell = dest + row * occ->cols + col;
+      int64_t x0 = CLAMP(floor(col * occ->cell_w * scale_x), 0, tw);
+      int64_t x1 = CLAMP(ceil((col + 1) * occ->cell_w * scale_x), 0, tw);
+      if (!*cell || x1 <= x0 || y1 <= y0) {
+        continue;
+      }
+      bool glass = true;
+      for (int64_t y = y0; y < y1 && glass; y++) {
+        for (int64_t x = x0; x < x1 && glass; x++) {
+          glass = is_glass(thumb[y * tw + x], threshold);
+        }
+      }
+      if (glass) {
+        *cell = 0;
+      }
+    }
+  }
+
+  g_free(thumb);
+  return true;
+}
+
+bool openslide_get_tile_occupancy(openslide_t *osr,
+                                  int32_t level,
+                                  int32_t tissue_threshold,
+                                  uint8_t *dest) {
+  const struct _openslide_occupancy *occ = get_occupancy(osr, level);
+  if (occ == NULL) {
+    return false;
+  }
+
+  for (int64_t row = 0; row < occ->rows; row++) {
+    for (int64_t col = 0; col < occ->cols; col++) {
+      dest[row * occ->cols + col] = _openslide_occupancy_test(occ, col, row);
+    }
+  }
+
+  if (tissue_threshold > 0) {
+    return clear_glass_cells(osr, level, occ, MIN(tissue_threshold, 255),
+                             dest);
+  }
+  return true;
+}
+
 
 void openslide_cairo_read_region(openslide_t *osr,
 				 cairo_t *cr,
@@ -662,12 +1584,112 @@ const char * const *openslide_get_property_names(openslide_t *osr) {
   return osr->property_names;
 }
 
+// open the slide in hash-only mode.  *hash_OUT is NULL if the slide is
+// unhashable.
+static bool hash_slide(const struct _openslide_format *format,
+                       const char *filename,
+                       struct _openslide_tifflike *tl,
+                       char **hash_OUT,
+                       GError **err) {
+  openslide_t *osr = create_osr();
+  osr->hash_only = true;
+  struct _openslide_hash *quickhash1 = _openslide_hash_quickhash1_create();
+  bool success = open_backend(osr, format, filename, tl, quickhash1, err);
+  if (success) {
+    *hash_OUT = g_strdup(_openslide_hash_get_string(quickhash1));
+  }
+  _openslide_hash_destroy(quickhash1);
+  openslide_close(osr);
+  return success;
+}
+
+// open the slide again, this time hashing it
+static char *compute_quickhash1(const struct _openslide_format *format,
+                                const char *filename) {
+  GError *tmp_err = NULL;
+  struct _openslide_tifflike *tl = NULL;
+  char *result = NULL;
+
+  if (format->container == _OPENSLIDE_CONTAINER_TIFF) {
+    tl = _openslide_tifflike_create(filename, &tmp_err);
+    if (!tl) {
+      goto DONE;
+    }
+  }
+
+  hash_slide(format, filename, tl, &result, &tmp_err);
+  _openslide_tifflike_destroy(tl);
+
+DONE:
+  if (tmp_err) {
+    g_warning("Couldn't compute quickhash1 for %s: %s", filename,
+              tmp_err->message);
+    g_clear_error(&tmp_err);
+  }
+  return result;
+}
+
+bool openslide_compute_quickhash1(const char *filename, char *hash,
+                                  char *error, size_t error_size) {
+  GError *tmp_err = NULL;
+
+  g_assert(openslide_was_dynamically_loaded);
+
+  if (error && error_size) {
+    *error = 0;
+  }
+
+  struct _openslide_tifflike *tl;
+  const struct _openslide_format *format = detect_format(filename, &tl);
+  if (!format) {
+    // not a slide file
+    return false;
+  }
+
+  char *result = NULL;
+  if (hash_slide(format, filename, tl, &result, &tmp_err) && !result) {
+    g_set_error(&tmp_err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "No quickhash-1 available");
+  }
+  _openslide_tifflike_destroy(tl);
+
+  if (tmp_err) {
+    // copied out, so sweeping many files doesn't keep their messages
+    if (error && error_size) {
+      g_strlcpy(error, tmp_err->message, error_size);
+    }
+    g_clear_error(&tmp_err);
+    return false;
+  }
+
+  g_strlcpy(hash, result, OPENSLIDE_QUICKHASH1_SIZE);
+  g_free(result);
+  return true;
+}
+
+static const char *get_quickhash1(openslide_t *osr) {
+  g_mutex_lock(osr->quickhash1_lock);
+  if (!osr->quickhash1_done) {
+    osr->quickhash1 = compute_quickhash1(osr->format, osr->filename);
+    osr->quickhash1_done = true;
+  }
+  g_mutex_unlock(osr->quickhash1_lock);
+  return osr->quickhash1;
+}
+
 const char *openslide_get_property_value(openslide_t *osr, const char *name) {
   if (openslide_get_error(osr)) {
     return NULL;
   }
 
-  return g_hash_table_lookup(osr->properties, name);
+  // quickhash1 is listed with no value until it is first requested
+  gpointer value = NULL;
+  if (g_hash_table_lookup_extended(osr->properties, name, NULL, &value) &&
+      value == NULL && osr->filename &&
+      !strcmp(name, OPENSLIDE_PROPERTY_NAME_QUICKHASH1)) {
+    value = (gpointer) get_quickhash1(osr);
+  }
+  return value;
 }
 
 const char * const *openslide_get_associated_image_names(openslide_t *osr) {
@@ -695,6 +1717,70 @@ void openslide_get_associated_image_dimensions(openslide_t *osr, const char *nam
   }
 }
 
+void _openslide_associated_image_get_scaled_dimensions(struct _openslide_associated_image *img,
+                                                       int32_t scale_denom,
+                                                       int64_t *w, int64_t *h) {
+  *w = (img->w + scale_denom - 1) / scale_denom;
+  *h = (img->h + scale_denom - 1) / scale_denom;
+}
+
+static bool decode_associated_image(struct _openslide_associated_image *img,
+                                    int32_t scale_denom,
+                                    uint32_t *dest,
+                                    GError **err) {
+  if (scale_denom == 1) {
+    return img->ops->get_argb_data(img, dest, err);
+  }
+  g_assert(img->ops->get_argb_data_scaled);
+  return img->ops->get_argb_data_scaled(img, scale_denom, dest, err);
+}
+
+// associated images share the tile cache, so keep big ones from
+// flushing the tiles out of it
+#define ASSOCIATED_IMAGE_CACHE_FRACTION 8
+
+static bool associated_image_cacheable(openslide_t *osr, int64_t size) {
+  struct _openslide_cache *cache =
+    _openslide_cache_binding_get_cache(osr->cache);
+  bool result = size <= _openslide_cache_get_capacity(cache) /
+                        ASSOCIATED_IMAGE_CACHE_FRACTION;
+  _openslide_cache_unref(cache);
+  return result;
+}
+
+const uint32_t *_openslide_associated_image_read(openslide_t *osr,
+                                                 struct _openslide_associated_image *img,
+                                                 int32_t scale_denom,
+                                                 struct _openslide_cache_entry **cache_entry,
+                                                 GError **err) {
+  // keyed by output size, so each scale has its own entry
+  int64_t w, h;
+  _openslide_associated_image_get_scaled_dimensions(img, scale_denom, &w, &h);
+  uint32_t *data = _openslide_cache_get(osr->cache, img, w, h, cache_entry);
+  if (data) {
+    return data;
+  }
+
+  // sizes vary, so keep them out of the buffer pool
+  int64_t size = w * h * 4;
+  data = g_slice_alloc(size);
+  if (!decode_associated_image(img, scale_denom, data, err)) {
+    g_slice_free1(size, data);
+    return NULL;
+  }
+  // too big to keep: the entry is ours alone and is freed on unref
+  bool old_bypass = false;
+  bool cacheable = associated_image_cacheable(osr, size);
+  if (!cacheable) {
+    old_bypass = _openslide_cache_set_thread_bypass(true);
+  }
+  _openslide_cache_put(osr->cache, img, w, h, data, size, cache_entry);
+  if (!cacheable) {
+    _openslide_cache_set_thread_bypass(old_bypass);
+  }
+  return data;
+}
+
 void openslide_read_associated_image(openslide_t *osr,
 				     const char *name,
 				     uint32_t *dest) {
@@ -707,23 +1793,71 @@ void openslide_read_associated_image(openslide_t *osr,
   struct _openslide_associated_image *img = g_hash_table_lookup(osr->associated_images,
 								name);
   if (img) {
-    // this function is documented to do nothing on failure, so we need an
-    // extra memcpy
-    size_t pixels = img->w * img->h;
-    uint32_t *buf = g_new(uint32_t, pixels);
+    size_t size = img->w * img->h * 4;
 
-    if (img->ops->get_argb_data(img, buf, &tmp_err)) {
+    if (dest && !associated_image_cacheable(osr, size)) {
+      // it won't be cached, so decode in place
+      if (!decode_associated_image(img, 1, dest, &tmp_err)) {
+        memset(dest, 0, size);
+        _openslide_propagate_error(osr, tmp_err);
+      }
+      return;
+    }
+
+    struct _openslide_cache_entry *cache_entry;
+    const uint32_t *data = _openslide_associated_image_read(osr, img, 1,
+                                                            &cache_entry,
+                                                            &tmp_err);
+    if (data) {
       if (dest) {
-        memcpy(dest, buf, pixels * sizeof(uint32_t));
+        memcpy(dest, data, size);
       }
+      _openslide_cache_entry_unref(cache_entry);
     } else {
+      if (dest) {
+        memset(dest, 0, size);
+      }
       _openslide_propagate_error(osr, tmp_err);
     }
+  }
+}
 
-    g_free(buf);
+void openslide_set_cache(openslide_t *osr, openslide_cache_t *cache) {
+  if (openslide_get_error(osr)) {
+    return;
   }
+
+  _openslide_cache_binding_set(osr->cache, cache);
+}
+
+void openslide_set_cache_capacity(openslide_t *osr, size_t capacity) {
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  struct _openslide_cache *cache =
+    _openslide_cache_binding_get_cache(osr->cache);
+  openslide_cache_set_capacity(cache, capacity);
+  _openslide_cache_unref(cache);
+}
+
+void openslide_get_cache_stats(openslide_t *osr,
+                               openslide_cache_stats_t *stats,
+                               openslide_cache_stats_t *compressed) {
+  struct _openslide_cache *cache =
+    _openslide_cache_binding_get_cache(osr->cache);
+  openslide_cache_get_stats(cache, stats, compressed);
+  _openslide_cache_unref(cache);
 }
 
 const char *openslide_get_version(void) {
   return SUFFIXED_VERSION;
 }
+
+void openslide_set_mmap_enabled(bool enabled) {
+  _openslide_file_set_mmap_enabled(enabled);
+}
+
+void openslide_set_synthetic_levels_enabled(bool enabled) {
+  _openslide_synthetic_set_enabled(enabled);
+}
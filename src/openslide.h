@@ -32,6 +32,8 @@
 
 #include <openslide-features.h>
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -43,6 +45,16 @@ extern "C" {
  */
 typedef struct _openslide openslide_t;
 
+/**
+ * An OpenSlide tile cache.
+ */
+typedef struct _openslide_cache openslide_cache_t;
+
+/**
+ * A reference to a decoded tile, returned by openslide_borrow_tile().
+ */
+typedef struct _openslide_cache_entry openslide_tile_ref_t;
+
 
 /**
  * @name Basic Usage
@@ -89,6 +101,97 @@ OPENSLIDE_PUBLIC()
 openslide_t *openslide_open(const char *filename);
 
 
+/**
+ * Open a whole slide image, sharing the OpenSlide object with other
+ * callers that have opened the same file.
+ *
+ * Files are matched by canonical path, and are considered the same only
+ * if their device, inode, size, and modification time have not changed.
+ * If several threads open the same file at once, it is read only once and
+ * all of them receive the result.  Each successful call must be balanced
+ * by a call to openslide_release_shared(); a shared object must not be
+ * passed to openslide_close().  Objects with no remaining users are closed
+ * after the timeout set with openslide_set_shared_idle_timeout().  An
+ * object in error state is not handed to later callers; they open the
+ * file again.
+ *
+ * @param filename The filename to open.
+ * @return
+ *         On success, a shared OpenSlide object.
+ *         If the file does not exist or is not recognized by OpenSlide,
+ *         NULL.
+ *         If the file is recognized but an error occurred, a shared
+ *         OpenSlide object in error state.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_t *openslide_open_shared(const char *filename);
+
+
+/**
+ * Release an OpenSlide object returned by openslide_open_shared().
+ *
+ * The caller must not use the object after this call returns.  The
+ * object is closed once it has had no users for the idle timeout, or
+ * immediately if it is in error state or the file has been replaced.
+ *
+ * @param osr The OpenSlide object, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_release_shared(openslide_t *osr);
+
+
+/**
+ * Set how long shared OpenSlide objects stay open with no users.
+ *
+ * The default is 30 seconds.  A timeout of 0 closes objects as soon as
+ * they are released, and also closes any that are currently idle.
+ *
+ * @param timeout_ms The timeout, in milliseconds.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_shared_idle_timeout(int64_t timeout_ms);
+
+
+/**
+ * The size of a buffer for openslide_compute_quickhash1(), including the
+ * terminating NUL.
+ *
+ * @since 3.5.0
+ */
+#define OPENSLIDE_QUICKHASH1_SIZE 65
+
+
+/**
+ * Compute the "quickhash-1" sum of a whole slide image without opening
+ * it for reading.
+ *
+ * This gives the same result as reading the
+ * #OPENSLIDE_PROPERTY_NAME_QUICKHASH1 property of a slide opened with
+ * openslide_open(), but does only the work needed for the hash, and is
+ * therefore much faster when only the hash is wanted.  It is safe to
+ * call from several threads at once.
+ *
+ * @param filename The filename to hash.
+ * @param[out] hash A buffer of #OPENSLIDE_QUICKHASH1_SIZE bytes, which
+ *                  receives the sum as a NUL-terminated hex string.
+ * @param[out] error If not NULL, a buffer of @p error_size bytes owned by
+ *                   the caller.  It receives an empty string on success
+ *                   or if the file is not recognized by OpenSlide, and
+ *                   otherwise a NUL-terminated message describing the
+ *                   error, truncated to fit.
+ * @param error_size The size of @p error.
+ * @return true on success, false if the file is not recognized, cannot be
+ *         read, or cannot be hashed.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_compute_quickhash1(const char *filename, char *hash,
+                                  char *error, size_t error_size);
+
+
 /**
  * Get the number of levels in the whole slide image.
  *
@@ -179,6 +282,470 @@ void openslide_read_region(openslide_t *osr,
 			   int64_t w, int64_t h);
 
 
+/**
+ * Pixel formats for openslide_read_region_format().
+ * @since 3.5.0
+ */
+typedef enum {
+  /**
+   * Pre-multiplied ARGB in native-endian 32-bit words, as returned by
+   * openslide_read_region().
+   */
+  OPENSLIDE_PIXEL_FORMAT_ARGB32,
+  /** Non-premultiplied R, G, B, A bytes. */
+  OPENSLIDE_PIXEL_FORMAT_RGBA32,
+  /** R, G, B bytes, with transparent areas composited onto black. */
+  OPENSLIDE_PIXEL_FORMAT_RGB24,
+  /** B, G, R bytes, with transparent areas composited onto black. */
+  OPENSLIDE_PIXEL_FORMAT_BGR24,
+  /** 8-bit BT.601 luma, with transparent areas composited onto black. */
+  OPENSLIDE_PIXEL_FORMAT_GRAY8,
+} openslide_pixel_format_t;
+
+/**
+ * Get the size of one pixel in the specified format.
+ *
+ * @param format The pixel format.
+ * @return The number of bytes per pixel, or -1 if the format is invalid.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int32_t openslide_get_pixel_format_size(openslide_pixel_format_t format);
+
+/**
+ * Copy pixel data in the specified format from a whole slide image.
+ *
+ * This function is equivalent to openslide_read_region(), but writes
+ * pixels in @p format.  Rows are packed.  @p dest must be a valid pointer
+ * to at least (@p w * @p h * openslide_get_pixel_format_size(@p format))
+ * bytes of memory, aligned to 4 bytes for the 32-bit formats.  If an
+ * error occurs or has occurred, then the memory pointed to by @p dest
+ * will be cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer for the pixel data.
+ * @param format The pixel format to write.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_region_format(openslide_t *osr,
+                                  void *dest,
+                                  openslide_pixel_format_t format,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h);
+
+
+/**
+ * Get the dimensions of a thumbnail of the whole slide.
+ *
+ * The thumbnail has the aspect ratio of level 0, and is as large as
+ * possible without exceeding @p max_w by @p max_h or the size of level 0.
+ *
+ * @param osr The OpenSlide object.
+ * @param max_w The maximum width of the thumbnail.
+ * @param max_h The maximum height of the thumbnail.
+ * @param[out] w The width of the thumbnail, 0 if @p max_w or @p max_h is
+ *               not positive, or -1 if an error occurred.
+ * @param[out] h The height of the thumbnail, 0 if @p max_w or @p max_h is
+ *               not positive, or -1 if an error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_thumbnail_dimensions(openslide_t *osr,
+                                        int64_t max_w, int64_t max_h,
+                                        int64_t *w, int64_t *h);
+
+/**
+ * Copy a pre-multiplied ARGB thumbnail of the whole slide.
+ *
+ * The thumbnail is area-averaged from whichever source is cheapest to
+ * read: the smallest sufficiently large level, or the vendor's
+ * "thumbnail" associated image when it is smaller and has the same
+ * aspect ratio.  @p dest must be a valid pointer to enough memory to hold
+ * the thumbnail, at least (width * height * 4) bytes in length.  Get the
+ * width and height with openslide_get_thumbnail_dimensions().  If an error
+ * occurs or has occurred, then the memory pointed to by @p dest will be
+ * cleared, except that nothing is written if an error had already
+ * occurred before the call.
+ *
+ * @param osr The OpenSlide object.
+ * @param max_w The maximum width of the thumbnail.
+ * @param max_h The maximum height of the thumbnail.
+ * @param dest The destination buffer for the ARGB data.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_thumbnail(openslide_t *osr,
+                              int64_t max_w, int64_t max_h,
+                              uint32_t *dest);
+
+
+/**
+ * A region to be read by openslide_read_regions().
+ *
+ * The fields up to and including @p h have the same meaning as the
+ * corresponding arguments to openslide_read_region().
+ *
+ * @since 3.5.0
+ */
+typedef struct {
+  /** The destination buffer for the ARGB data, or NULL. */
+  uint32_t *dest;
+  /** The top left x-coordinate, in the level 0 reference frame. */
+  int64_t x;
+  /** The top left y-coordinate, in the level 0 reference frame. */
+  int64_t y;
+  /** The desired level. */
+  int32_t level;
+  /** The width of the region. Must be non-negative. */
+  int64_t w;
+  /** The height of the region. Must be non-negative. */
+  int64_t h;
+  /** Flags such as #OPENSLIDE_READ_NO_CACHE, or 0. */
+  uint32_t flags;
+  /**
+   * Set by openslide_read_regions() to NULL if the region was read
+   * successfully, or to a message describing the error.  The message is
+   * owned by OpenSlide, must not be freed, and remains valid until the
+   * OpenSlide object is closed.
+   */
+  const char *error;
+} openslide_read_request_t;
+
+/**
+ * Don't add the tiles of this region to the tile cache.
+ *
+ * Tiles already in the cache are still used.  Programs that read every
+ * tile of a slide once, such as exporters, can set this flag to avoid
+ * pushing out the tiles that interactive readers of the same cache are
+ * using.
+ */
+#define OPENSLIDE_READ_NO_CACHE (1 << 0)
+
+
+/**
+ * Copy pre-multiplied ARGB data for several regions of a whole slide image.
+ *
+ * This function is equivalent to calling openslide_read_region() for
+ * each request, except that the work is spread across an internal pool
+ * of threads.  It can also be used to read a single large region faster.
+ *
+ * Each request reports its own success or failure in its @p error field.
+ * The destination buffer of a failed request is cleared.  As with
+ * openslide_read_region(), a failure to read a region also puts the
+ * OpenSlide object into the error state; requests that were already
+ * under way when the failure occurred may still succeed.
+ *
+ * @param osr The OpenSlide object.
+ * @param reqs The regions to read.
+ * @param count The number of elements in @p reqs.
+ * @return The number of requests that failed.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int32_t openslide_read_regions(openslide_t *osr,
+                               openslide_read_request_t *reqs,
+                               int32_t count);
+
+
+/**
+ * A read started by openslide_read_region_async().
+ */
+typedef struct _openslide_async_read openslide_async_read_t;
+
+
+/**
+ * A function called when an asynchronous read completes.
+ *
+ * @param req The request passed to openslide_read_region_async(), with
+ *            its @p error field set.
+ * @param userdata The data passed to openslide_read_region_async().
+ */
+typedef void (*openslide_read_callback_t)(openslide_read_request_t *req,
+                                          void *userdata);
+
+
+/**
+ * Start reading a region of a whole slide image without waiting for it.
+ *
+ * The region is read as by openslide_read_regions() on an internal pool
+ * of threads.  When the read completes, fails, or is cancelled, @p
+ * callback is called exactly once, from one of those threads, with the
+ * @p error field of @p req set as by openslide_read_regions().  An event
+ * loop can have the callback write to a pipe or an eventfd that it
+ * watches.  If OpenSlide has no worker threads, as on a single
+ * processor, the read is done and the callback called before this
+ * function returns.
+ *
+ * A read covering part of a region being read by an earlier
+ * asynchronous read, at the same level, waits for the earlier read to
+ * finish and then takes the shared tiles from the tile cache instead of
+ * decoding them again.
+ *
+ * @p req and its destination buffer must remain valid until the callback
+ * is called.  openslide_close() cancels reads that have not started and
+ * waits for the rest; their callbacks are still called, possibly after
+ * it returns.  The @p error message of @p req remains valid until the
+ * callback returns or the handle is given to openslide_release_read(),
+ * whichever is later.  A handle can still be released after the
+ * OpenSlide object is closed, but not given to openslide_cancel_read().
+ *
+ * @param osr The OpenSlide object.
+ * @param req The region to read.
+ * @param callback The function to call when the read completes.
+ * @param userdata Data to pass to @p callback.
+ * @return A handle for openslide_cancel_read() and
+ *         openslide_release_read().
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_async_read_t *openslide_read_region_async(openslide_t *osr,
+                                                    openslide_read_request_t *req,
+                                                    openslide_read_callback_t callback,
+                                                    void *userdata);
+
+
+/**
+ * Cancel an asynchronous read.
+ *
+ * If the read has not started, it completes without reading anything:
+ * its destination buffer is cleared and its @p error field is set.
+ * Otherwise this function has no effect.  Either way, the callback is
+ * still called exactly once.
+ *
+ * @param handle The handle returned by openslide_read_region_async().
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cancel_read(openslide_async_read_t *handle);
+
+
+/**
+ * Release a handle returned by openslide_read_region_async().
+ *
+ * The handle may be released before or after the read completes, but
+ * cannot be used afterward.
+ *
+ * @param handle The handle, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_release_read(openslide_async_read_t *handle);
+
+
+/**
+ * Hint that a region of a whole slide image will be read soon.
+ *
+ * OpenSlide decodes the tiles covering the region on a low-priority
+ * background thread and keeps them in the tile cache, so that a later
+ * openslide_read_region() of the region is served without decoding.
+ * Hints are processed in the order they are given.  The tile cache must
+ * be large enough to hold the region for the hint to help.
+ *
+ * Failures while prefetching are not reported and do not put the
+ * OpenSlide object into the error state.
+ *
+ * @param osr The OpenSlide object.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @return A positive ID for openslide_cancel_prefetch_hint(), or -1 if
+ *         an error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int openslide_give_prefetch_hint(openslide_t *osr,
+				 int64_t x, int64_t y,
+				 int32_t level,
+				 int64_t w, int64_t h);
+
+
+/**
+ * Cancel a prefetch hint.
+ *
+ * Parts of the region that the background thread has not started on are
+ * dropped.  Unknown or finished IDs are ignored.
+ *
+ * @param osr The OpenSlide object.
+ * @param prefetch_id An ID returned by openslide_give_prefetch_hint().
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id);
+
+
+/**
+ * Borrow the decoded pixels of a single tile of a level.
+ *
+ * This is a cheaper alternative to openslide_read_region() for programs
+ * that serve a slide's native tiles: when the tile is in the tile cache,
+ * no pixels are copied at all.  Not every slide format supports it; if
+ * this function returns NULL and openslide_get_error() returns NULL, the
+ * tile is not available this way and openslide_read_region() must be
+ * used instead.
+ *
+ * The tile data is pre-multiplied ARGB, like that of
+ * openslide_read_region(), with rows packed tightly.  Tiles at the right
+ * and bottom edges of the level are returned at full size; pixels beyond
+ * the edges of the level are transparent.
+ *
+ * The data is read-only, and remains valid until the reference is given
+ * to openslide_release_tile().  Every reference must be released before
+ * the OpenSlide object is closed.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The column of the tile.
+ * @param tile_row The row of the tile.
+ * @param[out] w The width of the tile, or -1 if unavailable.
+ * @param[out] h The height of the tile, or -1 if unavailable.
+ * @param[out] ref A reference to release when done with the data, or NULL
+ *                 if unavailable.
+ * @return The tile data, or NULL if the tile is unavailable or an error
+ *         occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+const uint32_t *openslide_borrow_tile(openslide_t *osr,
+                                      int32_t level,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int64_t *w, int64_t *h,
+                                      openslide_tile_ref_t **ref);
+
+
+/**
+ * Release a tile reference returned by openslide_borrow_tile().
+ *
+ * @param ref The reference, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_release_tile(openslide_tile_ref_t *ref);
+
+
+/**
+ * Compression formats of tiles returned by openslide_read_raw_tile().
+ * More may be added in later releases.
+ *
+ * @since 3.5.0
+ */
+typedef enum {
+  /** A complete JPEG stream, which any JPEG decoder can read. */
+  OPENSLIDE_TILE_FORMAT_JPEG,
+} openslide_tile_format_t;
+
+
+/**
+ * Get the compressed data of a single tile of a level, as stored in the
+ * slide.
+ *
+ * Programs that serve a slide's native tiles in a format the client can
+ * decode can send this data as it is, without decoding and re-encoding
+ * it.  Tables shared between tiles are merged in, so the result stands
+ * alone.  Tiles are only available this way if they decode to exactly
+ * the pixels openslide_read_region() would return: they are not available if
+ * they extend past the edge of the level, overlap other tiles, are
+ * missing from the slide, or belong to a level OpenSlide computes
+ * itself.  If this function returns NULL and openslide_get_error()
+ * returns NULL, the tile is not available this way.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The column of the tile.
+ * @param tile_row The row of the tile.
+ * @param[out] format The format of the data.
+ * @param[out] w The width of the tile, or -1 if unavailable.
+ * @param[out] h The height of the tile, or -1 if unavailable.
+ * @param[out] len The length of the data in bytes, or -1 if unavailable.
+ * @return The data, to be freed with openslide_free_raw_tile(), or NULL
+ *         if the tile is unavailable or an error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void *openslide_read_raw_tile(openslide_t *osr,
+                              int32_t level,
+                              int64_t tile_col, int64_t tile_row,
+                              openslide_tile_format_t *format,
+                              int64_t *w, int64_t *h,
+                              int64_t *len);
+
+
+/**
+ * Free data returned by openslide_read_raw_tile().
+ *
+ * @param data The data, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_free_raw_tile(void *data);
+
+
+/**
+ * Get the dimensions of the occupancy map of a level.
+ *
+ * The map divides the level into cells one tile in size, starting at
+ * the top left corner of the level.  See openslide_get_tile_occupancy().
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param[out] cell_w The width of a cell in level pixels, or -1 if the
+ *                    map is unavailable or an error occurred.
+ * @param[out] cell_h The height of a cell in level pixels, or -1 if the
+ *                    map is unavailable or an error occurred.
+ * @param[out] cols The number of columns of cells, or -1 if the map is
+ *                  unavailable or an error occurred.
+ * @param[out] rows The number of rows of cells, or -1 if the map is
+ *                  unavailable or an error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_tile_occupancy_dimensions(openslide_t *osr,
+                                             int32_t level,
+                                             double *cell_w, double *cell_h,
+                                             int64_t *cols, int64_t *rows);
+
+
+/**
+ * Find the cells of a level that hold image data.
+ *
+ * Cells are marked empty if the slide file stores nothing there, such as
+ * positions the scanner skipped or tiles with no data.  Reading an empty
+ * cell returns transparent pixels without decoding anything.  The map is
+ * only available for some slide formats.
+ *
+ * If @p tissue_threshold is positive, cells that look like bare glass
+ * at low resolution are marked empty too.  A pixel is glass if it is
+ * transparent, or if its red, green, and blue values are all at least
+ * @p tissue_threshold.  This is a heuristic, and is applied only to the
+ * result of this call and not to reads.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tissue_threshold The brightness, from 1 to 255, at or above which
+ *                         a pixel is glass, or 0 to skip the check.
+ * @param dest A buffer of (cols * rows) bytes, as given by
+ *             openslide_get_tile_occupancy_dimensions(), which receives 1
+ *             for each occupied cell and 0 for each empty one, in
+ *             row-major order.
+ * @return true on success, or false if the map is unavailable or an
+ *         error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_get_tile_occupancy(openslide_t *osr,
+                                  int32_t level,
+                                  int32_t tissue_threshold,
+                                  uint8_t *dest);
+
+
 /**
  * Close an OpenSlide object.
  * No other threads may be using the object.
@@ -253,6 +820,11 @@ const char *openslide_get_error(openslide_t *osr);
 
 /**
  * The name of the property containing the "quickhash-1" sum.
+ *
+ * The sum is computed the first time this property is read, which may
+ * take some time.  The property is only listed for slides that can be
+ * hashed.  Its value is NULL only if the slide can no longer be read
+ * when the sum is computed.
  */
 #define OPENSLIDE_PROPERTY_NAME_QUICKHASH1 "openslide.quickhash-1"
 
@@ -410,8 +982,10 @@ void openslide_get_associated_image_dimensions(openslide_t *osr,
  * with a whole slide image. @p dest must be a valid pointer to enough
  * memory to hold the image, at least (width * height * 4) bytes in
  * length.  Get the width and height with
- * openslide_get_associated_image_dimensions(). This call does nothing
- * if an error occurred.
+ * openslide_get_associated_image_dimensions().  Decoded images are kept
+ * in the tile cache, so repeated reads are cheap.  If an error occurs,
+ * then the memory pointed to by @p dest will be cleared, except that
+ * nothing is written if an error had already occurred before the call.
  *
  * @param osr The OpenSlide object.
  * @param dest The destination buffer for the ARGB data.
@@ -422,6 +996,457 @@ OPENSLIDE_PUBLIC()
 void openslide_read_associated_image(openslide_t *osr,
 				     const char *name,
 				     uint32_t *dest);
+
+
+/**
+ * Get the dimensions of a reduced copy of an associated image.
+ *
+ * The copy has the aspect ratio of the associated image, and is as large
+ * as possible without exceeding @p max_w by @p max_h or the size of the
+ * image.
+ *
+ * @param osr The OpenSlide object.
+ * @param name The name of the desired associated image. Must be
+ *             a valid name as given by openslide_get_associated_image_names().
+ * @param max_w The maximum width of the copy.
+ * @param max_h The maximum height of the copy.
+ * @param[out] w The width of the copy, 0 if @p max_w or @p max_h is not
+ *               positive, or -1 if an error occurred.
+ * @param[out] h The height of the copy, 0 if @p max_w or @p max_h is not
+ *               positive, or -1 if an error occurred.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_associated_image_scaled_dimensions(openslide_t *osr,
+                                                      const char *name,
+                                                      int64_t max_w,
+                                                      int64_t max_h,
+                                                      int64_t *w,
+                                                      int64_t *h);
+
+
+/**
+ * Copy a reduced copy of an associated image as pre-multiplied ARGB data.
+ *
+ * The image is area-averaged to the size given by
+ * openslide_get_associated_image_scaled_dimensions().  For JPEG
+ * associated images, it is first decoded at the smallest of 1/2, 1/4,
+ * or 1/8 size that is still large enough, which is much faster than
+ * reading the full image.  @p dest must be a valid pointer to at least
+ * (width * height * 4) bytes.  If an error occurs, then the memory
+ * pointed to by @p dest will be cleared, except that nothing is written
+ * if an error had already occurred before the call.
+ *
+ * @param osr The OpenSlide object.
+ * @param name The name of the desired associated image. Must be
+ *             a valid name as given by openslide_get_associated_image_names().
+ * @param max_w The maximum width of the copy.
+ * @param max_h The maximum height of the copy.
+ * @param dest The destination buffer for the ARGB data.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_associated_image_scaled(openslide_t *osr,
+                                            const char *name,
+                                            int64_t max_w, int64_t max_h,
+                                            uint32_t *dest);
+//@}
+
+/**
+ * @name Caching
+ * Managing the tile cache.
+ *
+ * By default, each OpenSlide object has its own private tile cache of a
+ * modest size.  Programs that keep many slides open at once can instead
+ * create a cache of their chosen size and share it among several
+ * OpenSlide objects, so that all of them draw from one memory budget.
+ */
+//@{
+
+/**
+ * Create a new tile cache, unconnected to any OpenSlide object.
+ *
+ * The cache can be attached to one or more OpenSlide objects with
+ * openslide_set_cache().  The caller owns one reference to the cache,
+ * which must be released with openslide_cache_release().
+ *
+ * @param capacity The capacity of the cache, in bytes.
+ * @return A new cache.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_cache_t *openslide_cache_create(size_t capacity);
+
+
+/**
+ * Tile cache eviction policies.
+ */
+typedef enum {
+  /**
+   * Keep recently used tiles.  This is the default.
+   */
+  OPENSLIDE_CACHE_POLICY_CLOCK,
+  /**
+   * Keep tiles that have been used more than once.  A sweep over many
+   * tiles that are each read once displaces only a small part of the
+   * cache.
+   */
+  OPENSLIDE_CACHE_POLICY_2Q,
+  /**
+   * Keep recently used tiles, preferring those that were slow to decode
+   * for their size.
+   */
+  OPENSLIDE_CACHE_POLICY_COST,
+} openslide_cache_policy_t;
+
+
+/**
+ * Create a new tile cache with a specific eviction policy.
+ *
+ * This function is like openslide_cache_create(), which uses the
+ * default policy.  The default can be changed by setting the
+ * OPENSLIDE_CACHE_POLICY environment variable to "clock", "2q", or
+ * "cost"; the setting also applies to the private cache of each
+ * OpenSlide object.
+ *
+ * @param capacity The capacity of the cache, in bytes.
+ * @param policy The eviction policy.
+ * @return A new cache.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+openslide_cache_t *openslide_cache_create_with_policy(size_t capacity,
+                                                      openslide_cache_policy_t policy);
+
+
+/**
+ * Set the capacity of the compressed tier of a tile cache.
+ *
+ * Besides decoded pixels, a cache can keep the compressed data of tiles
+ * whose decoded pixels have been evicted.  Decoding such a tile again
+ * needs no file I/O, and compressed tiles take much less memory than
+ * decoded ones.  The compressed tier has its own byte budget, and is
+ * disabled while its capacity is zero, as it is when a cache is
+ * created.  Only some slide formats use it.
+ *
+ * @param cache The cache.
+ * @param capacity The capacity of the compressed tier, in bytes.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_set_compressed_capacity(openslide_cache_t *cache,
+                                             size_t capacity);
+
+
+/**
+ * Use the specified cache for the specified OpenSlide object.
+ *
+ * The OpenSlide object keeps a reference to the cache, so the caller may
+ * release its own reference at any time.  Tiles already cached for this
+ * object in its previous cache are discarded from its point of view.
+ *
+ * @param osr The OpenSlide object.
+ * @param cache The cache to attach.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_cache(openslide_t *osr, openslide_cache_t *cache);
+
+
+/**
+ * Change the capacity of a tile cache.
+ *
+ * If the cache holds more than the new capacity, tiles are evicted
+ * immediately.
+ *
+ * @param cache The cache.
+ * @param capacity The capacity of the cache, in bytes.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_set_capacity(openslide_cache_t *cache, size_t capacity);
+
+
+/**
+ * Change the capacity of the tile cache an OpenSlide object is using.
+ *
+ * If the cache is shared, this affects every OpenSlide object using it.
+ *
+ * @param osr The OpenSlide object.
+ * @param capacity The capacity of the cache, in bytes.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_cache_capacity(openslide_t *osr, size_t capacity);
+
+
+/**
+ * Set the capacity of the private tile cache of OpenSlide objects
+ * opened from now on.
+ *
+ * The default can also be set with the OPENSLIDE_CACHE_SIZE environment
+ * variable, in bytes.
+ *
+ * @param capacity The capacity of each new private cache, in bytes.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_default_cache_capacity(size_t capacity);
+
+
+/**
+ * Counters describing the behavior of a tile cache.  The counters start
+ * at zero when the cache is created.
+ */
+typedef struct {
+  /** Lookups that found a tile. */
+  uint64_t hits;
+  /** Lookups that found nothing. */
+  uint64_t misses;
+  /** Tiles added to the cache. */
+  uint64_t insertions;
+  /** Tiles evicted to make room for others. */
+  uint64_t evictions;
+  /** Tiles not added because they were larger than the cache. */
+  uint64_t refused;
+  /** Bytes of tile data currently held. */
+  uint64_t bytes;
+  /** The current capacity, in bytes. */
+  uint64_t capacity;
+} openslide_cache_stats_t;
+
+
+/**
+ * Get statistics for a tile cache and its compressed tier.
+ *
+ * @param cache The cache.
+ * @param[out] stats Statistics for decoded tiles, or NULL.
+ * @param[out] compressed Statistics for the compressed tier, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_get_stats(openslide_cache_t *cache,
+                               openslide_cache_stats_t *stats,
+                               openslide_cache_stats_t *compressed);
+
+
+/**
+ * Get statistics for the tile cache an OpenSlide object is using.
+ *
+ * If the cache is shared, the statistics cover every OpenSlide object
+ * using it.
+ *
+ * @param osr The OpenSlide object.
+ * @param[out] stats Statistics for decoded tiles, or NULL.
+ * @param[out] compressed Statistics for the compressed tier, or NULL.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_cache_stats(openslide_t *osr,
+                               openslide_cache_stats_t *stats,
+                               openslide_cache_stats_t *compressed);
+
+
+/**
+ * Release the caller's reference to a cache.
+ *
+ * The cache is freed once it is no longer used by any OpenSlide object.
+ *
+ * @param cache The cache.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_release(openslide_cache_t *cache);
+//@}
+
+/**
+ * @name Performance Counters
+ * Time spent in each stage of reading.
+ *
+ * Counting is enabled by adding "performance" to the OPENSLIDE_DEBUG
+ * environment variable; otherwise the counters stay at zero.  Each
+ * thread counts separately, and the counts are summed when they are
+ * requested.  Stages can nest: decode times include any file I/O the
+ * decoder does itself.
+ */
+//@{
+
+/**
+ * Stages measured by the performance counters.  More may be added in
+ * later releases.
+ *
+ * @since 3.5.0
+ */
+typedef enum {
+  /** File reads. */
+  OPENSLIDE_PERF_FILE_IO,
+  /** JPEG decoding. */
+  OPENSLIDE_PERF_DECODE_JPEG,
+  /** JPEG 2000 decoding. */
+  OPENSLIDE_PERF_DECODE_JP2K,
+  /** PNG decoding. */
+  OPENSLIDE_PERF_DECODE_PNG,
+  /** Decoding through gdk-pixbuf. */
+  OPENSLIDE_PERF_DECODE_GDKPIXBUF,
+  /** Decoding through libtiff. */
+  OPENSLIDE_PERF_DECODE_TIFF,
+  /** Tile cache lookups; bytes count hits. */
+  OPENSLIDE_PERF_CACHE_GET,
+  /** Tile cache insertions. */
+  OPENSLIDE_PERF_CACHE_PUT,
+  /** Compositing tiles into the destination. */
+  OPENSLIDE_PERF_COMPOSITE,
+  /** TIFF directory switches. */
+  OPENSLIDE_PERF_TIFF_DIRECTORY,
+  /** The number of stages in this version of the header. */
+  OPENSLIDE_PERF_STAGE_COUNT,
+} openslide_perf_stage_t;
+
+
+/**
+ * The totals for one stage.
+ */
+typedef struct {
+  /** Times the stage ran. */
+  uint64_t count;
+  /** Total time spent, in nanoseconds. */
+  uint64_t nsec;
+  /** Total bytes handled: read, decoded, or cached. */
+  uint64_t bytes;
+} openslide_perf_counter_t;
+
+
+/**
+ * Get the performance counters for every thread in the process, since
+ * the library was loaded or the counters were last reset.
+ *
+ * Counters of threads reading at the time of the call may be slightly
+ * out of date.
+ *
+ * @param[out] counters An array of @p count counters, indexed by
+ *                      openslide_perf_stage_t.
+ * @param count The number of elements in @p counters.  Stages beyond
+ *              the library's own count are zeroed.
+ * @return The number of stages the library measures.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+int32_t openslide_get_perf_counters(openslide_perf_counter_t *counters,
+                                    int32_t count);
+
+
+/**
+ * Get the name of a performance counter stage.
+ *
+ * @param stage The stage.
+ * @return A short name such as "file-io", or NULL if the stage is
+ *         unknown.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+const char *openslide_get_perf_stage_name(openslide_perf_stage_t stage);
+
+
+/**
+ * Reset the performance counters to zero.
+ *
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_reset_perf_counters(void);
+//@}
+
+/**
+ * @name Tracing
+ * Events from the reading of individual tiles.
+ *
+ * A registered callback is told when each tile read begins and ends,
+ * and what the tile cache did in between, so that slow reads can be
+ * attributed to the tiles responsible.  With no callback registered,
+ * tracing costs nothing measurable.
+ */
+//@{
+
+/**
+ * The kinds of trace events.  More may be added in later releases.
+ *
+ * @since 3.5.0
+ */
+typedef enum {
+  /** A backend is about to read a tile. */
+  OPENSLIDE_TRACE_TILE_BEGIN,
+  /** The tile was found in the tile cache. */
+  OPENSLIDE_TRACE_CACHE_HIT,
+  /** The tile was not in the tile cache, and will be decoded. */
+  OPENSLIDE_TRACE_CACHE_MISS,
+  /** The decoded tile was added to the tile cache. */
+  OPENSLIDE_TRACE_CACHE_PUT,
+  /** The backend has finished with the tile. */
+  OPENSLIDE_TRACE_TILE_END,
+} openslide_trace_event_type_t;
+
+
+/**
+ * A trace event.  Fields accumulate over the life of a tile read; each
+ * event reports the values so far.
+ *
+ * @since 3.5.0
+ */
+typedef struct {
+  /** The kind of event. */
+  openslide_trace_event_type_t type;
+  /** The slide being read. */
+  openslide_t *osr;
+  /** The level of the tile, or -1 for tiles outside the level list. */
+  int32_t level;
+  /** The column of the tile in the backend's tile grid. */
+  int64_t tile_col;
+  /** The row of the tile in the backend's tile grid. */
+  int64_t tile_row;
+  /** Whether the last cache lookup for the tile hit. */
+  bool cache_hit;
+  /** Whether the read succeeded; valid for OPENSLIDE_TRACE_TILE_END. */
+  bool success;
+  /** Size of the decoded tile, for cache events. */
+  int64_t bytes;
+  /** Bytes read from the slide's files so far. */
+  int64_t bytes_read;
+  /** Nanoseconds spent decoding so far, including any file reads the
+   *  decoder makes itself. */
+  int64_t decode_nsec;
+  /** Nanoseconds since OPENSLIDE_TRACE_TILE_BEGIN. */
+  int64_t elapsed_nsec;
+} openslide_trace_event_t;
+
+
+/**
+ * A trace callback.
+ *
+ * It is called on the thread reading the tile, and so may be called
+ * concurrently from several threads.  It must not call back into
+ * OpenSlide, except to call openslide_set_trace_callback().
+ *
+ * @param event The event, valid only for the duration of the call.
+ * @param data The data passed to openslide_set_trace_callback().
+ * @since 3.5.0
+ */
+typedef void (*openslide_trace_fn)(const openslide_trace_event_t *event,
+                                   void *data);
+
+
+/**
+ * Register a callback for tile events from every slide in the process,
+ * replacing any previous callback.
+ *
+ * A tile read already in progress on another thread may still report
+ * to the previous callback.
+ *
+ * @param callback The callback, or NULL to stop tracing.
+ * @param data Passed to the callback.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_trace_callback(openslide_trace_fn callback, void *data);
 //@}
 
 /**
@@ -439,6 +1464,50 @@ void openslide_read_associated_image(openslide_t *osr,
 OPENSLIDE_PUBLIC()
 const char *openslide_get_version(void);
 
+
+/**
+ * Enable or disable memory-mapped I/O for slides opened afterward.
+ *
+ * When enabled, OpenSlide maps each TIFF-based slide file into memory
+ * and decodes compressed tiles in place rather than copying them into
+ * a buffer first.  This can help with slides on fast local storage.
+ * However, if a mapped file is truncated while a slide is open, the
+ * process may be killed by SIGBUS, so mapping is disabled by default.
+ *
+ * The default can also be changed by setting the OPENSLIDE_MMAP
+ * environment variable to a value other than "0".  Already-open slides
+ * are unaffected.
+ *
+ * @param enabled Whether to use memory-mapped I/O.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_mmap_enabled(bool enabled);
+
+/**
+ * Enable or disable synthetic levels for slides opened afterward.
+ *
+ * When enabled, OpenSlide extends the pyramid of each slide below its
+ * smallest level, halving the dimensions at each step until the level
+ * fits in a 256x256 tile.  Synthetic levels are numbered after the
+ * slide's own levels and behave like them, except that
+ * openslide_read_raw_tile() returns no data for them.  Their tiles are
+ * computed on first use by averaging the level above, and are kept in
+ * the slide's cache.  Where the slide's compression allows it, the first
+ * synthetic levels are instead decoded directly from the smallest level
+ * at reduced size.  Synthetic levels are disabled by default, so the
+ * level count of a slide only reflects the levels stored in it.
+ *
+ * The default can also be changed by setting the
+ * OPENSLIDE_SYNTHETIC_LEVELS environment variable to a value other than
+ * "0".  Already-open slides are unaffected.
+ *
+ * @param enabled Whether to add synthetic levels.
+ * @since 3.5.0
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_synthetic_levels_enabled(bool enabled);
+
 //@}
 
 /**
@@ -559,15 +1628,6 @@ const char *openslide_get_comment(openslide_t *osr);
 
 //@}
 
-// these are meant to throw compile- and link-time errors,
-// since the functions they replace were never implemented
-int _openslide_give_prefetch_hint_UNIMPLEMENTED(void);
-void _openslide_cancel_prefetch_hint_UNIMPLEMENTED(void);
-#define openslide_give_prefetch_hint(osr, x, y, level, w, h)	\
-  _openslide_give_prefetch_hint_UNIMPLEMENTED(-1);
-#define openslide_cancel_prefetch_hint(osr, prefetch_id)	\
-  _openslide_cancel_prefetch_hint_UNIMPLEMENTED(-1)
-
 /**
  * @mainpage OpenSlide
  *
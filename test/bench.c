@@ -0,0 +1,446 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Benchmark region reads from a slide across thread counts, levels,
+   access patterns, cache states, and region sizes, and report latency
+   percentiles and throughput for each combination as JSON.
+
+   Each run opens a fresh handle.  A cold run measures the first pass
+   over its trace; a warm run reads the trace once before timing it.
+   The OS page cache is not dropped, so cold runs measure decoding
+   rather than disk reads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <openslide.h>
+
+enum pattern {
+  PATTERN_SEQUENTIAL,
+  PATTERN_RANDOM,
+  PATTERN_PAN,
+};
+
+static const char *const pattern_names[] = {
+  [PATTERN_SEQUENTIAL] = "sequential",
+  [PATTERN_RANDOM] = "random",
+  [PATTERN_PAN] = "pan",
+};
+
+// region size at which -n applies; others get the same pixel budget
+#define REFERENCE_SIZE 512
+
+// viewport of the pan trace, in regions
+#define PAN_VIEW_W 4
+#define PAN_VIEW_H 3
+
+struct read {
+  int64_t x;  // level 0
+  int64_t y;  // level 0
+};
+
+struct run {
+  const char *filename;
+  int32_t level;
+  int64_t size;
+  struct read *reads;
+  int count;
+  int threads;
+  int64_t cache_capacity;  // -1 for default
+
+  // per-read latency, seconds
+  double *latencies;
+  volatile gint next;
+  openslide_t *osr;
+};
+
+static gchar *opt_threads = (gchar *) "1,2,4,8";
+static gchar *opt_levels;
+static gchar *opt_patterns = (gchar *) "sequential,random,pan";
+static gchar *opt_caches = (gchar *) "cold,warm";
+static gchar *opt_sizes = (gchar *) "256,512,5000";
+static gint opt_count = 200;
+static gint64 opt_cache_capacity = -1;
+static gint opt_seed = 1;
+
+static const GOptionEntry options[] = {
+  {"threads", 't', 0, G_OPTION_ARG_STRING, &opt_threads,
+   "Thread counts to sweep (default 1,2,4,8)", "LIST"},
+  {"levels", 'l', 0, G_OPTION_ARG_STRING, &opt_levels,
+   "Levels to read (default all)", "LIST"},
+  {"patterns", 'p', 0, G_OPTION_ARG_STRING, &opt_patterns,
+   "Access patterns: sequential, random, pan (default all)", "LIST"},
+  {"cache", 'c', 0, G_OPTION_ARG_STRING, &opt_caches,
+   "Cache states: cold, warm (default both)", "LIST"},
+  {"sizes", 's', 0, G_OPTION_ARG_STRING, &opt_sizes,
+   "Region edge lengths in pixels (default 256,512,5000)", "LIST"},
+  {"count", 'n', 0, G_OPTION_ARG_INT, &opt_count,
+   "Reads per run at 512 pixels, scaled for other sizes (default 200)",
+   "N"},
+  {"cache-size", 'C', 0, G_OPTION_ARG_INT64, &opt_cache_capacity,
+   "Tile cache capacity in bytes (default library default)", "BYTES"},
+  {"seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+   "Seed for random traces (default 1)", "N"},
+  {NULL, 0, 0, 0, NULL, NULL, NULL}
+};
+
+static void fail(const char *str) {
+  fprintf(stderr, "%s\n", str);
+  exit(1);
+}
+
+static GArray *parse_int_list(const char *str, const char *what) {
+  GArray *arr = g_array_new(FALSE, FALSE, sizeof(int64_t));
+  char **items = g_strsplit(str, ",", 0);
+  for (char **item = items; *item; item++) {
+    char *end;
+    int64_t value = g_ascii_strtoll(*item, &end, 10);
+    if (*end || end == *item || value < 0) {
+      fprintf(stderr, "Invalid %s: %s\n", what, *item);
+      exit(2);
+    }
+    g_array_append_val(arr, value);
+  }
+  g_strfreev(items);
+  if (arr->len == 0) {
+    fprintf(stderr, "No %s given\n", what);
+    exit(2);
+  }
+  return arr;
+}
+
+static bool list_contains(const char *list, const char *name) {
+  char **items = g_strsplit(list, ",", 0);
+  bool found = false;
+  for (char **item = items; *item; item++) {
+    if (!strcmp(*item, name)) {
+      found = true;
+    }
+  }
+  g_strfreev(items);
+  return found;
+}
+
+static openslide_t *open_slide(const char *filename) {
+  openslide_t *osr = openslide_open(filename);
+  if (osr == NULL) {
+    fail("Unrecognized file");
+  }
+  const char *err = openslide_get_error(osr);
+  if (err) {
+    fail(err);
+  }
+  return osr;
+}
+
+// region origins, in level coordinates, for count reads of size x size
+static struct read *make_trace(enum pattern pattern,
+                               int64_t level_w, int64_t level_h,
+                               double downsample, int64_t size,
+                               int count, GRand *rand) {
+  struct read *reads = g_new(struct read, count);
+  int64_t cols = MAX(1, (level_w + size - 1) / size);
+  int64_t rows = MAX(1, (level_h + size - 1) / size);
+
+  switch (pattern) {
+  case PATTERN_SEQUENTIAL:
+    // raster order, wrapping if the trace is longer than the level
+    for (int i = 0; i < count; i++) {
+      reads[i].x = (i % cols) * size;
+      reads[i].y = ((i / cols) % rows) * size;
+    }
+    break;
+  case PATTERN_RANDOM:
+    for (int i = 0; i < count; i++) {
+      reads[i].x = g_rand_int_range(rand, 0, MAX(1, level_w - size + 1));
+      reads[i].y = g_rand_int_range(rand, 0, MAX(1, level_h - size + 1));
+    }
+    break;
+  case PATTERN_PAN: {
+    // a viewer panning a region-aligned viewport a third of a region
+    // per step, turning now and then, and fetching the regions that
+    // come into view
+    int64_t vx = g_rand_int_range(rand, 0, MAX(1, level_w - size + 1));
+    int64_t vy = g_rand_int_range(rand, 0, MAX(1, level_h - size + 1));
+    int64_t dx = size / 3, dy = 0;
+    GHashTable *seen = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             g_free, NULL);
+    int i = 0;
+    while (i < count) {
+      int64_t c0 = vx / size, r0 = vy / size;
+      for (int64_t r = r0; r < r0 + PAN_VIEW_H && r < rows && i < count; r++) {
+        for (int64_t c = c0; c < c0 + PAN_VIEW_W && c < cols && i < count;
+             c++) {
+          int64_t key = r * cols + c;
+          if (!g_hash_table_lookup(seen, &key)) {
+            g_hash_table_insert(seen, g_memdup(&key, sizeof(key)),
+                                GINT_TO_POINTER(1));
+            reads[i].x = c * size;
+            reads[i].y = r * size;
+            i++;
+          }
+        }
+      }
+      if (g_rand_int_range(rand, 0, 8) == 0) {
+        int64_t t = dx;
+        dx = -dy;
+        dy = t;
+      }
+      vx += dx;
+      vy += dy;
+      // bounce off the edges
+      if (vx < 0 || vx + size > level_w) {
+        dx = -dx;
+        vx = CLAMP(vx, 0, MAX(0, level_w - size));
+      }
+      if (vy < 0 || vy + size > level_h) {
+        dy = -dy;
+        vy = CLAMP(vy, 0, MAX(0, level_h - size));
+      }
+      if (g_hash_table_size(seen) >= (guint) (cols * rows)) {
+        // level exhausted; forget it and keep going
+        g_hash_table_remove_all(seen);
+      }
+    }
+    g_hash_table_destroy(seen);
+    break;
+  }
+  }
+
+  for (int i = 0; i < count; i++) {
+    reads[i].x *= downsample;
+    reads[i].y *= downsample;
+  }
+  return reads;
+}
+
+static void *thread_func(void *data) {
+  struct run *run = data;
+  uint32_t *buf = g_malloc(run->size * run->size * 4);
+  GTimer *timer = g_timer_new();
+
+  int i;
+  while ((i = g_atomic_int_exchange_and_add(&run->next, 1)) < run->count) {
+    g_timer_start(timer);
+    openslide_read_region(run->osr, buf, run->reads[i].x, run->reads[i].y,
+                          run->level, run->size, run->size);
+    run->latencies[i] = g_timer_elapsed(timer, NULL);
+  }
+
+  g_timer_destroy(timer);
+  g_free(buf);
+  return NULL;
+}
+
+// returns elapsed seconds
+static double do_pass(struct run *run) {
+  GThread *threads[run->threads];
+  run->next = 0;
+
+  GTimer *timer = g_timer_new();
+  for (int i = 0; i < run->threads; i++) {
+    threads[i] = g_thread_create(thread_func, run, TRUE, NULL);
+    if (threads[i] == NULL) {
+      fail("Couldn't start thread");
+    }
+  }
+  for (int i = 0; i < run->threads; i++) {
+    g_thread_join(threads[i]);
+  }
+  double seconds = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  return seconds;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+// nearest-rank percentile of sorted values, in milliseconds
+static double percentile(const double *sorted, int count, double p) {
+  int rank = (int) (p * count + 0.999999);
+  return sorted[CLAMP(rank - 1, 0, count - 1)] * 1000;
+}
+
+static void print_json_string(const char *str) {
+  putchar('"');
+  for (const char *p = str; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      printf("\\%c", *p);
+    } else if ((unsigned char) *p < 0x20) {
+      printf("\\u%04x", *p);
+    } else {
+      putchar(*p);
+    }
+  }
+  putchar('"');
+}
+
+static void do_run(struct run *run, enum pattern pattern, bool warm,
+                   bool first) {
+  run->osr = open_slide(run->filename);
+  if (run->cache_capacity >= 0) {
+    openslide_set_cache_capacity(run->osr, run->cache_capacity);
+  }
+  run->latencies = g_new0(double, run->count);
+
+  if (warm) {
+    do_pass(run);
+  }
+  double seconds = do_pass(run);
+
+  const char *err = openslide_get_error(run->osr);
+  if (err) {
+    fail(err);
+  }
+  openslide_cache_stats_t stats;
+  openslide_get_cache_stats(run->osr, &stats, NULL);
+  openslide_close(run->osr);
+  run->osr = NULL;
+
+  qsort(run->latencies, run->count, sizeof(double), compare_doubles);
+  double pixels = (double) run->count * run->size * run->size;
+
+  printf("%s\n    {\"threads\": %d, \"level\": %d, \"pattern\": \"%s\", "
+         "\"cache\": \"%s\", \"region\": %"G_GINT64_FORMAT", "
+         "\"reads\": %d, \"seconds\": %.6f, "
+         "\"tiles_per_sec\": %.3f, \"mpix_per_sec\": %.3f, "
+         "\"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, "
+         "\"cache_hits\": %"G_GUINT64_FORMAT", "
+         "\"cache_misses\": %"G_GUINT64_FORMAT"}",
+         first ? "" : ",",
+         run->threads, run->level, pattern_names[pattern],
+         warm ? "warm" : "cold", run->size, run->count, seconds,
+         run->count / seconds, pixels / seconds / 1e6,
+         percentile(run->latencies, run->count, 0.50),
+         percentile(run->latencies, run->count, 0.95),
+         percentile(run->latencies, run->count, 0.99),
+         stats.hits, stats.misses);
+  fflush(stdout);
+  g_free(run->latencies);
+}
+
+int main(int argc, char **argv) {
+  if (!g_thread_supported()) {
+    g_thread_init(NULL);
+  }
+
+  GError *tmp_err = NULL;
+  GOptionContext *ctx = g_option_context_new("SLIDE");
+  g_option_context_add_main_entries(ctx, options, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &tmp_err)) {
+    fprintf(stderr, "%s\n", tmp_err->message);
+    g_clear_error(&tmp_err);
+    return 2;
+  }
+  g_option_context_free(ctx);
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s [OPTION...] SLIDE\n", argv[0]);
+    return 2;
+  }
+  const char *filename = argv[1];
+
+  openslide_t *osr = open_slide(filename);
+  int32_t level_count = openslide_get_level_count(osr);
+
+  GArray *threads = parse_int_list(opt_threads, "thread count");
+  GArray *sizes = parse_int_list(opt_sizes, "region size");
+  GArray *levels;
+  if (opt_levels) {
+    levels = parse_int_list(opt_levels, "level");
+  } else {
+    levels = g_array_new(FALSE, FALSE, sizeof(int64_t));
+    for (int64_t l = 0; l < level_count; l++) {
+      g_array_append_val(levels, l);
+    }
+  }
+
+  printf("{\"slide\": ");
+  print_json_string(filename);
+  printf(", \"version\": ");
+  print_json_string(openslide_get_version());
+  printf(", \"runs\": [");
+
+  GRand *rand = g_rand_new_with_seed(opt_seed);
+  bool first = true;
+  for (guint li = 0; li < levels->len; li++) {
+    int32_t level = g_array_index(levels, int64_t, li);
+    if (level >= level_count) {
+      fail("Level out of range");
+    }
+    int64_t w, h;
+    openslide_get_level_dimensions(osr, level, &w, &h);
+    double downsample = openslide_get_level_downsample(osr, level);
+
+    for (guint si = 0; si < sizes->len; si++) {
+      int64_t size = g_array_index(sizes, int64_t, si);
+      if (size == 0) {
+        fail("Invalid region size: 0");
+      }
+      // same pixel budget as opt_count reads at REFERENCE_SIZE
+      double scale = (double) REFERENCE_SIZE * REFERENCE_SIZE /
+                     (size * size);
+      int count = MAX(4, (int) (opt_count * scale));
+
+      for (enum pattern pattern = PATTERN_SEQUENTIAL;
+           pattern <= PATTERN_PAN; pattern++) {
+        if (!list_contains(opt_patterns, pattern_names[pattern])) {
+          continue;
+        }
+        // every thread count and cache state reads the same trace
+        struct read *reads = make_trace(pattern, w, h, downsample, size,
+                                        count, rand);
+        for (guint ti = 0; ti < threads->len; ti++) {
+          for (int warm = 0; warm <= 1; warm++) {
+            if (!list_contains(opt_caches, warm ? "warm" : "cold")) {
+              continue;
+            }
+            struct run run = {
+              .filename = filename,
+              .level = level,
+              .size = size,
+              .reads = reads,
+              .count = count,
+              .threads = MAX(1, g_array_index(threads, int64_t, ti)),
+              .cache_capacity = opt_cache_capacity,
+            };
+            do_run(&run, pattern, warm, first);
+            first = false;
+          }
+        }
+        g_free(reads);
+      }
+    }
+  }
+  printf("\n]}\n");
+
+  g_rand_free(rand);
+  g_array_free(levels, TRUE);
+  g_array_free(sizes, TRUE);
+  g_array_free(threads, TRUE);
+  openslide_close(osr);
+  return 0;
+}
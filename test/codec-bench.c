@@ -0,0 +1,489 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Decode microbenchmarks.  Each input is a JPEG, JPEG 2000 codestream,
+   PNG, or BMP file, or a tiled TIFF (such as an Aperio or generic TIFF
+   slide), from which the first tile of each tiled directory is taken.
+   Every applicable decoder and color space is run on one thread in a
+   loop, and the pixel conversion kernels are run on synthetic data.
+   Results are reported as JSON, in MPix/s per core.
+
+   This is linked against the library sources rather than the shared
+   library, since it calls internal functions. */
+
+#include <config.h>
+
+#include "openslide-private.h"
+#include "openslide-decode-gdkpixbuf.h"
+#include "openslide-decode-jp2k.h"
+#include "openslide-decode-jpeg.h"
+#include "openslide-decode-png.h"
+#include "openslide-decode-tiff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+// synthetic kernel input
+#define KERNEL_PIXELS (1024 * 1024)
+
+// maximum tiled TIFF directories to benchmark per file
+#define MAX_TIFF_DIRS 8
+
+struct bench;
+typedef bool (*decode_fn)(struct bench *b, uint32_t *dest, GError **err);
+
+struct bench {
+  char *input;
+  const char *codec;
+  char *variant;
+  int32_t w;  // output dimensions
+  int32_t h;
+  decode_fn decode;
+
+  // input, by codec
+  const char *filename;
+  const void *data;
+  int32_t len;
+  J_COLOR_SPACE jpeg_space;
+  int32_t scale_denom;
+  enum _openslide_jp2k_colorspace jp2k_space;
+  int32_t reduce;
+  struct _openslide_tiff_level tiffl;
+  TIFF *tiff;
+};
+
+struct kernel_input {
+  int32_t *c0;
+  int32_t *c1;
+  int32_t *c2;
+  uint8_t *p0;
+  uint8_t *p1;
+  uint8_t *p2;
+};
+
+static struct kernel_input kernel_input;
+
+static gdouble opt_seconds = 1;
+static gboolean opt_no_kernels;
+
+static const GOptionEntry options[] = {
+  {"seconds", 's', 0, G_OPTION_ARG_DOUBLE, &opt_seconds,
+   "Minimum time per benchmark (default 1)", "SECONDS"},
+  {"no-kernels", 0, 0, G_OPTION_ARG_NONE, &opt_no_kernels,
+   "Skip the pixel conversion kernels", NULL},
+  {NULL, 0, 0, 0, NULL, NULL, NULL}
+};
+
+static bool first_result = true;
+
+static void print_json_string(const char *str) {
+  putchar('"');
+  for (const char *p = str; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      printf("\\%c", *p);
+    } else if ((unsigned char) *p < 0x20) {
+      printf("\\u%04x", *p);
+    } else {
+      putchar(*p);
+    }
+  }
+  putchar('"');
+}
+
+static bool decode_jpeg(struct bench *b, uint32_t *dest, GError **err) {
+  return _openslide_jpeg_decode_buffer_scaled(b->data, b->len, NULL, 0,
+                                              b->jpeg_space, dest,
+                                              b->scale_denom, b->w, b->h,
+                                              err);
+}
+
+static bool decode_jpeg_gray(struct bench *b, uint32_t *dest, GError **err) {
+  return _openslide_jpeg_decode_buffer_gray(b->data, b->len,
+                                            (uint8_t *) dest, b->w, b->h,
+                                            err);
+}
+
+static bool decode_jp2k(struct bench *b, uint32_t *dest, GError **err) {
+  return _openslide_jp2k_decode_buffer_reduced(dest, b->w, b->h, b->reduce,
+                                               b->data, b->len,
+                                               b->jp2k_space, err);
+}
+
+static bool decode_png(struct bench *b, uint32_t *dest, GError **err) {
+  return _openslide_png_read(b->filename, 0, dest, b->w, b->h, err);
+}
+
+static bool decode_gdkpixbuf(struct bench *b, uint32_t *dest,
+                             GError **err) {
+  return _openslide_gdkpixbuf_read(b->filename, 0, dest, b->w, b->h, err);
+}
+
+static bool decode_tiff_rgba(struct bench *b, uint32_t *dest, GError **err) {
+  return _openslide_tiff_read_tile(&b->tiffl, b->tiff, dest, 0, 0, err);
+}
+
+static bool decode_tiff_jpeg(struct bench *b, uint32_t *dest, GError **err) {
+  return _openslide_tiff_read_tile_scaled(&b->tiffl, b->tiff, dest, 0, 0,
+                                          b->scale_denom, err);
+}
+
+static bool kernel_abgr(struct bench *b, uint32_t *dest,
+                        GError **err G_GNUC_UNUSED) {
+  _openslide_abgr_to_argb(dest, (size_t) b->w * b->h);
+  return true;
+}
+
+static bool kernel_ycbcr(struct bench *b, uint32_t *dest,
+                         GError **err G_GNUC_UNUSED) {
+  _openslide_ycbcr_to_argb(dest, kernel_input.c0, kernel_input.c1,
+                           kernel_input.c2, b->w * b->h);
+  return true;
+}
+
+static bool kernel_rgb(struct bench *b, uint32_t *dest,
+                       GError **err G_GNUC_UNUSED) {
+  _openslide_rgb_to_argb(dest, kernel_input.c0, kernel_input.c1,
+                         kernel_input.c2, b->w * b->h);
+  return true;
+}
+
+static bool kernel_planes(struct bench *b, uint32_t *dest,
+                          GError **err G_GNUC_UNUSED) {
+  _openslide_planes_to_argb(dest, kernel_input.p0, kernel_input.p1,
+                            kernel_input.p2, b->w * b->h);
+  return true;
+}
+
+static struct bench *add_bench(GPtrArray *benches, const char *input,
+                               const char *codec, char *variant,
+                               int32_t w, int32_t h, decode_fn decode) {
+  struct bench *b = g_slice_new0(struct bench);
+  b->input = g_strdup(input);
+  b->codec = codec;
+  b->variant = variant;
+  b->w = w;
+  b->h = h;
+  b->decode = decode;
+  g_ptr_array_add(benches, b);
+  return b;
+}
+
+static void run_bench(struct bench *b) {
+  uint32_t *dest = g_malloc0((size_t) b->w * b->h * 4);
+  GError *tmp_err = NULL;
+
+  // once untimed, to fault in buffers and catch errors
+  if (!b->decode(b, dest, &tmp_err)) {
+    fprintf(stderr, "%s: %s %s: %s\n", b->input, b->codec, b->variant,
+            tmp_err->message);
+    g_clear_error(&tmp_err);
+    g_free(dest);
+    return;
+  }
+
+  int64_t iterations = 0;
+  double seconds;
+  GTimer *timer = g_timer_new();
+  do {
+    b->decode(b, dest, NULL);
+    iterations++;
+    seconds = g_timer_elapsed(timer, NULL);
+  } while (seconds < opt_seconds || iterations < 3);
+  g_timer_destroy(timer);
+  g_free(dest);
+
+  double mpix = (double) b->w * b->h * iterations / 1e6;
+  printf("%s\n    {\"input\": ", first_result ? "" : ",");
+  print_json_string(b->input);
+  printf(", \"codec\": \"%s\", \"variant\": ", b->codec);
+  print_json_string(b->variant);
+  printf(", \"width\": %d, \"height\": %d, \"iterations\": %"
+         G_GINT64_FORMAT", \"mpix_per_sec_per_core\": %.3f}",
+         b->w, b->h, iterations, mpix / seconds);
+  fflush(stdout);
+  first_result = false;
+}
+
+static void add_jpeg(GPtrArray *benches, const char *filename,
+                     const void *data, int32_t len) {
+  int32_t w, h;
+  GError *tmp_err = NULL;
+  if (!_openslide_jpeg_decode_buffer_dimensions(data, len, &w, &h,
+                                                &tmp_err)) {
+    fprintf(stderr, "%s: %s\n", filename, tmp_err->message);
+    g_clear_error(&tmp_err);
+    return;
+  }
+
+  static const struct {
+    const char *name;
+    J_COLOR_SPACE space;
+  } spaces[] = {
+    {"ycbcr", JCS_YCbCr},
+    {"rgb", JCS_RGB},
+  };
+  for (guint i = 0; i < G_N_ELEMENTS(spaces); i++) {
+    for (int32_t s = 1; s <= 8; s *= 2) {
+      struct bench *b = add_bench(benches, filename, "jpeg",
+                                  g_strdup_printf("%s 1/%d", spaces[i].name,
+                                                  s),
+                                  (w + s - 1) / s, (h + s - 1) / s,
+                                  decode_jpeg);
+      b->data = data;
+      b->len = len;
+      b->jpeg_space = spaces[i].space;
+      b->scale_denom = s;
+    }
+  }
+  struct bench *b = add_bench(benches, filename, "jpeg", g_strdup("gray"),
+                              w, h, decode_jpeg_gray);
+  b->data = data;
+  b->len = len;
+}
+
+static void add_jp2k(GPtrArray *benches, const char *filename,
+                     const void *data, int32_t len,
+                     int32_t w, int32_t h) {
+  static const struct {
+    const char *name;
+    enum _openslide_jp2k_colorspace space;
+  } spaces[] = {
+    {"rgb", OPENSLIDE_JP2K_RGB},
+    {"ycbcr", OPENSLIDE_JP2K_YCBCR},
+  };
+  int32_t max_reduce = MIN(_openslide_jp2k_get_max_reduce(data, len), 2);
+  for (guint i = 0; i < G_N_ELEMENTS(spaces); i++) {
+    for (int32_t r = 0; r <= max_reduce; r++) {
+      int32_t s = 1 << r;
+      struct bench *b = add_bench(benches, filename, "jp2k",
+                                  g_strdup_printf("%s 1/%d", spaces[i].name,
+                                                  s),
+                                  (w + s - 1) / s, (h + s - 1) / s,
+                                  decode_jp2k);
+      b->data = data;
+      b->len = len;
+      b->jp2k_space = spaces[i].space;
+      b->reduce = r;
+    }
+  }
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int32_t read_le32(const uint8_t *p) {
+  return (int32_t) (p[0] | (p[1] << 8) | (p[2] << 16) |
+                    ((uint32_t) p[3] << 24));
+}
+
+// dimensions from a bare JPEG 2000 codestream's SIZ marker
+static bool get_j2k_dimensions(const uint8_t *data, gsize len,
+                               int32_t *w, int32_t *h) {
+  // SOC, SIZ marker, Lsiz, Rsiz, Xsiz, Ysiz, XOsiz, YOsiz
+  if (len < 24) {
+    return false;
+  }
+  *w = read_be32(data + 8) - read_be32(data + 16);
+  *h = read_be32(data + 12) - read_be32(data + 20);
+  return *w > 0 && *h > 0;
+}
+
+static void add_tiff(GPtrArray *benches, const char *filename,
+                     GPtrArray *to_free) {
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  GError *tmp_err = NULL;
+  TIFF *tiff = _openslide_tiffcache_get(tc, &tmp_err);
+  if (tiff == NULL) {
+    fprintf(stderr, "%s: %s\n", filename, tmp_err->message);
+    g_clear_error(&tmp_err);
+    _openslide_tiffcache_destroy(tc);
+    return;
+  }
+
+  int found = 0;
+  tdir_t count = TIFFNumberOfDirectories(tiff);
+  for (tdir_t dir = 0; dir < count && found < MAX_TIFF_DIRS; dir++) {
+    if (!_openslide_tiff_set_dir(tiff, dir, NULL) || !TIFFIsTiled(tiff)) {
+      continue;
+    }
+    struct _openslide_tiff_level tiffl;
+    if (!_openslide_tiff_level_init(tiff, dir, NULL, &tiffl, NULL)) {
+      continue;
+    }
+    uint16_t compression;
+    if (!TIFFGetField(tiff, TIFFTAG_COMPRESSION, &compression)) {
+      continue;
+    }
+    found++;
+    char *input = g_strdup_printf("%s:%d", filename, dir);
+
+    if (compression == 33003 || compression == 33005) {
+      // Aperio JPEG 2000; libtiff can't decode these
+      void *data;
+      int32_t len;
+      if (_openslide_tiff_read_tile_data(&tiffl, tiff, &data, &len, 0, 0,
+                                         NULL)) {
+        g_ptr_array_add(to_free, data);
+        int32_t w, h;
+        if (get_j2k_dimensions(data, len, &w, &h)) {
+          add_jp2k(benches, input, data, len, w, h);
+        }
+      }
+    } else {
+      struct bench *b = add_bench(benches, input, "tiff",
+                                  g_strdup_printf("rgba compression %d",
+                                                  compression),
+                                  tiffl.tile_w, tiffl.tile_h,
+                                  decode_tiff_rgba);
+      b->tiffl = tiffl;
+      b->tiff = tiff;
+      for (int32_t s = 1; tiffl.native_jpeg && s <= 8; s *= 2) {
+        b = add_bench(benches, input, "tiff",
+                      g_strdup_printf("native jpeg 1/%d", s),
+                      tiffl.tile_w / s, tiffl.tile_h / s,
+                      decode_tiff_jpeg);
+        b->tiffl = tiffl;
+        b->tiff = tiff;
+        b->scale_denom = s;
+      }
+    }
+    g_free(input);
+  }
+  // keep the handle for the benchmarks; the process exits afterward
+  if (found == 0) {
+    fprintf(stderr, "%s: no tiled directories\n", filename);
+  }
+}
+
+static void add_file(GPtrArray *benches, const char *filename,
+                     GPtrArray *to_free) {
+  GError *tmp_err = NULL;
+  gchar *contents;
+  gsize len;
+  if (!g_file_get_contents(filename, &contents, &len, &tmp_err)) {
+    fprintf(stderr, "%s\n", tmp_err->message);
+    g_clear_error(&tmp_err);
+    return;
+  }
+  const uint8_t *p = (const uint8_t *) contents;
+
+  if (len > 4 && (!memcmp(p, "II*\0", 4) || !memcmp(p, "MM\0*", 4) ||
+                  !memcmp(p, "II+\0", 4) || !memcmp(p, "MM\0+", 4))) {
+    g_free(contents);
+    add_tiff(benches, filename, to_free);
+    return;
+  }
+
+  g_ptr_array_add(to_free, contents);
+  if (len > 3 && p[0] == 0xFF && p[1] == 0xD8) {
+    add_jpeg(benches, filename, contents, len);
+  } else if (len > 4 && p[0] == 0xFF && p[1] == 0x4F &&
+             p[2] == 0xFF && p[3] == 0x51) {
+    int32_t w, h;
+    if (get_j2k_dimensions(p, len, &w, &h)) {
+      add_jp2k(benches, filename, contents, len, w, h);
+    }
+  } else if (len > 24 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8)) {
+    add_bench(benches, filename, "png", g_strdup("file"),
+              read_be32(p + 16), read_be32(p + 20),
+              decode_png)->filename = filename;
+  } else if (len > 26 && p[0] == 'B' && p[1] == 'M') {
+    add_bench(benches, filename, "gdkpixbuf", g_strdup("bmp"),
+              read_le32(p + 18), ABS(read_le32(p + 22)),
+              decode_gdkpixbuf)->filename = filename;
+  } else {
+    fprintf(stderr, "%s: unknown file type\n", filename);
+  }
+}
+
+static void add_kernels(GPtrArray *benches) {
+  kernel_input.c0 = g_new(int32_t, KERNEL_PIXELS);
+  kernel_input.c1 = g_new(int32_t, KERNEL_PIXELS);
+  kernel_input.c2 = g_new(int32_t, KERNEL_PIXELS);
+  kernel_input.p0 = g_malloc(KERNEL_PIXELS);
+  kernel_input.p1 = g_malloc(KERNEL_PIXELS);
+  kernel_input.p2 = g_malloc(KERNEL_PIXELS);
+  GRand *rand = g_rand_new_with_seed(1);
+  for (int i = 0; i < KERNEL_PIXELS; i++) {
+    kernel_input.c0[i] = kernel_input.p0[i] = g_rand_int_range(rand, 0, 256);
+    kernel_input.c1[i] = kernel_input.p1[i] = g_rand_int_range(rand, 0, 256);
+    kernel_input.c2[i] = kernel_input.p2[i] = g_rand_int_range(rand, 0, 256);
+  }
+  g_rand_free(rand);
+
+  add_bench(benches, "synthetic", "kernel", g_strdup("abgr_to_argb"),
+            KERNEL_PIXELS, 1, kernel_abgr);
+  add_bench(benches, "synthetic", "kernel", g_strdup("ycbcr_to_argb"),
+            KERNEL_PIXELS, 1, kernel_ycbcr);
+  add_bench(benches, "synthetic", "kernel", g_strdup("rgb_to_argb"),
+            KERNEL_PIXELS, 1, kernel_rgb);
+  add_bench(benches, "synthetic", "kernel", g_strdup("planes_to_argb"),
+            KERNEL_PIXELS, 1, kernel_planes);
+}
+
+int main(int argc, char **argv) {
+  if (!g_thread_supported()) {
+    g_thread_init(NULL);
+  }
+
+  GError *tmp_err = NULL;
+  GOptionContext *ctx = g_option_context_new("[FILE...]");
+  g_option_context_add_main_entries(ctx, options, NULL);
+  if (!g_option_context_parse(ctx, &argc, &argv, &tmp_err)) {
+    fprintf(stderr, "%s\n", tmp_err->message);
+    g_clear_error(&tmp_err);
+    return 2;
+  }
+  g_option_context_free(ctx);
+
+  GPtrArray *benches = g_ptr_array_new();
+  GPtrArray *to_free = g_ptr_array_new();
+  for (int i = 1; i < argc; i++) {
+    add_file(benches, argv[i], to_free);
+  }
+  if (!opt_no_kernels) {
+    add_kernels(benches);
+  }
+
+  printf("{\"version\": ");
+  print_json_string(openslide_get_version());
+  printf(", \"results\": [");
+  for (guint i = 0; i < benches->len; i++) {
+    run_bench(benches->pdata[i]);
+  }
+  printf("\n]}\n");
+
+  for (guint i = 0; i < benches->len; i++) {
+    struct bench *b = benches->pdata[i];
+    g_free(b->input);
+    g_free(b->variant);
+    g_slice_free(struct bench, b);
+  }
+  g_ptr_array_free(benches, TRUE);
+  for (guint i = 0; i < to_free->len; i++) {
+    g_free(to_free->pdata[i]);
+  }
+  g_ptr_array_free(to_free, TRUE);
+  return 0;
+}
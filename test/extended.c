@@ -24,6 +24,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -31,6 +32,7 @@
 #endif
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <openslide.h>
 
 static void fail(const char *str, ...) {
@@ -59,6 +61,45 @@ static void test_image_fetch(openslide_t *osr,
   }
 }
 
+static GMutex *async_lock;
+static GCond *async_cond;
+static int async_pending;
+
+static void async_done(openslide_read_request_t *req, void *userdata) {
+  const char *expected = userdata;
+  if (g_strcmp0(req->error, expected)) {
+    fail("Async read: expected %s, got %s", expected ? expected : "success",
+         req->error ? req->error : "success");
+  }
+  g_mutex_lock(async_lock);
+  async_pending--;
+  g_cond_broadcast(async_cond);
+  g_mutex_unlock(async_lock);
+}
+
+// for reads outstanding at close, which may or may not be cancelled
+static void async_done_or_cancelled(openslide_read_request_t *req,
+                                    void *userdata G_GNUC_UNUSED) {
+  async_done(req, req->error ? "Read cancelled" : NULL);
+}
+
+static volatile gint traced_begins;
+static volatile gint traced_ends;
+
+static void trace_event(const openslide_trace_event_t *event,
+                        void *data G_GNUC_UNUSED) {
+  switch (event->type) {
+  case OPENSLIDE_TRACE_TILE_BEGIN:
+    g_atomic_int_inc(&traced_begins);
+    break;
+  case OPENSLIDE_TRACE_TILE_END:
+    g_atomic_int_inc(&traced_ends);
+    break;
+  default:
+    break;
+  }
+}
+
 #ifndef WIN32
 static gint leak_test_running;  /* atomic ops only */
 
@@ -121,9 +162,138 @@ static void check_cloexec_leaks(const char *slide, void *prog,
   g_atomic_int_set(&leak_test_running, 0);
   g_thread_join(thr);
 }
+
+#define SNAPSHOT_TEST_SIZE 200
+
+// read a region from level 0 and the smallest level, plus the quickhash
+static uint32_t *read_for_snapshot(const char *slide, int64_t x, int64_t y,
+                                   char **hash_OUT) {
+  openslide_t *osr = openslide_open(slide);
+  if (!osr || openslide_get_error(osr)) {
+    fail("Open for snapshot test failed");
+  }
+  int32_t top = openslide_get_level_count(osr) - 1;
+  int64_t count = SNAPSHOT_TEST_SIZE * SNAPSHOT_TEST_SIZE;
+  uint32_t *buf = g_new(uint32_t, 2 * count);
+  openslide_read_region(osr, buf, x, y, 0,
+                        SNAPSHOT_TEST_SIZE, SNAPSHOT_TEST_SIZE);
+  openslide_read_region(osr, buf + count, 0, 0, top,
+                        SNAPSHOT_TEST_SIZE, SNAPSHOT_TEST_SIZE);
+  if (openslide_get_error(osr)) {
+    fail("Read for snapshot test failed: %s", openslide_get_error(osr));
+  }
+  *hash_OUT = g_strdup(openslide_get_property_value(osr,
+                             OPENSLIDE_PROPERTY_NAME_QUICKHASH1));
+  openslide_close(osr);
+  return buf;
+}
+
+static void check_snapshot_read(const char *slide, int64_t x, int64_t y,
+                                const uint32_t *expected,
+                                const char *expected_hash,
+                                const char *what) {
+  char *hash;
+  uint32_t *buf = read_for_snapshot(slide, x, y, &hash);
+  if (memcmp(buf, expected, 2 * SNAPSHOT_TEST_SIZE * SNAPSHOT_TEST_SIZE *
+             sizeof(uint32_t))) {
+    fail("Pixels differ after %s", what);
+  }
+  if (g_strcmp0(hash, expected_hash)) {
+    fail("quickhash-1 differs after %s", what);
+  }
+  g_free(hash);
+  g_free(buf);
+}
+
+// rewrite every file in the cache directory; returns false if it's empty
+static bool corrupt_cache_files(const char *dir, bool truncate) {
+  bool found = false;
+  GDir *d = g_dir_open(dir, 0, NULL);
+  if (d == NULL) {
+    fail("Couldn't open snapshot directory");
+  }
+  const char *name;
+  while ((name = g_dir_read_name(d)) != NULL) {
+    char *file = g_build_filename(dir, name, NULL);
+    char *contents;
+    gsize len;
+    if (g_file_get_contents(file, &contents, &len, NULL)) {
+      if (truncate) {
+        len /= 2;
+      } else {
+        // keep the header so the snapshot is parsed, then scribble
+        memset(contents + len / 4, 0xff, len - len / 4);
+      }
+      if (!g_file_set_contents(file, contents, len, NULL)) {
+        fail("Couldn't corrupt %s", file);
+      }
+      g_free(contents);
+      found = true;
+    }
+    g_free(file);
+  }
+  g_dir_close(d);
+  return found;
+}
+
+static void remove_cache_files(const char *dir) {
+  GDir *d = g_dir_open(dir, 0, NULL);
+  if (d) {
+    const char *name;
+    while ((name = g_dir_read_name(d)) != NULL) {
+      char *file = g_build_filename(dir, name, NULL);
+      g_unlink(file);
+      g_free(file);
+    }
+    g_dir_close(d);
+  }
+  g_rmdir(dir);
+}
+
+static void check_snapshots(const char *slide, int64_t x, int64_t y) {
+  char *expected_hash;
+  g_unsetenv("OPENSLIDE_INDEX_CACHE_DIR");
+  uint32_t *expected = read_for_snapshot(slide, x, y, &expected_hash);
+
+  char *dir = g_build_filename(g_get_tmp_dir(),
+                               "openslide-snapshot-XXXXXX", NULL);
+  if (mkdtemp(dir) == NULL) {
+    fail("Couldn't create snapshot directory");
+  }
+  g_setenv("OPENSLIDE_INDEX_CACHE_DIR", dir, true);
+
+  // first open saves, second open restores
+  check_snapshot_read(slide, x, y, expected, expected_hash, "saving snapshot");
+  check_snapshot_read(slide, x, y, expected, expected_hash,
+                      "reopening from snapshot");
+
+  // a damaged snapshot must be rejected, not trusted
+  for (int i = 0; i < 2; i++) {
+    if (!corrupt_cache_files(dir, i == 0)) {
+      // format doesn't save snapshots
+      break;
+    }
+    check_snapshot_read(slide, x, y, expected, expected_hash,
+                        i == 0 ? "truncating snapshot" :
+                                 "corrupting snapshot");
+    // the rejected snapshot was replaced by a fresh one
+    check_snapshot_read(slide, x, y, expected, expected_hash,
+                        "reopening from replaced snapshot");
+  }
+
+  g_unsetenv("OPENSLIDE_INDEX_CACHE_DIR");
+  remove_cache_files(dir);
+  g_free(dir);
+  g_free(expected_hash);
+  g_free(expected);
+}
 #else /* WIN32 */
 static void child_check_open_fds(void) {}
 
+static void check_snapshots(const char *slide G_GNUC_UNUSED,
+                            int64_t x G_GNUC_UNUSED,
+                            int64_t y G_GNUC_UNUSED) {}
+
 static void check_cloexec_leaks(const char *slide G_GNUC_UNUSED,
                                 void *prog G_GNUC_UNUSED,
                                 int64_t x G_GNUC_UNUSED,
@@ -167,6 +337,19 @@ int main(int argc, char **argv) {
     fail("Reopen failed");
   }
 
+  // hash-only open must agree with the property
+  char hash[OPENSLIDE_QUICKHASH1_SIZE];
+  char hash_err[256];
+  const char *hash_prop = openslide_get_property_value(osr,
+                                 OPENSLIDE_PROPERTY_NAME_QUICKHASH1);
+  if (openslide_compute_quickhash1(path, hash, hash_err, sizeof(hash_err))) {
+    if (!hash_prop || strcmp(hash, hash_prop)) {
+      fail("quickhash-1 mismatch");
+    }
+  } else if (hash_prop) {
+    fail("Couldn't compute quickhash-1: %s", hash_err);
+  }
+
   int64_t w, h;
   openslide_get_level0_dimensions(osr, &w, &h);
 
@@ -200,7 +383,9 @@ int main(int argc, char **argv) {
   const char * const *property_names = openslide_get_property_names(osr);
   while (*property_names) {
     const char *name = *property_names;
-    openslide_get_property_value(osr, name);
+    if (!openslide_get_property_value(osr, name)) {
+      fail("Listed property %s has no value", name);
+    }
     property_names++;
   }
 
@@ -214,11 +399,61 @@ int main(int argc, char **argv) {
 
     uint32_t *buf = g_new(uint32_t, w * h);
     openslide_read_associated_image(osr, name, buf);
+    // again, from the cache
+    uint32_t *buf2 = g_new(uint32_t, w * h);
+    openslide_read_associated_image(osr, name, buf2);
+    if (memcmp(buf, buf2, w * h * 4)) {
+      fail("Associated image %s differs on second read", name);
+    }
+    g_free(buf2);
     g_free(buf);
 
+    int64_t sw, sh;
+    openslide_get_associated_image_scaled_dimensions(osr, name, 100, 100,
+                                                     &sw, &sh);
+    if (sw <= 0 || sh <= 0 || sw > MIN(w, 100) || sh > MIN(h, 100)) {
+      fail("Bad scaled dimensions for %s", name);
+    }
+    buf = g_new(uint32_t, sw * sh);
+    openslide_read_associated_image_scaled(osr, name, 100, 100, buf);
+    g_free(buf);
+    if (openslide_get_error(osr)) {
+      fail("Reading scaled %s failed: %s", name, openslide_get_error(osr));
+    }
+
     associated_image_names++;
   }
 
+  // associated images mustn't crowd the tiles out of a small cache
+  openslide_t *assoc = openslide_open(path);
+  if (!assoc || openslide_get_error(assoc)) {
+    fail("Reopen failed");
+  }
+  openslide_set_cache_capacity(assoc, 1024 * 1024);
+  int64_t assoc_count = 0;
+  for (associated_image_names = openslide_get_associated_image_names(assoc);
+       *associated_image_names; associated_image_names++) {
+    const char *name = *associated_image_names;
+    int64_t aw, ah;
+    openslide_get_associated_image_dimensions(assoc, name, &aw, &ah);
+    uint32_t *buf = g_new(uint32_t, aw * ah);
+    openslide_read_associated_image(assoc, name, buf);
+    openslide_read_associated_image(assoc, name, NULL);
+    g_free(buf);
+    assoc_count++;
+  }
+  openslide_cache_stats_t assoc_stats;
+  openslide_get_cache_stats(assoc, &assoc_stats, NULL);
+  if ((int64_t) assoc_stats.bytes >
+      assoc_count * (int64_t) assoc_stats.capacity / 8) {
+    fail("Associated images took %"G_GINT64_FORMAT" cache bytes",
+         (int64_t) assoc_stats.bytes);
+  }
+  if (openslide_get_error(assoc)) {
+    fail("Reading associated images failed: %s", openslide_get_error(assoc));
+  }
+  openslide_close(assoc);
+
   test_image_fetch(osr, -10, -10, 200, 200);
   test_image_fetch(osr, w/2, h/2, 500, 500);
   test_image_fetch(osr, w - 200, h - 100, 500, 400);
@@ -237,6 +472,321 @@ int main(int argc, char **argv) {
     test_image_fetch(osr, bounds_xx, bounds_yy, 200, 200);
   }
 
+  // batch read
+  openslide_read_request_t reqs[4] = {
+    { .x = bounds_xx, .y = bounds_yy, .level = 0, .w = 2000, .h = 1500 },
+    { .x = w / 2, .y = h / 2, .level = levels - 1, .w = 300, .h = 300 },
+    { .x = -10, .y = -10, .level = 0, .w = 200, .h = 200 },
+    { .x = 0, .y = 0, .level = 0, .w = 1000, .h = 1000 },  // NULL buffer
+  };
+  for (int i = 0; i < 3; i++) {
+    reqs[i].dest = g_new(uint32_t, reqs[i].w * reqs[i].h);
+  }
+  if (openslide_read_regions(osr, reqs, 4)) {
+    fail("Batch read failed: %s", openslide_get_error(osr));
+  }
+  for (int i = 0; i < 3; i++) {
+    // compare against a single read
+    uint32_t *buf = g_new(uint32_t, reqs[i].w * reqs[i].h);
+    openslide_read_region(osr, buf, reqs[i].x, reqs[i].y, reqs[i].level,
+                          reqs[i].w, reqs[i].h);
+    if (memcmp(buf, reqs[i].dest, reqs[i].w * reqs[i].h * 4)) {
+      fail("Batch read result differs from single read");
+    }
+    g_free(buf);
+    g_free(reqs[i].dest);
+  }
+
+  // output formats, against ARGB
+  {
+    const int64_t fw = 300, fh = 300;
+    uint32_t *argb = g_new(uint32_t, fw * fh);
+    uint8_t *rgb = g_new(uint8_t, fw * fh * 3);
+    uint8_t *rgba = g_new(uint8_t, fw * fh * 4);
+    openslide_read_region(osr, argb, reqs[0].x, reqs[0].y, 0, fw, fh);
+    openslide_read_region_format(osr, rgb, OPENSLIDE_PIXEL_FORMAT_RGB24,
+                                 reqs[0].x, reqs[0].y, 0, fw, fh);
+    openslide_read_region_format(osr, rgba, OPENSLIDE_PIXEL_FORMAT_RGBA32,
+                                 reqs[0].x, reqs[0].y, 0, fw, fh);
+    if (openslide_get_error(osr)) {
+      fail("Format read failed: %s", openslide_get_error(osr));
+    }
+    for (int64_t i = 0; i < fw * fh; i++) {
+      uint32_t p = argb[i];
+      if (rgb[3 * i] != ((p >> 16) & 0xff) ||
+          rgb[3 * i + 1] != ((p >> 8) & 0xff) ||
+          rgb[3 * i + 2] != (p & 0xff)) {
+        fail("RGB24 read differs from ARGB read");
+      }
+      if ((p >> 24) == 0xff &&
+          (rgba[4 * i] != rgb[3 * i] || rgba[4 * i + 3] != 0xff)) {
+        fail("RGBA32 read differs from ARGB read");
+      }
+    }
+    if (openslide_get_pixel_format_size(OPENSLIDE_PIXEL_FORMAT_GRAY8) != 1 ||
+        openslide_get_pixel_format_size(-1) != -1) {
+      fail("Bad pixel format size");
+    }
+    g_free(rgba);
+    g_free(rgb);
+    g_free(argb);
+  }
+
+  // thumbnail
+  int64_t thumb_w, thumb_h;
+  openslide_get_thumbnail_dimensions(osr, 256, 256, &thumb_w, &thumb_h);
+  if (thumb_w <= 0 || thumb_h <= 0 || thumb_w > 256 || thumb_h > 256 ||
+      (thumb_w != 256 && thumb_h != 256 && thumb_w != w && thumb_h != h)) {
+    fail("Bad thumbnail dimensions %"G_GINT64_FORMAT"x%"G_GINT64_FORMAT,
+         thumb_w, thumb_h);
+  }
+  uint32_t *thumb = g_new(uint32_t, thumb_w * thumb_h);
+  openslide_read_thumbnail(osr, 256, 256, thumb);
+  if (openslide_get_error(osr)) {
+    fail("Thumbnail read failed: %s", openslide_get_error(osr));
+  }
+  g_free(thumb);
+
+  // borrowed tile
+  int64_t tw, th;
+  openslide_tile_ref_t *ref;
+  const uint32_t *tile = openslide_borrow_tile(osr, 0, 0, 0, &tw, &th, &ref);
+  if (tile) {
+    uint32_t *buf = g_new(uint32_t, tw * th);
+    openslide_read_region(osr, buf, 0, 0, 0, tw, th);
+    if (memcmp(buf, tile, tw * th * 4)) {
+      fail("Borrowed tile differs from read_region");
+    }
+    g_free(buf);
+  } else if (openslide_get_error(osr)) {
+    fail("Borrowing tile failed: %s", openslide_get_error(osr));
+  }
+  openslide_release_tile(ref);
+  if (openslide_borrow_tile(osr, 0, -1, 0, &tw, &th, &ref) ||
+      openslide_get_error(osr)) {
+    fail("Borrowed nonexistent tile");
+  }
+
+  // raw tiles
+  openslide_tile_format_t tile_format;
+  int64_t raw_len;
+  uint8_t *raw = openslide_read_raw_tile(osr, 0, 0, 0, &tile_format,
+                                         &tw, &th, &raw_len);
+  if (raw) {
+    if (tile_format != OPENSLIDE_TILE_FORMAT_JPEG || raw_len < 4 ||
+        raw[0] != 0xFF || raw[1] != 0xD8 || tw <= 0 || th <= 0) {
+      fail("Bad raw tile");
+    }
+  } else if (openslide_get_error(osr)) {
+    fail("Reading raw tile failed: %s", openslide_get_error(osr));
+  }
+  openslide_free_raw_tile(raw);
+  if (openslide_read_raw_tile(osr, 0, -1, 0, &tile_format, &tw, &th,
+                              &raw_len) || openslide_get_error(osr)) {
+    fail("Read nonexistent raw tile");
+  }
+
+  // occupancy map
+  double cell_w, cell_h;
+  int64_t cols, rows;
+  openslide_get_tile_occupancy_dimensions(osr, 0, &cell_w, &cell_h,
+                                          &cols, &rows);
+  if (cols >= 0) {
+    uint8_t *occupancy = g_new(uint8_t, cols * rows);
+    if (!openslide_get_tile_occupancy(osr, 0, 0, occupancy) ||
+        !openslide_get_tile_occupancy(osr, 0, 220, occupancy)) {
+      fail("Reading occupancy failed: %s", openslide_get_error(osr));
+    }
+    g_free(occupancy);
+  } else if (openslide_get_error(osr)) {
+    fail("Occupancy dimensions failed: %s", openslide_get_error(osr));
+  }
+
+  // async reads, two of them overlapping
+  async_lock = g_mutex_new();
+  async_cond = g_cond_new();
+  openslide_read_request_t areqs[2] = {
+    { .x = bounds_xx, .y = bounds_yy, .level = 0, .w = 1000, .h = 1000 },
+    { .x = bounds_xx + 500, .y = bounds_yy, .level = 0, .w = 1000, .h = 1000 },
+  };
+  openslide_async_read_t *handles[2];
+  async_pending = 2;
+  for (int i = 0; i < 2; i++) {
+    areqs[i].dest = g_new(uint32_t, areqs[i].w * areqs[i].h);
+    handles[i] = openslide_read_region_async(osr, &areqs[i], async_done,
+                                             NULL);
+  }
+  g_mutex_lock(async_lock);
+  while (async_pending) {
+    g_cond_wait(async_cond, async_lock);
+  }
+  g_mutex_unlock(async_lock);
+  for (int i = 0; i < 2; i++) {
+    uint32_t *buf = g_new(uint32_t, areqs[i].w * areqs[i].h);
+    openslide_read_region(osr, buf, areqs[i].x, areqs[i].y, areqs[i].level,
+                          areqs[i].w, areqs[i].h);
+    if (memcmp(buf, areqs[i].dest, areqs[i].w * areqs[i].h * 4)) {
+      fail("Async read result differs from single read");
+    }
+    g_free(buf);
+    g_free(areqs[i].dest);
+    openslide_release_read(handles[i]);
+  }
+
+  // closing with reads outstanding waits for or cancels them
+  openslide_t *async_osr = openslide_open(path);
+  if (!async_osr || openslide_get_error(async_osr)) {
+    fail("Reopen failed");
+  }
+  async_pending = 2;
+  for (int i = 0; i < 2; i++) {
+    areqs[i].dest = g_new(uint32_t, areqs[i].w * areqs[i].h);
+    handles[i] = openslide_read_region_async(async_osr, &areqs[i],
+                                             async_done_or_cancelled, NULL);
+  }
+  openslide_close(async_osr);
+  g_mutex_lock(async_lock);
+  while (async_pending) {
+    g_cond_wait(async_cond, async_lock);
+  }
+  g_mutex_unlock(async_lock);
+  for (int i = 0; i < 2; i++) {
+    g_free(areqs[i].dest);
+    openslide_release_read(handles[i]);
+  }
+  g_cond_free(async_cond);
+  g_mutex_free(async_lock);
+
+  // prefetch hints; closing with hints outstanding must be safe
+  int prefetch_id = openslide_give_prefetch_hint(osr, bounds_xx, bounds_yy,
+                                                 0, 3000, 3000);
+  if (prefetch_id <= 0) {
+    fail("Prefetch hint failed: %s", openslide_get_error(osr));
+  }
+  openslide_cancel_prefetch_hint(osr, prefetch_id);
+  openslide_give_prefetch_hint(osr, 0, 0, levels - 1, 2000, 2000);
+  test_image_fetch(osr, 0, 0, 200, 200);
+
+  // closing must wait for hinted reads that are already running
+  openslide_t *hinted = openslide_open(path);
+  if (!hinted || openslide_get_error(hinted)) {
+    fail("Reopen failed");
+  }
+  openslide_give_prefetch_hint(hinted, 0, 0, 0, MIN(w, 8192), MIN(h, 8192));
+  openslide_close(hinted);
+
+  // shared cache
+  openslide_cache_t *cache = openslide_cache_create(64 * 1024 * 1024);
+  openslide_cache_set_compressed_capacity(cache, 16 * 1024 * 1024);
+  openslide_t *osr2 = openslide_open(path);
+  if (!osr2 || openslide_get_error(osr2)) {
+    fail("Reopen failed");
+  }
+  openslide_set_cache(osr, cache);
+  openslide_set_cache(osr2, cache);
+  openslide_cache_release(cache);
+  test_image_fetch(osr, bounds_xx, bounds_yy, 200, 200);
+  test_image_fetch(osr2, bounds_xx, bounds_yy, 200, 200);
+  openslide_close(osr2);
+  test_image_fetch(osr, bounds_xx, bounds_yy, 200, 200);
+
+  // shared handles
+  openslide_t *shared = openslide_open_shared(path);
+  if (!shared || openslide_get_error(shared)) {
+    fail("Shared open failed");
+  }
+  if (openslide_open_shared(path) != shared) {
+    fail("Second shared open returned a different object");
+  }
+  openslide_release_shared(shared);
+  openslide_release_shared(shared);
+  openslide_set_shared_idle_timeout(0);
+  openslide_cache_stats_t stats;
+  openslide_get_cache_stats(osr, &stats, NULL);
+  if (stats.capacity != 64 * 1024 * 1024 || stats.bytes > stats.capacity ||
+      stats.insertions + stats.refused == 0) {
+    fail("Unexpected cache statistics");
+  }
+  openslide_set_cache_capacity(osr, 0);
+  openslide_get_cache_stats(osr, &stats, NULL);
+  if (stats.bytes) {
+    fail("Cache not emptied");
+  }
+
+  // synthetic levels
+  openslide_set_synthetic_levels_enabled(true);
+  openslide_t *synth = openslide_open(path);
+  openslide_set_synthetic_levels_enabled(false);
+  if (!synth || openslide_get_error(synth)) {
+    fail("Open with synthetic levels failed");
+  }
+  int32_t synth_levels = openslide_get_level_count(synth);
+  if (synth_levels < levels) {
+    fail("Synthetic levels replaced native ones");
+  }
+  for (int32_t i = 0; i < levels; i++) {
+    int64_t nw, nh, sw, sh;
+    openslide_get_level_dimensions(osr, i, &nw, &nh);
+    openslide_get_level_dimensions(synth, i, &sw, &sh);
+    if (nw != sw || nh != sh) {
+      fail("Native level %d changed with synthetic levels", i);
+    }
+  }
+  int64_t sw, sh;
+  openslide_get_level_dimensions(synth, synth_levels - 1, &sw, &sh);
+  if (synth_levels > levels) {
+    if (sw > 256 || sh > 256) {
+      fail("Smallest synthetic level is %"G_GINT64_FORMAT"x%"G_GINT64_FORMAT,
+           sw, sh);
+    }
+    if (openslide_read_raw_tile(synth, synth_levels - 1, 0, 0, &tile_format,
+                                &tw, &th, &raw_len)) {
+      fail("Read raw tile of synthetic level");
+    }
+  }
+  // synthetic tiles read native tiles while being traced themselves
+  uint32_t *synth_buf = g_new(uint32_t, sw * sh);
+  openslide_set_trace_callback(trace_event, NULL);
+  openslide_read_region(synth, synth_buf, 0, 0, synth_levels - 1, sw, sh);
+  openslide_set_trace_callback(NULL, NULL);
+  g_free(synth_buf);
+  if (g_atomic_int_get(&traced_begins) != g_atomic_int_get(&traced_ends)) {
+    fail("Unbalanced nested trace events: %d begins, %d ends",
+         g_atomic_int_get(&traced_begins), g_atomic_int_get(&traced_ends));
+  }
+  if (openslide_get_error(synth)) {
+    fail("Reading synthetic level failed: %s", openslide_get_error(synth));
+  }
+  openslide_close(synth);
+
+  // index snapshots
+  check_snapshots(path, bounds_xx, bounds_yy);
+
+  // performance counters
+  openslide_perf_counter_t counters[OPENSLIDE_PERF_STAGE_COUNT];
+  openslide_reset_perf_counters();
+  if (openslide_get_perf_counters(counters, OPENSLIDE_PERF_STAGE_COUNT) !=
+      OPENSLIDE_PERF_STAGE_COUNT) {
+    fail("Unexpected number of performance counters");
+  }
+  for (int i = 0; i < OPENSLIDE_PERF_STAGE_COUNT; i++) {
+    if (!openslide_get_perf_stage_name(i)) {
+      fail("Missing name for performance stage %d", i);
+    }
+  }
+  if (openslide_get_perf_stage_name(OPENSLIDE_PERF_STAGE_COUNT)) {
+    fail("Name for nonexistent performance stage");
+  }
+
+  // tracing
+  openslide_set_trace_callback(trace_event, NULL);
+  test_image_fetch(osr, bounds_xx, bounds_yy, 200, 200);
+  openslide_set_trace_callback(NULL, NULL);
+  if (g_atomic_int_get(&traced_begins) != g_atomic_int_get(&traced_ends)) {
+    fail("Unbalanced trace events: %d begins, %d ends",
+         g_atomic_int_get(&traced_begins), g_atomic_int_get(&traced_ends));
+  }
+
   openslide_close(osr);
 
   check_cloexec_leaks(path, argv[0], bounds_xx, bounds_yy);
@@ -0,0 +1,552 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2007-2014 Carnegie Mellon University
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Write a Deep Zoom tile pyramid.
+ *
+ * Pyramid levels that match a slide level are read from the slide, a
+ * band of tile rows at a time.  Each other level is built from the
+ * level above it: rows stream down the pyramid, each pair of rows
+ * being averaged into one row of the next level, so every slide pixel
+ * is read once per matching level rather than once per pyramid level.
+ * Each level keeps only the rows that its next row of tiles, with
+ * overlap, still needs.  Tiles are encoded and written by a pool of
+ * threads while the main thread reads and downsamples.
+ */
+
+#include "openslide.h"
+#include "openslide-tools-common.h"
+
+#include <png.h>
+#include <jpeglib.h>
+#include <inttypes.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// encode jobs allowed to wait per thread, bounding memory use
+#define QUEUED_PER_THREAD 8
+// bands read from the slide are limited to this size
+#define MAX_BAND_BYTES (128 * 1024 * 1024)
+
+static gint tile_size = 254;
+static gint overlap = 1;
+static gchar *format;
+static gint quality = 75;
+static gint jobs;
+
+static const GOptionEntry options[] = {
+  {"tile-size", 's', 0, G_OPTION_ARG_INT, &tile_size,
+   "Tile size, excluding overlap (default 254)", "PIXELS"},
+  {"overlap", 'o', 0, G_OPTION_ARG_INT, &overlap,
+   "Pixels of overlap between adjacent tiles (default 1)", "PIXELS"},
+  {"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+   "Tile format: jpeg or png (default jpeg)", "FORMAT"},
+  {"quality", 'q', 0, G_OPTION_ARG_INT, &quality,
+   "JPEG quality (default 75)", "QUALITY"},
+  {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+   "Encoding threads (default: one per processor)", "COUNT"},
+  {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct dzlevel {
+  int32_t index;
+  int64_t w;
+  int64_t h;
+  int64_t cols;
+  int64_t rows;
+
+  // slide level to read, or -1 to build from the level above
+  int32_t slide_level;
+  struct dzlevel *parent;  // next smaller level, or NULL
+
+  // the most recent rows, indexed by row % ring_rows
+  uint32_t *ring;
+  int64_t ring_rows;
+  int64_t rows_received;
+  int64_t next_tile_row;
+
+  char *dir;
+};
+
+struct tile_job {
+  char *path;
+  uint32_t *pixels;
+  int64_t w;
+  int64_t h;
+};
+
+static struct {
+  GMutex *lock;
+  GCond *cond;
+  int64_t queued;
+} encoder;
+
+static bool write_jpeg;
+static uint8_t bg_r = 255, bg_g = 255, bg_b = 255;
+
+static void fail(const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  char *msg = g_strdup_vprintf(format, ap);
+  va_end(ap);
+
+  fprintf(stderr, "%s: %s\n", g_get_prgname(), msg);
+  fflush(stderr);
+
+  exit(1);
+}
+
+static FILE *open_output(const char *path) {
+  FILE *f = g_fopen(path, "wb");
+  if (!f) {
+    fail("Can't open %s for writing: %s", path, strerror(errno));
+  }
+  return f;
+}
+
+static void close_output(FILE *f, const char *path) {
+  if (fclose(f)) {
+    fail("Can't write %s: %s", path, strerror(errno));
+  }
+}
+
+// premultiplied ARGB to RGB over the background
+static void encode_jpeg(struct tile_job *job) {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+
+  FILE *f = open_output(job->path);
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, f);
+  cinfo.image_width = job->w;
+  cinfo.image_height = job->h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  uint8_t *row = g_malloc(job->w * 3);
+  for (int64_t y = 0; y < job->h; y++) {
+    const uint32_t *src = job->pixels + y * job->w;
+    for (int64_t x = 0; x < job->w; x++) {
+      uint32_t p = src[x];
+      uint32_t t = 255 - (p >> 24);
+      row[x * 3 + 0] = ((p >> 16) & 0xFF) + (t * bg_r + 127) / 255;
+      row[x * 3 + 1] = ((p >> 8) & 0xFF) + (t * bg_g + 127) / 255;
+      row[x * 3 + 2] = (p & 0xFF) + (t * bg_b + 127) / 255;
+    }
+    JSAMPROW rows[1] = {row};
+    jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  g_free(row);
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  close_output(f, job->path);
+}
+
+// premultiplied ARGB to un-premultiplied RGBA
+static void encode_png(struct tile_job *job) {
+  FILE *f = open_output(job->path);
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                NULL, NULL, NULL);
+  if (!png_ptr) {
+    fail("Could not initialize PNG");
+  }
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    fail("Could not initialize PNG");
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    fail("Error writing %s", job->path);
+  }
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, job->w, job->h, 8,
+               PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  uint8_t *row = g_malloc(job->w * 4);
+  for (int64_t y = 0; y < job->h; y++) {
+    const uint32_t *src = job->pixels + y * job->w;
+    for (int64_t x = 0; x < job->w; x++) {
+      uint32_t p = src[x];
+      uint8_t a = p >> 24;
+      uint8_t *out = row + x * 4;
+      if (a == 0) {
+        memset(out, 0, 4);
+        continue;
+      }
+      out[0] = ((((p >> 16) & 0xFF) * 255) + a / 2) / a;
+      out[1] = ((((p >> 8) & 0xFF) * 255) + a / 2) / a;
+      out[2] = (((p & 0xFF) * 255) + a / 2) / a;
+      out[3] = a;
+    }
+    png_write_row(png_ptr, row);
+  }
+  g_free(row);
+
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  close_output(f, job->path);
+}
+
+static void encode_tile(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct tile_job *job = data;
+
+  if (write_jpeg) {
+    encode_jpeg(job);
+  } else {
+    encode_png(job);
+  }
+  g_free(job->pixels);
+  g_free(job->path);
+  g_slice_free(struct tile_job, job);
+
+  g_mutex_lock(encoder.lock);
+  encoder.queued--;
+  g_cond_signal(encoder.cond);
+  g_mutex_unlock(encoder.lock);
+}
+
+static void queue_tile(GThreadPool *pool, struct tile_job *job) {
+  g_mutex_lock(encoder.lock);
+  while (encoder.queued >= QUEUED_PER_THREAD * jobs) {
+    g_cond_wait(encoder.cond, encoder.lock);
+  }
+  encoder.queued++;
+  g_mutex_unlock(encoder.lock);
+
+  GError *err = NULL;
+  g_thread_pool_push(pool, job, &err);
+  if (err) {
+    fail("Couldn't queue tile: %s", err->message);
+  }
+}
+
+static const uint32_t *ring_row(struct dzlevel *l, int64_t y) {
+  return l->ring + (y % l->ring_rows) * l->w;
+}
+
+// first and last+1 pixel of a tile along one axis, including overlap
+static void tile_span(int64_t i, int64_t size, int64_t *start, int64_t *end) {
+  *start = i * tile_size - (i ? overlap : 0);
+  *end = MIN((i + 1) * tile_size + overlap, size);
+}
+
+static void emit_tile_row(GThreadPool *pool, struct dzlevel *l, int64_t row) {
+  int64_t y0, y1;
+  tile_span(row, l->h, &y0, &y1);
+  for (int64_t col = 0; col < l->cols; col++) {
+    int64_t x0, x1;
+    tile_span(col, l->w, &x0, &x1);
+
+    struct tile_job *job = g_slice_new(struct tile_job);
+    job->w = x1 - x0;
+    job->h = y1 - y0;
+    job->pixels = g_new(uint32_t, job->w * job->h);
+    for (int64_t y = y0; y < y1; y++) {
+      memcpy(job->pixels + (y - y0) * job->w, ring_row(l, y) + x0,
+             job->w * 4);
+    }
+    job->path = g_strdup_printf("%s/%"PRId64"_%"PRId64".%s", l->dir,
+                                col, row, write_jpeg ? "jpeg" : "png");
+    queue_tile(pool, job);
+  }
+}
+
+// average premultiplied pixels; b may be NULL at the bottom edge
+static void downsample_rows(const uint32_t *a, const uint32_t *b,
+                            int64_t src_w, uint32_t *dest, int64_t dest_w) {
+  for (int64_t x = 0; x < dest_w; x++) {
+    const uint32_t *rows[2] = {a, b};
+    uint32_t sum[4] = {0, 0, 0, 0};
+    uint32_t n = 0;
+    for (int r = 0; r < 2; r++) {
+      if (!rows[r]) {
+        continue;
+      }
+      for (int64_t sx = 2 * x; sx < MIN(2 * x + 2, src_w); sx++) {
+        uint32_t p = rows[r][sx];
+        sum[0] += p >> 24;
+        sum[1] += (p >> 16) & 0xFF;
+        sum[2] += (p >> 8) & 0xFF;
+        sum[3] += p & 0xFF;
+        n++;
+      }
+    }
+    dest[x] = ((sum[0] + n / 2) / n) << 24 |
+              ((sum[1] + n / 2) / n) << 16 |
+              ((sum[2] + n / 2) / n) << 8 |
+              ((sum[3] + n / 2) / n);
+  }
+}
+
+// add the next row of a level, passing it down the pyramid and writing
+// any row of tiles it completes
+static void push_row(GThreadPool *pool, struct dzlevel *l,
+                     const uint32_t *row) {
+  int64_t y = l->rows_received++;
+  uint32_t *slot = l->ring + (y % l->ring_rows) * l->w;
+  if (slot != row) {
+    memcpy(slot, row, l->w * 4);
+  }
+
+  while (l->next_tile_row < l->rows) {
+    int64_t y0, y1;
+    tile_span(l->next_tile_row, l->h, &y0, &y1);
+    if (l->rows_received < y1) {
+      break;
+    }
+    emit_tile_row(pool, l, l->next_tile_row++);
+  }
+
+  struct dzlevel *p = l->parent;
+  if (p && p->slide_level == -1 && (y % 2 || y == l->h - 1)) {
+    const uint32_t *a = ring_row(l, y - y % 2);
+    const uint32_t *b = y % 2 ? ring_row(l, y) : NULL;
+    uint32_t *dest = p->ring + (p->rows_received % p->ring_rows) * p->w;
+    downsample_rows(a, b, l->w, dest, p->w);
+    push_row(pool, p, dest);
+  }
+}
+
+// read a level from the slide, a band of tile rows at a time
+static void read_level(openslide_t *osr, GThreadPool *pool,
+                       struct dzlevel *l) {
+  double ds = openslide_get_level_downsample(osr, l->slide_level);
+
+  // bands of whole slide tiles can bypass the cache, since no tile is
+  // needed twice
+  int64_t band_h = tile_size;
+  uint32_t flags = 0;
+  char *prop = g_strdup_printf("openslide.level[%d].tile-height",
+                               l->slide_level);
+  const char *tile_h = openslide_get_property_value(osr, prop);
+  g_free(prop);
+  if (tile_h && g_ascii_strtoll(tile_h, NULL, 10) > 0) {
+    band_h = g_ascii_strtoll(tile_h, NULL, 10);
+    flags = OPENSLIDE_READ_NO_CACHE;
+  }
+  if (l->w * band_h * 4 > MAX_BAND_BYTES) {
+    band_h = MAX(MAX_BAND_BYTES / (l->w * 4), 1);
+    flags = 0;
+  }
+  band_h = MIN(band_h, l->h);
+
+  uint32_t *band = g_new(uint32_t, l->w * band_h);
+  for (int64_t y = 0; y < l->h; y += band_h) {
+    openslide_read_request_t req = {
+      .dest = band,
+      .x = 0,
+      .y = y * ds,
+      .level = l->slide_level,
+      .w = l->w,
+      .h = MIN(band_h, l->h - y),
+      .flags = flags,
+    };
+    openslide_read_regions(osr, &req, 1);
+    if (req.error) {
+      fail("%s", req.error);
+    }
+    for (int64_t row = 0; row < req.h; row++) {
+      push_row(pool, l, band + row * l->w);
+    }
+  }
+  g_free(band);
+}
+
+static int get_default_jobs(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (count > 0) {
+    return count;
+  }
+#endif
+  return 1;
+}
+
+static void write_dzi(const char *path, int64_t w, int64_t h) {
+  FILE *f = open_output(path);
+  fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+          "Format=\"%s\" Overlap=\"%d\" TileSize=\"%d\">"
+          "<Size Height=\"%"PRId64"\" Width=\"%"PRId64"\"/></Image>\n",
+          write_jpeg ? "jpeg" : "png", overlap, tile_size, h, w);
+  close_output(f, path);
+}
+
+static const struct openslide_tools_usage_info usage_info = {
+  "slide output-base",
+  "Write a Deep Zoom tile pyramid of a virtual slide.",
+  options,
+};
+
+int main (int argc, char **argv) {
+  if (!g_thread_supported()) {
+    g_thread_init(NULL);
+  }
+
+  _openslide_tools_parse_commandline(&usage_info, &argc, &argv);
+  if (argc != 3) {
+    _openslide_tools_usage(&usage_info);
+  }
+  const char *slide = argv[1];
+  const char *base = argv[2];
+
+  // validate options
+  if (tile_size < 1) {
+    fail("tile size must be positive");
+  }
+  if (overlap < 0) {
+    fail("overlap must be non-negative");
+  }
+  if (format == NULL || !g_ascii_strcasecmp(format, "jpeg") ||
+      !g_ascii_strcasecmp(format, "jpg")) {
+    write_jpeg = true;
+  } else if (g_ascii_strcasecmp(format, "png")) {
+    fail("unknown format %s", format);
+  }
+  if (quality < 0 || quality > 100) {
+    fail("quality must be between 0 and 100");
+  }
+  if (jobs <= 0) {
+    jobs = get_default_jobs();
+  }
+
+  // open slide
+  openslide_t *osr = openslide_open(slide);
+  if (osr == NULL) {
+    fail("%s: Not a file that OpenSlide can recognize", slide);
+  }
+  const char *err = openslide_get_error(osr);
+  if (err) {
+    fail("%s: %s", slide, err);
+  }
+  const char *bgcolor = openslide_get_property_value(osr,
+                                                     OPENSLIDE_PROPERTY_NAME_BACKGROUND_COLOR);
+  if (bgcolor) {
+    unsigned int r, g, b;
+    if (sscanf(bgcolor, "%2x%2x%2x", &r, &g, &b) == 3) {
+      bg_r = r;
+      bg_g = g;
+      bg_b = b;
+    }
+  }
+
+  // compute the pyramid, largest level last
+  int64_t w, h;
+  openslide_get_level0_dimensions(osr, &w, &h);
+  if (w <= 0 || h <= 0) {
+    fail("%s: Slide has no pixels", slide);
+  }
+  int32_t count = 1;
+  for (int64_t size = MAX(w, h); size > 1; size = (size + 1) / 2) {
+    count++;
+  }
+  struct dzlevel *levels = g_new0(struct dzlevel, count);
+  char *files_dir = g_strdup_printf("%s_files", base);
+  for (int32_t i = count - 1; i >= 0; i--) {
+    struct dzlevel *l = &levels[i];
+    l->index = i;
+    if (i == count - 1) {
+      l->w = w;
+      l->h = h;
+    } else {
+      l->w = (levels[i + 1].w + 1) / 2;
+      l->h = (levels[i + 1].h + 1) / 2;
+    }
+    l->cols = (l->w + tile_size - 1) / tile_size;
+    l->rows = (l->h + tile_size - 1) / tile_size;
+    l->parent = i ? &levels[i - 1] : NULL;
+    l->ring_rows = MAX(tile_size + 2 * overlap, 2);
+    l->ring = g_new(uint32_t, l->ring_rows * l->w);
+
+    // read from the slide if a slide level has these dimensions, to
+    // within rounding
+    double downsample = (double) (1LL << (count - 1 - i));
+    int32_t slide_level = openslide_get_best_level_for_downsample(osr,
+                                                                  downsample);
+    int64_t sw, sh;
+    openslide_get_level_dimensions(osr, slide_level, &sw, &sh);
+    if (i == count - 1 || (llabs(sw - l->w) <= 1 && llabs(sh - l->h) <= 1)) {
+      l->slide_level = slide_level;
+    } else {
+      l->slide_level = -1;
+    }
+
+    l->dir = g_strdup_printf("%s/%d", files_dir, i);
+    if (g_mkdir_with_parents(l->dir, 0777)) {
+      fail("Can't create %s: %s", l->dir, strerror(errno));
+    }
+  }
+
+  // start encoders
+  encoder.lock = g_mutex_new();
+  encoder.cond = g_cond_new();
+  GError *tmp_err = NULL;
+  GThreadPool *pool = g_thread_pool_new(encode_tile, NULL, jobs, TRUE,
+                                        &tmp_err);
+  if (!pool) {
+    fail("Couldn't start encoders: %s", tmp_err->message);
+  }
+
+  // read each level that comes from the slide, building the levels
+  // below it along the way
+  for (int32_t i = count - 1; i >= 0; i--) {
+    if (levels[i].slide_level != -1) {
+      read_level(osr, pool, &levels[i]);
+    }
+  }
+
+  // wait for encoders
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_cond_free(encoder.cond);
+  g_mutex_free(encoder.lock);
+
+  char *dzi = g_strdup_printf("%s.dzi", base);
+  write_dzi(dzi, w, h);
+  g_free(dzi);
+
+  // clean up
+  for (int32_t i = 0; i < count; i++) {
+    g_free(levels[i].ring);
+    g_free(levels[i].dir);
+  }
+  g_free(levels);
+  g_free(files_dir);
+  openslide_close(osr);
+
+  return 0;
+}
@@ -24,57 +24,116 @@
 #include "openslide.h"
 #include "openslide-tools-common.h"
 
-static gboolean process(const char *file) {
-  openslide_t *osr = openslide_open(file);
-  if (osr == NULL) {
+static gint jobs = 1;
+
+static const GOptionEntry options[] = {
+  {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+   "Hash this many files at once (default 1)", "COUNT"},
+  {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct result {
+  const char *file;
+  char hash[OPENSLIDE_QUICKHASH1_SIZE];
+  char *err;
+  gboolean ok;
+  gboolean done;
+};
+
+// results are printed in argument order, as they become available
+static struct {
+  GMutex *lock;
+  struct result *results;
+  int count;
+  int next_to_print;
+} output;
+
+static void print_result(struct result *r) {
+  if (r->ok) {
+    printf("%s  %s\n", r->hash, r->file);
+  } else if (r->err) {
+    fprintf(stderr, "%s: %s: %s\n", g_get_prgname(), r->file, r->err);
+    fflush(stderr);
+    g_free(r->err);
+    r->err = NULL;
+  } else {
     fprintf(stderr, "%s: %s: Not a file that OpenSlide can recognize\n",
-	    g_get_prgname(), file);
+	    g_get_prgname(), r->file);
     fflush(stderr);
-    return FALSE;
   }
+}
 
-  const char *err = openslide_get_error(osr);
-  if (err) {
-    fprintf(stderr, "%s: %s: %s\n", g_get_prgname(), file, err);
-    fflush(stderr);
-    openslide_close(osr);
-    return FALSE;
-  }
+static void process(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct result *r = data;
 
-  const char *hash = openslide_get_property_value(osr,
-        "openslide.quickhash-1");
-  if (hash != NULL) {
-    printf("%s  %s\n", hash, file);
-  } else {
-    fprintf(stderr, "%s: %s: No quickhash-1 available\n", g_get_prgname(),
-            file);
-    fflush(stderr);
-    openslide_close(osr);
-    return FALSE;
+  char err[1024];
+  r->ok = openslide_compute_quickhash1(r->file, r->hash, err, sizeof(err));
+  if (!r->ok && err[0]) {
+    r->err = g_strdup(err);
   }
 
-  openslide_close(osr);
-  return TRUE;
+  g_mutex_lock(output.lock);
+  r->done = TRUE;
+  while (output.next_to_print < output.count &&
+         output.results[output.next_to_print].done) {
+    print_result(&output.results[output.next_to_print++]);
+  }
+  g_mutex_unlock(output.lock);
 }
 
 
 static const struct openslide_tools_usage_info usage_info = {
   "FILE...",
   "Print OpenSlide quickhash-1 (256-bit) checksums.",
+  options,
 };
 
 int main (int argc, char **argv) {
+  if (!g_thread_supported()) {
+    g_thread_init(NULL);
+  }
+
   _openslide_tools_parse_commandline(&usage_info, &argc, &argv);
   if (argc < 2) {
     _openslide_tools_usage(&usage_info);
   }
+  if (jobs < 1) {
+    fprintf(stderr, "%s: jobs must be positive\n", g_get_prgname());
+    return 2;
+  }
+
+  output.lock = g_mutex_new();
+  output.count = argc - 1;
+  output.results = g_new0(struct result, output.count);
+  for (int i = 0; i < output.count; i++) {
+    output.results[i].file = argv[i + 1];
+  }
+
+  if (jobs == 1) {
+    for (int i = 0; i < output.count; i++) {
+      process(&output.results[i], NULL);
+    }
+  } else {
+    GError *err = NULL;
+    GThreadPool *pool = g_thread_pool_new(process, NULL, jobs, TRUE, &err);
+    if (!pool) {
+      fprintf(stderr, "%s: %s\n", g_get_prgname(), err->message);
+      return 1;
+    }
+    for (int i = 0; i < output.count; i++) {
+      g_thread_pool_push(pool, &output.results[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+  }
 
   int ret = 0;
-  for (int i = 1; i < argc; i++) {
-    if (!process(argv[i])) {
+  for (int i = 0; i < output.count; i++) {
+    if (!output.results[i].ok) {
       ret = 1;
     }
   }
 
+  g_free(output.results);
+  g_mutex_free(output.lock);
   return ret;
 }
@@ -27,6 +27,8 @@
 struct openslide_tools_usage_info {
   const char *parameter_string;
   const char *summary;
+  // tool-specific options, or NULL
+  const GOptionEntry *options;
 };
 
 void _openslide_tools_parse_commandline(const struct openslide_tools_usage_info *info,
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <setjmp.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 static const char SOFTWARE[] = "Software";
 static const char OPENSLIDE[] = "OpenSlide <http://openslide.org/>";
@@ -60,6 +61,126 @@ static void fail(const char *format, ...) {
 }
 
 
+// bands are limited to this size, and otherwise are one tile row high
+#define MAX_BAND_BYTES (128 * 1024 * 1024)
+#define DEFAULT_BAND_HEIGHT 256
+
+static gboolean fast;
+
+static const GOptionEntry options[] = {
+  {"fast", 'f', 0, G_OPTION_ARG_NONE, &fast,
+   "Compress quickly, at the expense of file size", NULL},
+  {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+// a band of rows, read in the background while the previous one is
+// written
+struct band {
+  openslide_read_request_t req;
+  openslide_async_read_t *handle;
+  bool done;
+};
+
+static GMutex *band_lock;
+static GCond *band_cond;
+
+// un-premultiplied value of each color component for each alpha
+static uint8_t unpremultiply[256][256];
+
+static void init_unpremultiply(void) {
+  for (int a = 1; a < 256; a++) {
+    for (int c = 0; c < 256; c++) {
+      unpremultiply[a][c] = (c * 255 + a / 2) / a;
+    }
+  }
+}
+
+// ARGB to R, G, B, A in memory, for an opaque pixel
+static inline uint32_t pack_opaque(uint32_t p) {
+  return GUINT32_TO_LE((p & 0xFF00FF00) |
+                       ((p >> 16) & 0xFF) |
+                       ((p & 0xFF) << 16));
+}
+
+// ARGB to R, G, B, A in memory, un-premultiplying alpha
+static inline uint32_t pack_any(uint32_t p) {
+  uint8_t a = p >> 24;
+  uint32_t r = unpremultiply[a][(p >> 16) & 0xFF];
+  uint32_t g = unpremultiply[a][(p >> 8) & 0xFF];
+  uint32_t b = unpremultiply[a][p & 0xFF];
+  return GUINT32_TO_LE(r | (g << 8) | (b << 16) | ((uint32_t) a << 24));
+}
+
+// un-premultiply alpha and pack into expected format
+static void convert_pixels(uint32_t *buf, int64_t count) {
+  int64_t i = 0;
+  // usually every pixel is opaque, and the inner loops vectorize
+  for (; i + 8 <= count; i += 8) {
+    uint32_t alpha = 0xFF000000;
+    for (int j = 0; j < 8; j++) {
+      alpha &= buf[i + j];
+    }
+    if (alpha == 0xFF000000) {
+      for (int j = 0; j < 8; j++) {
+        buf[i + j] = pack_opaque(buf[i + j]);
+      }
+    } else {
+      for (int j = 0; j < 8; j++) {
+        buf[i + j] = pack_any(buf[i + j]);
+      }
+    }
+  }
+  for (; i < count; i++) {
+    buf[i] = pack_any(buf[i]);
+  }
+}
+
+static void band_done(openslide_read_request_t *req G_GNUC_UNUSED,
+                      void *userdata) {
+  struct band *band = userdata;
+  g_mutex_lock(band_lock);
+  band->done = true;
+  g_cond_broadcast(band_cond);
+  g_mutex_unlock(band_lock);
+}
+
+static void band_start(openslide_t *osr, struct band *band,
+                       int64_t x, int64_t yy, double ds, int32_t level,
+                       int32_t w, int32_t rows) {
+  band->req.x = x;
+  band->req.y = yy * ds;
+  band->req.level = level;
+  band->req.w = w;
+  band->req.h = rows;
+  band->done = false;
+  band->handle = openslide_read_region_async(osr, &band->req,
+                                             band_done, band);
+}
+
+static void band_wait(struct band *band) {
+  g_mutex_lock(band_lock);
+  while (!band->done) {
+    g_cond_wait(band_cond, band_lock);
+  }
+  g_mutex_unlock(band_lock);
+  openslide_release_read(band->handle);
+  band->handle = NULL;
+  if (band->req.error) {
+    fail("%s", band->req.error);
+  }
+}
+
+// rows in the band starting at yy, ending bands on tile boundaries
+// where possible
+static int32_t band_rows(int64_t yy, int32_t remaining,
+                         int32_t band_h, bool aligned) {
+  int32_t rows = band_h;
+  if (aligned && yy >= 0) {
+    rows = band_h - yy % band_h;
+  }
+  return MIN(rows, remaining);
+}
+
 static void write_png(openslide_t *osr, FILE *f,
 		      int64_t x, int64_t y, int32_t level,
 		      int32_t w, const int32_t h) {
@@ -85,6 +206,11 @@ static void write_png(openslide_t *osr, FILE *f,
 	       PNG_COMPRESSION_TYPE_DEFAULT,
 	       PNG_FILTER_TYPE_DEFAULT);
 
+  if (fast) {
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+  }
+
   // text
   png_text text_ptr[1];
   memset(text_ptr, 0, sizeof text_ptr);
@@ -111,61 +237,72 @@ static void write_png(openslide_t *osr, FILE *f,
   // start writing
   png_write_info(png_ptr, info_ptr);
 
-  uint32_t *dest = g_malloc(w * 4);
-  int32_t lines_to_draw = h;
+  // read a tile row at a time, if the tile height is known
+  int32_t band_h = DEFAULT_BAND_HEIGHT;
+  bool aligned = false;
+  char *prop = g_strdup_printf("openslide.level[%d].tile-height", level);
+  const char *tile_h = openslide_get_property_value(osr, prop);
+  g_free(prop);
+  if (tile_h && g_ascii_strtoll(tile_h, NULL, 10) > 0) {
+    band_h = MIN(g_ascii_strtoll(tile_h, NULL, 10), INT32_MAX);
+    aligned = true;
+  }
+  if ((int64_t) w * band_h * 4 > MAX_BAND_BYTES) {
+    band_h = MAX(MAX_BAND_BYTES / ((int64_t) w * 4), 1);
+    aligned = false;
+  }
+  band_h = MIN(band_h, h);
+
+  init_unpremultiply();
+  band_lock = g_mutex_new();
+  band_cond = g_cond_new();
+  struct band bands[2];
+  memset(bands, 0, sizeof bands);
+  for (int i = 0; i < 2; i++) {
+    bands[i].req.dest = g_malloc((int64_t) w * band_h * 4);
+  }
+
+  // read each band while writing the one before
   double ds = openslide_get_level_downsample(osr, level);
-  int32_t yy = y / ds;
-  while (lines_to_draw) {
-    openslide_read_region(osr, dest,
-			  x, yy * ds, level, w, 1);
+  int64_t yy = y / ds;
+  int32_t lines_to_read = h;
+  int32_t rows = band_rows(yy, lines_to_read, band_h, aligned);
+  band_start(osr, &bands[0], x, yy, ds, level, w, rows);
+  yy += rows;
+  lines_to_read -= rows;
+  for (int cur = 0; ; cur = !cur) {
+    struct band *band = &bands[cur];
+    struct band *next = &bands[!cur];
+    if (lines_to_read) {
+      rows = band_rows(yy, lines_to_read, band_h, aligned);
+      band_start(osr, next, x, yy, ds, level, w, rows);
+      yy += rows;
+      lines_to_read -= rows;
+    }
 
+    band_wait(band);
     const char *err = openslide_get_error(osr);
     if (err) {
       fail("%s", err);
     }
 
-    // un-premultiply alpha and pack into expected format
-    for (int i = 0; i < w; i++) {
-      uint32_t p = dest[i];
-      uint8_t *p8 = (uint8_t *) (dest + i);
-
-      uint8_t a = (p >> 24) & 0xFF;
-      uint8_t r = (p >> 16) & 0xFF;
-      uint8_t g = (p >> 8) & 0xFF;
-      uint8_t b = p & 0xFF;
-
-      switch (a) {
-      case 0:
-	r = 0;
-	b = 0;
-	g = 0;
-	break;
-
-      case 255:
-	// no action
-	break;
-
-      default:
-	r = (r * 255 + a / 2) / a;
-	g = (g * 255 + a / 2) / a;
-	b = (b * 255 + a / 2) / a;
-	break;
-      }
-
-      // write back
-      p8[0] = r;
-      p8[1] = g;
-      p8[2] = b;
-      p8[3] = a;
+    uint32_t *dest = band->req.dest;
+    convert_pixels(dest, (int64_t) w * band->req.h);
+    for (int64_t row = 0; row < band->req.h; row++) {
+      png_write_row(png_ptr, (png_bytep) (dest + row * w));
     }
 
-    png_write_row(png_ptr, (png_bytep) dest);
-    yy++;
-    lines_to_draw--;
+    if (!next->handle) {
+      break;
+    }
   }
 
   // end
-  g_free(dest);
+  for (int i = 0; i < 2; i++) {
+    g_free(bands[i].req.dest);
+  }
+  g_cond_free(band_cond);
+  g_mutex_free(band_lock);
   g_free(key);
   g_free(text);
   png_write_end(png_ptr, info_ptr);
@@ -176,9 +313,14 @@ static void write_png(openslide_t *osr, FILE *f,
 static const struct openslide_tools_usage_info usage_info = {
   "slide x y level width height output.png",
   "Write a region of a virtual slide to a PNG.",
+  options,
 };
 
 int main (int argc, char **argv) {
+  if (!g_thread_supported()) {
+    g_thread_init(NULL);
+  }
+
   _openslide_tools_parse_commandline(&usage_info, &argc, &argv);
   if (argc != 8) {
     _openslide_tools_usage(&usage_info);